@@ -25,99 +25,439 @@ SOFTWARE.
 *****************************************************************************************/
 
 #include "clunet.h"
+#include "clunet_hal.h"
 
 #include <stdint.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/wdt.h>
-#include <util/crc16.h>
 
 #define STATE_IDLE 0
 #define STATE_ACTIVE 1
 #define STATE_WAIT_INTERFRAME 2
 #define STATE_PROCESS 4
 
-#define RECEIVED_SRC_ADDRESS (uint8_t)read_buffer[CLUNET_OFFSET_SRC_ADDRESS]
-#define RECEIVED_DST_ADDRESS (uint8_t)read_buffer[CLUNET_OFFSET_DST_ADDRESS]
-#define RECEIVED_COMMAND (uint8_t)read_buffer[CLUNET_OFFSET_COMMAND]
-#define RECEIVED_DATA_PTR read_buffer + CLUNET_OFFSET_DATA
-#define RECEIVED_DATA_SIZE (uint8_t)read_buffer[CLUNET_OFFSET_SIZE]
+#define RECEIVED_SRC_ADDRESS (uint8_t)buffer[CLUNET_OFFSET_SRC_ADDRESS]
+#define RECEIVED_DST_ADDRESS (uint8_t)buffer[CLUNET_OFFSET_DST_ADDRESS]
+#define RECEIVED_COMMAND (uint8_t)buffer[CLUNET_OFFSET_COMMAND]
+#define RECEIVED_DATA_PTR buffer + CLUNET_OFFSET_DATA
+#define RECEIVED_DATA_SIZE (uint8_t)buffer[CLUNET_OFFSET_SIZE]
+#define RECEIVED_PRIORITY (uint8_t)buffer[CLUNET_OFFSET_DATA + RECEIVED_DATA_SIZE] // In place of the checked CRC
 
 /* Pointers to the callback functions on receiving packet (must be short as possible) */
 static void (*cb_data_received)(uint8_t src_address, uint8_t command, char* data, uint8_t size) = 0;
 static void (*cb_data_received_sniff)(uint8_t src_address, uint8_t dst_address, uint8_t command, char* data, uint8_t size) = 0;
 
-/* Global static variables (RAM: 7 bytes) */
+/* Global static variables (RAM: 9 bytes) */
 static uint8_t reading_state = STATE_WAIT_INTERFRAME; // Current reading state
 static uint8_t sending_state = STATE_IDLE; // Current sending state
 static uint8_t reading_priority; // Receiving packet priority
-static uint8_t sending_priority; // Sending priority (1 to 8)
-static uint8_t sending_length; // Sending data length
+static uint8_t sending_priority; // Sending priority of queue head (1 to 8)
+static const uint8_t* sending_runs; // Next byte of run lengths of the frame on the line
+static uint8_t sending_nibble; // Next run is in the high nibble
 static uint8_t dominant_task; // Dominant task (bits)
 static uint8_t reading_flag; // Reading flag
 
+#ifdef CLUNET_T_DATA
+/* Dual-rate frames: bit period is CLUNET_T up to the source address and CLUNET_T_DATA after it (RAM: 2 bytes) */
+static uint8_t sending_period; // Bit period of the runs on the line
+static uint8_t reading_period; // Bit period of the frame being read
+#define RUN_RATE_SWITCH 0x0F // Run nibble: following runs are sent with CLUNET_T_DATA
+#else
+#define sending_period CLUNET_T
+#define reading_period CLUNET_T
+#endif
+
+#ifdef CLUNET_CLOCK_RECOVERY
+/* Clock recovery: bit period of the frame sender estimated from its runs, 1/16 tick units (RAM: 2 bytes) */
+static uint16_t recovered_period;
+#endif
+
+/* Transmit queue: frame pool and priority ordered list of pool slots (RAM: 2 * CLUNET_SEND_QUEUE_SIZE + 3 bytes) */
+#define SEND_SLOT_NONE 0xFF
+static uint8_t send_head = SEND_SLOT_NONE; // Frame on the line or next to go
+static uint8_t send_last = SEND_SLOT_NONE; // Last sent frame (while its slot is not reused)
+static uint8_t send_free = (uint8_t)((1 << CLUNET_SEND_QUEUE_SIZE) - 1); // Free slots mask
+static uint8_t send_next[CLUNET_SEND_QUEUE_SIZE]; // Next slot in queue
+static uint8_t send_priority[CLUNET_SEND_QUEUE_SIZE]; // Frame priority
+
+#ifdef CLUNET_SEND_COMPLETE
+/* Send results: destination and command of queued frames, ring of results for clunet_poll() (RAM: 5 * CLUNET_SEND_QUEUE_SIZE + 4 bytes) */
+static void (*cb_send_complete)(uint8_t dst_address, uint8_t command, uint8_t result) = 0;
+static uint8_t send_address[CLUNET_SEND_QUEUE_SIZE];
+static uint8_t send_command[CLUNET_SEND_QUEUE_SIZE];
+static struct
+{
+	uint8_t address;
+	uint8_t command;
+	uint8_t result;
+} send_results[CLUNET_SEND_QUEUE_SIZE];
+static uint8_t send_results_head;
+static volatile uint8_t send_results_count;
+#define SEND_RESULT(slot, result) send_result(slot, result)
+#else
+#define SEND_RESULT(slot, result) { }
+#endif
+
+#ifdef CLUNET_SEND_RETRIES
+/* Retry limit: lost arbitrations of queued frames (RAM: CLUNET_SEND_QUEUE_SIZE bytes) */
+static uint8_t send_losses[CLUNET_SEND_QUEUE_SIZE];
+#endif
+
+#ifndef CLUNET_READ_QUEUE_SIZE
+/* Built-in replies of the external ISR: slots with raw frames for clunet_poll() to encode (RAM: 1 byte) */
+static volatile uint8_t send_raw;
+#endif
+
+#ifdef CLUNET_SEND_AGING
+/* Priority aging: losses left until the next promotion, frames to be promoted by clunet_poll() (RAM: CLUNET_SEND_QUEUE_SIZE + 1 bytes) */
+static uint8_t send_age[CLUNET_SEND_QUEUE_SIZE];
+static uint8_t send_aging;
+#endif
+
+#if defined(CLUNET_FAIR_GAP) || defined(CLUNET_DISCOVERY_SLOTS)
+/* Start gap: interframe is over, the queue head waits for the line to stay idle longer (RAM: 1 byte) */
+static uint8_t start_gap;
+#define START_GAP_BROKEN { start_gap = 0; }
+#else
+#define START_GAP_BROKEN { }
+#endif
+
+#ifdef CLUNET_FAIR_GAP
+/* Fair arbitration: after a sent frame the next one of the same or lower priority waits for the fairness gap (RAM: 1 byte) */
+static uint8_t fair_priority; // Priority of the frame sent in this fairness interval, 0 - none
+#define FAIR_SENT(prio) { fair_priority = (prio); }
+#else
+#define FAIR_SENT(prio) { }
+#endif
+
+#ifdef CLUNET_DISCOVERY_SLOTS
+/* Slotted discovery responses: extra idle gap of queued frames, T units (RAM: CLUNET_SEND_QUEUE_SIZE bytes).
+   Sender pulls the line 1T after its interframe ends, so slots are 2T apart. */
+static uint8_t send_gap[CLUNET_SEND_QUEUE_SIZE];
+#define DISCOVERY_SLOT ((uint8_t)(2 * (CLUNET_DEVICE_ID % CLUNET_DISCOVERY_SLOTS)))
+#else
+#define DISCOVERY_SLOT 0
+#endif
+
+#ifdef CLUNET_BUS_LOAD
+/* Bus load: busy ticks counted by external ISR, averaged by clunet_bus_load_poll() over windows (RAM: 9 bytes) */
+static volatile uint16_t bus_busy; // Ticks since the last poll
+static uint32_t load_busy; // Ticks of the current window
+static uint16_t load_start; // Window start, ms
+static uint8_t bus_load; // Busy share, 1/255 units
+#define BUS_BUSY(ticks) { bus_busy += (ticks); }
+#else
+#define BUS_BUSY(ticks) { }
+#endif
+
+#ifdef CLUNET_SHAPER_RATE
+/* Token bucket of frames with priority 1-2, 1/1000 frame units (RAM: 2 bytes) */
+#define SHAPER_FRAME 1000
+#define SHAPER_FULL ((uint16_t)CLUNET_SHAPER_BURST * SHAPER_FRAME)
+#define SHAPER_LEVEL ((uint8_t)(CLUNET_SHAPER_LOAD * 255 / 100))
+static uint16_t shaper_tokens = SHAPER_FULL;
+#define SHAPER_ALLOWS(prio) (((prio) > CLUNET_PRIORITY_INFO) || (shaper_tokens >= SHAPER_FRAME))
+#define SHAPER_TAKE(prio) { if ((prio) <= CLUNET_PRIORITY_INFO) shaper_tokens = (shaper_tokens > SHAPER_FRAME) ? shaper_tokens - SHAPER_FRAME : 0; }
+#else
+#define SHAPER_ALLOWS(prio) 1
+#define SHAPER_TAKE(prio) { }
+#endif
+
+#ifdef CLUNET_CAPTURE
+/* Capture: 32-bit time of the start bit, every read slot is followed by its capture tail (RAM: 10 + 6 per slot bytes) */
+static void (*cb_capture)(uint32_t time, uint8_t flags, const char* frame, uint8_t size) = 0;
+static volatile uint32_t capture_clock; // Timer wraps in ticks, low byte is zero
+static uint32_t capture_start; // Start bit of the frame being read
+static uint8_t capture_lost; // CLUNET_CAPTURE_LOST: frames were dropped since the last record
+#define CAPTURE_TAIL 6 // Time (4 bytes LE), flags, received CRC
+#define CAPTURING (cb_capture != 0)
+// Overflow interrupt may be pending: a small timer value is already after the wrap
+#define CAPTURE_TIME(time, now) { time = capture_clock | (now); if (CLUNET_TIMER_OVERFLOW && !((now) & 0x80)) time += 256; }
+#define CAPTURE_START(now) CAPTURE_TIME(capture_start, now)
+#define CAPTURE_LOST_FRAME { if (cb_capture) capture_lost = CLUNET_CAPTURE_LOST; }
+#else
+#define CAPTURE_TAIL 0
+#define CAPTURING 0
+#define CAPTURE_START(now) { }
+#define CAPTURE_LOST_FRAME { }
+#endif
+
 /* Data buffers */
-static char send_buffer[CLUNET_SEND_BUFFER_SIZE]; // Sending data buffer
-static char read_buffer[CLUNET_READ_BUFFER_SIZE]; // Reading data buffer
+static uint8_t send_buffer[CLUNET_SEND_QUEUE_SIZE][CLUNET_SEND_BUFFER_SIZE]; // Sending frames pool (encoded line runs)
+#ifdef CLUNET_READ_QUEUE_SIZE
+/* Receive ring: ISR fills the tail slot, clunet_poll() drains complete packets from the head (RAM: 3 bytes) */
+static char read_buffer[CLUNET_READ_QUEUE_SIZE][CLUNET_READ_BUFFER_SIZE + CAPTURE_TAIL]; // Reading packets ring
+static char* reading_buffer = read_buffer[0]; // Slot being filled by ISR
+static uint8_t read_head; // Oldest complete packet
+static volatile uint8_t read_count; // Number of complete packets
+#else
+static char read_buffer[CLUNET_READ_BUFFER_SIZE + CAPTURE_TAIL]; // Reading data buffer
+#define reading_buffer read_buffer
+#endif
+
+#ifdef CLUNET_RECEIVE_FILTER
+/* Receive filter: bitmaps of accepted destination addresses and commands (RAM: 65 bytes) */
+static uint8_t filter_addresses[32];
+static uint8_t filter_commands[32];
+static uint8_t reading_skip; // Frame is rejected: only its length is tracked
+#define FILTER_ACCEPTS(table, value) (table[(value) >> 3] & (1 << ((value) & 7)))
+#else
+#define reading_skip 0
+#endif
+
+#ifdef CLUNET_STATS
+/* Statistics counters (RAM: CLUNET_STATS_SIZE + 1 bytes) */
+static clunet_stats_t stats;
+static uint8_t stats_retries; // Lost attempts of the queue head
+#define STATS_INC(counter) { stats.counter++; }
+#define STATS_LOST(counter) { stats.counter++; if (++stats_retries > stats.max_retries) stats.max_retries = stats_retries; }
+#define STATS_NEXT_FRAME { stats_retries = 0; }
+#else
+#define STATS_INC(counter) { }
+#define STATS_LOST(counter) { }
+#define STATS_NEXT_FRAME { }
+#endif
+
+#ifdef CLUNET_HANDLERS
+/* Command handlers: open addressing table, search starts at the command's own entry (RAM: 5 * CLUNET_HANDLERS + 1 bytes) */
+#define HANDLERS_MASK (CLUNET_HANDLERS - 1)
+static struct
+{
+	uint8_t command;
+	uint8_t src_address;
+	uint8_t src_mask;
+	clunet_handler_t f; // 0 - free entry
+} handlers[CLUNET_HANDLERS];
+static uint8_t handlers_count; // Registered handlers, up to CLUNET_HANDLERS - 1: one entry is always free
+
+/* Entry of the command or the free entry where its search ends */
+static uint8_t
+handler_find(const uint8_t command)
+{
+	uint8_t idx = command & HANDLERS_MASK;
+	while (handlers[idx].f && (handlers[idx].command != command))
+		idx = (idx + 1) & HANDLERS_MASK;
+	return idx;
+}
+#endif
 
 #ifdef CLUNET_DEVICE_NAME
  static const char device_name[] = CLUNET_DEVICE_NAME; // Simple and short device name
 #endif
 
+static uint8_t send_reply(const uint8_t address, const uint8_t prio, const uint8_t command, const char* data, const uint8_t size, const uint8_t gap);
+
 /* Function for process receiving packet */
 static void
-process_received_packet(void)
+process_received_packet(char* buffer)
 {
 	const uint8_t src_address = RECEIVED_SRC_ADDRESS;
 	const uint8_t dst_address = RECEIVED_DST_ADDRESS;
 	const uint8_t command = RECEIVED_COMMAND;
 	const uint8_t data_size = RECEIVED_DATA_SIZE;
 	char* data_ptr = RECEIVED_DATA_PTR;
+#ifdef CLUNET_HANDLERS
+	const uint8_t priority = RECEIVED_PRIORITY;
+#endif
+
+#ifdef CLUNET_CAPTURE
+	const char* tail = buffer + CLUNET_READ_BUFFER_SIZE;
+	if (cb_capture)
+	{
+		// Received CRC takes its place back for the raw frame, priority is in the flags
+		const uint32_t time = (uint8_t)tail[0] | ((uint32_t)(uint8_t)tail[1] << 8) | ((uint32_t)(uint8_t)tail[2] << 16) | ((uint32_t)(uint8_t)tail[3] << 24);
+		const char priority_byte = data_ptr[data_size];
+		data_ptr[data_size] = tail[5];
+		(*cb_capture)(time, (uint8_t)tail[4], buffer, CLUNET_OFFSET_DATA + data_size + 1);
+		data_ptr[data_size] = priority_byte;
+	}
+	if (tail[4] & CLUNET_CAPTURE_CRC_ERROR)
+		return;
+#endif
 
 	if (cb_data_received_sniff)
 		(*cb_data_received_sniff)(src_address, dst_address, command, data_ptr, data_size);
 
+#ifdef CLUNET_RECEIVE_FILTER
+	if ((src_address != CLUNET_DEVICE_ID) && FILTER_ACCEPTS(filter_addresses, dst_address) && FILTER_ACCEPTS(filter_commands, command))
+#else
 	if ((src_address != CLUNET_DEVICE_ID) && ((dst_address == CLUNET_DEVICE_ID) || (dst_address == CLUNET_BROADCAST_ADDRESS)))
+#endif
 	{
 		/* Команда перезагрузки */
 		if (command == CLUNET_COMMAND_REBOOT)
 		{
+#ifdef CLUNET_BOOT_UPDATE_FLAG
+			eeprom_update_byte((uint8_t*)(CLUNET_BOOT_UPDATE_FLAG), CLUNET_BOOT_UPDATE_REQUESTED);
+#endif
 			wdt_enable(WDTO_15MS);
 			while (1);
 		}
 
-		if (!sending_state || (sending_priority <= CLUNET_PRIORITY_MESSAGE))
+#ifdef CLUNET_HANDLERS
+		/* Registered handler takes the command instead of built-in answers and the common callback */
+		const uint8_t idx = handler_find(command);
+		if (handlers[idx].f && (handlers[idx].command == command))
+		{
+			if (!((src_address ^ handlers[idx].src_address) & handlers[idx].src_mask))
+				(*handlers[idx].f)(src_address, command, data_ptr, data_size, priority);
+			return;
+		}
+#endif
+
+		/* Replies take only a free slot of the transmit queue, application frames are never dropped for them */
+		switch (command)
 		{
-			switch (command)
+			/* Answer for discovery command */
+			case CLUNET_COMMAND_DISCOVERY:
 			{
-				/* Answer for discovery command */
-				case CLUNET_COMMAND_DISCOVERY:
-					
-					#ifdef CLUNET_DEVICE_NAME
-					clunet_send(src_address, CLUNET_PRIORITY_MESSAGE, CLUNET_COMMAND_DISCOVERY_RESPONSE, device_name, sizeof(device_name) - 1);
-					#else
-					clunet_send(src_address, CLUNET_PRIORITY_MESSAGE, CLUNET_COMMAND_DISCOVERY_RESPONSE, 0, 0);
-					#endif
-					return;
-	
-				/* Answer for ping */
-				case CLUNET_COMMAND_PING:
-	
-					clunet_send(src_address, CLUNET_PRIORITY_COMMAND, CLUNET_COMMAND_PING_REPLY, data_ptr, data_size);
+				// Incremental discovery: devices marked in the bitmap of known addresses keep silent
+				if ((data_size > (CLUNET_DEVICE_ID >> 3)) && (data_ptr[CLUNET_DEVICE_ID >> 3] & (1 << (CLUNET_DEVICE_ID & 7))))
 					return;
+				// Answers to a broadcast are spread over slots by device address
+				const uint8_t gap = (dst_address == CLUNET_BROADCAST_ADDRESS) ? DISCOVERY_SLOT : 0;
+				#ifdef CLUNET_DEVICE_NAME
+				send_reply(src_address, CLUNET_PRIORITY_MESSAGE, CLUNET_COMMAND_DISCOVERY_RESPONSE, device_name, sizeof(device_name) - 1, gap);
+				#else
+				send_reply(src_address, CLUNET_PRIORITY_MESSAGE, CLUNET_COMMAND_DISCOVERY_RESPONSE, 0, 0, gap);
+				#endif
+				return;
 			}
+
+			/* Answer for ping */
+			case CLUNET_COMMAND_PING:
+
+				send_reply(src_address, CLUNET_PRIORITY_COMMAND, CLUNET_COMMAND_PING_REPLY, data_ptr, data_size, 0);
+				return;
+
+#ifdef CLUNET_STATS
+			/* Answer for statistics request */
+			case CLUNET_COMMAND_STATS:
+			{
+				clunet_stats_t copy;
+				clunet_get_stats(&copy);
+				// Counters are reset only when the reply with them is queued
+				if (send_reply(src_address, CLUNET_PRIORITY_INFO, CLUNET_COMMAND_STATS_REPLY, (const char*)&copy, CLUNET_STATS_SIZE, 0)
+					&& data_size && (*data_ptr == 1))
+					clunet_reset_stats();
+				return;
+			}
+#endif
 		}
 		if (cb_data_received)
 			(*cb_data_received)(src_address, command, data_ptr, data_size);
 	}
 }
 
-/* Timer output compare interrupt service routine (RAM: 4 bytes) */
+#ifdef CLUNET_SEND_COMPLETE
+/* Result of the frame in slot for clunet_poll(), lost if the ring is full (interrupts must be disabled) */
+static void
+send_result(const uint8_t slot, const uint8_t result)
+{
+	if (send_results_count < CLUNET_SEND_QUEUE_SIZE)
+	{
+		uint8_t idx = send_results_head + send_results_count;
+		if (idx >= CLUNET_SEND_QUEUE_SIZE)
+			idx -= CLUNET_SEND_QUEUE_SIZE;
+		send_results[idx].address = send_address[slot];
+		send_results[idx].command = send_command[slot];
+		send_results[idx].result = result;
+		send_results_count++;
+	}
+}
+#endif
+
+#if defined(CLUNET_SEND_RETRIES) || defined(CLUNET_SEND_AGING)
+/* Queue head lost arbitration and waits for interframe: count the loss, give up or ask clunet_poll() for promotion */
+static void
+send_lost(void)
+{
+	const uint8_t slot = send_head;
+#ifdef CLUNET_SEND_RETRIES
+	if (++send_losses[slot] > CLUNET_SEND_RETRIES)
+	{
+		SEND_RESULT(slot, CLUNET_SEND_GAVE_UP);
+		STATS_NEXT_FRAME;
+		send_free |= (1 << slot);
+		send_head = send_next[slot];
+		if (send_head != SEND_SLOT_NONE)
+			sending_priority = send_priority[send_head];
+		else
+			sending_state = STATE_IDLE;
+		return;
+	}
+#endif
+#ifdef CLUNET_SEND_AGING
+	if (!--send_age[slot])
+	{
+		send_age[slot] = CLUNET_SEND_AGING;
+		if (send_priority[slot] < CLUNET_SEND_AGING_MAX)
+			send_aging |= (1 << slot);
+	}
+#endif
+}
+#define SEND_LOST send_lost()
+#else
+#define SEND_LOST { }
+#endif
+
+/* Frame which lost arbitration gives way to frames queued with higher priority while it was on the line */
+static inline void
+send_requeue(void)
+{
+	const uint8_t slot = send_head;
+	const uint8_t next = send_next[slot];
+	if ((next == SEND_SLOT_NONE) || (send_priority[next] <= send_priority[slot]))
+		return;
+	uint8_t* link = &send_next[next];
+	while ((*link != SEND_SLOT_NONE) && (send_priority[*link] >= send_priority[slot]))
+		link = &send_next[*link];
+	send_next[slot] = *link;
+	*link = slot;
+	send_head = next;
+	sending_priority = send_priority[next];
+	STATS_NEXT_FRAME;
+}
+
+#if defined(CLUNET_FAIR_GAP) || defined(CLUNET_DISCOVERY_SLOTS)
+/* Idle time the queue head waits for after interframe, T units */
+static inline uint8_t
+send_start_gap(void)
+{
+	uint8_t gap = 0;
+#ifdef CLUNET_FAIR_GAP
+	// Frame was sent in this fairness interval: nodes which have not sent yet go first
+	if (send_priority[send_head] <= fair_priority)
+		gap = CLUNET_FAIR_GAP;
+#endif
+#ifdef CLUNET_DISCOVERY_SLOTS
+	gap += send_gap[send_head];
+#endif
+	return gap;
+}
+#endif
+
+/* Next run of the frame on the line */
+static inline uint8_t
+send_next_run(void)
+{
+	uint8_t run = *sending_runs;
+	if (sending_nibble)
+	{
+		run >>= 4;
+		sending_runs++;
+	}
+	else
+		run &= 0x0F;
+	sending_nibble ^= 1;
+	return run;
+}
+
+/*
+	Timer output compare interrupt service routine.
+	Frame is already encoded by clunet_send() to the line runs: dominant, recessive, ..., dominant.
+	Every run is a nibble with its length in bits (1-5, bit stuffing applied), zero nibble ends the frame.
+*/
 ISR(CLUNET_TIMER_COMP_VECTOR)
 {
-	// Static variables
-	static uint8_t data_byte, byte_index, bit_mask, bit_task, crc;
-	
 	// If in NOT ACTIVE state
 	if (!(sending_state & STATE_ACTIVE))
 	{
@@ -130,31 +470,42 @@ ISR(CLUNET_TIMER_COMP_VECTOR)
 			return;
 		}
 
-		// We in WAIT_INTERFRAME state
+		// We in WAIT_INTERFRAME state: take the queue head
+		send_requeue();
+#if defined(CLUNET_FAIR_GAP) || defined(CLUNET_DISCOVERY_SLOTS)
+		// Nodes without the gap start right after interframe, their frame makes us wait for the next interframe
+		if (!start_gap)
+		{
+			const uint8_t gap = send_start_gap();
+			if (gap)
+			{
+				start_gap = 1;
+				CLUNET_TIMER_REG_OCR = CLUNET_TIMER_REG + (gap * CLUNET_T - 1);
+				return;
+			}
+		}
+		start_gap = 0;
+#ifdef CLUNET_FAIR_GAP
+		fair_priority = 0; // Idle line ends the fairness interval
+#endif
+#endif
 		sending_state = STATE_ACTIVE;                             // Set sending process to ACTIVE state
-		data_byte = sending_priority - 1;                         // First must send priority bits
-		byte_index = 0;                                           // Data index
-		bit_mask = 0x04;                                          // Priority MSB location
-		bit_task = 1;                                             // Start bit
+		sending_runs = send_buffer[send_head];                    // First run: start bit and leading priority bits
+		sending_nibble = 0;
+#ifdef CLUNET_T_DATA
+		sending_period = CLUNET_T;                                // Arbitration field goes with T
+#endif
 		reading_flag = 0;                                         // Reset reading flag
-		crc = 0;                                                  // Reset CRC value
 		CLUNET_TIMER_REG_OCR = CLUNET_TIMER_REG + (CLUNET_T - 1); // Planning next interrupt throuth 1T
 		return;
 	}
-	
+
 	const uint8_t line_pullup = CLUNET_SENDING;
 
-	// If we need to free line - do it and check for end data.
+	// If we need to free line - do it.
 	if (line_pullup)
 	{
 		CLUNET_SEND_0;
-		// If data sending complete
-		if (!bit_mask)
-		{
-			sending_state = STATE_IDLE;
-			CLUNET_DISABLE_OCI;
-			return;
-		}
 		reading_flag = 1;
 	}
 
@@ -166,58 +517,55 @@ ISR(CLUNET_TIMER_COMP_VECTOR)
 		// Check if we not been in reading ISR or first send cycle
 		if (reading_flag)
 		{
+			STATS_LOST(lost_flag);
 			sending_state = STATE_WAIT_INTERFRAME;
+			SEND_LOST;
 			CLUNET_DISABLE_OCI;
 			return;
 		}
-
 		CLUNET_SEND_1;
-
-		// If data sending complete: doing stop 1T bit
-		if (!bit_mask)
-		{
-			dominant_task = 1;
-			CLUNET_TIMER_REG_OCR += CLUNET_T;
-			return;
-		}
 	}
 
-	/* COLLECTING DATA BITS */
-	do
+	// Next run length
+	uint8_t run = send_next_run();
+#ifdef CLUNET_T_DATA
+	// Arbitration field is sent: data phase starts with the switch bit
+	if (run == RUN_RATE_SWITCH)
 	{
-		const uint8_t bit_value = data_byte & bit_mask;
-
-		if ((line_pullup && bit_value) || (!line_pullup && !bit_value))
-			break;
-
-		bit_task++;
+		sending_period = CLUNET_T_DATA;
+		run = send_next_run();
+	}
+#endif
 
-		// If sending byte complete: reset bit index and get next byte to send
-		if (!(bit_mask >>= 1))
+	// If data sending complete (only after dominant run): release the slot and go to the next frame after interframe gap
+	if (!run)
+	{
+		const uint8_t slot = send_head;
+		STATS_INC(sent);
+		STATS_NEXT_FRAME;
+		SEND_RESULT(slot, CLUNET_SEND_OK);
+		FAIR_SENT(send_priority[slot]);
+		send_free |= (1 << slot);
+		send_last = slot;
+		send_head = send_next[slot];
+		if (send_head != SEND_SLOT_NONE)
 		{
-			if (byte_index < sending_length)
-			{
-				data_byte = send_buffer[byte_index];
-				crc = _crc_ibutton_update(crc, data_byte);
-			}
-			else if (byte_index == sending_length)
-				data_byte = crc;
-			else
-				break;
-			bit_mask = 0x80;
-			byte_index++;
+			sending_priority = send_priority[send_head];
+			sending_state = STATE_WAIT_INTERFRAME;                // External ISR plans OCR on our front edge
 		}
+		else
+		{
+			sending_state = STATE_IDLE;
+			CLUNET_DISABLE_OCI;
+		}
+		return;
 	}
-	while (bit_task < 5);
-	
+
 	// Update OCR
-	CLUNET_TIMER_REG_OCR += CLUNET_T * bit_task;
+	CLUNET_TIMER_REG_OCR += sending_period * run;
 
 	if (!line_pullup)
-		dominant_task = bit_task;
-
-	// Bit stuffing correction
-	bit_task = (bit_task == 5);
+		dominant_task = run;
 }
 /* End of ISR(CLUNET_TIMER_COMP_VECTOR) */
 
@@ -227,31 +575,72 @@ ISR(CLUNET_INT_VECTOR)
 	// Static variables (RAM: 6 bytes)
 	static uint8_t data_byte, byte_index, bit_index, bit_stuffing, last_time, crc;
 	
+#ifdef CLUNET_INT_CAPTURE_REG
+	// Edge time and direction are latched by input capture unit, next capture waits for the opposite edge
+	const uint8_t now = CLUNET_INT_CAPTURE_REG;
+	const uint8_t front_edge = CLUNET_INT_CAPTURE_FRONT ? 255 : 0;
+	CLUNET_INT_CAPTURE_NEXT;
+#else
 	const uint8_t now = CLUNET_TIMER_REG;
 	const uint8_t front_edge = CLUNET_READING ? 0 : 255;
+#endif
 	uint8_t num_bits = 0; // Number of reading bits
 
 	if ((reading_state & STATE_ACTIVE) || (sending_state & STATE_ACTIVE))
 	{
 		// Reading bits
 		const uint8_t ticks = now - last_time;
-		const uint8_t t12 = CLUNET_T / 2;
-		if ((ticks >= t12) && (ticks < (5 * CLUNET_T + t12)))
+#ifdef CLUNET_CLOCK_RECOVERY
+		// Bit boundaries by the recovered period of the sender
+		const uint16_t ticks16 = (uint16_t)ticks << 4;
+		const uint16_t t12 = recovered_period / 2;
+		if ((ticks16 >= t12) && (ticks16 < (5 * recovered_period + t12)))
+		{
+			uint16_t period = t12;
+			for ( ; ticks16 >= period; period += recovered_period, num_bits++);
+			// Rounded residual of the run slowly corrects the period (longer runs weigh more), within 1/8 of nominal
+			const uint8_t shift = ((num_bits + 3) >> 1) + 2;
+			period = recovered_period + (((int16_t)(ticks16 - num_bits * recovered_period) + (1 << (shift - 1))) >> shift);
+			if (period < reading_period * 14)
+				period = reading_period * 14;
+			else if (period > reading_period * 18)
+				period = reading_period * 18;
+			// Only the arbitration winner drives the line after the source address: count from the edge itself
+			if (front_edge)
+				last_time = (byte_index > CLUNET_OFFSET_SRC_ADDRESS) ? now : last_time + ((num_bits * recovered_period + 8) >> 4);
+			recovered_period = period;
+		}
+#else
+		const uint8_t t12 = reading_period / 2;
+		if ((ticks >= t12) && (ticks < (5 * reading_period + t12)))
 		{
 			uint8_t period = t12;
-			for ( ; ticks >= period; period += CLUNET_T, num_bits++);
+			for ( ; ticks >= period; period += reading_period, num_bits++);
 			if (front_edge)
-				last_time += num_bits * CLUNET_T;
+				last_time += num_bits * reading_period;
 		}
+#endif
+		BUS_BUSY(num_bits * reading_period);
 	}
 
 	// If sending is active
 	if (sending_state & STATE_ACTIVE)
 	{
 		// Check for conflict on the line
-		if ((front_edge && (num_bits > dominant_task)) || (!front_edge && !CLUNET_SENDING && (CLUNET_TIMER_REG_OCR - now >= (int8_t)(CLUNET_T / 2))))
+		if ((front_edge && (num_bits > dominant_task)) || (!front_edge && !CLUNET_SENDING && ((uint8_t)(CLUNET_TIMER_REG_OCR - now) >= (sending_period / 2))))
 		{
+#ifdef CLUNET_STATS
+			if (front_edge)
+			{
+				STATS_LOST(lost_front);
+			}
+			else
+			{
+				STATS_LOST(lost_falling);
+			}
+#endif
 			sending_state = STATE_WAIT_INTERFRAME;
+			SEND_LOST;
 			goto _wait_interframe;
 		}
 		reading_flag = 0;
@@ -280,9 +669,21 @@ _wait_interframe:
 		if (!reading_state)
 		{
 			data_byte = reading_priority = byte_index = crc = 0;
+#ifdef CLUNET_RECEIVE_FILTER
+			reading_skip = 0;
+#endif
+#ifdef CLUNET_T_DATA
+			reading_period = CLUNET_T;
+#endif
+#ifdef CLUNET_CLOCK_RECOVERY
+			recovered_period = CLUNET_T << 4;
+#endif
 			bit_stuffing = 1;
 			reading_state = STATE_ACTIVE;
 			bit_index = 5;
+			BUS_BUSY(7 * CLUNET_T); // Interframe gap belongs to the frame
+			START_GAP_BROKEN;
+			CAPTURE_START(now);
 			return;
 		}
 	}
@@ -312,50 +713,160 @@ _wait_interframe:
 	{
 		if (reading_priority)
 		{
-			read_buffer[byte_index++] = data_byte;
-			crc = _crc_ibutton_update(crc, data_byte);
+			// Rejected frame: header is kept for its length, no data writes and CRC
+			if (reading_skip)
+			{
+				if (byte_index < CLUNET_OFFSET_DATA)
+					reading_buffer[byte_index] = data_byte;
+				byte_index++;
+			}
+			else
+			{
+				reading_buffer[byte_index++] = data_byte;
+				crc = _crc_ibutton_update(crc, data_byte);
+#ifdef CLUNET_RECEIVE_FILTER
+				// Destination and command are decoded: check acceptance tables (sniffer needs every frame)
+				if ((byte_index == CLUNET_OFFSET_COMMAND + 1) && !cb_data_received_sniff && !CAPTURING)
+				{
+					const uint8_t dst_address = reading_buffer[CLUNET_OFFSET_DST_ADDRESS];
+					reading_skip = ((uint8_t)reading_buffer[CLUNET_OFFSET_SRC_ADDRESS] == CLUNET_DEVICE_ID)
+						|| !FILTER_ACCEPTS(filter_addresses, dst_address) || !FILTER_ACCEPTS(filter_commands, data_byte);
+				}
+#endif
+			}
 		}
 		else
 			reading_priority = data_byte + 1;
 
 		// Whole packet readed
-		if ((byte_index > CLUNET_OFFSET_SIZE) && (byte_index > RECEIVED_DATA_SIZE + CLUNET_OFFSET_DATA))
+		if ((byte_index > CLUNET_OFFSET_SIZE) && (byte_index > (uint8_t)reading_buffer[CLUNET_OFFSET_SIZE] + CLUNET_OFFSET_DATA))
 		{
 			reading_state = STATE_WAIT_INTERFRAME;
+			if (reading_skip)
+				return;
 			// Packet from another device, line is busy
-			if (!crc)
-				process_received_packet();
+			if (crc)
+			{
+				STATS_INC(crc_errors);
+				// Damaged frame goes only to the capture callback
+				if (!CAPTURING)
+					return;
+			}
+			else
+				STATS_INC(received);
+#ifdef CLUNET_CAPTURE
+			char* tail = reading_buffer + CLUNET_READ_BUFFER_SIZE;
+			tail[0] = capture_start;
+			tail[1] = capture_start >> 8;
+			tail[2] = capture_start >> 16;
+			tail[3] = capture_start >> 24;
+			tail[4] = (reading_priority - 1) | (crc ? CLUNET_CAPTURE_CRC_ERROR : 0) | capture_lost;
+			tail[5] = reading_buffer[byte_index - 1];
+			capture_lost = 0;
+#endif
+			reading_buffer[byte_index - 1] = reading_priority; // Checked CRC gives its place to priority
+#ifdef CLUNET_READ_QUEUE_SIZE
+			// Commit packet to the ring, when the ring is full the packet is dropped and slot is reused
+			if (read_count < (CLUNET_READ_QUEUE_SIZE - 1))
+			{
+				read_count++;
+				reading_buffer += CLUNET_READ_BUFFER_SIZE + CAPTURE_TAIL;
+				if (reading_buffer == read_buffer[CLUNET_READ_QUEUE_SIZE])
+					reading_buffer = read_buffer[0];
+			}
+			else
+			{
+				STATS_INC(overflows);
+				CAPTURE_LOST_FRAME;
+			}
+#else
+			process_received_packet(read_buffer);
+#endif
 		}
 		
-		// Если данные прочитаны не полностью и мы не выходим за пределы буфера, то присвоим очередной байт и подготовим битовый индекс
-		else if (byte_index < CLUNET_READ_BUFFER_SIZE)
+		// Если данные прочитаны не полностью и мы не выходим за пределы буфера, то присвоим очередной байт и подготовим битовый индекс.
+		// Rejected frame is not buffered, it is limited by the protocol (255 bytes with CRC), so the index never wraps
+		else if (reading_skip ? (byte_index < CLUNET_OFFSET_DATA + 251) : (byte_index < CLUNET_READ_BUFFER_SIZE))
 		{
 			bit_index &= 7;
 			data_byte = front_edge;
 		}
 		
-		// Иначе ошибка: нехватка приемного буфера -> игнорируем пакет
+		// Иначе ошибка: нехватка приемного буфера (или размер отброшенного пакета больше 250) -> игнорируем пакет
 		else
+		{
+			if (!reading_skip)
+			{
+				STATS_INC(overflows);
+				CAPTURE_LOST_FRAME;
+			}
 			reading_state = STATE_WAIT_INTERFRAME;
+		}
 	}
 
 	/* Проверка на битстаффинг, учитываем в следующем цикле */
 	bit_stuffing = (num_bits == 5);
+
+#ifdef CLUNET_T_DATA
+	// Source address is read: the rest of the frame goes with CLUNET_T_DATA, its switch bit is skipped as a stuffed one.
+	// Only the winner drives the line now, so time is counted from this edge, not from the arbitration skewed one.
+	if ((byte_index == CLUNET_OFFSET_SRC_ADDRESS + 1) && (reading_period == CLUNET_T))
+	{
+		reading_period = CLUNET_T_DATA;
+		bit_stuffing = 1;
+		last_time = now;
+#ifdef CLUNET_CLOCK_RECOVERY
+		recovered_period = CLUNET_T_DATA << 4; // Recovered again, scaling to the new period would need division
+#endif
+	}
+#endif
 }
 /* End of ISR(CLUNET_INT_VECTOR) */
 
+#ifdef CLUNET_CAPTURE
+/* Timer overflow: upper 24 bits of capture time */
+ISR(CLUNET_TIMER_OVF_VECTOR)
+{
+	capture_clock += 256;
+}
+
+uint32_t
+clunet_capture_time(void)
+{
+	const uint8_t sreg = SREG;
+	cli();
+	const uint8_t now = CLUNET_TIMER_REG;
+	uint32_t time;
+	CAPTURE_TIME(time, now);
+	SREG = sreg;
+	return time;
+}
+#endif
+
 void
 clunet_init(void)
 {
 
-	sending_length = MCUSR; // Используем переменную sending_length для отправки содержимого регистра MCUSR
+	const char reset_reason = MCUSR;
 	MCUSR = 0;
 
 	wdt_disable();
 
+#ifdef CLUNET_RECEIVE_FILTER
+	// Accept frames to us and broadcasts with any command
+	uint8_t idx;
+	for (idx = 0; idx < sizeof(filter_commands); idx++)
+		filter_commands[idx] = 0xFF;
+	clunet_filter_address(CLUNET_DEVICE_ID, 1);
+	clunet_filter_address(CLUNET_BROADCAST_ADDRESS, 1);
+#endif
+
 	CLUNET_TIMER_INIT;
 	CLUNET_PIN_INIT;
 	CLUNET_INT_INIT;
+#ifdef CLUNET_CAPTURE
+	CLUNET_ENABLE_OVI;
+#endif
 
 	// If line is free, then planning reset reading state
 	if (!CLUNET_READING)
@@ -371,72 +882,619 @@ clunet_init(void)
 		CLUNET_BROADCAST_ADDRESS,
 		CLUNET_PRIORITY_MESSAGE,
 		CLUNET_COMMAND_BOOT_COMPLETED,
-		(char*)&sending_length,
-		sizeof(sending_length)
+		&reset_reason,
+		sizeof(reset_reason)
 	);
 }
 
-void
-clunet_send(const uint8_t address, const uint8_t prio, const uint8_t command, const char* data, const uint8_t size)
+/* Start sending of the queue head if transmitter is idle (interrupts must be disabled) */
+static void
+send_start(void)
 {
-	/* Если размер данных в пределах буфера передачи (максимально для протокола 250 байт) */
-	if (size < (CLUNET_SEND_BUFFER_SIZE - CLUNET_OFFSET_DATA))
+	sending_priority = send_priority[send_head];
+	if (!sending_state)
 	{
+		// Frame of another device is on the line
+		if (reading_state & STATE_ACTIVE)
+			STATS_INC(interframe_waits);
+		sending_state = STATE_WAIT_INTERFRAME; // Set sending to WAIT_INTERFRAME state
+		// If line is pull-up - enable OCI without clear OCF, else External ISR do planning to send
+		if (!CLUNET_READING)
+			CLUNET_ENABLE_OCI;
+	}
+}
 
-		if (sending_state)
-			clunet_abort_send();
+/* Insert slot into the queue after frames with the same or higher priority (interrupts must be disabled) */
+static void
+send_enqueue(const uint8_t slot)
+{
+	const uint8_t prio = send_priority[slot];
+	uint8_t* link = &send_head;
+	// The frame on the line keeps its place
+	if (sending_state & STATE_ACTIVE)
+		link = &send_next[send_head];
+	while ((*link != SEND_SLOT_NONE) && (send_priority[*link] >= prio))
+		link = &send_next[*link];
+	send_next[slot] = *link;
+	*link = slot;
+	send_start();
+}
 
-		/* Заполняем переменные */
-		sending_priority = (prio > 8) ? 8 : prio ? : 1;
-		send_buffer[CLUNET_OFFSET_SRC_ADDRESS] = CLUNET_DEVICE_ID;
-		send_buffer[CLUNET_OFFSET_DST_ADDRESS] = address;
-		send_buffer[CLUNET_OFFSET_COMMAND] = command;
-		send_buffer[CLUNET_OFFSET_SIZE] = size;
-		
-		/* Есть данные для отправки? Тогда скопируем их в буфер */
-		if (size && data)
+/* Frame in slot is queued again: its losses are counted from zero */
+static inline void
+send_restart(const uint8_t slot)
+{
+#ifdef CLUNET_SEND_RETRIES
+	send_losses[slot] = 0;
+#endif
+#ifdef CLUNET_SEND_AGING
+	send_age[slot] = CLUNET_SEND_AGING;
+	send_aging &= ~(1 << slot);
+#endif
+	(void)slot;
+}
+
+/* Allocate free slot, if queue is full and 'evict' is set - drop the last waiting frame with priority below 'prio' (interrupts must be disabled) */
+static uint8_t
+send_alloc(const uint8_t prio, const uint8_t evict)
+{
+	uint8_t slot;
+	for (slot = 0; slot < CLUNET_SEND_QUEUE_SIZE; slot++)
+	{
+		if (send_free & (1 << slot))
 		{
-			uint8_t idx = 0;
-			do
-				send_buffer[CLUNET_OFFSET_DATA + idx] = data[idx];
-			while (++idx < size);
+			send_free &= ~(1 << slot);
+			if (slot == send_last)
+				send_last = SEND_SLOT_NONE;
+			send_restart(slot);
+			return slot;
 		}
+	}
 
-		sending_length = size + CLUNET_OFFSET_DATA;
-		
-		clunet_resend_last_packet();
+	if (!evict)
+		return SEND_SLOT_NONE;
+	uint8_t* link = &send_head;
+	uint8_t* tail = 0;
+	// The frame on the line can't be dropped
+	if (sending_state & STATE_ACTIVE)
+		link = &send_next[send_head];
+	for ( ; *link != SEND_SLOT_NONE; link = &send_next[*link])
+		tail = link;
+	// Frame of the same priority keeps its place: the new one is refused
+	if (!tail || (send_priority[*tail] >= prio))
+		return SEND_SLOT_NONE;
+
+	slot = *tail;
+	*tail = SEND_SLOT_NONE;
+	SEND_RESULT(slot, CLUNET_SEND_DROPPED);
+	// Dropped the only frame which was waiting for the line
+	if (send_head == SEND_SLOT_NONE)
+		sending_state = STATE_IDLE;
+	send_restart(slot);
+	return slot;
+}
+
+/* Store run length nibble to the encoded frame, returns 0 on overflow */
+static uint8_t
+send_put_run(uint8_t* runs, uint16_t* count, const uint8_t run)
+{
+	if (*count >= 2 * CLUNET_SEND_BUFFER_SIZE)
+		return 0;
+	uint8_t* const ptr = runs + (*count >> 1);
+	if (*count & 1)
+		*ptr |= run << 4;
+	else
+		*ptr = run;
+	(*count)++;
+	return 1;
+}
+
+/*
+	Encode frame to the line runs for timer ISR: start bit, priority bits and frame bytes with CRC, all MSB first.
+	Dominant run continues while bits are 1, recessive while bits are 0. After 5 equal bits the line is inverted
+	and this stuffed bit begins the next run. If the last run is recessive, 1T dominant stop bit is added.
+	Dual-rate frame (CLUNET_T_DATA) ends the run on the last bit of the source address, puts RUN_RATE_SWITCH
+	and begins the data phase with the inverted switch bit, which is decoded as a stuffed one.
+	Returns 0 if encoded frame doesn't fit the slot.
+*/
+static uint8_t
+send_encode(uint8_t* runs, const uint8_t prio, const uint8_t* header, const char* data, const uint8_t size)
+{
+	uint8_t crc = 0;
+	uint8_t idx;
+	for (idx = 0; idx < CLUNET_OFFSET_DATA; idx++)
+		crc = _crc_ibutton_update(crc, header[idx]);
+	for (idx = 0; idx < size; idx++)
+		crc = _crc_ibutton_update(crc, data[idx]);
+
+	uint16_t count = 0;
+	uint8_t level = 0x80; // Dominant level (bits equal to 1)
+	uint8_t run = 1; // Start bit
+	uint8_t byte_index = 0;
+	uint8_t data_byte = (prio - 1) << 5;
+	uint8_t bit_index = 3;
+#ifdef CLUNET_T_DATA
+	uint8_t rate_switch = 0;
+#endif
+
+	while (1)
+	{
+		// Collect bits of the current level
+		do
+		{
+			if ((data_byte ^ level) & 0x80)
+				break;
+			run++;
+			data_byte <<= 1;
+			if (!--bit_index)
+			{
+				if (byte_index < CLUNET_OFFSET_DATA)
+					data_byte = header[byte_index];
+				else if (byte_index < CLUNET_OFFSET_DATA + size)
+					data_byte = data[byte_index - CLUNET_OFFSET_DATA];
+				else if (byte_index == CLUNET_OFFSET_DATA + size)
+					data_byte = crc;
+				else
+					goto _complete;
+				byte_index++;
+				bit_index = 8;
+#ifdef CLUNET_T_DATA
+				// Source address is complete: the run ends on the rate switch
+				if (byte_index == CLUNET_OFFSET_DST_ADDRESS + 1)
+				{
+					rate_switch = 1;
+					break;
+				}
+#endif
+			}
+		}
+		while (run < 5);
+
+		if (!send_put_run(runs, &count, run))
+			return 0;
+
+#ifdef CLUNET_T_DATA
+		// Inverted switch bit begins the data phase, receivers skip it as a stuffed bit
+		if (rate_switch)
+		{
+			if (!send_put_run(runs, &count, RUN_RATE_SWITCH))
+				return 0;
+			rate_switch = 0;
+			run = 1;
+			level ^= 0x80;
+			continue;
+		}
+#endif
+
+		// Bit stuffing: stuffed bit begins the next run
+		run = (run == 5);
+		level ^= 0x80;
+	}
+
+_complete:
+	// Last run, stop bit if it is recessive and terminator
+	return send_put_run(runs, &count, run) && (level || send_put_run(runs, &count, 1)) && send_put_run(runs, &count, 0);
+}
+
+/* Slot for the frame with its queue fields set, SEND_SLOT_NONE if the queue is full or the shaper refuses the frame */
+static uint8_t
+send_prepare(const uint8_t address, const uint8_t priority, const uint8_t command, const uint8_t gap, const uint8_t evict)
+{
+	const uint8_t sreg = SREG;
+	cli();
+	const uint8_t slot = SHAPER_ALLOWS(priority) ? send_alloc(priority, evict) : SEND_SLOT_NONE;
+	SREG = sreg;
+
+	if (slot != SEND_SLOT_NONE)
+	{
+		send_priority[slot] = priority;
+#ifdef CLUNET_DISCOVERY_SLOTS
+		send_gap[slot] = gap;
+#endif
+#ifdef CLUNET_SEND_COMPLETE
+		send_address[slot] = address;
+		send_command[slot] = command;
+#endif
+	}
+	(void)address;
+	(void)command;
+	(void)gap;
+	return slot;
+}
+
+/* Кодируем пакет в буфер слота и ставим в очередь (ISR останется только переключать линию), слот освобождается, если пакет не поместился */
+static uint8_t
+send_commit(const uint8_t slot, const uint8_t* header, const char* data)
+{
+	const uint8_t priority = send_priority[slot];
+	const uint8_t encoded = send_encode(send_buffer[slot], priority, header, data, header[CLUNET_OFFSET_SIZE]);
+
+	const uint8_t sreg = SREG;
+	cli();
+	if (encoded)
+	{
+		SHAPER_TAKE(priority);
+		send_enqueue(slot);
+	}
+	else
+		send_free |= (1 << slot);
+	SREG = sreg;
+
+	return encoded;
+}
+
+/* Queue the frame, it waits for 'gap' T of idle line after interframe (CLUNET_DISCOVERY_SLOTS), without 'evict' only a free slot is taken */
+static uint8_t
+send_frame(const uint8_t address, const uint8_t prio, const uint8_t command, const char* data, const uint8_t size, const uint8_t gap, const uint8_t evict)
+{
+	/* Если размер данных в пределах протокола (максимально 250 байт) */
+	if (size <= 250)
+	{
+		const uint8_t priority = (prio > 8) ? 8 : prio ? : 1;
+		const uint8_t slot = send_prepare(address, priority, command, gap, evict);
+
+		if (slot == SEND_SLOT_NONE)
+			return 0;
+
+		/* Заголовок пакета */
+		uint8_t header[CLUNET_OFFSET_DATA];
+		header[CLUNET_OFFSET_SRC_ADDRESS] = CLUNET_DEVICE_ID;
+		header[CLUNET_OFFSET_DST_ADDRESS] = address;
+		header[CLUNET_OFFSET_COMMAND] = command;
+		header[CLUNET_OFFSET_SIZE] = data ? size : 0;
+
+		return send_commit(slot, header, data);
 	}
+	return 0;
+}
+
+#ifdef CLUNET_READ_QUEUE_SIZE
+/* Built-in reply, clunet_poll() context: only a free slot is taken */
+static uint8_t
+send_reply(const uint8_t address, const uint8_t prio, const uint8_t command, const char* data, const uint8_t size, const uint8_t gap)
+{
+	return send_frame(address, prio, command, data, size, gap, 0);
+}
+#else
+/*
+	Built-in reply from the external ISR: raw frame is copied to a free slot and clunet_poll() encodes it.
+	CRC and stuffing of a long frame take longer than the interframe gap, so the ISR would miss the next frame.
+*/
+static uint8_t
+send_reply(const uint8_t address, const uint8_t prio, const uint8_t command, const char* data, const uint8_t size, const uint8_t gap)
+{
+	if (CLUNET_OFFSET_DATA + size > CLUNET_SEND_BUFFER_SIZE)
+		return 0;
+	const uint8_t slot = send_prepare(address, prio, command, gap, 0);
+	if (slot == SEND_SLOT_NONE)
+		return 0;
+
+	uint8_t* const frame = send_buffer[slot];
+	frame[CLUNET_OFFSET_SRC_ADDRESS] = CLUNET_DEVICE_ID;
+	frame[CLUNET_OFFSET_DST_ADDRESS] = address;
+	frame[CLUNET_OFFSET_COMMAND] = command;
+	frame[CLUNET_OFFSET_SIZE] = size;
+	uint8_t idx;
+	for (idx = 0; idx < size; idx++)
+		frame[CLUNET_OFFSET_DATA + idx] = data[idx];
+	send_raw |= (1 << slot);
+	return 1;
+}
+
+/* Raw reply of the ISR goes to the stack (CLUNET_SEND_BUFFER_SIZE bytes) and is encoded back into its slot */
+static void
+send_reply_encode(const uint8_t slot)
+{
+	uint8_t frame[CLUNET_SEND_BUFFER_SIZE];
+	const uint8_t* const raw = send_buffer[slot];
+	const uint8_t length = CLUNET_OFFSET_DATA + raw[CLUNET_OFFSET_SIZE];
+	uint8_t idx;
+	for (idx = 0; idx < length; idx++)
+		frame[idx] = raw[idx];
+
+	const uint8_t sreg = SREG;
+	cli();
+	send_raw &= ~(1 << slot);
+	SREG = sreg;
+
+	send_commit(slot, frame, (const char*)frame + CLUNET_OFFSET_DATA);
+}
+#endif
+
+uint8_t
+clunet_send(const uint8_t address, const uint8_t prio, const uint8_t command, const char* data, const uint8_t size)
+{
+	return send_frame(address, prio, command, data, size, 0, 1);
 }
 /* Конец void clunet_send(.....) */
 
-/* Возвращает 0, если готов к передаче, иначе приоритет текущей задачи */
+/* Возвращает 0, если в очереди есть место, иначе приоритет текущей задачи */
 uint8_t
 clunet_ready_to_send(void)
 {
-	return sending_state ? sending_priority : 0;
+	return send_free ? 0 : sending_priority;
 }
 
 void
 clunet_resend_last_packet(void)
 {
-	sending_state = STATE_WAIT_INTERFRAME; // Set sending to WAIT_INTERFRAME state
-	// If line is pull-up - enable OCI without clear OCF, else External ISR do planning to send
-	if (!CLUNET_READING)
-		CLUNET_ENABLE_OCI;
+	const uint8_t sreg = SREG;
+	cli();
+	const uint8_t slot = send_last;
+	// Slot of the last sent frame has not been reused yet
+	if (slot != SEND_SLOT_NONE)
+	{
+		send_last = SEND_SLOT_NONE;
+		send_free &= ~(1 << slot);
+		send_restart(slot);
+		send_enqueue(slot);
+	}
+	SREG = sreg;
 }
 
 void
 clunet_abort_send(void)
 {
-		cli();
-		CLUNET_DISABLE_OCI;
-		if ((sending_state & 1) && !CLUNET_READING)
+	const uint8_t sreg = SREG;
+	cli();
+	const uint8_t slot = send_head;
+	if (slot != SEND_SLOT_NONE)
+	{
+		// If line is free after aborted transmission - plan interframe (else External ISR will do it on front edge)
+		if ((sending_state & STATE_ACTIVE) && !CLUNET_READING)
+		{
 			CLUNET_TIMER_REG_OCR = CLUNET_TIMER_REG + (7 * CLUNET_T - 1);
-		sending_state = STATE_IDLE;
-		sei();
+			CLUNET_CLEAR_OCF;
+			CLUNET_ENABLE_OCI;
+		}
 		CLUNET_SEND_0;
+		STATS_NEXT_FRAME;
+		SEND_RESULT(slot, CLUNET_SEND_ABORTED);
+		send_free |= (1 << slot);
+		send_head = send_next[slot];
+		sending_state = STATE_IDLE;
+		if (send_head != SEND_SLOT_NONE)
+			send_start();
+	}
+	SREG = sreg;
 }
 
+#ifdef CLUNET_SEND_AGING
+/* Longest frame which fits the send buffer (every run carries up to 5 bits): header, data and CRC */
+#define SEND_DECODE_SIZE ((CLUNET_SEND_BUFFER_SIZE * 10 / 8 < CLUNET_OFFSET_DATA + 251) ? (CLUNET_SEND_BUFFER_SIZE * 10 / 8) : (CLUNET_OFFSET_DATA + 251))
+
+/*	send_promote() decodes the frame into a stack buffer of SEND_DECODE_SIZE bytes (160 with 128-byte send buffer,
+	255 at most) while clunet_poll() runs, plus a few bytes of send_encode(). Not more than a quarter of RAM. */
+#if defined(RAMEND) && defined(RAMSTART) && (SEND_DECODE_SIZE > (RAMEND - RAMSTART + 1) / 4)
+#  error CLUNET_SEND_AGING: decode buffer does not fit the stack, reduce CLUNET_SEND_BUFFER_SIZE
+#endif
+
+/* Frame bytes back from the line runs: start and priority bits, stuffed bits and the rate switch bit are skipped */
+static void
+send_decode(const uint8_t* runs, uint8_t* frame)
+{
+	uint16_t count = 0;
+	uint16_t bits = 0;
+	uint16_t total = 8 * (CLUNET_OFFSET_SIZE + 1); // Header until its size byte is known
+	uint8_t skip = 4;
+	uint8_t level = 1;
+	while (bits < total)
+	{
+		uint8_t run = runs[count >> 1];
+		run = (count & 1) ? (run >> 4) : (run & 0x0F);
+		count++;
+#ifdef CLUNET_T_DATA
+		if (run == RUN_RATE_SWITCH)
+		{
+			skip = 1;
+			continue;
+		}
+#endif
+		const uint8_t stuffing = (run == 5);
+		for ( ; run && (bits < total); run--)
+		{
+			if (skip)
+			{
+				skip--;
+				continue;
+			}
+			frame[bits >> 3] = (frame[bits >> 3] << 1) | level;
+			if (++bits == 8 * (CLUNET_OFFSET_SIZE + 1))
+				total = 8 * (CLUNET_OFFSET_DATA + frame[CLUNET_OFFSET_SIZE] + 1);
+		}
+		if (stuffing)
+			skip = 1;
+		level ^= 1;
+	}
+}
+
+/* Encode waiting frame again one priority higher, the frame on the line waits for the next call */
+static void
+send_promote(const uint8_t slot)
+{
+	const uint8_t mask = 1 << slot;
+	uint8_t sreg = SREG;
+	cli();
+	if ((slot == send_head) && (sending_state & STATE_ACTIVE))
+	{
+		SREG = sreg;
+		return;
+	}
+	send_aging &= ~mask;
+	// Slot was released before promotion
+	if (send_free & mask)
+	{
+		SREG = sreg;
+		return;
+	}
+	// Out of the queue ISR doesn't touch the slot
+	uint8_t* link = &send_head;
+	while (*link != slot)
+		link = &send_next[*link];
+	*link = send_next[slot];
+	if (send_head == SEND_SLOT_NONE)
+		sending_state = STATE_IDLE;
+	else
+		sending_priority = send_priority[send_head];
+	SREG = sreg;
+
+	uint8_t frame[SEND_DECODE_SIZE];
+	send_decode(send_buffer[slot], frame);
+	const char* data = (const char*)frame + CLUNET_OFFSET_DATA;
+	// Longer encoding may not fit: the frame goes on with its priority
+	if (send_encode(send_buffer[slot], send_priority[slot] + 1, frame, data, frame[CLUNET_OFFSET_SIZE]))
+		send_priority[slot]++;
+	else
+		send_encode(send_buffer[slot], send_priority[slot], frame, data, frame[CLUNET_OFFSET_SIZE]);
+
+	sreg = SREG;
+	cli();
+	send_enqueue(slot);
+	SREG = sreg;
+}
+#endif
+
+void
+clunet_poll(void)
+{
+#ifdef CLUNET_READ_QUEUE_SIZE
+	while (read_count)
+	{
+		process_received_packet(read_buffer[read_head]);
+		if (++read_head == CLUNET_READ_QUEUE_SIZE)
+			read_head = 0;
+		const uint8_t sreg = SREG;
+		cli();
+		read_count--;
+		SREG = sreg;
+	}
+#else
+	uint8_t raw;
+	for (raw = 0; raw < CLUNET_SEND_QUEUE_SIZE; raw++)
+		if (send_raw & (1 << raw))
+			send_reply_encode(raw);
+#endif
+#ifdef CLUNET_SEND_AGING
+	uint8_t slot;
+	for (slot = 0; slot < CLUNET_SEND_QUEUE_SIZE; slot++)
+		if (send_aging & (1 << slot))
+			send_promote(slot);
+#endif
+#ifdef CLUNET_SEND_COMPLETE
+	while (send_results_count)
+	{
+		const uint8_t address = send_results[send_results_head].address;
+		const uint8_t command = send_results[send_results_head].command;
+		const uint8_t result = send_results[send_results_head].result;
+		if (++send_results_head == CLUNET_SEND_QUEUE_SIZE)
+			send_results_head = 0;
+		const uint8_t sreg = SREG;
+		cli();
+		send_results_count--;
+		SREG = sreg;
+		if (cb_send_complete)
+			(*cb_send_complete)(address, command, result);
+	}
+#endif
+}
+
+#ifdef CLUNET_BUS_LOAD
+void
+clunet_bus_load_poll(const uint16_t now)
+{
+	uint8_t sreg = SREG;
+	cli();
+	load_busy += bus_busy;
+	bus_busy = 0;
+	SREG = sreg;
+
+	const uint16_t elapsed = now - load_start;
+	if (elapsed < CLUNET_BUS_LOAD)
+		return;
+	load_start = now;
+	// Main loop was stalled: window is dropped, otherwise busy ticks may overflow the sample
+	if (elapsed > 1000)
+	{
+		load_busy = 0;
+		return;
+	}
+	const uint32_t total = (uint32_t)elapsed * CLUNET_TICKS_PER_MS;
+	const uint16_t sample = (load_busy >= total) ? 255 : (uint16_t)((load_busy * 255) / total);
+	load_busy = 0;
+	bus_load = (3 * (uint16_t)bus_load + sample + 2) >> 2;
+
+#ifdef CLUNET_SHAPER_RATE
+	// Refill rate goes down linearly from CLUNET_SHAPER_LOAD to the saturated bus
+	uint32_t tokens = (uint32_t)elapsed * CLUNET_SHAPER_RATE;
+	if (bus_load > SHAPER_LEVEL)
+		tokens = tokens * (255 - bus_load) / (255 - SHAPER_LEVEL);
+	sreg = SREG;
+	cli();
+	tokens += shaper_tokens;
+	shaper_tokens = (tokens > SHAPER_FULL) ? SHAPER_FULL : (uint16_t)tokens;
+	SREG = sreg;
+#endif
+}
+
+uint8_t
+clunet_bus_load(void)
+{
+	return bus_load;
+}
+#endif
+
+#ifdef CLUNET_SHAPER_RATE
+uint8_t
+clunet_send_allowed(const uint8_t prio)
+{
+	return SHAPER_ALLOWS(prio);
+}
+#endif
+
+#ifdef CLUNET_RECEIVE_FILTER
+static void
+filter_set(uint8_t* table, const uint8_t value, const uint8_t accept)
+{
+	const uint8_t mask = 1 << (value & 7);
+	if (accept)
+		table[value >> 3] |= mask;
+	else
+		table[value >> 3] &= ~mask;
+}
+
+void
+clunet_filter_address(const uint8_t address, const uint8_t accept)
+{
+	filter_set(filter_addresses, address, accept);
+}
+
+void
+clunet_filter_command(const uint8_t command, const uint8_t accept)
+{
+	filter_set(filter_commands, command, accept);
+}
+#endif
+
+#ifdef CLUNET_STATS
+void
+clunet_get_stats(clunet_stats_t* copy)
+{
+	const uint8_t sreg = SREG;
+	cli();
+	*copy = stats;
+	SREG = sreg;
+}
+
+void
+clunet_reset_stats(void)
+{
+	const uint8_t sreg = SREG;
+	cli();
+	stats = (clunet_stats_t){ 0 };
+	stats_retries = 0;
+	SREG = sreg;
+}
+#endif
 
 void
 clunet_set_on_data_received(void (*f)(uint8_t src_address, uint8_t command, char* data, uint8_t size))
@@ -444,8 +1502,74 @@ clunet_set_on_data_received(void (*f)(uint8_t src_address, uint8_t command, char
 	cb_data_received = f;
 }
 
+#ifdef CLUNET_HANDLERS
+uint8_t
+clunet_set_handler(const uint8_t command, clunet_handler_t f, const uint8_t src_address, const uint8_t src_mask)
+{
+	const uint8_t sreg = SREG;
+	cli();
+	uint8_t idx = handler_find(command);
+	const uint8_t found = handlers[idx].f && (handlers[idx].command == command);
+	if (f)
+	{
+		if (!found)
+		{
+			// Table is full: the last free entry ends the search of commands without a handler
+			if (handlers_count == HANDLERS_MASK)
+			{
+				SREG = sreg;
+				return 0;
+			}
+			handlers_count++;
+		}
+		handlers[idx].command = command;
+		handlers[idx].src_address = src_address;
+		handlers[idx].src_mask = src_mask;
+		handlers[idx].f = f;
+	}
+	else if (found)
+	{
+		// Entries after the removed one move back, so the search for them does not stop at the hole
+		uint8_t next = idx;
+		handlers[idx].f = 0;
+		handlers_count--;
+		while (1)
+		{
+			next = (next + 1) & HANDLERS_MASK;
+			if (!handlers[next].f)
+				break;
+			const uint8_t home = handlers[next].command & HANDLERS_MASK;
+			if (((uint8_t)(next - home) & HANDLERS_MASK) >= ((uint8_t)(next - idx) & HANDLERS_MASK))
+			{
+				handlers[idx] = handlers[next];
+				handlers[next].f = 0;
+				idx = next;
+			}
+		}
+	}
+	SREG = sreg;
+	return 1;
+}
+#endif
+
+#ifdef CLUNET_SEND_COMPLETE
+void
+clunet_set_on_send_complete(void (*f)(uint8_t dst_address, uint8_t command, uint8_t result))
+{
+	cb_send_complete = f;
+}
+#endif
+
 void
 clunet_set_on_data_received_sniff(void (*f)(uint8_t src_address, uint8_t dst_address, uint8_t command, char* data, uint8_t size))
 {
 	cb_data_received_sniff = f;
 }
+
+#ifdef CLUNET_CAPTURE
+void
+clunet_set_on_capture(void (*f)(uint32_t time, uint8_t flags, const char* frame, uint8_t size))
+{
+	cb_capture = f;
+}
+#endif
@@ -32,7 +32,8 @@ SOFTWARE.
 #define CLUNET_BROADCAST_ADDRESS 255
 
 #define CLUNET_COMMAND_DISCOVERY 0
-/* Поиск других устройств, параметров нет */
+/* Поиск других устройств. Данные (необязательно) - битовая карта уже известных адресов: бит (адрес & 7) байта (адрес >> 3),
+   устройства с установленным битом не отвечают; короткая карта описывает только первые 8 * размер адресов */
 
 #define CLUNET_COMMAND_DISCOVERY_RESPONSE 0x01
 /* Ответ устройств на поиск, в качестве параметра - название устройства (текст) */
@@ -44,10 +45,28 @@ SOFTWARE.
 <-2 - подтверждение перехода, плюс два байта - размер страницы
 ->3 запись прошивки, 4 байта - адрес, всё остальное - данные (равные размеру страницы)
 <-4 блок прошивки записан
-->5 выход из режима прошивки */
+->5 выход из режима прошивки
+->6 потоковая запись, формат как у 3, подтверждается сразу после приема
+<-7 подтверждение потоковой записи, 4 байта - адрес следующей ожидаемой страницы
+<-8 страница отброшена (пропуск), 4 байта - адрес ожидаемой страницы
+->9 запрос CRC-16 страниц, 4 байта - адрес, 1 байт - количество (до 16)
+<-10 ответ, 4 байта - адрес, далее CRC-16 каждой страницы
+->11 потоковая запись страницы, сжатой RLE, 4 байта - адрес, далее сжатые данные
+   (6 и 11 на широковещательный адрес - многоадресная запись без подтверждений)
+->12 запрос пропущенных страниц многоадресной записи, 2 байта - номер первой страницы, 1 байт - количество (до 128)
+<-13 ответ, 2 байта - номер первой страницы, далее битовая карта пропущенных страниц */
 
 #define CLUNET_COMMAND_REBOOT 0x03
-/* Перезагружает устройство в загрузчик. */
+/* Перезагружает устройство в загрузчик.
+   При заданном CLUNET_BOOT_UPDATE_FLAG (адрес в EEPROM) выставляет флаг запроса обновления:
+   без него загрузчик с целым образом приложения сразу запускает приложение. */
+
+#ifdef CLUNET_BOOT_UPDATE_FLAG
+/* Флаг запроса обновления (байт в EEPROM): 0xFF - не запрошено */
+#define CLUNET_BOOT_UPDATE_REQUESTED 0x00
+/* Длина (4 байта) и CRC-16 (2 байта) образа приложения, записываются загрузчиком в конце обновления */
+#define CLUNET_BOOT_IMAGE_INFO (CLUNET_BOOT_UPDATE_FLAG - 6)
+#endif
 
 #define CLUNET_COMMAND_BOOT_COMPLETED 0x04
 /* Посылается устройством после инициализации библиотеки, сообщает об успешной загрузке устройства. Параметр - содержимое MCU регистра, говорящее о причине перезагрузки. */
@@ -58,6 +77,24 @@ SOFTWARE.
 #define CLUNET_COMMAND_PING_REPLY 0xFF
 /* Ответ на пинг, в данных то, что было прислано в предыдущей команде */
 
+#define CLUNET_COMMAND_STATS 0xFC
+/* Запрос статистики шины (если устройство собрано с CLUNET_STATS). Данные: пусто, либо 1 - сбросить счётчики, если ответ поставлен в очередь */
+
+#define CLUNET_COMMAND_STATS_REPLY 0xFD
+/* Ответ на запрос статистики: поля clunet_stats_t по порядку, little-endian (CLUNET_STATS_SIZE байт) */
+
+#define CLUNET_COMMAND_REQUEST 0xF8
+/* Запрос с номером транзакции (clunet_request.h): номер транзакции, команда, данные команды */
+
+#define CLUNET_COMMAND_RESPONSE 0xF9
+/* Ответ на запрос: номер транзакции из запроса, команда ответа, данные */
+
+#define CLUNET_COMMAND_BULK_DATA 0xFA
+/* Сегмент передачи большого блока данных (clunet_bulk.h): номер передачи, размер сегмента, номер сегмента (2 байта, старший бит - последний сегмент), данные */
+
+#define CLUNET_COMMAND_BULK_ACK 0xFB
+/* Подтверждение сегментов: номер передачи, статус, первый непринятый сегмент (2 байта), битовая маска принятых после него (4 байта) */
+
 #define CLUNET_PRIORITY_NOTICE 1
 /* Приоритет пакета 1 - неважное уведомление, которое вообще может быть потеряно без последствий */
 
@@ -73,12 +110,15 @@ SOFTWARE.
 #ifndef CLUNET_T
 #define CLUNET_T ((F_CPU / CLUNET_TIMER_PRESCALER) / 15625)
 #endif
-#if CLUNET_T < 8
+#if (CLUNET_T < 8) && !(defined(CLUNET_INT_CAPTURE_REG) && (CLUNET_T >= 4))
 #  error Timer frequency is too small, increase CPU frequency or decrease timer prescaler
 #endif
 #if CLUNET_T > 24
 #  error Timer frequency is too big, decrease CPU frequency or increase timer prescaler
 #endif
+#if defined(CLUNET_T_DATA) && ((CLUNET_T_DATA < 4) || (CLUNET_T_DATA >= CLUNET_T))
+#  error CLUNET_T_DATA must be from 4 to CLUNET_T - 1
+#endif
 
 #define CLUNET_CONCAT(a, b)            a ## b
 #define CLUNET_OUTPORT(name)           CLUNET_CONCAT(PORT, name)
@@ -104,21 +144,153 @@ SOFTWARE.
 #if CLUNET_READ_BUFFER_SIZE > 255
 #  error CLUNET_READ_BUFFER_SIZE must be <= 255
 #endif
+#if CLUNET_READ_BUFFER_SIZE < 5
+#  error CLUNET_READ_BUFFER_SIZE must be >= 5 (header and CRC)
+#endif
+#if defined(CLUNET_READ_QUEUE_SIZE) && ((CLUNET_READ_QUEUE_SIZE < 2) || (CLUNET_READ_QUEUE_SIZE > 8))
+#  error CLUNET_READ_QUEUE_SIZE must be from 2 to 8
+#endif
+#ifndef CLUNET_SEND_QUEUE_SIZE
+#  define CLUNET_SEND_QUEUE_SIZE 1
+#endif
+#if (CLUNET_SEND_QUEUE_SIZE < 1) || (CLUNET_SEND_QUEUE_SIZE > 8)
+#  error CLUNET_SEND_QUEUE_SIZE must be from 1 to 8
+#endif
+#if defined(CLUNET_HANDLERS) && ((CLUNET_HANDLERS < 2) || (CLUNET_HANDLERS > 128) || (CLUNET_HANDLERS & (CLUNET_HANDLERS - 1)))
+#  error CLUNET_HANDLERS must be a power of two from 2 to 128
+#endif
+#if defined(CLUNET_SEND_RETRIES) && ((CLUNET_SEND_RETRIES < 1) || (CLUNET_SEND_RETRIES > 254))
+#  error CLUNET_SEND_RETRIES must be from 1 to 254
+#endif
+#ifdef CLUNET_SEND_AGING
+#  if (CLUNET_SEND_AGING < 1) || (CLUNET_SEND_AGING > 255)
+#    error CLUNET_SEND_AGING must be from 1 to 255
+#  endif
+#  ifndef CLUNET_SEND_AGING_MAX
+#    define CLUNET_SEND_AGING_MAX CLUNET_PRIORITY_MESSAGE
+#  endif
+#  if (CLUNET_SEND_AGING_MAX < 2) || (CLUNET_SEND_AGING_MAX > 8)
+#    error CLUNET_SEND_AGING_MAX must be from 2 to 8
+#  endif
+#endif
+#if defined(CLUNET_FAIR_GAP) && ((CLUNET_FAIR_GAP < 2) || (CLUNET_FAIR_GAP > 8))
+#  error CLUNET_FAIR_GAP must be from 2 to 8
+#endif
+#ifdef CLUNET_DISCOVERY_SLOTS
+#  if (CLUNET_DISCOVERY_SLOTS < 2) || (CLUNET_DISCOVERY_SLOTS > 8)
+#    error CLUNET_DISCOVERY_SLOTS must be from 2 to 8
+#  endif
+#  ifdef CLUNET_FAIR_GAP
+#    if (CLUNET_FAIR_GAP + 2 * (CLUNET_DISCOVERY_SLOTS - 1)) * CLUNET_T > 255
+#      error CLUNET_FAIR_GAP and CLUNET_DISCOVERY_SLOTS gaps are too long for 8-bit timer
+#    endif
+#  elif 2 * (CLUNET_DISCOVERY_SLOTS - 1) * CLUNET_T > 255
+#    error CLUNET_DISCOVERY_SLOTS gap is too long for 8-bit timer
+#  endif
+#endif
+#ifdef CLUNET_BUS_LOAD
+#  if (CLUNET_BUS_LOAD < 10) || (CLUNET_BUS_LOAD > 250)
+#    error CLUNET_BUS_LOAD must be from 10 to 250 (ms)
+#  endif
+#  ifndef CLUNET_TICKS_PER_MS
+#    define CLUNET_TICKS_PER_MS (F_CPU / CLUNET_TIMER_PRESCALER / 1000)
+#  endif
+#endif
+#ifdef CLUNET_SHAPER_RATE
+#  ifndef CLUNET_BUS_LOAD
+#    error CLUNET_SHAPER_RATE requires CLUNET_BUS_LOAD
+#  endif
+#  if (CLUNET_SHAPER_RATE < 1) || (CLUNET_SHAPER_RATE > 255)
+#    error CLUNET_SHAPER_RATE must be from 1 to 255 (frames/s)
+#  endif
+#  ifndef CLUNET_SHAPER_BURST
+#    define CLUNET_SHAPER_BURST 4
+#  endif
+#  if (CLUNET_SHAPER_BURST < 1) || (CLUNET_SHAPER_BURST > 60)
+#    error CLUNET_SHAPER_BURST must be from 1 to 60
+#  endif
+#  ifndef CLUNET_SHAPER_LOAD
+#    define CLUNET_SHAPER_LOAD 50
+#  endif
+#  if (CLUNET_SHAPER_LOAD < 0) || (CLUNET_SHAPER_LOAD > 95)
+#    error CLUNET_SHAPER_LOAD must be from 0 to 95 (%)
+#  endif
+#endif
+#if defined(CLUNET_CAPTURE) && (!defined(CLUNET_TIMER_OVF_VECTOR) || !defined(CLUNET_ENABLE_OVI) || !defined(CLUNET_TIMER_OVERFLOW))
+#  error CLUNET_CAPTURE requires CLUNET_TIMER_OVF_VECTOR, CLUNET_ENABLE_OVI and CLUNET_TIMER_OVERFLOW
+#endif
 
 // Инициализация
 void clunet_init(void);
 
-// Возвращает 0, если готов к передаче, иначе приоритет текущей задачи
+// Возвращает 0, если в очереди передачи есть место, иначе приоритет текущей задачи
 uint8_t clunet_ready_to_send(void);
 
-// Resend last sended packet
+// Queue last sent packet again (if its queue slot is not reused yet)
 void clunet_resend_last_packet(void);
 
-// Abort current sending
+// Abort current sending, next queued packet will be sent after interframe
 void clunet_abort_send(void);
 
-// Отправка пакета
-void clunet_send(const uint8_t address, const uint8_t prio, const uint8_t command, const char* data, const uint8_t size);
+// Отправка пакета: ставит пакет в очередь по приоритету.
+// Если очередь полна, вытесняет последний ожидающий пакет с приоритетом ниже prio,
+// а при равном или более высоком приоритете ожидающих пакетов возвращает 0 (очередь полна).
+// Пакет сразу кодируется для передачи (CRC, битстаффинг), повторы передачи используют готовый поток.
+// Возвращает 0, если пакет не поставлен в очередь или не поместился в CLUNET_SEND_BUFFER_SIZE,
+// а также если ограничитель (CLUNET_SHAPER_RATE) не пропускает сейчас пакет с приоритетом 1-2.
+uint8_t clunet_send(const uint8_t address, const uint8_t prio, const uint8_t command, const char* data, const uint8_t size);
+
+// Обработка принятых пакетов из основного цикла (если задан CLUNET_READ_QUEUE_SIZE),
+// в этом режиме все обработчики вызываются отсюда, а не из прерывания.
+// Без CLUNET_READ_QUEUE_SIZE здесь кодируются ответы на PING, DISCOVERY и STATS (прерывание только копирует их в очередь).
+// Здесь же повышается приоритет пакетов (CLUNET_SEND_AGING) и сообщаются результаты отправки (CLUNET_SEND_COMPLETE).
+void clunet_poll(void);
+
+#ifdef CLUNET_BUS_LOAD
+// Оценка загрузки шины, вызывать из основного цикла со временем в миллисекундах (не реже раза в 100 мс).
+// Каждые CLUNET_BUS_LOAD мс доля занятого времени линии усредняется, здесь же пополняется ограничитель.
+void clunet_bus_load_poll(const uint16_t now);
+
+// Загрузка шины: 0 - линия свободна, 255 - занята всё время (пакеты всех устройств и паузы между ними)
+uint8_t clunet_bus_load(void);
+#endif
+
+#ifdef CLUNET_SHAPER_RATE
+// Возвращает 1, если clunet_send() сейчас пропустит пакет с приоритетом prio (приоритеты выше 2 не ограничиваются)
+uint8_t clunet_send_allowed(const uint8_t prio);
+#endif
+
+#ifdef CLUNET_RECEIVE_FILTER
+// Фильтр приёма (вызывать после clunet_init): пакеты с неразрешённым адресом назначения или командой
+// отбрасываются прямо в прерывании, без записи данных в буфер и подсчёта CRC.
+// По умолчанию разрешены свой адрес, широковещательный адрес и все команды.
+// Если установлен sniff-обработчик, принимаются все пакеты, а фильтр применяется только к clunet_set_on_data_received().
+void clunet_filter_address(const uint8_t address, const uint8_t accept);
+void clunet_filter_command(const uint8_t command, const uint8_t accept);
+#endif
+
+#ifdef CLUNET_STATS
+/* Bus statistics counters, 16-bit counters wrap around */
+typedef struct
+{
+	uint16_t sent;			// Frames sent
+	uint16_t received;		// Frames read from the line with good CRC (not rejected by receive filter)
+	uint16_t crc_errors;		// Frames with bad CRC (not rejected by receive filter)
+	uint16_t overflows;		// Frames dropped: longer than read buffer or receive ring is full
+	uint16_t lost_front;		// Arbitration lost on front edge: dominant run longer than ours
+	uint16_t lost_falling;		// Arbitration lost on falling edge: line pulled down out of our bit boundary
+	uint16_t lost_flag;		// Arbitration lost before our dominant bit (3-rd type, reading flag)
+	uint16_t interframe_waits;	// Sending started while frame of another device was on the line
+	uint8_t max_retries;		// Maximal number of lost attempts of one frame
+} clunet_stats_t;
+#define CLUNET_STATS_SIZE 17
+
+// Копия счётчиков статистики
+void clunet_get_stats(clunet_stats_t* stats);
+
+// Сброс счётчиков статистики
+void clunet_reset_stats(void);
+#endif
 
 // Установка функций, которые вызываются при получении пакетов
 // Эта - получает пакеты, которые адресованы нам
@@ -127,4 +299,42 @@ void clunet_set_on_data_received(void (*f)(uint8_t src_address, uint8_t command,
 // А эта - абсолютно все, которые ходят по сети, включая наши
 void clunet_set_on_data_received_sniff(void (*f)(uint8_t src_address, uint8_t dst_address, uint8_t command, char* data, uint8_t size));
 
+/* Capture record flags (CLUNET_CAPTURE, clunet_capture.h) */
+#define CLUNET_CAPTURE_PRIORITY 0x07	// Priority of the frame - 1
+#define CLUNET_CAPTURE_CRC_ERROR 0x08	// Frame is damaged, it is not processed otherwise
+#define CLUNET_CAPTURE_LOST 0x10	// Frames were dropped before this one (receive buffer or ring was full)
+
+#ifdef CLUNET_CAPTURE
+// Захват всех пакетов для анализа (сниффер), вызывается там же, где sniff-обработчик, включая пакеты с ошибкой CRC.
+// time - время стартового бита в тиках таймера, расширенное до 32 бит прерыванием переполнения таймера;
+// frame - пакет как он был на линии: источник, назначение, команда, размер, данные и CRC (size байт).
+void clunet_set_on_capture(void (*f)(uint32_t time, uint8_t flags, const char* frame, uint8_t size));
+
+// Текущее время в тех же тиках (32 бита), можно вызывать и при запрещённых прерываниях
+uint32_t clunet_capture_time(void);
+#endif
+
+#ifdef CLUNET_HANDLERS
+/* Command handler, priority of the frame is 1-8 */
+typedef void (*clunet_handler_t)(uint8_t src_address, uint8_t command, char* data, uint8_t size, uint8_t priority);
+
+// Обработчик команды command: пакеты этой команды, адресованные нам, получает только он (вместо clunet_set_on_data_received()
+// и встроенных ответов на DISCOVERY, PING, STATS), если (src_address источника & src_mask) == (src_address & src_mask),
+// пакеты других источников отбрасываются. src_mask = 0 - от любого источника. f = 0 удаляет обработчик.
+// Возвращает 0, если таблица обработчиков заполнена: в ней CLUNET_HANDLERS - 1 обработчиков, одна запись всегда свободна.
+uint8_t clunet_set_handler(const uint8_t command, clunet_handler_t f, const uint8_t src_address, const uint8_t src_mask);
+#endif
+
+#ifdef CLUNET_SEND_COMPLETE
+/* Send results */
+#define CLUNET_SEND_OK 0		// Frame is on the line
+#define CLUNET_SEND_ABORTED 1		// clunet_abort_send()
+#define CLUNET_SEND_GAVE_UP 2		// Arbitration lost more than CLUNET_SEND_RETRIES times
+#define CLUNET_SEND_DROPPED 3		// Full queue: dropped for a frame with strictly higher priority
+
+// Результат отправки каждого пакета из очереди (адрес и команда пакета), вызывается из clunet_poll().
+// Хранится не более CLUNET_SEND_QUEUE_SIZE результатов, clunet_poll() нужно вызывать чаще.
+void clunet_set_on_send_complete(void (*f)(uint8_t dst_address, uint8_t command, uint8_t result));
+#endif
+
 #endif
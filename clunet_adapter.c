@@ -0,0 +1,214 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+#include "clunet_adapter.h"
+#include "clunet_hal.h"
+
+#include <stdint.h>
+
+#define TX_MASK (CLUNET_ADAPTER_TX_SIZE - 1)
+
+/* Encoded size of a byte */
+#define SLIP_SIZE(byte) ((((byte) == CLUNET_GW_SLIP_END) || ((byte) == CLUNET_GW_SLIP_ESC)) ? 2 : 1)
+
+/* Control record with an argument and up to one data byte: END, header, data and CRC (all may be escaped), END */
+#define CONTROL_ROOM (2 + 2 * (CLUNET_GW_HEADER_SIZE + 2))
+
+/* UART ring: main loop writes at tx_write and publishes tx_head, UART ISR reads at tx_tail (RAM: CLUNET_ADAPTER_TX_SIZE + 6 bytes) */
+static uint8_t tx_buffer[CLUNET_ADAPTER_TX_SIZE];
+static uint8_t tx_write;
+static volatile uint8_t tx_head;
+static volatile uint8_t tx_tail;
+static void (*tx_start)(void);
+static uint8_t tx_crc;
+static uint16_t dropped;
+
+/* Host frame: UART ISR receives it, main loop takes it when rx_state is set */
+#define RX_READY 1	// Valid record in rx_record
+#define RX_REFUSED 2	// Valid record longer than rx_record
+static uint8_t rx_record[CLUNET_GW_HEADER_SIZE + CLUNET_ADAPTER_MAX_DATA + 1];
+static uint16_t rx_size; // Bytes of the record being received, also beyond rx_record
+static uint8_t rx_crc;
+static uint8_t rx_escape;
+static volatile uint8_t rx_state;
+
+static void
+put_raw(const uint8_t byte)
+{
+	tx_buffer[tx_write] = byte;
+	tx_write = (tx_write + 1) & TX_MASK;
+}
+
+static void
+put(const uint8_t byte)
+{
+	tx_crc = _crc_ibutton_update(tx_crc, byte);
+	if (byte == CLUNET_GW_SLIP_END)
+	{
+		put_raw(CLUNET_GW_SLIP_ESC);
+		put_raw(CLUNET_GW_SLIP_ESC_END);
+	}
+	else if (byte == CLUNET_GW_SLIP_ESC)
+	{
+		put_raw(CLUNET_GW_SLIP_ESC);
+		put_raw(CLUNET_GW_SLIP_ESC_ESC);
+	}
+	else
+		put_raw(byte);
+}
+
+static uint8_t
+tx_room(void)
+{
+	return (tx_tail - tx_write - 1) & TX_MASK;
+}
+
+/* Record to the host, returns 0 if it does not fit the UART buffer */
+static uint8_t
+put_record(const uint8_t a, const uint8_t b, const uint8_t command, const char* data, const uint8_t size)
+{
+	const uint8_t header[CLUNET_GW_HEADER_SIZE] = { a, b, command, size };
+	// Leading and closing END, CRC may be escaped
+	uint16_t need = 4;
+	uint8_t i;
+	for (i = 0; i < CLUNET_GW_HEADER_SIZE; i++)
+		need += SLIP_SIZE(header[i]);
+	for (i = 0; i < size; i++)
+		need += SLIP_SIZE((uint8_t)data[i]);
+	if (need > tx_room())
+		return 0;
+	// Leading END flushes line noise collected by the receiver
+	put_raw(CLUNET_GW_SLIP_END);
+	tx_crc = 0;
+	for (i = 0; i < CLUNET_GW_HEADER_SIZE; i++)
+		put(header[i]);
+	for (i = 0; i < size; i++)
+		put(data[i]);
+	put(tx_crc);
+	put_raw(CLUNET_GW_SLIP_END);
+	tx_head = tx_write;
+	if (tx_start)
+		(*tx_start)();
+	return 1;
+}
+
+static uint8_t
+hello(void)
+{
+	const char window = 1;
+	return put_record(CLUNET_GW_CONTROL, CLUNET_GW_HELLO, CLUNET_DEVICE_ID, &window, 1);
+}
+
+/* Every frame on the bus, own ones come back once transmitted */
+static void
+sniffed(uint8_t src_address, uint8_t dst_address, uint8_t command, char* data, uint8_t size)
+{
+	if (!put_record(src_address, dst_address, command, data, size))
+		dropped++;
+}
+
+void
+clunet_adapter_start(void (*f)(void))
+{
+	tx_start = f;
+	hello();
+	clunet_set_on_data_received_sniff(sniffed);
+}
+
+void
+clunet_adapter_rx(uint8_t byte)
+{
+	// Host frame waits for the transmit queue: the host keeps to its window, anything else is noise
+	if (rx_state)
+		return;
+	if (byte == CLUNET_GW_SLIP_END)
+	{
+		const uint16_t size = rx_size;
+		const uint8_t crc = rx_crc;
+		rx_size = rx_crc = rx_escape = 0;
+		if ((size > CLUNET_GW_HEADER_SIZE) && !crc && (size == CLUNET_GW_HEADER_SIZE + rx_record[3] + 1))
+			rx_state = (size <= sizeof(rx_record)) ? RX_READY : RX_REFUSED;
+		return;
+	}
+	if (byte == CLUNET_GW_SLIP_ESC)
+	{
+		rx_escape = 1;
+		return;
+	}
+	if (rx_escape)
+	{
+		rx_escape = 0;
+		if (byte == CLUNET_GW_SLIP_ESC_END)
+			byte = CLUNET_GW_SLIP_END;
+		else if (byte == CLUNET_GW_SLIP_ESC_ESC)
+			byte = CLUNET_GW_SLIP_ESC;
+	}
+	rx_crc = _crc_ibutton_update(rx_crc, byte);
+	if (rx_size < sizeof(rx_record))
+		rx_record[rx_size] = byte;
+	if (rx_size < 0xFFFF)
+		rx_size++;
+}
+
+uint8_t
+clunet_adapter_tx(uint8_t* byte)
+{
+	const uint8_t tail = tx_tail;
+	if (tail == tx_head)
+		return 0;
+	*byte = tx_buffer[tail];
+	tx_tail = (tail + 1) & TX_MASK;
+	return 1;
+}
+
+void
+clunet_adapter_poll(void)
+{
+	const uint8_t state = rx_state;
+	if (!state)
+		return;
+	// Answer must fit the UART buffer, the record waits otherwise
+	if (tx_room() < CONTROL_ROOM)
+		return;
+	if (rx_record[0] == CLUNET_GW_CONTROL)
+	{
+		// Host has opened the link or lost its credits: announce again
+		if (rx_record[1] == CLUNET_GW_HELLO)
+			hello();
+		rx_state = 0;
+		return;
+	}
+	uint8_t queued = 0;
+	if ((state == RX_READY) && rx_record[0] && (rx_record[0] <= 8))
+	{
+		// Only a free slot of the transmit queue, the frame waits for it
+		if (clunet_ready_to_send())
+			return;
+		queued = clunet_send(rx_record[1], rx_record[0], rx_record[2], (const char*)rx_record + CLUNET_GW_HEADER_SIZE, rx_record[3]);
+	}
+	put_record(CLUNET_GW_CONTROL, CLUNET_GW_CREDIT, queued, 0, 0);
+	rx_state = 0;
+}
+
+uint16_t
+clunet_adapter_dropped(void)
+{
+	return dropped;
+}
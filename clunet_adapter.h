@@ -0,0 +1,76 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	Serial adapter of the network gateway: a CLUNET node that links the bus to clunet-gatewayd
+	(tools/gateway) over a UART.
+
+	The link is the record stream of clunet_gateway.h, every record is followed by CRC-8 and SLIP framed.
+	Every frame seen on the bus goes to the host, own frames too once they are on the line (sniff callback).
+	The adapter buffers one host frame (HELLO window 1): it is passed to clunet_send() when the transmit
+	queue has room, then CREDIT returns the window to the host. A host frame which is too long for
+	the receive buffer or a bad priority is answered with CREDIT 0.
+	Callbacks must run from the main loop, so deferred receiving (CLUNET_READ_QUEUE_SIZE) is required.
+*/
+
+#ifndef __CLUNET_ADAPTER_H__
+#define __CLUNET_ADAPTER_H__
+
+#include "clunet.h"
+#include "clunet_gateway.h"
+
+#ifndef CLUNET_READ_QUEUE_SIZE
+#  error clunet_adapter requires CLUNET_READ_QUEUE_SIZE
+#endif
+
+/* UART output buffer, bytes (power of two, 32-256): a bus frame which does not fit it is dropped */
+#ifndef CLUNET_ADAPTER_TX_SIZE
+#  define CLUNET_ADAPTER_TX_SIZE 256
+#endif
+#if (CLUNET_ADAPTER_TX_SIZE < 32) || (CLUNET_ADAPTER_TX_SIZE > 256) || (CLUNET_ADAPTER_TX_SIZE & (CLUNET_ADAPTER_TX_SIZE - 1))
+#  error CLUNET_ADAPTER_TX_SIZE must be a power of two from 32 to 256
+#endif
+
+/* Maximal data size of a host frame (receive buffer of the header, data and CRC) */
+#ifndef CLUNET_ADAPTER_MAX_DATA
+#  if CLUNET_SEND_BUFFER_SIZE < CLUNET_GW_MAX_DATA
+#    define CLUNET_ADAPTER_MAX_DATA CLUNET_SEND_BUFFER_SIZE
+#  else
+#    define CLUNET_ADAPTER_MAX_DATA CLUNET_GW_MAX_DATA
+#  endif
+#endif
+
+// Начать работу: HELLO хосту, затем все пакеты шины (ставит обработчик clunet_set_on_data_received_sniff()).
+// tx_start() разрешает прерывание UART "регистр данных пуст", вызывается, когда в буфере есть данные.
+void clunet_adapter_start(void (*tx_start)(void));
+
+// Из прерывания UART: принятый байт
+void clunet_adapter_rx(uint8_t byte);
+
+// Из прерывания UART: следующий байт для хоста. Возвращает 0, если отправлять нечего (прерывание нужно запретить).
+uint8_t clunet_adapter_tx(uint8_t* byte);
+
+// Из главного цикла после clunet_poll(): пакет хоста в очередь передачи, ответы хосту
+void clunet_adapter_poll(void);
+
+// Пакеты шины, не поместившиеся в буфер UART
+uint16_t clunet_adapter_dropped(void);
+
+#endif
@@ -0,0 +1,390 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+#include "clunet_bulk.h"
+
+#include <stdint.h>
+
+/* Outgoing transfer (RAM: 32 bytes) */
+static struct
+{
+	uint8_t id;		// Transfer number (never 0)
+	uint8_t address;
+	uint8_t prio;
+	uint8_t retries;	// Timeouts without progress
+	uint16_t count;		// Number of segments, 0 - no transfer
+	uint16_t base;		// First not acknowledged segment
+	uint16_t next;		// First never sent segment
+	uint16_t time;		// Last progress or timeout
+	uint32_t acked;		// Acknowledged segments from base (bit 0 - base)
+	uint32_t resend;	// Segments to send again from base
+	uint32_t repaired;	// Segments already sent again after selective acknowledgement
+	uint32_t length;
+	void (*read)(uint32_t offset, char* buffer, uint8_t size);
+	void (*done)(uint8_t result);
+} tx;
+
+/* Incoming transfers */
+struct bulk_session
+{
+	uint8_t src;
+	uint8_t id;		// 0 - session is free
+	uint8_t segment;	// Segment size of the sender
+	uint8_t unacked;	// Segments received after the last acknowledgement
+	uint8_t last_size;	// Data size of the last segment
+	uint16_t next;		// First missing segment
+	uint16_t count;		// Number of segments, 0 while the last one is not received
+	uint16_t time;		// Last activity
+	uint32_t received;	// Received segments from next (bit 0 - next)
+};
+static struct bulk_session rx[CLUNET_BULK_SESSIONS];
+
+static uint16_t bulk_now;
+static uint8_t bulk_last_id;
+
+static void (*cb_bulk_data)(uint8_t src_address, uint8_t id, uint32_t offset, const char* data, uint8_t size) = 0;
+static void (*cb_bulk_complete)(uint8_t src_address, uint8_t id, uint32_t length) = 0;
+
+/* Bitmap of 'n' lowest bits */
+static uint32_t
+bulk_mask(const uint16_t n)
+{
+	return (n >= 32) ? 0xFFFFFFFF : (((uint32_t)1 << n) - 1);
+}
+
+static void
+tx_finish(const uint8_t result)
+{
+	tx.count = 0;
+	if (tx.done)
+		(*tx.done)(result);
+}
+
+uint8_t
+clunet_bulk_send(const uint8_t address, const uint8_t prio, const uint32_t length,
+	void (*read)(uint32_t offset, char* buffer, uint8_t size), void (*done)(uint8_t result))
+{
+	const uint32_t count = length / CLUNET_BULK_SEGMENT_SIZE + 1; // Last segment may be empty
+	if (tx.count || (count >= CLUNET_BULK_LAST))
+		return 0;
+	if (!++bulk_last_id)
+		bulk_last_id = 1;
+	tx.id = bulk_last_id;
+	tx.address = address;
+	tx.prio = prio;
+	tx.retries = 0;
+	tx.count = count;
+	tx.base = tx.next = 0;
+	tx.time = bulk_now;
+	tx.acked = tx.resend = tx.repaired = 0;
+	tx.length = length;
+	tx.read = read;
+	tx.done = done;
+	return tx.id;
+}
+
+void
+clunet_bulk_abort(void)
+{
+	if (tx.count)
+		tx_finish(CLUNET_BULK_ABORTED);
+}
+
+/* Sender: acknowledgement of outgoing transfer */
+static void
+tx_acknowledged(const char* data)
+{
+	const uint8_t status = data[1];
+	const uint16_t next = (uint8_t)data[2] | ((uint8_t)data[3] << 8);
+	const uint32_t mask = (uint8_t)data[4] | ((uint32_t)(uint8_t)data[5] << 8) | ((uint32_t)(uint8_t)data[6] << 16) | ((uint32_t)(uint8_t)data[7] << 24);
+
+	if (status != CLUNET_BULK_STATUS_OK)
+	{
+		tx_finish(CLUNET_BULK_REJECTED);
+		return;
+	}
+	// Old or invalid acknowledgement
+	if ((next < tx.base) || (next > tx.next))
+		return;
+
+	// Cumulative part: slide the window
+	const uint16_t shift = next - tx.base;
+	if (shift)
+	{
+		tx.acked = (shift >= 32) ? 0 : (tx.acked >> shift);
+		tx.resend = (shift >= 32) ? 0 : (tx.resend >> shift);
+		tx.repaired = (shift >= 32) ? 0 : (tx.repaired >> shift);
+		tx.base = next;
+		tx.retries = 0;
+		tx.time = bulk_now;
+	}
+	if (tx.base == tx.count)
+	{
+		tx_finish(CLUNET_BULK_OK);
+		return;
+	}
+
+	// Selective part: segments before the last acknowledged one are lost, each is repaired once until timeout
+	tx.acked |= mask << 1;
+	const uint32_t sent = bulk_mask(tx.next - tx.base);
+	uint32_t holes = tx.acked & sent;
+	if (holes)
+	{
+		uint8_t last = 31;
+		while (!(holes & ((uint32_t)1 << last)))
+			last--;
+		holes = ~tx.acked & ~tx.repaired & bulk_mask(last);
+		tx.resend |= holes;
+		tx.repaired |= holes;
+	}
+}
+
+static void
+rx_acknowledge(struct bulk_session* s, const uint8_t status)
+{
+	char ack[8];
+	const uint32_t mask = s->received >> 1;
+	ack[0] = s->id;
+	ack[1] = status;
+	ack[2] = (uint8_t)s->next;
+	ack[3] = (uint8_t)(s->next >> 8);
+	ack[4] = (uint8_t)mask;
+	ack[5] = (uint8_t)(mask >> 8);
+	ack[6] = (uint8_t)(mask >> 16);
+	ack[7] = (uint8_t)(mask >> 24);
+	// Only a free slot is taken (queued frames of the application are not evicted), otherwise acknowledgement is repeated by clunet_bulk_poll()
+	if (!clunet_ready_to_send() && clunet_send(s->src, CLUNET_PRIORITY_MESSAGE, CLUNET_COMMAND_BULK_ACK, ack, sizeof(ack)))
+		s->unacked = 0;
+}
+
+/* Session of transfer: existing one, free one, one of the same source, or the least recently used idle one */
+static struct bulk_session*
+rx_session(const uint8_t src, const uint8_t id)
+{
+	struct bulk_session* found = 0;
+	uint8_t idx;
+	for (idx = 0; idx < CLUNET_BULK_SESSIONS; idx++)
+	{
+		struct bulk_session* s = &rx[idx];
+		if (s->id && (s->src == src))
+		{
+			if (s->id == id)
+				return s;
+			found = s; // New transfer of the same sender replaces the old one
+			break;
+		}
+		if (!s->id)
+			found = s;
+		else if (!found && ((uint16_t)(bulk_now - s->time) >= CLUNET_BULK_TIMEOUT * (CLUNET_BULK_RETRIES + 1)))
+			found = s;
+	}
+	if (found)
+	{
+		found->src = src;
+		found->id = id;
+		found->segment = 0;
+		found->unacked = 0;
+		found->next = found->count = 0;
+		found->received = 0;
+	}
+	return found;
+}
+
+/* Receiver: segment of incoming transfer */
+static void
+rx_segment(const uint8_t src, const char* data, const uint8_t size)
+{
+	const uint8_t id = data[0];
+	const uint8_t segment = data[1];
+	uint16_t seq = (uint8_t)data[2] | ((uint8_t)data[3] << 8);
+	const uint8_t last = (seq & CLUNET_BULK_LAST) ? 1 : 0;
+	seq &= ~CLUNET_BULK_LAST;
+
+	struct bulk_session* s = rx_session(src, id);
+	if (!s)
+	{
+		struct bulk_session reject = { src, id, 0, 0, 0, 0, 0, 0, 0 };
+		rx_acknowledge(&reject, CLUNET_BULK_STATUS_REJECTED);
+		return;
+	}
+	s->time = bulk_now;
+	s->segment = segment;
+	if (last)
+	{
+		s->count = seq + 1;
+		s->last_size = size - CLUNET_BULK_HEADER_SIZE;
+	}
+
+	// Duplicate: acknowledgement was lost
+	const uint16_t ahead = seq - s->next;
+	if ((seq < s->next) || ((ahead < 32) && (s->received & ((uint32_t)1 << ahead))))
+	{
+		rx_acknowledge(s, CLUNET_BULK_STATUS_OK);
+		return;
+	}
+	// Out of the window
+	if (ahead >= 32)
+		return;
+
+	if (cb_bulk_data)
+		(*cb_bulk_data)(src, id, (uint32_t)seq * segment, data + CLUNET_BULK_HEADER_SIZE, size - CLUNET_BULK_HEADER_SIZE);
+
+	// First gap is reported at once, so the sender can repeat lost segments
+	const uint8_t gap = ahead && !(s->received >> 1);
+	s->received |= (uint32_t)1 << ahead;
+	while (s->received & 1)
+	{
+		s->received >>= 1;
+		s->next++;
+	}
+	s->unacked++;
+
+	if (s->count && (s->next == s->count))
+	{
+		rx_acknowledge(s, CLUNET_BULK_STATUS_OK);
+		if (cb_bulk_complete)
+			(*cb_bulk_complete)(src, id, (uint32_t)(s->count - 1) * segment + s->last_size);
+	}
+	else if (gap || (s->unacked >= (CLUNET_BULK_WINDOW + 1) / 2))
+		rx_acknowledge(s, CLUNET_BULK_STATUS_OK);
+}
+
+uint8_t
+clunet_bulk_received(const uint8_t src_address, const uint8_t command, const char* data, const uint8_t size)
+{
+	switch (command)
+	{
+		case CLUNET_COMMAND_BULK_DATA:
+			if (size >= CLUNET_BULK_HEADER_SIZE && data[0])
+				rx_segment(src_address, data, size);
+			return 1;
+		case CLUNET_COMMAND_BULK_ACK:
+			if ((size == 8) && tx.count && (src_address == tx.address) && ((uint8_t)data[0] == tx.id))
+				tx_acknowledged(data);
+			return 1;
+	}
+	return 0;
+}
+
+#ifdef CLUNET_HANDLERS
+static void
+bulk_handler(uint8_t src_address, uint8_t command, char* data, uint8_t size, uint8_t priority)
+{
+	(void)priority;
+	clunet_bulk_received(src_address, command, data, size);
+}
+
+uint8_t
+clunet_bulk_register(void)
+{
+	return clunet_set_handler(CLUNET_COMMAND_BULK_DATA, bulk_handler, 0, 0)
+		&& clunet_set_handler(CLUNET_COMMAND_BULK_ACK, bulk_handler, 0, 0);
+}
+#endif
+
+void
+clunet_bulk_poll(const uint16_t now)
+{
+	uint8_t idx;
+	bulk_now = now;
+
+	// Delayed acknowledgements
+	for (idx = 0; idx < CLUNET_BULK_SESSIONS; idx++)
+	{
+		struct bulk_session* s = &rx[idx];
+		if (s->id && s->unacked && ((uint16_t)(now - s->time) >= CLUNET_BULK_ACK_DELAY))
+			rx_acknowledge(s, CLUNET_BULK_STATUS_OK);
+	}
+
+	if (!tx.count)
+		return;
+
+	// Retransmission timeout: everything not acknowledged is sent again.
+	// While the transmit queue is full segments are still waiting for the line, not for the receiver.
+	if (clunet_ready_to_send())
+		tx.time = now;
+#ifdef CLUNET_SHAPER_RATE
+	// The same while the shaper holds segments back
+	else if (!clunet_send_allowed(tx.prio))
+		tx.time = now;
+#endif
+	else if ((tx.next != tx.base) && ((uint16_t)(now - tx.time) >= CLUNET_BULK_TIMEOUT))
+	{
+		if (++tx.retries > CLUNET_BULK_RETRIES)
+		{
+			tx_finish(CLUNET_BULK_TIMEOUT_ERROR);
+			return;
+		}
+		tx.resend = ~tx.acked & bulk_mask(tx.next - tx.base);
+		tx.repaired = 0;
+		tx.time = now;
+	}
+
+	// Keep the transmit queue full: lost segments first, then new ones inside the window
+	while (!clunet_ready_to_send())
+	{
+		uint16_t seq;
+#ifdef CLUNET_SHAPER_RATE
+		if (!clunet_send_allowed(tx.prio))
+			break;
+#endif
+		if (tx.resend)
+		{
+			uint8_t bit = 0;
+			while (!(tx.resend & ((uint32_t)1 << bit)))
+				bit++;
+			tx.resend &= ~((uint32_t)1 << bit);
+			seq = tx.base + bit;
+		}
+		else if ((tx.next < tx.count) && (tx.next - tx.base < CLUNET_BULK_WINDOW))
+			seq = tx.next++;
+		else
+			break;
+
+		char frame[CLUNET_BULK_HEADER_SIZE + CLUNET_BULK_SEGMENT_SIZE];
+		const uint32_t offset = (uint32_t)seq * CLUNET_BULK_SEGMENT_SIZE;
+		const uint8_t size = (seq == tx.count - 1) ? (uint8_t)(tx.length - offset) : CLUNET_BULK_SEGMENT_SIZE;
+		const uint16_t header = (seq == tx.count - 1) ? (seq | CLUNET_BULK_LAST) : seq;
+		frame[0] = tx.id;
+		frame[1] = CLUNET_BULK_SEGMENT_SIZE;
+		frame[2] = (uint8_t)header;
+		frame[3] = (uint8_t)(header >> 8);
+		if (size)
+			(*tx.read)(offset, frame + CLUNET_BULK_HEADER_SIZE, size);
+		// Queue has a free slot, so only a frame bigger than send buffer is not queued
+		if (!clunet_send(tx.address, tx.prio, CLUNET_COMMAND_BULK_DATA, frame, CLUNET_BULK_HEADER_SIZE + size))
+		{
+			tx_finish(CLUNET_BULK_ABORTED);
+			return;
+		}
+	}
+}
+
+void
+clunet_bulk_set_on_data(void (*f)(uint8_t src_address, uint8_t id, uint32_t offset, const char* data, uint8_t size))
+{
+	cb_bulk_data = f;
+}
+
+void
+clunet_bulk_set_on_complete(void (*f)(uint8_t src_address, uint8_t id, uint32_t length))
+{
+	cb_bulk_complete = f;
+}
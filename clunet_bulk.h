@@ -0,0 +1,117 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	Transfer of large data blocks over CLUNET: segmentation, sequence numbers,
+	sliding window with selective acknowledgements and retransmission.
+
+	Sender reads data by callback while sending, receiver gets every segment by callback
+	with its offset as soon as it arrives (possibly out of order), so neither side needs
+	a buffer for the whole block. Callbacks run from clunet_poll(), so deferred receiving
+	(CLUNET_READ_QUEUE_SIZE) is required.
+*/
+
+#ifndef __CLUNET_BULK_H__
+#define __CLUNET_BULK_H__
+
+#include "clunet.h"
+
+#ifndef CLUNET_READ_QUEUE_SIZE
+#  error clunet_bulk requires CLUNET_READ_QUEUE_SIZE
+#endif
+
+/* Segment header: transfer id, segment size, segment number (bit 15 - last segment) */
+#define CLUNET_BULK_HEADER_SIZE 4
+#define CLUNET_BULK_LAST 0x8000
+
+/*
+	Segment data size. Default fits the send buffer with any data (up to 4 buffer bytes per frame byte),
+	typical data takes about 2 buffer bytes per byte, so it may be increased if data is known.
+*/
+#ifndef CLUNET_BULK_SEGMENT_SIZE
+#  define CLUNET_BULK_SEGMENT_SIZE ((2 * CLUNET_SEND_BUFFER_SIZE - 7) / 8 - CLUNET_OFFSET_DATA - CLUNET_BULK_HEADER_SIZE - 1)
+#endif
+#if (CLUNET_BULK_SEGMENT_SIZE < 1) || (CLUNET_BULK_SEGMENT_SIZE > 250 - CLUNET_BULK_HEADER_SIZE)
+#  error CLUNET_BULK_SEGMENT_SIZE is out of range, increase CLUNET_SEND_BUFFER_SIZE
+#endif
+
+/* Sender window in segments (1-32) */
+#ifndef CLUNET_BULK_WINDOW
+#  define CLUNET_BULK_WINDOW 16
+#endif
+#if (CLUNET_BULK_WINDOW < 1) || (CLUNET_BULK_WINDOW > 32)
+#  error CLUNET_BULK_WINDOW must be from 1 to 32
+#endif
+
+/* Simultaneous incoming transfers (RAM: 15 bytes each) */
+#ifndef CLUNET_BULK_SESSIONS
+#  define CLUNET_BULK_SESSIONS 1
+#endif
+
+/* Retransmission timeout (ms) and number of retries without progress */
+#ifndef CLUNET_BULK_TIMEOUT
+#  define CLUNET_BULK_TIMEOUT 200
+#endif
+#ifndef CLUNET_BULK_RETRIES
+#  define CLUNET_BULK_RETRIES 5
+#endif
+
+/* Receiver acknowledges every half window or after this delay (ms) */
+#ifndef CLUNET_BULK_ACK_DELAY
+#  define CLUNET_BULK_ACK_DELAY 20
+#endif
+
+/* Transfer results */
+#define CLUNET_BULK_OK 0
+#define CLUNET_BULK_TIMEOUT_ERROR 1	// No progress after CLUNET_BULK_RETRIES retransmissions
+#define CLUNET_BULK_REJECTED 2		// Receiver has no free session
+#define CLUNET_BULK_ABORTED 3		// clunet_bulk_abort() or segment does not fit the send buffer
+
+/* Acknowledgement status */
+#define CLUNET_BULK_STATUS_OK 0
+#define CLUNET_BULK_STATUS_REJECTED 1
+
+// Начать передачу length байт устройству address с приоритетом prio.
+// Данные читаются функцией read(offset, buffer, size) по мере отправки, по окончании вызывается done(result).
+// Возвращает номер передачи или 0, если предыдущая передача ещё не закончена.
+uint8_t clunet_bulk_send(const uint8_t address, const uint8_t prio, const uint32_t length,
+	void (*read)(uint32_t offset, char* buffer, uint8_t size), void (*done)(uint8_t result));
+
+// Прервать текущую передачу
+void clunet_bulk_abort(void);
+
+// Пакеты транспорта: вызывать из обработчика clunet_set_on_data_received(), возвращает 1, если пакет обработан
+uint8_t clunet_bulk_received(const uint8_t src_address, const uint8_t command, const char* data, const uint8_t size);
+
+#ifdef CLUNET_HANDLERS
+// Либо зарегистрировать обработчики команд транспорта, возвращает 0, если таблица обработчиков заполнена
+uint8_t clunet_bulk_register(void);
+#endif
+
+// Отправка сегментов и таймеры: вызывать из главного цикла после clunet_poll(), now - время в миллисекундах
+void clunet_bulk_poll(const uint16_t now);
+
+// Приём: каждый новый сегмент со смещением в блоке (сегменты могут приходить не по порядку)
+void clunet_bulk_set_on_data(void (*f)(uint8_t src_address, uint8_t id, uint32_t offset, const char* data, uint8_t size));
+
+// Приём: блок принят полностью
+void clunet_bulk_set_on_complete(void (*f)(uint8_t src_address, uint8_t id, uint32_t length));
+
+#endif
@@ -0,0 +1,185 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+#include "clunet_capture.h"
+#include "clunet_hal.h"
+
+#include <stdint.h>
+
+#ifndef CLUNET_CAPTURE
+#  error clunet_capture requires CLUNET_CAPTURE
+#endif
+
+#define TX_MASK (CLUNET_CAPTURE_TX_SIZE - 1)
+
+#define BATCH_TIMEOUT_TICKS ((uint32_t)CLUNET_CAPTURE_BATCH_TIMEOUT * 1000000UL / CLUNET_CAPTURE_TICK_NS)
+
+/* UART ring: producer writes at tx_write and publishes tx_head, UART ISR reads at tx_tail (RAM: CLUNET_CAPTURE_TX_SIZE + 11 bytes) */
+static uint8_t tx_buffer[CLUNET_CAPTURE_TX_SIZE];
+static uint8_t tx_write;
+static volatile uint8_t tx_head;
+static volatile uint8_t tx_tail;
+static void (*tx_start)(void);
+
+static uint8_t batch_open;
+static uint8_t batch_crc;
+static uint16_t batch_size; // Record bytes of the open batch
+static uint32_t batch_time; // Capture time of its first record
+static uint8_t lost; // CLUNET_CAPTURE_LOST for the next record
+static uint16_t dropped;
+
+static void
+put_raw(const uint8_t byte)
+{
+	tx_buffer[tx_write] = byte;
+	tx_write = (tx_write + 1) & TX_MASK;
+}
+
+static void
+put_escaped(const uint8_t byte)
+{
+	if (byte == CLUNET_CAPTURE_SLIP_END)
+	{
+		put_raw(CLUNET_CAPTURE_SLIP_ESC);
+		put_raw(CLUNET_CAPTURE_SLIP_ESC_END);
+	}
+	else if (byte == CLUNET_CAPTURE_SLIP_ESC)
+	{
+		put_raw(CLUNET_CAPTURE_SLIP_ESC);
+		put_raw(CLUNET_CAPTURE_SLIP_ESC_ESC);
+	}
+	else
+		put_raw(byte);
+}
+
+static void
+put(const uint8_t byte)
+{
+	batch_crc = _crc_ibutton_update(batch_crc, byte);
+	put_escaped(byte);
+}
+
+static void
+batch_close(void)
+{
+	put_escaped(batch_crc);
+	put_raw(CLUNET_CAPTURE_SLIP_END);
+	batch_open = 0;
+}
+
+static void
+publish(void)
+{
+	tx_head = tx_write;
+	if (tx_start)
+		(*tx_start)();
+}
+
+/* Encoded size of a byte */
+#define SLIP_SIZE(byte) ((((byte) == CLUNET_CAPTURE_SLIP_END) || ((byte) == CLUNET_CAPTURE_SLIP_ESC)) ? 2 : 1)
+
+static void
+capture_record(uint32_t time, uint8_t flags, const char* frame, uint8_t size)
+{
+	const uint8_t header[CLUNET_CAPTURE_RECORD_HEADER] = { time, time >> 8, time >> 16, time >> 24, flags | lost, size };
+	// Room for the type byte of a new batch and for closing the batch (CRC may be escaped, END)
+	uint16_t need = (batch_open ? 0 : 1) + 3;
+	uint8_t i;
+	for (i = 0; i < CLUNET_CAPTURE_RECORD_HEADER; i++)
+		need += SLIP_SIZE(header[i]);
+	for (i = 0; i < size; i++)
+		need += SLIP_SIZE((uint8_t)frame[i]);
+	if (need > (uint8_t)((tx_tail - tx_write - 1) & TX_MASK))
+	{
+		lost = CLUNET_CAPTURE_LOST;
+		dropped++;
+		return;
+	}
+	lost = 0;
+	if (!batch_open)
+	{
+		batch_open = 1;
+		batch_crc = 0;
+		batch_size = 0;
+		batch_time = clunet_capture_time();
+		put(CLUNET_CAPTURE_BATCH_RECORDS);
+	}
+	for (i = 0; i < CLUNET_CAPTURE_RECORD_HEADER; i++)
+		put(header[i]);
+	for (i = 0; i < size; i++)
+		put(frame[i]);
+	batch_size += CLUNET_CAPTURE_RECORD_HEADER + size;
+	publish();
+}
+
+void
+clunet_capture_start(void (*f)(void))
+{
+	const uint8_t header[CLUNET_CAPTURE_HEADER_SIZE] = {
+		CLUNET_CAPTURE_MAGIC[0], CLUNET_CAPTURE_MAGIC[1], CLUNET_CAPTURE_MAGIC[2], CLUNET_CAPTURE_MAGIC[3],
+		CLUNET_CAPTURE_VERSION, CLUNET_T, 0, 0,
+		(uint8_t)CLUNET_CAPTURE_TICK_NS, (uint8_t)(CLUNET_CAPTURE_TICK_NS >> 8),
+		(uint8_t)(CLUNET_CAPTURE_TICK_NS >> 16), (uint8_t)(CLUNET_CAPTURE_TICK_NS >> 24) };
+	uint8_t i;
+	const uint8_t sreg = SREG;
+	cli();
+	tx_start = f;
+	// Leading END flushes line noise collected by the receiver
+	put_raw(CLUNET_CAPTURE_SLIP_END);
+	batch_crc = 0;
+	put(CLUNET_CAPTURE_BATCH_HEADER);
+	for (i = 0; i < CLUNET_CAPTURE_HEADER_SIZE; i++)
+		put(header[i]);
+	batch_close();
+	publish();
+	SREG = sreg;
+	clunet_set_on_capture(capture_record);
+}
+
+uint8_t
+clunet_capture_tx(uint8_t* byte)
+{
+	const uint8_t tail = tx_tail;
+	if (tail == tx_head)
+		return 0;
+	*byte = tx_buffer[tail];
+	tx_tail = (tail + 1) & TX_MASK;
+	return 1;
+}
+
+void
+clunet_capture_poll(void)
+{
+	const uint8_t sreg = SREG;
+	cli();
+	// Batch is long enough or its first record waits too long
+	if (batch_open && ((batch_size >= CLUNET_CAPTURE_BATCH) || (clunet_capture_time() - batch_time >= BATCH_TIMEOUT_TICKS)))
+	{
+		batch_close();
+		publish();
+	}
+	SREG = sreg;
+}
+
+uint16_t
+clunet_capture_dropped(void)
+{
+	return dropped;
+}
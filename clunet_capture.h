@@ -0,0 +1,103 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	Binary capture of every CLUNET frame (sniffer) and its stream over a serial line.
+
+	Capture file, little-endian:
+		header:	"CLCP", version (1), CLUNET_T, 2 reserved bytes, timer tick in nanoseconds (4 bytes)
+		record:	time (4 bytes, timer ticks of the start bit, wraps every 2^32 ticks),
+			flags (CLUNET_CAPTURE_* of clunet.h: priority - 1, CRC error, frames lost before),
+			size (1 byte), frame as it was on the line: source, destination, command, size, data, CRC
+
+	Stream (sniffer UART): batches framed with SLIP (RFC 1055), a batch is its type byte,
+	the contents and CRC-8 (Dallas/Maxim, as on the bus). The header batch goes once on start.
+	A record batch is closed when it has CLUNET_CAPTURE_BATCH record bytes or CLUNET_CAPTURE_BATCH_TIMEOUT
+	after its first record, so a busy bus gets long batches and a frame on an idle one waits for the timeout.
+	Bytes of the open batch go to the UART at once, the receiver checks them when the batch is closed.
+*/
+
+#ifndef __CLUNET_CAPTURE_H__
+#define __CLUNET_CAPTURE_H__
+
+#include "clunet.h"
+
+#define CLUNET_CAPTURE_MAGIC "CLCP"
+#define CLUNET_CAPTURE_VERSION 1
+#define CLUNET_CAPTURE_HEADER_SIZE 12
+#define CLUNET_CAPTURE_RECORD_HEADER 6	// Time, flags, size
+
+/* Stream batch types */
+#define CLUNET_CAPTURE_BATCH_HEADER 'H'
+#define CLUNET_CAPTURE_BATCH_RECORDS 'R'
+
+#define CLUNET_CAPTURE_SLIP_END 0xC0
+#define CLUNET_CAPTURE_SLIP_ESC 0xDB
+#define CLUNET_CAPTURE_SLIP_ESC_END 0xDC
+#define CLUNET_CAPTURE_SLIP_ESC_ESC 0xDD
+
+#ifdef CLUNET_CAPTURE
+
+/* UART output buffer, bytes (power of two, 16-256): a record which does not fit it is dropped, so it should hold the longest one */
+#ifndef CLUNET_CAPTURE_TX_SIZE
+#  define CLUNET_CAPTURE_TX_SIZE 256
+#endif
+#if (CLUNET_CAPTURE_TX_SIZE < 16) || (CLUNET_CAPTURE_TX_SIZE > 256) || (CLUNET_CAPTURE_TX_SIZE & (CLUNET_CAPTURE_TX_SIZE - 1))
+#  error CLUNET_CAPTURE_TX_SIZE must be a power of two from 16 to 256
+#endif
+
+/* Batch is closed after this many record bytes (link error loses less)... */
+#ifndef CLUNET_CAPTURE_BATCH
+#  define CLUNET_CAPTURE_BATCH 128
+#endif
+
+/* ...or this many milliseconds after its first record (1-500) */
+#ifndef CLUNET_CAPTURE_BATCH_TIMEOUT
+#  define CLUNET_CAPTURE_BATCH_TIMEOUT 50
+#endif
+#if (CLUNET_CAPTURE_BATCH_TIMEOUT < 1) || (CLUNET_CAPTURE_BATCH_TIMEOUT > 500)
+#  error CLUNET_CAPTURE_BATCH_TIMEOUT must be from 1 to 500 (ms)
+#endif
+
+/* Timer tick for the stream header */
+#ifndef CLUNET_CAPTURE_TICK_NS
+#  ifdef CLUNET_TICKS_PER_MS
+#    define CLUNET_CAPTURE_TICK_NS (1000000UL / CLUNET_TICKS_PER_MS)
+#  else
+#    define CLUNET_CAPTURE_TICK_NS (1000000000UL / (F_CPU / CLUNET_TIMER_PRESCALER))
+#  endif
+#endif
+
+// Начать поток захвата: заголовок, затем все пакеты шины (ставит обработчик clunet_set_on_capture()).
+// tx_start() разрешает прерывание UART "регистр данных пуст", вызывается, когда в буфере есть данные.
+void clunet_capture_start(void (*tx_start)(void));
+
+// Из прерывания UART: следующий байт потока. Возвращает 0, если отправлять нечего (прерывание нужно запретить).
+uint8_t clunet_capture_tx(uint8_t* byte);
+
+// Из главного цикла после clunet_poll(): закрывает пакет записей по размеру или таймауту
+void clunet_capture_poll(void);
+
+// Записи, не поместившиеся в буфер UART (следующая запись получает флаг CLUNET_CAPTURE_LOST)
+uint16_t clunet_capture_dropped(void);
+
+#endif
+
+#endif
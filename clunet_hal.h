@@ -0,0 +1,45 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+
+/*
+	Hardware abstraction layer of CLUNET protocol core.
+
+	Besides pin macros (clunet.h) and timer/interrupt macros (clunet_config.h) the core uses only:
+	ISR(), cli(), sei(), SREG, MCUSR, wdt_enable(), wdt_disable(), WDTO_15MS and _crc_ibutton_update()
+	(and eeprom_update_byte() with CLUNET_BOOT_UPDATE_FLAG, which the host port does not support).
+	On AVR they come from avr-libc, other targets must provide "clunet_hal_host.h" with the same names
+	(see sim/clunet_hal_host.h for the virtual bus simulator port).
+*/
+
+#ifndef __CLUNET_HAL_H__
+#define __CLUNET_HAL_H__
+
+#if defined(__AVR__)
+#  include <avr/io.h>
+#  include <avr/interrupt.h>
+#  include <avr/wdt.h>
+#  include <util/crc16.h>
+#  include <avr/eeprom.h>
+#else
+#  include "clunet_hal_host.h"
+#endif
+
+#endif
@@ -0,0 +1,174 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+#include "clunet_request.h"
+
+#include <stdint.h>
+
+#define SLOT_MASK (CLUNET_REQUEST_SLOTS - 1)
+
+/* Outstanding requests, low bits of transaction id are the slot number */
+struct request_slot
+{
+	uint8_t id;		// Transaction id, 0 - slot is free
+	uint8_t address;
+	uint16_t time;		// Time of the request
+	uint16_t timeout;
+	void (*done)(uint8_t id, uint8_t address, uint8_t result, uint8_t command, const char* data, uint8_t size);
+};
+static struct request_slot slots[CLUNET_REQUEST_SLOTS];
+
+static uint16_t request_now;
+static uint8_t request_generation;
+
+static void (*cb_request)(uint8_t src_address, uint8_t id, uint8_t command, const char* data, uint8_t size) = 0;
+
+/* Header and data in one frame. Takes only a free slot of the transmit queue: a queued frame is never dropped for it */
+static uint8_t
+request_send(const uint8_t address, const uint8_t frame_command, const uint8_t id, const uint8_t command, const char* data, const uint8_t size)
+{
+	char frame[CLUNET_REQUEST_HEADER_SIZE + CLUNET_REQUEST_DATA_SIZE];
+	const uint8_t length = data ? size : 0;
+	uint8_t idx;
+	if ((length > CLUNET_REQUEST_DATA_SIZE) || clunet_ready_to_send())
+		return 0;
+	frame[0] = id;
+	frame[1] = command;
+	for (idx = 0; idx < length; idx++)
+		frame[CLUNET_REQUEST_HEADER_SIZE + idx] = data[idx];
+	return clunet_send(address, CLUNET_REQUEST_PRIORITY, frame_command, frame, CLUNET_REQUEST_HEADER_SIZE + length);
+}
+
+/* Slot is free before the callback, so it may send the next request */
+static void
+request_finish(struct request_slot* s, const uint8_t result, const uint8_t command, const char* data, const uint8_t size)
+{
+	const uint8_t id = s->id;
+	s->id = 0;
+	if (s->done)
+		(*s->done)(id, s->address, result, command, data, size);
+}
+
+uint8_t
+clunet_request(const uint8_t address, const uint8_t command, const char* data, const uint8_t size, const uint16_t timeout,
+	void (*done)(uint8_t id, uint8_t address, uint8_t result, uint8_t command, const char* data, uint8_t size))
+{
+	uint8_t slot;
+	if (address == CLUNET_BROADCAST_ADDRESS)
+		return 0;
+	for (slot = 0; slot < CLUNET_REQUEST_SLOTS; slot++)
+		if (!slots[slot].id)
+			break;
+	if (slot == CLUNET_REQUEST_SLOTS)
+		return 0;
+
+	// Generation in the high bits tells a late response to the previous request of the slot apart
+	uint8_t id;
+	do
+		id = (uint8_t)(++request_generation * CLUNET_REQUEST_SLOTS) | slot;
+	while (!id);
+
+	if (!request_send(address, CLUNET_COMMAND_REQUEST, id, command, data, size))
+		return 0;
+	struct request_slot* s = &slots[slot];
+	s->id = id;
+	s->address = address;
+	s->time = request_now;
+	s->timeout = timeout;
+	s->done = done;
+	return id;
+}
+
+void
+clunet_request_cancel(const uint8_t id)
+{
+	struct request_slot* s = &slots[id & SLOT_MASK];
+	if (id && (s->id == id))
+		request_finish(s, CLUNET_REQUEST_CANCELLED, 0, 0, 0);
+}
+
+uint8_t
+clunet_respond(const uint8_t address, const uint8_t id, const uint8_t command, const char* data, const uint8_t size)
+{
+	return request_send(address, CLUNET_COMMAND_RESPONSE, id, command, data, size);
+}
+
+uint8_t
+clunet_request_received(const uint8_t src_address, const uint8_t command, const char* data, const uint8_t size)
+{
+	switch (command)
+	{
+		case CLUNET_COMMAND_RESPONSE:
+			if (size >= CLUNET_REQUEST_HEADER_SIZE)
+			{
+				const uint8_t id = data[0];
+				struct request_slot* s = &slots[id & SLOT_MASK];
+				if (id && (s->id == id) && (s->address == src_address))
+					request_finish(s, CLUNET_REQUEST_OK, data[1], data + CLUNET_REQUEST_HEADER_SIZE, size - CLUNET_REQUEST_HEADER_SIZE);
+			}
+			return 1;
+		case CLUNET_COMMAND_REQUEST:
+			if (size >= CLUNET_REQUEST_HEADER_SIZE)
+			{
+				// Ping is answered here, as clunet.c answers the plain one
+				if ((uint8_t)data[1] == CLUNET_COMMAND_PING)
+					clunet_respond(src_address, data[0], CLUNET_COMMAND_PING_REPLY, data + CLUNET_REQUEST_HEADER_SIZE, size - CLUNET_REQUEST_HEADER_SIZE);
+				else if (cb_request)
+					(*cb_request)(src_address, data[0], data[1], data + CLUNET_REQUEST_HEADER_SIZE, size - CLUNET_REQUEST_HEADER_SIZE);
+			}
+			return 1;
+	}
+	return 0;
+}
+
+#ifdef CLUNET_HANDLERS
+static void
+request_handler(uint8_t src_address, uint8_t command, char* data, uint8_t size, uint8_t priority)
+{
+	(void)priority;
+	clunet_request_received(src_address, command, data, size);
+}
+
+uint8_t
+clunet_request_register(void)
+{
+	return clunet_set_handler(CLUNET_COMMAND_REQUEST, request_handler, 0, 0)
+		&& clunet_set_handler(CLUNET_COMMAND_RESPONSE, request_handler, 0, 0);
+}
+#endif
+
+void
+clunet_request_poll(const uint16_t now)
+{
+	uint8_t slot;
+	request_now = now;
+	for (slot = 0; slot < CLUNET_REQUEST_SLOTS; slot++)
+	{
+		struct request_slot* s = &slots[slot];
+		if (s->id && ((uint16_t)(now - s->time) >= s->timeout))
+			request_finish(s, CLUNET_REQUEST_TIMEOUT, 0, 0, 0);
+	}
+}
+
+void
+clunet_request_set_on_request(void (*f)(uint8_t src_address, uint8_t id, uint8_t command, const char* data, uint8_t size))
+{
+	cb_request = f;
+}
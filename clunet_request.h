@@ -0,0 +1,97 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	Request/response transactions over CLUNET.
+
+	Request is sent as CLUNET_COMMAND_REQUEST with transaction id and command of the request before its data,
+	responder answers with CLUNET_COMMAND_RESPONSE with the same transaction id. Transaction id selects
+	the slot of the outstanding request, so a response is routed to its callback at once, and many requests
+	to different devices may wait for responses at the same time. Callbacks run from clunet_poll()
+	and clunet_request_poll(), so deferred receiving (CLUNET_READ_QUEUE_SIZE) is required.
+*/
+
+#ifndef __CLUNET_REQUEST_H__
+#define __CLUNET_REQUEST_H__
+
+#include "clunet.h"
+
+#ifndef CLUNET_READ_QUEUE_SIZE
+#  error clunet_request requires CLUNET_READ_QUEUE_SIZE
+#endif
+
+/* Request and response header: transaction id, command */
+#define CLUNET_REQUEST_HEADER_SIZE 2
+
+/* Outstanding requests (RAM: 6 bytes + pointer each), power of two from 1 to 64 */
+#ifndef CLUNET_REQUEST_SLOTS
+#  define CLUNET_REQUEST_SLOTS 4
+#endif
+#if (CLUNET_REQUEST_SLOTS < 1) || (CLUNET_REQUEST_SLOTS > 64) || (CLUNET_REQUEST_SLOTS & (CLUNET_REQUEST_SLOTS - 1))
+#  error CLUNET_REQUEST_SLOTS must be a power of two from 1 to 64
+#endif
+
+/* Maximal data size of request and response (stack buffer of the header and data) */
+#ifndef CLUNET_REQUEST_DATA_SIZE
+#  if CLUNET_SEND_BUFFER_SIZE < 250 - CLUNET_REQUEST_HEADER_SIZE
+#    define CLUNET_REQUEST_DATA_SIZE CLUNET_SEND_BUFFER_SIZE
+#  else
+#    define CLUNET_REQUEST_DATA_SIZE (250 - CLUNET_REQUEST_HEADER_SIZE)
+#  endif
+#endif
+
+/* Priority of requests and responses */
+#ifndef CLUNET_REQUEST_PRIORITY
+#  define CLUNET_REQUEST_PRIORITY CLUNET_PRIORITY_COMMAND
+#endif
+
+/* Request results */
+#define CLUNET_REQUEST_OK 0
+#define CLUNET_REQUEST_TIMEOUT 1	// No response in timeout
+#define CLUNET_REQUEST_CANCELLED 2	// clunet_request_cancel()
+
+// Отправить запрос command устройству address (не широковещательный), ответ ждём timeout миллисекунд.
+// По ответу или таймауту вызывается done(id, address, result, command, data, size), при таймауте данных нет.
+// Возвращает номер транзакции или 0, если нет свободного слота, очередь передачи полна или данные слишком велики.
+// Запрос занимает только свободное место в очереди передачи и не вытесняет из неё другие пакеты.
+uint8_t clunet_request(const uint8_t address, const uint8_t command, const char* data, const uint8_t size, const uint16_t timeout,
+	void (*done)(uint8_t id, uint8_t address, uint8_t result, uint8_t command, const char* data, uint8_t size));
+
+// Отменить ожидание ответа, done() вызывается с CLUNET_REQUEST_CANCELLED
+void clunet_request_cancel(const uint8_t id);
+
+// Ответ на запрос id устройства address (можно и позже, вне обработчика запроса). Возвращает 0, если ответ не поставлен в очередь (в том числе при полной очереди передачи).
+uint8_t clunet_respond(const uint8_t address, const uint8_t id, const uint8_t command, const char* data, const uint8_t size);
+
+// Пакеты транзакций: вызывать из обработчика clunet_set_on_data_received(), возвращает 1, если пакет обработан
+uint8_t clunet_request_received(const uint8_t src_address, const uint8_t command, const char* data, const uint8_t size);
+
+#ifdef CLUNET_HANDLERS
+// Либо зарегистрировать обработчики команд транзакций, возвращает 0, если таблица обработчиков заполнена
+uint8_t clunet_request_register(void);
+#endif
+
+// Таймауты: вызывать из главного цикла после clunet_poll(), now - время в миллисекундах
+void clunet_request_poll(const uint16_t now);
+
+// Входящие запросы (кроме CLUNET_COMMAND_PING, на него отвечаем сами), отвечать clunet_respond()
+void clunet_request_set_on_request(void (*f)(uint8_t src_address, uint8_t id, uint8_t command, const char* data, uint8_t size));
+
+#endif
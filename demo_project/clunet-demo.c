@@ -16,6 +16,7 @@ int main (void)
 	
 	while (1)
 	{
+		clunet_poll();
 	}
 	return 0;
 }
@@ -19,19 +19,34 @@ SOFTWARE.
 *****************************************************************************************/
 
 #include <avr/boot.h>
-#include <avr/interrupt.h>
-#include <util/crc16.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
 #include "clunet.h"
-
-#define COMMAND_FIRMWARE_UPDATE_START	0	// Информируем сеть, что мы в загрузчике
-#define COMMAND_FIRMWARE_UPDATE_INIT	1	// Субкоманда инициализации процедуры загрузки прошивки
-#define COMMAND_FIRMWARE_UPDATE_READY	2	// Информируем, что мы в режиме прошивки
-#define COMMAND_FIRMWARE_UPDATE_WRITE	3	// Субкоманда записи данных во флеш-память (отправитель внешнее устройство)
-#define COMMAND_FIRMWARE_UPDATE_WRITTEN	4	// Подтверждение выполнения команды записи (отправитель мы)
-#define COMMAND_FIRMWARE_UPDATE_DONE	5	// Субкоманда окончания записи и выполнения записанной программы (отправитель внешнее устройство)
+#include "clunet_hal.h"
+#include "clunet_bootloader.h"
 
 #define APP_END (FLASHEND - (BOOTSIZE * 2))
 
+/*
+	Необязательные возможности (Makefile, BOOTLOADER_FEATURES), каждая увеличивает образ загрузчика.
+	Без них загрузчик умеет только WRITE/INIT/DONE и помещается в 512 слов (программатор: -w -c),
+	с ними нужна секция загрузчика 1024 слова (размеры по возможностям - README.md).
+		BOOTLOADER_STREAM	- потоковая запись STREAM с ACK/NAK
+		BOOTLOADER_RLE		- страницы STREAM_RLE (включает BOOTLOADER_STREAM)
+		BOOTLOADER_CRC		- запрос CRC страниц (пропуск неизменных страниц)
+		BOOTLOADER_MULTICAST	- многоадресная запись и запрос STATUS (включает BOOTLOADER_STREAM)
+		BOOTLOADER_FAST_BOOT	- быстрый старт по CLUNET_BOOT_UPDATE_FLAG и CRC образа
+*/
+#if (defined(BOOTLOADER_RLE) || defined(BOOTLOADER_MULTICAST)) && !defined(BOOTLOADER_STREAM)
+#  define BOOTLOADER_STREAM
+#endif
+#if defined(BOOTLOADER_FAST_BOOT) && !defined(CLUNET_BOOT_UPDATE_FLAG)
+#  error BOOTLOADER_FAST_BOOT requires CLUNET_BOOT_UPDATE_FLAG in clunet_config.h
+#endif
+
+// Количество страниц приложения (размер битовой карты многоадресной записи)
+#define APP_PAGES ((uint16_t)((APP_END + 1UL) / MY_SPM_PAGESIZE))
+
 #define RECEIVED_COMMAND buffer[CLUNET_OFFSET_COMMAND]
 #define RECEIVED_SUB_COMMAND buffer[CLUNET_OFFSET_DATA]
 #define FLASHER_ADDRESS buffer[CLUNET_OFFSET_SRC_ADDRESS]
@@ -50,31 +65,52 @@ SOFTWARE.
 #define BOOTLOADER_TIMEOUT_OVERFLOWS ((uint16_t)(((float)BOOTLOADER_TIMEOUT / 1000.0f) * ((float)F_CPU / (float)CLUNET_TIMER_PRESCALER / 256.0f)))
 
 
-static uint8_t buffer[MY_SPM_PAGESIZE + 11];
+#if (FLASHEND > USHRT_MAX)
+typedef uint32_t flash_address_t;
+#else
+typedef uint16_t flash_address_t;
+#endif
+
+/*	Загрузчик собирается без стартового кода (-nostartfiles): прерывания не используются, таблица векторов не нужна,
+	а переменные не требуют начальных значений (лежат в .noinit). Остается обнулить __zero_reg__ и установить стек
+	(у ATmega8 указатель стека после сброса равен 0). Далее выполнение переходит в main (секция .init9).
+*/
+static void __attribute__((naked, used, section(".init2")))
+init(void)
+{
+	asm volatile (
+		"clr __zero_reg__"			"\n\t"
+		"ldi r28, lo8(%[ramend])"	"\n\t"
+		"ldi r29, hi8(%[ramend])"	"\n\t"
+		"out %[sph], r29"			"\n\t"
+		"out %[spl], r28"
+		:: [ramend] "i" (RAMEND), [sph] "I" (_SFR_IO_ADDR(SPH)), [spl] "I" (_SFR_IO_ADDR(SPL))
+	);
+}
+
+static uint8_t buffer[MY_SPM_PAGESIZE + 11] __attribute__((section(".noinit")));
 
-static void (*jump_to_app)(void) = 0x0000;
+#ifdef BOOTLOADER_RLE
+// Распакованная страница сжатой потоковой записи
+static uint8_t page[MY_SPM_PAGESIZE] __attribute__((section(".noinit")));
+#endif
 
-static uint8_t
-control_command[5] =		{
-					CLUNET_DEVICE_ID,
-					CLUNET_BROADCAST_ADDRESS,
-					CLUNET_COMMAND_BOOT_CONTROL,	// команда
-					1,				// размер данных
-					0				// субкоманда
-				};
+#ifdef BOOTLOADER_MULTICAST
+// Битовая карта страниц, принятых многоадресной записью
+static uint8_t received_pages[(APP_PAGES + 7) / 8] __attribute__((section(".noinit")));
+#endif
 
-static uint8_t
-update_init_response[6] =	{
-					CLUNET_DEVICE_ID,
-					CLUNET_BROADCAST_ADDRESS,
-					CLUNET_COMMAND_BOOT_CONTROL,	// команда
-					2,				// размер данных
-					COMMAND_FIRMWARE_UPDATE_READY,	// субкоманда
-					MY_SPM_PAGESIZE			// размер страницы
-				};
+static void (* const jump_to_app)(void) __attribute__((noreturn)) = 0x0000;
 
 // Максимально допустимая рассинхронизация между устройствами сети
-const uint8_t max_delta = (uint8_t)((float)CLUNET_T * 0.3f);
+static const uint8_t max_delta = (uint8_t)((float)CLUNET_T * 0.3f);
+
+#ifdef CLUNET_T_DATA
+// Период бита пакета: CLUNET_T до адреса отправителя включительно, далее CLUNET_T_DATA
+static uint8_t bit_period __attribute__((section(".noinit")));
+#else
+#define bit_period CLUNET_T
+#endif
 
 static uint8_t
 ibutton_crc(const uint8_t* data, const uint8_t size)
@@ -140,7 +176,7 @@ read_signal(const uint8_t signal)
 {
 	CLUNET_TIMER_REG = 0;
 	uint8_t bitNum = 0;
-	uint8_t period = CLUNET_T / 2;
+	uint8_t period = bit_period / 2;
 	uint8_t state;
 	do
 	{
@@ -149,7 +185,7 @@ read_signal(const uint8_t signal)
 			// Ошибка: не может быть больше 5 бит
 			if (++bitNum > 5)
 				return 0;
-			period += CLUNET_T;
+			period += bit_period;
 		}
 		state = CLUNET_READING;
 	}
@@ -157,33 +193,55 @@ read_signal(const uint8_t signal)
 	return bitNum;
 }
 
+/*	Отправка системного пакета (субкоманда sub_command, size байт данных) устройству address.
+	Пакет собирается в приемном буфере: данные после субкоманды должны быть уже записаны туда.
+*/
 static void
-send(const uint8_t* data, const uint8_t size)
+send(const uint8_t address, const uint8_t sub_command, const uint8_t size)
 {
-	const uint8_t crc = ibutton_crc(data, size);
+	buffer[CLUNET_OFFSET_SRC_ADDRESS] = CLUNET_DEVICE_ID;
+	buffer[CLUNET_OFFSET_DST_ADDRESS] = address;
+	buffer[CLUNET_OFFSET_COMMAND] = CLUNET_COMMAND_BOOT_CONTROL;
+	buffer[CLUNET_OFFSET_SIZE] = size;
+	RECEIVED_SUB_COMMAND = sub_command;
+	const uint8_t length = CLUNET_OFFSET_DATA + size;
+	const uint8_t crc = ibutton_crc(buffer, length);
 _repeat:
 	// Ждем освобождения линии и межкадровое пространство 8Т в блокирующем режиме (в конце концов замкнутая накоротко линия это ненормально)
 	wait_interframe();
 	CLUNET_SEND_1;
 	uint8_t bit_index, byte_index, line_pullup;
 	bit_index = byte_index = line_pullup = 0;
-	uint8_t data_byte = *data;
+	uint8_t data_byte = buffer[0];
 	uint8_t bit_task = 4;
+#ifdef CLUNET_T_DATA
+	uint8_t rate_switch = 0;
+	bit_period = CLUNET_T;
+#endif
 
 	do
 	{
 		CLUNET_TIMER_REG = 0; // Reset timer
-		while (((data_byte << bit_index) & 0x80) ^ line_pullup)
+		while ((data_byte & 0x80) ^ line_pullup)
 		{
 			bit_task++;
+			data_byte <<= 1;	// Старший бит - очередной передаваемый
 			if (++bit_index & 8)
 			{
-				if (++byte_index < size)
-					data_byte = data[byte_index];
-				else if (byte_index == size)
+				if (++byte_index < length)
+					data_byte = buffer[byte_index];
+				else if (byte_index == length)
 					data_byte = crc;
 				else break; // End of data
 				bit_index = 0;
+#ifdef CLUNET_T_DATA
+				// Адрес отправителя передан: серия заканчивается, далее бит переключения скорости
+				if (byte_index == CLUNET_OFFSET_SRC_ADDRESS + 1)
+				{
+					rate_switch = 1;
+					break;
+				}
+#endif
 			}
 			if (bit_task == 5)
 				break;
@@ -191,7 +249,7 @@ _repeat:
 
 		// Задержка по количеству передаваемых бит и проверка на конфликт с синхронизацией при передаче
 		uint8_t delta;
-		const uint8_t stop = bit_task * CLUNET_T;
+		const uint8_t stop = bit_task * bit_period;
 		do
 		{
 			const uint8_t now = CLUNET_TIMER_REG;
@@ -211,6 +269,15 @@ _repeat:
 			CLUNET_SEND_1;
 
 		bit_task = (bit_task == 5);
+#ifdef CLUNET_T_DATA
+		// Инвертированный бит переключения начинает фазу данных, приемники пропускают его как битстаффинг
+		if (rate_switch)
+		{
+			rate_switch = 0;
+			bit_task = 1;
+			bit_period = CLUNET_T_DATA;
+		}
+#endif
 	}
 	while (!(bit_index & 8));
 
@@ -227,7 +294,8 @@ _repeat:
 	static uint8_t read(void)
 	
 	Блокирует управление пока линия прижата, при освобождении ожидает межкадровый интервал длительностью 7Т,
-	переходит в состояние чтения пакета, читает, проверяет контрольную сумму, удостоверяется что этот пакет системный и предназначен для нас.
+	переходит в состояние чтения пакета, читает, проверяет контрольную сумму, удостоверяется что этот пакет системный и предназначен для нас
+	(или широковещательный - многоадресное обновление).
 	Возвращает длину принятого пакета, в случае ошибки - 0.
 */
 
@@ -241,6 +309,9 @@ read(void)
 	if (wait_for_start())
 		return 0;
 	// Читаем доминантные биты
+#ifdef CLUNET_T_DATA
+	bit_period = CLUNET_T;
+#endif
 	uint8_t num_bits = read_signal(0);
 	if (!(num_bits & 4))
 		return 0;
@@ -286,118 +357,381 @@ read(void)
 
 		// Смотрим надо ли применять битстаффинг
 		bit_stuff = (num_bits == 5);
+
+#ifdef CLUNET_T_DATA
+		// Адрес отправителя прочитан: остаток пакета идет с периодом CLUNET_T_DATA, бит переключения пропускаем как битстаффинг
+		if ((byte_index == CLUNET_OFFSET_SRC_ADDRESS + 1) && (bit_period == CLUNET_T))
+		{
+			bit_period = CLUNET_T_DATA;
+			bit_stuff = 1;
+		}
+#endif
 	}
 	// Пакет принят
-	if ((buffer[CLUNET_OFFSET_DST_ADDRESS] == CLUNET_DEVICE_ID) && (RECEIVED_COMMAND == CLUNET_COMMAND_BOOT_CONTROL)
+#ifdef BOOTLOADER_MULTICAST
+	if (((buffer[CLUNET_OFFSET_DST_ADDRESS] == CLUNET_DEVICE_ID) || (buffer[CLUNET_OFFSET_DST_ADDRESS] == CLUNET_BROADCAST_ADDRESS))
+#else
+	if ((buffer[CLUNET_OFFSET_DST_ADDRESS] == CLUNET_DEVICE_ID)
+#endif
+		&& (RECEIVED_COMMAND == CLUNET_COMMAND_BOOT_CONTROL)
 		&& !ibutton_crc(buffer, byte_index))
 			return byte_index;
 	return 0;
 }
 
 
+/*	Начало программирования страницы: заполнение временного буфера SPM и стирание страницы (без ожидания).
+	Временный буфер заполняется до стирания (это допускается документацией), поэтому приемный буфер
+	сразу свободен для следующей страницы: он и временный буфер SPM образуют двойную буферизацию.
+*/
 static void
-#if (FLASHEND > USHRT_MAX)
-write_flash_page(uint32_t address, uint8_t* pagebuffer)
-#else
-write_flash_page(uint16_t address, uint8_t* pagebuffer)
-#endif
+fill_flash_page(const flash_address_t address, const uint8_t* pagebuffer)
 {
 
 	eeprom_busy_wait();
+	boot_spm_busy_wait();		// Предыдущая страница могла еще записываться
+
+	uint8_t i;
+	for (i = 0; i < MY_SPM_PAGESIZE; i += 2)
+		boot_page_fill(address + i, *((uint16_t*)(pagebuffer + i)));
 
 #if MY_SPM_PAGESIZE != SPM_PAGESIZE
 	if (!(address % SPM_PAGESIZE))
 #endif
-	{
 		boot_page_erase(address);
-		boot_spm_busy_wait();		// Wait until the memory is erased.
+}
+
+// Запуск записи страницы после окончания стирания (без ожидания окончания записи)
+static void
+write_flash_page(const flash_address_t address)
+{
+	boot_spm_busy_wait();		// Wait until the memory is erased.
+	boot_page_write(address);	// Store buffer in flash page.
+}
+
+// Ожидание окончания записи и разрешение чтения RWW-секции (приложения)
+static void
+finish_flash(void)
+{
+	boot_spm_busy_wait();		// Wait until the memory is written.
+	boot_rww_enable();
+}
+
+#ifdef BOOTLOADER_RLE
+/*	Распаковка страницы, сжатой RLE. Управляющий байт n < 128 - далее n + 1 байт как есть,
+	n >= 128 - следующий байт повторяется n - 126 раз (от 2 до 129).
+	Возвращает распакованную страницу, 0 при ошибке (данные должны распаковываться ровно в одну страницу).
+*/
+static const uint8_t*
+rle_decode(const uint8_t* src, uint8_t size)
+{
+	uint8_t* out = page;
+	uint8_t left = MY_SPM_PAGESIZE;	// Сколько байт страницы еще не заполнено
+	while (size--)
+	{
+		uint8_t n = *src++;
+		const uint8_t run = n & 0x80;
+		n = run ? n - 126 : n + 1;
+		const uint8_t used = run ? 1 : n;	// Сколько байт данных занимает блок после управляющего
+		if ((used > size) || (n > left))
+			return 0;
+		size -= used;
+		left -= n;
+		do
+			*out++ = run ? *src : *src++;
+		while (--n);
+		if (run)
+			src++;
 	}
+	return left ? 0 : page;
+}
+#endif
 
-	uint8_t i;
-	for (i = 0; i < MY_SPM_PAGESIZE; i += 2)
-		boot_page_fill(address + i, *((uint16_t*)(pagebuffer + i)));
+#if defined(BOOTLOADER_CRC) || defined(BOOTLOADER_FAST_BOOT)
+// Подсчет CRC-16 (полином 0xA001, начальное значение 0xFFFF) участка флеш-памяти
+static uint16_t
+flash_crc(flash_address_t address, flash_address_t size)
+{
+	uint16_t crc = 0xFFFF;
+	while (size--)
+	{
+#if (FLASHEND > USHRT_MAX)
+		crc = _crc16_update(crc, pgm_read_byte_far(address++));
+#else
+		crc = _crc16_update(crc, pgm_read_byte(address++));
+#endif
+	}
+	return crc;
+}
+#endif
 
-		boot_page_write(address);	// Store buffer in flash page.
-		boot_spm_busy_wait();		// Wait until the memory is written.
+#ifdef BOOTLOADER_FAST_BOOT
 
-		boot_rww_enable();
+// Длина и CRC-16 образа приложения (хранятся в EEPROM по адресу CLUNET_BOOT_IMAGE_INFO)
+struct image_info
+{
+	uint32_t length;
+	uint16_t crc;
+};
+
+// Проверка образа приложения. Возвращает 1, если образ цел.
+static uint8_t
+image_valid(const struct image_info* info)
+{
+	return info->length && (info->length <= APP_END + 1UL) && (flash_crc(0, info->length) == info->crc);
 }
 
-static inline void
-send_firmware_command(const uint8_t sub_command)
+#endif
+
+#ifdef BOOTLOADER_CRC
+/*	Ответ на запрос CRC-16 страниц флеш-памяти.
+	Ответ собирается в приемном буфере поверх запроса: адрес первой страницы остается на месте.
+*/
+static void
+send_page_crc(const uint8_t flasher_address)
 {
-	control_command[CLUNET_OFFSET_DATA] = sub_command;
-	send(control_command, sizeof(control_command));
+	finish_flash();		// Последняя страница потоковой записи могла еще записываться
+
+	flash_address_t address = *((flash_address_t*)(buffer + (CLUNET_OFFSET_DATA + 1)));
+	uint8_t count = buffer[CLUNET_OFFSET_DATA + 5];
+	if (count > CRC_QUERY_MAX)
+		count = CRC_QUERY_MAX;
+	const uint8_t size = 5 + count * 2;
+
+	uint16_t* crc = (uint16_t*)(buffer + (CLUNET_OFFSET_DATA + 5));
+	while (count--)
+	{
+		*crc++ = flash_crc(address, MY_SPM_PAGESIZE);
+		address += MY_SPM_PAGESIZE;
+	}
+
+	send(flasher_address, COMMAND_FIRMWARE_UPDATE_CRC_REPLY, size);
 }
+#endif
+
+#ifdef BOOTLOADER_MULTICAST
+/*	Ответ на запрос пропущенных страниц многоадресной записи (1 - страница не принята).
+	На широковещательный запрос отвечают только устройства с пропусками (NAK), полностью принявшие образ молчат.
+	Ответ собирается в приемном буфере поверх запроса: номер первой страницы остается на месте.
+*/
+static void
+send_missing_pages(const uint8_t flasher_address)
+{
+	uint16_t index = *((uint16_t*)(buffer + (CLUNET_OFFSET_DATA + 1)));
+	uint8_t count = buffer[CLUNET_OFFSET_DATA + 3];
+
+	if (count > STATUS_QUERY_MAX)
+		count = STATUS_QUERY_MAX;
+
+	uint8_t* const bitmap = buffer + (CLUNET_OFFSET_DATA + 3);
+	const uint8_t size = (count + 7) / 8;
+	uint8_t missing = (buffer[CLUNET_OFFSET_DST_ADDRESS] != CLUNET_BROADCAST_ADDRESS);
+	uint8_t i;
 
+	for (i = 0; i < size; i++)
+		bitmap[i] = 0;
 
-int main(void)
+	for (i = 0; i < count; i++, index++)
+	{
+		if ((index < APP_PAGES) && !(received_pages[index >> 3] & (1 << (index & 7))))
+		{
+			bitmap[i >> 3] |= 1 << (i & 7);
+			missing = 1;
+		}
+	}
+
+	if (missing)
+		send(flasher_address, COMMAND_FIRMWARE_UPDATE_MISSING, 3 + size);
+}
+#endif
+
+
+__attribute__((section(".init9"))) int
+main(void)
 {
 	cli();
  	CLUNET_TIMER_INIT;
 	CLUNET_PIN_INIT;
-	
+
+#ifdef BOOTLOADER_FAST_BOOT
+	// Быстрая загрузка: обновление не запрошено (CLUNET_COMMAND_REBOOT) и образ приложения цел - сразу запускаем приложение
+	if (eeprom_read_byte((uint8_t*)(CLUNET_BOOT_UPDATE_FLAG)) != CLUNET_BOOT_UPDATE_REQUESTED)
+	{
+		struct image_info info;
+		eeprom_read_block(&info, (void*)(CLUNET_BOOT_IMAGE_INFO), sizeof(info));
+		if (image_valid(&info))
+			jump_to_app();
+	}
+#endif
+
 	// Делаем 5 попыток получить в ответ служебный пакет, при успехе переходим в режим прошивки, иначе загружаем основную программу
 	uint8_t packets = 5;
 	do
 	{
 		// Посылаем широковещательный пакет, что мы в загрузчике
-		send_firmware_command(COMMAND_FIRMWARE_UPDATE_START);
+		send(CLUNET_BROADCAST_ADDRESS, COMMAND_FIRMWARE_UPDATE_START, 1);
 
 		if (read() && (RECEIVED_SUB_COMMAND == COMMAND_FIRMWARE_UPDATE_INIT))
 		{
 
 			const uint8_t flasher_address = FLASHER_ADDRESS; // Запомним, кто инициировал обновление, с тем и будем дальше работать
 
-			// Теперь работаем только с конкретным устройством
-			update_init_response[CLUNET_OFFSET_DST_ADDRESS] = flasher_address;
-			control_command[CLUNET_OFFSET_DST_ADDRESS] = flasher_address;
+#ifdef BOOTLOADER_STREAM
+			// Адрес следующей ожидаемой страницы потоковой записи
+			flash_address_t expected = 0;
+#endif
 
-			// Говорим устройству, что мы в режиме прошивки и сообщаем наш размер страницы памяти
-			send(update_init_response, sizeof(update_init_response));
-			
+			// Первым обрабатывается этот же пакет INIT, дальше работаем только с конкретным устройством
 			while (1)
 			{
-				// Если системный пакет получен и он от нужного устройства, то обработаем его
-				if (read() && FLASHER_ADDRESS == flasher_address)
+				const uint8_t subCmd = RECEIVED_SUB_COMMAND;
+
+				switch (subCmd)
 				{
-					const uint8_t subCmd = RECEIVED_SUB_COMMAND;
 
-					switch (subCmd)
+					case COMMAND_FIRMWARE_UPDATE_WRITE:
+#ifdef BOOTLOADER_STREAM
+					case COMMAND_FIRMWARE_UPDATE_STREAM:
+#endif
+#ifdef BOOTLOADER_RLE
+					case COMMAND_FIRMWARE_UPDATE_STREAM_RLE:
+#endif
 					{
 
-						case COMMAND_FIRMWARE_UPDATE_WRITE:
+						// Адрес страницы памяти берем начиная с 6-го байта (смещение +5). Размер фиксирован - 32 бит.
+						const flash_address_t address = *((flash_address_t*)(buffer + (CLUNET_OFFSET_DATA + 1)));
+
+						// Данные страницы: с 10-го байта в пакете (смещение +9), MY_SPM_PAGESIZE байт
+						const uint8_t* data = buffer + (CLUNET_OFFSET_DATA + 5);
+
+						if (subCmd == COMMAND_FIRMWARE_UPDATE_WRITE)
 						{
-	
-							#if (FLASHEND > USHRT_MAX)
-							uint32_t address = *((uint32_t*)(buffer + (CLUNET_OFFSET_DATA + 1)));
-							#else
-							uint16_t address = *((uint16_t*)(buffer + (CLUNET_OFFSET_DATA + 1)));	// Адрес страницы памяти берем начиная с 6-го байта (смещение +5). Размер фиксирован - 32 бит.
-							#endif
-	
-							uint8_t* pagebuffer = buffer + (CLUNET_OFFSET_DATA + 5); // с 10-го байта в пакете (смещение +9) начинаются данные. Размер - MY_SPM_PAGESIZE байт.
-	
-							write_flash_page(address, pagebuffer); // Пишем во флеш-память
-	
-							send_firmware_command(COMMAND_FIRMWARE_UPDATE_WRITTEN);	// Отправляем подтверждение записи
-	
+							// Запись с остановкой и ожиданием: подтверждаем только записанную страницу
+							fill_flash_page(address, data);
+							write_flash_page(address);
+							finish_flash();
+							send(flasher_address, COMMAND_FIRMWARE_UPDATE_WRITTEN, 1);	// Отправляем подтверждение записи
+							break;
 						}
-	
-						break;
-	
-						case COMMAND_FIRMWARE_UPDATE_INIT:
-	
-							send(update_init_response, sizeof(update_init_response));
+
+#ifdef BOOTLOADER_STREAM
+						/*	Потоковая запись: страницы идут строго по возрастанию адресов.
+							Ожидаемая страница подтверждается (кумулятивно - адресом следующей) сразу после приема:
+							подтверждение передается пока стирается страница, а запись идет во время приема следующей.
+							Повтор уже принятой страницы (потерялось подтверждение) подтверждается без записи,
+							страница с пропуском отбрасывается с NAK, и программатор повторяет передачу с ожидаемого адреса.
+							Кадр без данных переносит ожидаемый адрес: так пропускаются неизменные страницы.
+						*/
+						const uint8_t data_size = buffer[CLUNET_OFFSET_SIZE] - 5;
+
+#ifdef BOOTLOADER_RLE
+						// Распакованная страница (0 - ошибка распаковки)
+						if (subCmd == COMMAND_FIRMWARE_UPDATE_STREAM_RLE)
+							data = rle_decode(data, data_size);
+#endif
+
+#ifdef BOOTLOADER_MULTICAST
+						/*	Многоадресная запись (широковещательный кадр): страницы в любом порядке и без подтверждений,
+							принятые отмечаются в битовой карте и повторно не пишутся. Пропуски программатор
+							собирает запросом STATUS и досылает. Между страницами он выдерживает паузу на стирание.
+						*/
+						if (buffer[CLUNET_OFFSET_DST_ADDRESS] == CLUNET_BROADCAST_ADDRESS)
+						{
+							const uint16_t index = address / MY_SPM_PAGESIZE;
+							uint8_t* const bits = received_pages + (index >> 3);
+							const uint8_t mask = 1 << (index & 7);
+							if (data_size && data && (index < APP_PAGES) && !(*bits & mask))
+							{
+								fill_flash_page(address, data);
+								write_flash_page(address);
+								*bits |= mask;
+							}
 							break;
-	
-	
-						case COMMAND_FIRMWARE_UPDATE_DONE:
-	
-							goto _done;
-							
+						}
+#endif
+
+						if (!data_size)
+							expected = address;
+
+						if ((address == expected) && data_size && data)
+						{
+							fill_flash_page(address, data);
+							expected += MY_SPM_PAGESIZE;
+						}
+						else
+							data = 0;	// Страница не принята, писать нечего
+
+						// Подтверждается все, что уже позади ожидаемого адреса. Ошибка распаковки - тоже NAK:
+						// программатор повторит страницу (например, без сжатия)
+						*((uint32_t*)(buffer + (CLUNET_OFFSET_DATA + 1))) = expected;
+						send(flasher_address, (data_size && (address >= expected)) ? COMMAND_FIRMWARE_UPDATE_NAK : COMMAND_FIRMWARE_UPDATE_ACK, 5);
+
+						if (data)
+							write_flash_page(address);
+#endif
+
+					}
+
+					break;
+
+#ifdef BOOTLOADER_CRC
+					case COMMAND_FIRMWARE_UPDATE_CRC:
+
+						send_page_crc(flasher_address);
+						break;
+#endif
+
+#ifdef BOOTLOADER_MULTICAST
+					case COMMAND_FIRMWARE_UPDATE_STATUS:
+
+						send_missing_pages(flasher_address);
+						break;
+#endif
+
+					case COMMAND_FIRMWARE_UPDATE_INIT:
+					{
+#ifdef BOOTLOADER_FAST_BOOT
+						// Пока обновление не завершено, загрузчик будет ждать программатор при каждом старте
+						eeprom_update_byte((uint8_t*)(CLUNET_BOOT_UPDATE_FLAG), CLUNET_BOOT_UPDATE_REQUESTED);
+#endif
+#ifdef BOOTLOADER_STREAM
+						expected = 0;
+#endif
+#ifdef BOOTLOADER_MULTICAST
+						uint16_t i;
+						for (i = 0; i < sizeof(received_pages); i++)
+							received_pages[i] = 0;
+#endif
+						// Говорим устройству, что мы в режиме прошивки и сообщаем наш размер страницы памяти
+						buffer[CLUNET_OFFSET_DATA + 1] = MY_SPM_PAGESIZE;
+						send(flasher_address, COMMAND_FIRMWARE_UPDATE_READY, 2);
 					}
+					break;
+
+
+					case COMMAND_FIRMWARE_UPDATE_DONE:
+
+						finish_flash();	// Последняя страница потоковой записи могла еще записываться
+#ifdef BOOTLOADER_FAST_BOOT
+						// Необязательные данные: длина (4 байта) и CRC-16 (2 байта) образа. Если образ с ними сходится,
+						// запоминаем их и снимаем флаг запроса обновления: следующий старт будет быстрым
+						if (buffer[CLUNET_OFFSET_SIZE] >= 7)
+						{
+							const struct image_info* info = (const struct image_info*)(buffer + (CLUNET_OFFSET_DATA + 1));
+							if (image_valid(info))
+							{
+								eeprom_update_block(info, (void*)(CLUNET_BOOT_IMAGE_INFO), sizeof(*info));
+								eeprom_update_byte((uint8_t*)(CLUNET_BOOT_UPDATE_FLAG), 0xFF);
+							}
+						}
+#endif
+						goto _done;
+
 				}
-			}			
+
+				// Ждем следующий системный пакет от нужного устройства
+				while (!read() || (FLASHER_ADDRESS != flasher_address));
+			}
 		}
 	}
 	while (--packets);
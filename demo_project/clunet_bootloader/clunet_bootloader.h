@@ -0,0 +1,53 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	Subcommands of CLUNET_COMMAND_BOOT_CONTROL understood by clunet_bootloader
+	(shared with host tools: flasher and simulator stand-in).
+*/
+
+#ifndef __CLUNET_BOOTLOADER_H__
+#define __CLUNET_BOOTLOADER_H__
+
+#define COMMAND_FIRMWARE_UPDATE_START	0	// Информируем сеть, что мы в загрузчике
+#define COMMAND_FIRMWARE_UPDATE_INIT	1	// Субкоманда инициализации процедуры загрузки прошивки
+#define COMMAND_FIRMWARE_UPDATE_READY	2	// Информируем, что мы в режиме прошивки
+#define COMMAND_FIRMWARE_UPDATE_WRITE	3	// Субкоманда записи данных во флеш-память (отправитель внешнее устройство)
+#define COMMAND_FIRMWARE_UPDATE_WRITTEN	4	// Подтверждение выполнения команды записи (отправитель мы)
+#define COMMAND_FIRMWARE_UPDATE_DONE	5	// Субкоманда окончания записи и выполнения записанной программы (отправитель внешнее устройство)
+#define COMMAND_FIRMWARE_UPDATE_STREAM	6	// Субкоманда потоковой записи страницы, формат как у WRITE (отправитель внешнее устройство)
+#define COMMAND_FIRMWARE_UPDATE_ACK	7	// Страница принята, 4 байта - адрес следующей ожидаемой страницы (отправитель мы)
+#define COMMAND_FIRMWARE_UPDATE_NAK	8	// Страница отброшена, 4 байта - адрес ожидаемой страницы (отправитель мы)
+#define COMMAND_FIRMWARE_UPDATE_CRC	9	// Запрос CRC страниц: 4 байта - адрес первой страницы, 1 байт - количество страниц (отправитель внешнее устройство)
+#define COMMAND_FIRMWARE_UPDATE_CRC_REPLY	10	// Ответ: 4 байта - адрес первой страницы, далее CRC-16 каждой страницы (отправитель мы)
+#define COMMAND_FIRMWARE_UPDATE_STREAM_RLE	11	// Потоковая запись сжатой RLE страницы: 4 байта - адрес, далее сжатые данные (отправитель внешнее устройство)
+#define COMMAND_FIRMWARE_UPDATE_STATUS	12	// Запрос пропущенных страниц многоадресной записи: 2 байта - номер первой страницы, 1 байт - количество (отправитель внешнее устройство)
+#define COMMAND_FIRMWARE_UPDATE_MISSING	13	// Ответ: 2 байта - номер первой страницы, далее битовая карта пропущенных страниц (отправитель мы)
+
+// Загрузчик принимает и отправляет только пакеты с приоритетом 8 (все биты приоритета доминантные)
+#define BOOT_CONTROL_PRIORITY 8
+
+// Максимальное количество страниц в одном запросе пропущенных страниц
+#define STATUS_QUERY_MAX 128
+
+// Максимальное количество страниц в одном запросе CRC (ответ в 41 байт собирается в приемном буфере)
+#define CRC_QUERY_MAX 16
+
+#endif
@@ -29,21 +29,157 @@ SOFTWARE.
 /* Device name */
 #define CLUNET_DEVICE_NAME "CLUNET device"
 
-/* Buffers sizes (memory usage) */
+/*
+	Buffers sizes (memory usage).
+	Packets are queued already encoded to line runs (two runs per byte), so depending on data
+	one byte of packet takes from 1 to 4 bytes of send buffer (about 2 for random data).
+*/
 #define CLUNET_SEND_BUFFER_SIZE 128
 #define CLUNET_READ_BUFFER_SIZE 128
 
+/* Transmit queue length in packets (1-8), every packet takes CLUNET_SEND_BUFFER_SIZE bytes */
+#define CLUNET_SEND_QUEUE_SIZE 2
+
+/*
+	Send results (RAM: 5 * CLUNET_SEND_QUEUE_SIZE + 4 bytes): clunet_poll() reports every queued frame
+	to clunet_set_on_send_complete() - sent, aborted, given up or dropped from the full queue.
+*/
+//#define CLUNET_SEND_COMPLETE
+
+/* Retry limit: frame is given up after this number of lost arbitrations (1-254), by default it is retried forever */
+//#define CLUNET_SEND_RETRIES 50
+
+/*
+	Priority aging: after every CLUNET_SEND_AGING lost arbitrations the frame is encoded again
+	one priority higher, up to CLUNET_SEND_AGING_MAX (CLUNET_PRIORITY_MESSAGE by default, so commands
+	are not delayed by promoted frames on a saturated bus).
+	Promotion is done by clunet_poll(), so it must be called from main loop even without CLUNET_READ_QUEUE_SIZE.
+	It decodes the frame on the stack: CLUNET_SEND_BUFFER_SIZE * 10 / 8 bytes (160 here, 255 at most).
+*/
+//#define CLUNET_SEND_AGING 8
+//#define CLUNET_SEND_AGING_MAX CLUNET_PRIORITY_COMMAND
+
+/*
+	Fair arbitration among equal priorities (RAM: 2 bytes): after a sent frame the next one of the same or lower
+	priority starts only when the line stays idle CLUNET_FAIR_GAP T (2-8) longer than the interframe. Other waiting
+	nodes start right after the interframe, so every node sends once per such interval instead of the lowest
+	address winning every tie. Gap must exceed ISR latency differences of the nodes.
+*/
+//#define CLUNET_FAIR_GAP 2
+
+/*
+	Answers to a broadcast DISCOVERY start in one of CLUNET_DISCOVERY_SLOTS slots (2-8) chosen by
+	CLUNET_DEVICE_ID: the slot adds 2T per slot number to the idle gap before the answer, so nodes
+	of different slots do not collide over the whole frame. Costs one byte per send queue slot.
+*/
+//#define CLUNET_DISCOVERY_SLOTS 8
+
+/*
+	Deferred receiving: ring of packets (2-8), every packet takes CLUNET_READ_BUFFER_SIZE bytes.
+	ISR fills one slot while up to (CLUNET_READ_QUEUE_SIZE - 1) received packets wait for clunet_poll(),
+	callbacks (and replies to PING and DISCOVERY) are executed by clunet_poll() in main loop.
+	If not defined packets are processed right in the external interrupt, replies to PING, DISCOVERY and
+	STATS are copied there to the send queue as is and encoded (CRC, stuffing) by clunet_poll().
+*/
+//#define CLUNET_READ_QUEUE_SIZE 3
+
+/*
+	Receive filter (RAM: 65 bytes), see clunet_filter_address() and clunet_filter_command().
+	Frames for other devices are not buffered, so CLUNET_READ_BUFFER_SIZE may be as small as
+	the longest frame this device accepts.
+*/
+//#define CLUNET_RECEIVE_FILTER
+
+/*
+	Command handlers table (power of two 2-128, RAM: 5 bytes each + 1), see clunet_set_handler().
+	One entry is always free, so the table takes CLUNET_HANDLERS - 1 handlers and a command without a handler
+	is found missing at the first free entry.
+	Handler gets the command instead of clunet_set_on_data_received() and built-in answers.
+*/
+//#define CLUNET_HANDLERS 8
+
+/*
+	Bus load estimate (RAM: 9 bytes), see clunet_bus_load(): line busy time is counted by external ISR
+	(interframe gaps included), clunet_bus_load_poll() averages it over windows of CLUNET_BUS_LOAD ms (10-250).
+	CLUNET_TICKS_PER_MS is calculated from F_CPU and CLUNET_TIMER_PRESCALER if not defined.
+*/
+//#define CLUNET_BUS_LOAD 100
+
+/*
+	Shaper of frames with priority 1-2 (RAM: 2 bytes), requires CLUNET_BUS_LOAD: token bucket of CLUNET_SHAPER_BURST
+	frames (4 by default) is refilled with CLUNET_SHAPER_RATE frames/s (1-255) while bus load is below CLUNET_SHAPER_LOAD %
+	(50 by default), then the rate goes down linearly to zero on a saturated bus. clunet_send() refuses shaped frames
+	without a token, see clunet_send_allowed(). Higher priorities are never shaped.
+*/
+//#define CLUNET_SHAPER_RATE 10
+//#define CLUNET_SHAPER_BURST 4
+//#define CLUNET_SHAPER_LOAD 50
+
+/* Bus statistics counters (RAM: 18 bytes), see clunet_get_stats() and CLUNET_COMMAND_STATS */
+//#define CLUNET_STATS
+
+/*
+	Capture of every frame on the bus for the sniffer (RAM: 10 bytes + 6 bytes per read buffer), see clunet_set_on_capture()
+	and clunet_capture.h: start bit time is extended to 32 bits by the timer overflow interrupt, frames with CRC error
+	are kept. Every frame is read, a longer one than CLUNET_READ_BUFFER_SIZE is lost (next record gets CLUNET_CAPTURE_LOST).
+	Used by demo_project/clunet_sniffer.
+*/
+//#define CLUNET_CAPTURE
+
+/*
+	EEPROM address of the firmware update request flag (AVR only), shared with clunet_bootloader.
+	CLUNET_COMMAND_REBOOT sets it, so the bootloader waits for a flasher only when asked to
+	(or when the stored application image is not valid) and otherwise starts the application at once.
+	6 bytes below it keep length and CRC-16 of the application image.
+	Define it only together with FAST_BOOT in BOOTLOADER_FEATURES of clunet_bootloader/Makefile (off by default):
+	a bootloader without FAST_BOOT never reads the flag, and the application would write EEPROM for nothing.
+*/
+//#define CLUNET_BOOT_UPDATE_FLAG E2END
+
+/*
+	Receiver backend. By default the external interrupt (any logical change) reads the timer in its handler,
+	so edge times include interrupt latency and time spent in other handlers.
+	With CLUNET_ICP1 the input capture unit of Timer1 latches the timer at the edge in hardware,
+	receiving is not disturbed by other interrupts and T may be from 4. Bus pin must be ICP1 (ATmega8: PB0).
+*/
+//#define CLUNET_ICP1
+
 /* MCUs pin, external interrupt with any logical change is required! */
+#ifndef CLUNET_ICP1
 #define CLUNET_PORT D
 #define CLUNET_PIN 2
+#else
+#define CLUNET_PORT B
+#define CLUNET_PIN 0
+#endif
 
 /*
-	Custom T (T >= 8 && T <= 24).
+	Custom T (T >= 8 && T <= 24, with CLUNET_ICP1 T >= 4).
 	T is frame unit size in timer ticks. Lower - faster, higher - more stable.
 	If not defined T will be calculated as ~64us based on CLUNET_TIMER_PRESCALER value.
 */
 //#define CLUNET_T 8
 
+/*
+	Dual-rate frames: data phase T in timer ticks (CLUNET_T_DATA >= 4 && CLUNET_T_DATA < T).
+	Start bit, priority and source address are sent with T, so arbitration keeps its timing,
+	the rest of the frame follows one switch bit with CLUNET_T_DATA.
+	Every device of the network and clunet_bootloader must be built with the same value,
+	and both interrupt handlers must fit into CLUNET_T_DATA ticks (see tools/isr-profiler).
+*/
+//#define CLUNET_T_DATA 4
+
+/*
+	Clock recovery (RAM: 2 bytes): receiver estimates bit period of the sender from its runs
+	and counts bits of the rest of the frame with it, within 1/8 of T.
+	Useful with uncalibrated RC oscillators (several percent of drift between devices).
+	Only the receive path changes, so it may be enabled on some devices of the network only,
+	clunet_bootloader keeps the fixed period. Interrupt handler is longer (16-bit arithmetic).
+*/
+//#define CLUNET_CLOCK_RECOVERY
+
+#ifndef CLUNET_ICP1
+
 /* 8-bit Timer/Counter definitions */
 
 // Timer initialization in NORMAL MODE
@@ -54,10 +190,12 @@ SOFTWARE.
 #define CLUNET_TIMER_REG TCNT2
 // Output Compare Register
 #define CLUNET_TIMER_REG_OCR OCR2
-// Overflow Condition (used in bootloader only)
+// Overflow Condition (bootloader and CLUNET_CAPTURE)
 #define CLUNET_TIMER_OVERFLOW (TIFR & (1 << TOV2))
 // Reset Overflow Flag Command (used in bootloader only)
 #define CLUNET_TIMER_OVERFLOW_CLEAR { TIFR = (1 << TOV2); }
+// Enable timer overflow interrupt (CLUNET_CAPTURE only)
+#define CLUNET_ENABLE_OVI { TIMSK |= (1 << TOIE2); }
 // Reset Output Compare Flag Command
 #define CLUNET_CLEAR_OCF { TIFR = (1 << OCF2); }
 // Enable timer compare interrupt (reset output compare flag & enable interrupt)
@@ -74,6 +212,42 @@ SOFTWARE.
 
 /* Interrupt vectors */
 #define CLUNET_TIMER_COMP_VECTOR TIMER2_COMP_vect
+#define CLUNET_TIMER_OVF_VECTOR TIMER2_OVF_vect
 #define CLUNET_INT_VECTOR INT0_vect
 
+#else
+
+/*
+	Timer1 in CTC mode with TOP = OCR1A = 255 counts as 8-bit timer, OCR1B is output compare.
+	All Timer1 values stay below 256, so the high byte latch is always zero and 8-bit access to low bytes is safe.
+*/
+#define CLUNET_TIMER_INIT { OCR1A = 255; TCCR1A = 0; TCCR1B = (1 << ICNC1) | (1 << WGM12) | (1 << CS11) | (1 << CS10); }
+#define CLUNET_TIMER_PRESCALER 64
+#define CLUNET_TIMER_REG TCNT1
+#define CLUNET_TIMER_REG_OCR OCR1BL
+// Counter wraps on compare match A (bootloader and CLUNET_CAPTURE)
+#define CLUNET_TIMER_OVERFLOW (TIFR & (1 << OCF1A))
+#define CLUNET_TIMER_OVERFLOW_CLEAR { TIFR = (1 << OCF1A); }
+#define CLUNET_ENABLE_OVI { TIMSK |= (1 << OCIE1A); }
+#define CLUNET_CLEAR_OCF { TIFR = (1 << OCF1B); }
+#define CLUNET_ENABLE_OCI { TIMSK |= (1 << OCIE1B); }
+#define CLUNET_DISABLE_OCI { TIMSK &= ~(1 << OCIE1B); }
+
+/* Input capture: waits for the edge opposite to the line level, then every handler switches the edge and clears the flag */
+#define CLUNET_INT_ENABLE { TIFR = (1 << ICF1); TIMSK |= (1 << TICIE1); }
+#define CLUNET_INT_DISABLE { TIMSK &= ~(1 << TICIE1); }
+#define CLUNET_INT_INIT { if (CLUNET_READING) TCCR1B |= (1 << ICES1); else TCCR1B &= ~(1 << ICES1); CLUNET_INT_ENABLE; }
+// Timer value latched at the edge
+#define CLUNET_INT_CAPTURE_REG ICR1L
+// Latched edge is the front one (line released)
+#define CLUNET_INT_CAPTURE_FRONT (TCCR1B & (1 << ICES1))
+// Wait for the opposite edge
+#define CLUNET_INT_CAPTURE_NEXT { TCCR1B ^= (1 << ICES1); TIFR = (1 << ICF1); }
+
+#define CLUNET_TIMER_COMP_VECTOR TIMER1_COMPB_vect
+#define CLUNET_TIMER_OVF_VECTOR TIMER1_COMPA_vect
+#define CLUNET_INT_VECTOR TIMER1_CAPT_vect
+
+#endif
+
 #endif
@@ -0,0 +1,75 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	CLUNET gateway adapter: links the bus to clunet-gatewayd (tools/gateway) over the UART,
+	the link protocol is described in tools/gateway/clunet_gateway.h.
+	UART: 500000 baud 8N1 (U2X, exact at 8 MHz), RXD and TXD.
+*/
+
+#include "clunet.h"
+#include "clunet_adapter.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#ifndef ADAPTER_BAUD
+#  define ADAPTER_BAUD 500000UL
+#endif
+
+// Байт от хоста
+ISR(USART_RXC_vect)
+{
+	clunet_adapter_rx(UDR);
+}
+
+// Байт хосту, когда буфер пуст - прерывание запрещается до следующих данных
+ISR(USART_UDRE_vect)
+{
+	uint8_t byte;
+	if (clunet_adapter_tx(&byte))
+		UDR = byte;
+	else
+		UCSRB &= ~(1 << UDRIE);
+}
+
+static void
+uart_tx_start(void)
+{
+	UCSRB |= (1 << UDRIE);
+}
+
+int main (void)
+{
+	UBRRH = 0;
+	UBRRL = F_CPU / 8 / ADAPTER_BAUD - 1;
+	UCSRA = (1 << U2X);
+	UCSRC = (1 << URSEL) | (1 << UCSZ1) | (1 << UCSZ0);
+	UCSRB = (1 << RXEN) | (1 << RXCIE) | (1 << TXEN);
+
+	clunet_init();
+	clunet_adapter_start(uart_tx_start);
+
+	while (1)
+	{
+		clunet_poll();
+		clunet_adapter_poll();
+	}
+	return 0;
+}
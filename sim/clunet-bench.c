@@ -0,0 +1,564 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+
+/*
+	clunet-bench: bus throughput and latency benchmark.
+
+	Runs a traffic profile on the virtual bus and reports delivered frames/s, payload bytes/s,
+	bus utilization, arbitration losses and queue-to-delivery latency per priority.
+	A profile is a text file of "key = value" lines (see profiles/), every key may also be
+	given on the command line after the profile name. Keys starting with "gate_" are limits:
+	if any is violated the exit code is 1, so the benchmark can be used as a regression gate.
+*/
+
+#include "sim.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define MAX_PRIO 8
+#define MS (1000.0 / SIM_TICK_US * SIM_SUB) // Sub-ticks per millisecond
+#define BENCH_COMMAND 0x80
+#define CLUNET_FRAME_OVERHEAD 5 // Header and CRC bytes
+
+struct profile
+{
+	char node_library[256];
+	int nodes;
+	int t;
+	int t_data;			// CLUNET_T_DATA of dual-rate node library, 0 - single rate
+	int latency;
+	int cost;
+	int drift_ppm;
+	uint32_t seed;
+	double warmup_ms;		// Not measured start interval
+	double duration_ms;		// Measured interval
+	double drain_ms;		// Time to deliver queued frames after traffic stops
+	double load;			// Offered load, fraction of the bus capacity (if rate is 0)
+	double rate;			// Offered frames per second for the whole bus
+	double broadcast;		// Fraction of broadcast frames
+	int size_min, size_max;		// Payload size range (>= 2)
+	double weight[MAX_PRIO + 1];	// Priority distribution
+	/* Gates (0 - not checked) */
+	double gate_min_fps;
+	double gate_min_bps;
+	double gate_min_delivery;	// Delivered / accepted
+	double gate_max_reject;		// Rejected by full queue or shaper / offered
+	double gate_max_losses;		// Arbitration losses per delivered frame
+	double gate_min_fairness;	// Jain's index of frames delivered from every node
+	double gate_max_p99_us[MAX_PRIO + 1];
+};
+
+struct sent
+{
+	int64_t time;			// clunet_send() time, -1 if already delivered
+	uint8_t prio;
+	uint8_t size;
+	uint8_t receivers;		// Expected deliveries
+};
+
+struct node_traffic
+{
+	int64_t next;			// Next arrival
+	uint16_t seq;
+	struct sent* sent;
+	uint32_t sent_size;
+	uint64_t delivered;		// Inside of measured interval
+};
+
+struct latency
+{
+	double* value;
+	uint32_t count, size;
+};
+
+struct bench
+{
+	struct profile p;
+	struct node_traffic* node;
+	int64_t start, end;		// Measured interval
+	uint64_t offered, accepted, rejected;
+	uint64_t delivered, delivered_bytes;	// Inside of measured interval
+	uint64_t delivered_total, expected_total;
+	uint64_t losses, windows;
+	int64_t busy;
+	int64_t sample;			// Next sample of the load estimated by nodes
+	double estimated;		// Sum of samples
+	uint64_t samples;
+	struct latency latency[MAX_PRIO + 1];
+};
+
+static uint32_t rng_state = 1;
+
+static uint32_t
+rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static double
+rng_uniform(void)
+{
+	return (rng() + 0.5) / 4294967296.0;
+}
+
+static void
+latency_add(struct latency* l, double v)
+{
+	if (l->count == l->size)
+	{
+		l->size = l->size ? l->size * 2 : 1024;
+		l->value = realloc(l->value, l->size * sizeof(double));
+	}
+	l->value[l->count++] = v;
+}
+
+static int
+cmp_double(const void* a, const void* b)
+{
+	const double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double
+percentile(const struct latency* l, int pct)
+{
+	if (!l->count)
+		return 0;
+	uint32_t idx = (uint32_t)((uint64_t)l->count * pct / 100);
+	if (idx >= l->count)
+		idx = l->count - 1;
+	return l->value[idx];
+}
+
+static void
+profile_defaults(struct profile* p)
+{
+	memset(p, 0, sizeof(*p));
+	strcpy(p->node_library, "./clunet-node.so");
+	p->nodes = 8;
+	p->t = 8;
+	p->seed = 1;
+	p->warmup_ms = 100;
+	p->duration_ms = 2000;
+	p->drain_ms = 500;
+	p->load = 0.5;
+	p->size_min = 2;
+	p->size_max = 16;
+	p->weight[1] = p->weight[2] = p->weight[3] = p->weight[4] = 1;
+}
+
+static int
+profile_set(struct profile* p, const char* key, const char* value)
+{
+	int prio;
+	if (!strcmp(key, "node_library"))
+		snprintf(p->node_library, sizeof(p->node_library), "%s", value);
+	else if (!strcmp(key, "nodes")) p->nodes = atoi(value);
+	else if (!strcmp(key, "t")) p->t = atoi(value);
+	else if (!strcmp(key, "t_data")) p->t_data = atoi(value);
+	else if (!strcmp(key, "latency")) p->latency = atoi(value);
+	else if (!strcmp(key, "cost")) p->cost = atoi(value);
+	else if (!strcmp(key, "drift_ppm")) p->drift_ppm = atoi(value);
+	else if (!strcmp(key, "seed")) p->seed = strtoul(value, 0, 0);
+	else if (!strcmp(key, "warmup_ms")) p->warmup_ms = atof(value);
+	else if (!strcmp(key, "duration_ms")) p->duration_ms = atof(value);
+	else if (!strcmp(key, "drain_ms")) p->drain_ms = atof(value);
+	else if (!strcmp(key, "load")) p->load = atof(value);
+	else if (!strcmp(key, "rate")) p->rate = atof(value);
+	else if (!strcmp(key, "broadcast")) p->broadcast = atof(value);
+	else if (!strcmp(key, "size_min")) p->size_min = atoi(value);
+	else if (!strcmp(key, "size_max")) p->size_max = atoi(value);
+	else if (!strcmp(key, "priorities"))
+	{
+		// "1:40,2:30,3:20,4:10"
+		memset(p->weight, 0, sizeof(p->weight));
+		const char* s = value;
+		while (*s)
+		{
+			double w;
+			int n;
+			if ((sscanf(s, "%d:%lf%n", &prio, &w, &n) != 2) || (prio < 1) || (prio > MAX_PRIO))
+				return -1;
+			p->weight[prio] = w;
+			s += n;
+			if (*s == ',')
+				s++;
+		}
+	}
+	else if (!strcmp(key, "gate_min_fps")) p->gate_min_fps = atof(value);
+	else if (!strcmp(key, "gate_min_bps")) p->gate_min_bps = atof(value);
+	else if (!strcmp(key, "gate_min_delivery")) p->gate_min_delivery = atof(value);
+	else if (!strcmp(key, "gate_max_reject")) p->gate_max_reject = atof(value);
+	else if (!strcmp(key, "gate_max_losses")) p->gate_max_losses = atof(value);
+	else if (!strcmp(key, "gate_min_fairness")) p->gate_min_fairness = atof(value);
+	else if ((sscanf(key, "gate_max_p99_us.%d", &prio) == 1) && (prio >= 1) && (prio <= MAX_PRIO))
+		p->gate_max_p99_us[prio] = atof(value);
+	else
+		return -1;
+	return 0;
+}
+
+/* Parse "key = value" (or "key=value"), '#' starts a comment */
+static int
+profile_line(struct profile* p, char* line, const char* where)
+{
+	char* hash = strchr(line, '#');
+	if (hash)
+		*hash = 0;
+	char* eq = strchr(line, '=');
+	char* key = line;
+	while (isspace((unsigned char)*key))
+		key++;
+	if (!*key)
+		return 0;
+	if (!eq)
+	{
+		fprintf(stderr, "%s: expected key = value\n", where);
+		return -1;
+	}
+	*eq = 0;
+	char* value = eq + 1;
+	char* e = eq;
+	while ((e > key) && isspace((unsigned char)e[-1]))
+		*--e = 0;
+	while (isspace((unsigned char)*value))
+		value++;
+	e = value + strlen(value);
+	while ((e > value) && isspace((unsigned char)e[-1]))
+		*--e = 0;
+	if (profile_set(p, key, value))
+	{
+		fprintf(stderr, "%s: invalid %s = %s\n", where, key, value);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+profile_load(struct profile* p, const char* path)
+{
+	char line[512], where[300];
+	int n = 0;
+	FILE* f = fopen(path, "r");
+	if (!f)
+	{
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f))
+	{
+		snprintf(where, sizeof(where), "%s:%d", path, ++n);
+		if (profile_line(p, line, where))
+		{
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Average frame duration on the line in sub-ticks: random data has ~1/16 stuffed bits, plus 1T stop bit and interframe */
+static double
+frame_time(const struct profile* p, double size)
+{
+	const double bits = 4 + 8 * (CLUNET_FRAME_OVERHEAD + size);
+	if (!p->t_data)
+		return (bits * 17 / 16 + 1 + 8) * p->t * SIM_SUB;
+	// Dual-rate: start bit, priority and source address with T, then switch bit, the rest and stop bit with t_data
+	const double arbitration = 4 + 8;
+	return ((arbitration * 17 / 16 + 8) * p->t + ((bits - arbitration) * 17 / 16 + 2) * p->t_data) * SIM_SUB;
+}
+
+static uint8_t
+pick_priority(const struct profile* p)
+{
+	double total = 0;
+	int prio;
+	for (prio = 1; prio <= MAX_PRIO; prio++)
+		total += p->weight[prio];
+	double x = rng_uniform() * total;
+	for (prio = 1; prio < MAX_PRIO; prio++)
+	{
+		if (x < p->weight[prio])
+			return prio;
+		x -= p->weight[prio];
+	}
+	return MAX_PRIO;
+}
+
+static void
+received(void* ctx, int node, uint8_t src, uint8_t cmd, const uint8_t* data, uint8_t size)
+{
+	struct bench* b = ctx;
+	const int from = sim_node_by_id(src);
+	(void)node;
+	if ((cmd != BENCH_COMMAND) || (from < 0) || (size < 2))
+		return;
+	const uint16_t seq = data[0] | (data[1] << 8);
+	struct node_traffic* nt = &b->node[from];
+	if (seq >= nt->sent_size)
+		return;
+	struct sent* s = &nt->sent[seq];
+	if ((s->time < 0) || !s->receivers)
+		return;
+	b->delivered_total++;
+	if (--s->receivers)
+		return;
+	// Frame is delivered when the last receiver got it
+	const int64_t now = sim_now();
+	if ((s->time >= b->start) && (s->time < b->end))
+		latency_add(&b->latency[s->prio], (now - s->time) * SIM_TICK_US / SIM_SUB);
+	if ((now >= b->start) && (now < b->end))
+	{
+		b->delivered++;
+		b->delivered_bytes += size;
+		nt->delivered++;
+	}
+	s->time = -1;
+}
+
+static void
+window(void* ctx, int64_t start, int64_t end, const uint8_t* drivers, int winner)
+{
+	struct bench* b = ctx;
+	int i;
+	if ((end <= b->start) || (start >= b->end))
+		return;
+	b->busy += ((end < b->end) ? end : b->end) - ((start > b->start) ? start : b->start);
+	b->windows++;
+	for (i = 0; i < SIM_MAX_NODES; i++)
+		if (drivers[i] && (i != winner))
+			b->losses++;
+}
+
+static void
+send_one(struct bench* b, int i)
+{
+	const struct profile* p = &b->p;
+	struct node_traffic* nt = &b->node[i];
+	uint8_t data[255];
+	int dst, j;
+
+	const uint8_t prio = pick_priority(p);
+	const uint8_t size = p->size_min + rng() % (p->size_max - p->size_min + 1);
+	const int broadcast = rng_uniform() < p->broadcast;
+	do
+		dst = rng() % p->nodes;
+	while (dst == i);
+
+	data[0] = (uint8_t)nt->seq;
+	data[1] = (uint8_t)(nt->seq >> 8);
+	for (j = 2; j < size; j++)
+		data[j] = (uint8_t)rng();
+
+	b->offered++;
+	if (!sim_send(i, broadcast ? 255 : sim_node_id(dst), prio, BENCH_COMMAND, data, size))
+	{
+		b->rejected++;
+		return;
+	}
+	b->accepted++;
+
+	if (nt->seq >= nt->sent_size)
+	{
+		nt->sent_size = nt->sent_size ? nt->sent_size * 2 : 1024;
+		nt->sent = realloc(nt->sent, nt->sent_size * sizeof(struct sent));
+	}
+	struct sent* s = &nt->sent[nt->seq++];
+	s->time = sim_now();
+	s->prio = prio;
+	s->size = size;
+	s->receivers = broadcast ? p->nodes - 1 : 1;
+	b->expected_total += s->receivers;
+}
+
+static int
+gate(const char* name, double value, double limit, int max)
+{
+	if (!limit || (max ? (value <= limit) : (value >= limit)))
+		return 0;
+	printf("GATE FAILED: %s = %.3f, %s %.3f\n", name, value, max ? "max" : "min", limit);
+	return 1;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: clunet-bench PROFILE [key=value ...]\n");
+}
+
+int
+main(int argc, char** argv)
+{
+	struct bench b;
+	int i, prio;
+
+	memset(&b, 0, sizeof(b));
+	profile_defaults(&b.p);
+	if (argc < 2)
+	{
+		usage();
+		return 2;
+	}
+	if (profile_load(&b.p, argv[1]))
+		return 2;
+	for (i = 2; i < argc; i++)
+		if (profile_line(&b.p, argv[i], "command line"))
+			return 2;
+
+	struct profile* p = &b.p;
+	if ((p->nodes < 2) || (p->size_min < 2) || (p->size_max < p->size_min) || (p->size_max > 250) || (p->duration_ms <= 0))
+	{
+		fprintf(stderr, "%s: invalid profile\n", argv[1]);
+		return 2;
+	}
+
+	// Offered frames per sub-tick for every node
+	double mean_size = (p->size_min + p->size_max) / 2.0;
+	double rate = p->rate ? p->rate / (1000 * MS) : p->load / frame_time(p, mean_size);
+	rate /= p->nodes;
+
+	struct sim_config cfg = { p->node_library, p->nodes, 1, p->latency, p->cost, p->drift_ppm, p->t, p->seed };
+	struct sim_hooks hooks = { &b, received, 0, window };
+	rng_state = p->seed ? p->seed : 1;
+	for (i = 0; i < 16; i++) // Small seeds give small first numbers
+		rng();
+	if (sim_init(&cfg, &hooks))
+		return 1;
+
+	b.node = calloc(p->nodes, sizeof(struct node_traffic));
+	// BOOT_COMPLETED broadcasts settle before traffic starts
+	const int64_t traffic_start = (int64_t)(20 * MS);
+	b.start = traffic_start + (int64_t)(p->warmup_ms * MS);
+	b.end = b.start + (int64_t)(p->duration_ms * MS);
+	b.sample = b.start;
+	for (i = 0; i < p->nodes; i++)
+		b.node[i].next = traffic_start + (int64_t)(-log(rng_uniform()) / rate);
+
+	// Poisson arrivals
+	while (1)
+	{
+		int next = 0;
+		for (i = 1; i < p->nodes; i++)
+			if (b.node[i].next < b.node[next].next)
+				next = i;
+		if (b.node[next].next >= b.end)
+			break;
+		// Bus load estimated by the nodes themselves (CLUNET_BUS_LOAD) is sampled every 10 ms of the measured interval
+		while ((b.sample < b.node[next].next) && (b.sample < b.end))
+		{
+			sim_run_until(b.sample);
+			if (b.sample >= b.start)
+			{
+				for (i = 0; i < p->nodes; i++)
+					b.estimated += sim_call(i, "sim_node_bus_load", 0, 0, 0) / 255.0;
+				b.samples += p->nodes;
+			}
+			b.sample += (int64_t)(10 * MS);
+		}
+		sim_run_until(b.node[next].next);
+		send_one(&b, next);
+		b.node[next].next += (int64_t)(-log(rng_uniform()) / rate) + 1;
+	}
+	sim_run_until(b.end + (int64_t)(p->drain_ms * MS));
+	const uint64_t isr_count = sim_isr_count();
+	sim_done();
+
+	/* Report */
+	const double seconds = p->duration_ms / 1000;
+	const double fps = b.delivered / seconds;
+	const double bps = b.delivered_bytes / seconds;
+	const double utilization = (double)b.busy / (b.end - b.start);
+	const double delivery = b.expected_total ? (double)b.delivered_total / b.expected_total : 1;
+	const double reject = b.offered ? (double)b.rejected / b.offered : 0;
+	const double losses = b.delivered ? (double)b.losses / b.delivered : 0;
+	const double estimated = b.samples ? b.estimated / b.samples : 0;
+	// Jain's fairness index: 1 - every node got the same share, 1/nodes - one node took the bus
+	double sum = 0, squares = 0;
+	uint64_t fewest = UINT64_MAX, most = 0;
+	for (i = 0; i < p->nodes; i++)
+	{
+		const double x = b.node[i].delivered;
+		sum += x;
+		squares += x * x;
+		if (b.node[i].delivered < fewest)
+			fewest = b.node[i].delivered;
+		if (b.node[i].delivered > most)
+			most = b.node[i].delivered;
+	}
+	const double fairness = squares ? sum * sum / (p->nodes * squares) : 1;
+
+	printf("profile %s: %d nodes, T=%d", argv[1], p->nodes, p->t);
+	if (p->t_data)
+		printf(", data T=%d", p->t_data);
+	printf(", payload %d-%d, offered %.0f frames/s\n",
+		p->size_min, p->size_max, b.offered / ((double)(b.end - traffic_start) / (1000 * MS)));
+	printf("  delivered    %10.1f frames/s  %10.1f payload bytes/s\n", fps, bps);
+	printf("  utilization  %10.1f %%  (estimated by nodes %.1f %%)\n", 100 * utilization, 100 * estimated);
+	printf("  frames       offered %llu, accepted %llu, rejected %llu\n",
+		(unsigned long long)b.offered, (unsigned long long)b.accepted, (unsigned long long)b.rejected);
+	printf("  receptions   %llu of %llu (%.2f%%)%s\n",
+		(unsigned long long)b.delivered_total, (unsigned long long)b.expected_total, 100 * delivery,
+		(b.delivered_total < b.expected_total) ? ", the rest was evicted from full queues or is still queued" : "");
+	printf("  arbitration  %llu losses in %llu bus windows (%.2f per delivered frame)\n",
+		(unsigned long long)b.losses, (unsigned long long)b.windows, losses);
+	printf("  fairness     %10.3f (frames per node %llu-%llu)\n", fairness, (unsigned long long)fewest, (unsigned long long)most);
+	printf("  interrupts   %llu\n", (unsigned long long)isr_count);
+	printf("  latency, us      count        p50        p99        max\n");
+	for (prio = 1; prio <= MAX_PRIO; prio++)
+	{
+		struct latency* l = &b.latency[prio];
+		if (!l->count)
+			continue;
+		qsort(l->value, l->count, sizeof(double), cmp_double);
+		printf("  priority %d  %10u %10.0f %10.0f %10.0f\n", prio, l->count,
+			percentile(l, 50), percentile(l, 99), l->value[l->count - 1]);
+	}
+
+	int failed = 0;
+	failed += gate("frames/s", fps, p->gate_min_fps, 0);
+	failed += gate("payload bytes/s", bps, p->gate_min_bps, 0);
+	failed += gate("delivery ratio", delivery, p->gate_min_delivery, 0);
+	failed += gate("reject ratio", reject, p->gate_max_reject, 1);
+	failed += gate("losses per frame", losses, p->gate_max_losses, 1);
+	failed += gate("fairness index", fairness, p->gate_min_fairness, 0);
+	for (prio = 1; prio <= MAX_PRIO; prio++)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "p99 latency of priority %d, us", prio);
+		failed += gate(name, percentile(&b.latency[prio], 99), p->gate_max_p99_us[prio], 1);
+	}
+
+	for (i = 0; i < p->nodes; i++)
+		free(b.node[i].sent);
+	free(b.node);
+	for (prio = 1; prio <= MAX_PRIO; prio++)
+		free(b.latency[prio].value);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,454 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	clunet-gwsim: network gateway stand-in on top of the simulated bus.
+
+	Node 0 of the simulator is the gateway, it bridges TCP clients (protocol of
+	tools/gateway/clunet_gateway.h) to the bus. The other nodes are devices with the
+	bootloader stand-in (sim_bootloader.c) installed. The simulation runs in real time
+	(or scaled by -x), so tools measure bus-limited throughput as with a real network.
+
+	With -s the gateway node is a serial adapter on a pseudo-terminal instead, for
+	clunet-gatewayd (SLIP framed records with credits, see clunet_gateway.h). The node runs
+	the adapter firmware code (clunet_adapter.c), the terminal is its UART.
+*/
+
+#define _GNU_SOURCE	// posix_openpt()
+
+#include "sim.h"
+#include "clunet.h"
+#include "clunet_gateway.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CLIENTS 16
+#define BUFFER_SIZE 65536
+
+struct client
+{
+	int fd;
+	uint8_t in[BUFFER_SIZE];
+	size_t in_len;
+	uint8_t out[BUFFER_SIZE];
+	size_t out_len;
+};
+
+static struct client clients[MAX_CLIENTS];
+static int clients_seen;
+static uint64_t frames_in, frames_out, frames_rejected;
+static volatile sig_atomic_t stop;
+
+/* Serial adapter mode */
+static struct
+{
+	int fd;
+	struct clunet_gw_link link;	// Output of the adapter, for the statistics
+	uint8_t out[BUFFER_SIZE];
+	size_t out_len;
+	uint8_t opened;		// Host has opened the terminal
+} adapter = { .fd = -1 };
+
+static void
+on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static void
+client_close(struct client* c)
+{
+	close(c->fd);
+	c->fd = -1;
+}
+
+static void
+client_put(struct client* c, uint8_t a, uint8_t b, uint8_t command, const uint8_t* data, uint8_t size)
+{
+	if (c->out_len + CLUNET_GW_HEADER_SIZE + size > sizeof(c->out))
+	{
+		// Client does not read: the gateway never blocks the bus for it
+		fprintf(stderr, "gwsim: client output overflow, disconnecting\n");
+		client_close(c);
+		return;
+	}
+	c->out[c->out_len++] = a;
+	c->out[c->out_len++] = b;
+	c->out[c->out_len++] = command;
+	c->out[c->out_len++] = size;
+	memcpy(c->out + c->out_len, data, size);
+	c->out_len += size;
+}
+
+/* Every frame seen by the gateway node goes to every client, own frames come back when transmitted */
+static void
+sniffed(void* ctx, int node, uint8_t src, uint8_t dst, uint8_t cmd, const uint8_t* data, uint8_t size)
+{
+	int i;
+	(void)ctx;
+	if (node)
+		return;
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].fd >= 0)
+			client_put(&clients[i], src, dst, cmd, data, size);
+	frames_out++;
+}
+
+/* Frames on the bus and credits in the adapter output */
+static void
+adapter_output(uint8_t byte)
+{
+	const uint8_t* r = adapter.link.record;
+	if (clunet_gw_link_input(&adapter.link, byte) <= 0)
+		return;
+	if (r[0] != CLUNET_GW_CONTROL)
+		frames_out++;
+	else if (r[1] == CLUNET_GW_CREDIT)
+	{
+		if (r[2])
+			frames_in++;
+		else
+			frames_rejected++;
+	}
+}
+
+/* Returns -1 when the host has closed the terminal */
+static int
+adapter_io(void)
+{
+	uint8_t buf[4096];
+	ssize_t n, i;
+	uint32_t byte;
+	while ((n = read(adapter.fd, buf, sizeof(buf))) > 0)
+	{
+		adapter.opened = 1;
+		for (i = 0; i < n; i++)
+			sim_call(0, "sim_adapter_rx", buf[i], 0, 0);
+	}
+	// Master side reads EIO while no process has the terminal open
+	if ((n < 0) && (errno == EIO))
+	{
+		if (adapter.opened)
+			return -1;
+		adapter.out_len = 0;
+		return 0;
+	}
+	while ((byte = sim_call(0, "sim_adapter_tx", 0, 0, 0)) <= 0xFF)
+	{
+		// Host does not read: as a UART the adapter loses the bytes
+		if (adapter.out_len < sizeof(adapter.out))
+			adapter.out[adapter.out_len++] = byte;
+		adapter_output(byte);
+	}
+	if (adapter.out_len)
+	{
+		n = write(adapter.fd, adapter.out, adapter.out_len);
+		if (n > 0)
+		{
+			memmove(adapter.out, adapter.out + n, adapter.out_len - n);
+			adapter.out_len -= n;
+		}
+	}
+	return 0;
+}
+
+static int
+adapter_open(const char* link_path)
+{
+	struct termios tio;
+	const char* name;
+	adapter.fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if ((adapter.fd < 0) || grantpt(adapter.fd) || unlockpt(adapter.fd) || !(name = ptsname(adapter.fd)))
+		return -1;
+	// Raw terminal: the line discipline must not touch SLIP bytes
+	if (!tcgetattr(adapter.fd, &tio))
+	{
+		cfmakeraw(&tio);
+		tcsetattr(adapter.fd, TCSANOW, &tio);
+	}
+	unlink(link_path);
+	if (symlink(name, link_path))
+		return -1;
+	fprintf(stderr, "gwsim: serial adapter %s -> %s\n", link_path, name);
+	return 0;
+}
+
+/* Parses complete records of client input, stops while the gateway queue is full (TCP backpressure) */
+static void
+client_pump(struct client* c)
+{
+	size_t pos = 0;
+	while (c->in_len - pos >= CLUNET_GW_HEADER_SIZE)
+	{
+		const uint8_t* r = c->in + pos;
+		const size_t length = CLUNET_GW_HEADER_SIZE + r[3];
+		if (c->in_len - pos < length)
+			break;
+		if (r[0] != CLUNET_GW_CONTROL)
+		{
+			if (sim_ready_to_send(0))
+				break;
+			if (sim_send(0, r[1], r[0], r[2], r + CLUNET_GW_HEADER_SIZE, r[3]))
+				frames_in++;
+			else
+				frames_rejected++;	// Encoded frame does not fit CLUNET_SEND_BUFFER_SIZE
+		}
+		pos += length;
+	}
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+}
+
+static int
+listen_on(int port)
+{
+	struct sockaddr_in addr;
+	const int one = 1;
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 8))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static double
+seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: clunet-gwsim [options]\n"
+		"  -l FILE   node library (default ./clunet-gwnode.so)\n"
+		"  -n N      number of devices (default 4)\n"
+		"  -g ID     gateway address, devices follow it (default 1)\n"
+		"  -p PORT   TCP port on 127.0.0.1 (default %d)\n"
+		"  -P N      flash page size of devices (default 64)\n"
+		"  -A N      application section size of devices (default 7168)\n"
+		"  -e N      percent of page frames lost by devices (default 0)\n"
+		"  -T N      CLUNET_T the node library was built with (default 8)\n"
+		"  -d N      clock drift, +/- ppm (default 0)\n"
+		"  -x N      speed of simulated time relative to real time (default 1)\n"
+		"  -s LINK   serial adapter on a pseudo-terminal (symbolic link to it) instead of TCP\n"
+		"  -q        quit when the last client disconnects (or the terminal is closed)\n", CLUNET_GW_PORT);
+}
+
+int
+main(int argc, char** argv)
+{
+	struct sim_config cfg = { "./clunet-gwnode.so", 5, 1, 0, 0, 0, 8, 1 };
+	struct sim_hooks hooks = { 0, 0, sniffed, 0 };
+	int port = CLUNET_GW_PORT, page_size = 64, app_size = 7168, loss = 0, quit = 0;
+	const char* pty_link = 0;
+	int listener = -1;
+	double speed = 1.0;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "l:n:g:p:P:A:e:T:d:x:s:qh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'l': cfg.node_library = optarg; break;
+			case 'n': cfg.nodes = atoi(optarg) + 1; break;
+			case 'g': cfg.first_id = atoi(optarg); break;
+			case 'p': port = atoi(optarg); break;
+			case 'P': page_size = atoi(optarg); break;
+			case 'A': app_size = atoi(optarg); break;
+			case 'e': loss = atoi(optarg); break;
+			case 'T': cfg.t = atoi(optarg); break;
+			case 'd': cfg.drift_ppm = atoi(optarg); break;
+			case 'x': speed = atof(optarg); break;
+			case 's': pty_link = optarg; break;
+			case 'q': quit = 1; break;
+			default: usage(); return 2;
+		}
+	}
+	if ((cfg.nodes < 2) || (cfg.nodes > SIM_MAX_NODES) || (cfg.first_id + cfg.nodes > CLUNET_BROADCAST_ADDRESS) || (speed <= 0))
+	{
+		usage();
+		return 2;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (pty_link)
+	{
+		if (adapter_open(pty_link))
+		{
+			perror("gwsim: pseudo-terminal");
+			return 1;
+		}
+	}
+	else if ((listener = listen_on(port)) < 0)
+	{
+		perror("gwsim: listen");
+		return 1;
+	}
+	for (i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	if (sim_init(&cfg, &hooks))
+		return 1;
+	for (i = 1; i < cfg.nodes; i++)
+	{
+		if (!sim_call(i, "sim_bootloader_install", page_size, app_size, loss))
+		{
+			fprintf(stderr, "gwsim: bad page size %d or application size %d\n", page_size, app_size);
+			return 2;
+		}
+		sim_reset(i);
+	}
+	fprintf(stderr, "gwsim: gateway %d, devices %d..%d (page %d, application %d bytes), port %d\n",
+		cfg.first_id, cfg.first_id + 1, cfg.first_id + cfg.nodes - 1, page_size, app_size, port);
+	if (pty_link)
+		sim_call(0, "sim_adapter_start", 0, 0, 0);
+
+	const double start = seconds();
+	while (!stop)
+	{
+		struct pollfd fds[MAX_CLIENTS + 1];
+		int count = 0;
+
+		fds[count].fd = pty_link ? adapter.fd : listener;
+		fds[count++].events = POLLIN;
+		for (i = 0; i < MAX_CLIENTS; i++)
+		{
+			if (clients[i].fd < 0)
+				continue;
+			fds[count].fd = clients[i].fd;
+			fds[count++].events = ((clients[i].in_len < sizeof(clients[i].in)) ? POLLIN : 0) | (clients[i].out_len ? POLLOUT : 0);
+		}
+		if ((poll(fds, count, 1) < 0) && (errno != EINTR))
+			break;
+
+		if (pty_link)
+		{
+			if (adapter_io() && quit)
+				break;
+		}
+		else if (fds[0].revents & POLLIN)
+		{
+			const int fd = accept(listener, 0, 0);
+			for (i = 0; (fd >= 0) && (i < MAX_CLIENTS) && (clients[i].fd >= 0); i++);
+			if (fd < 0)
+				;
+			else if (i == MAX_CLIENTS)
+				close(fd);
+			else
+			{
+				const int one = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				fcntl(fd, F_SETFL, O_NONBLOCK);
+				clients[i].fd = fd;
+				clients[i].in_len = clients[i].out_len = 0;
+				clients_seen++;
+				client_put(&clients[i], CLUNET_GW_CONTROL, CLUNET_GW_HELLO, cfg.first_id, 0, 0);
+			}
+		}
+
+		for (i = 0; i < MAX_CLIENTS; i++)
+		{
+			struct client* c = &clients[i];
+			ssize_t n;
+			if (c->fd < 0)
+				continue;
+			if (c->in_len < sizeof(c->in))
+			{
+				n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+				if (!n || ((n < 0) && (errno != EAGAIN) && (errno != EINTR)))
+				{
+					client_close(c);
+					continue;
+				}
+				if (n > 0)
+					c->in_len += n;
+			}
+			client_pump(c);
+			if (c->out_len)
+			{
+				n = write(c->fd, c->out, c->out_len);
+				if ((n < 0) && (errno != EAGAIN) && (errno != EINTR))
+				{
+					client_close(c);
+					continue;
+				}
+				if (n > 0)
+				{
+					memmove(c->out, c->out + n, c->out_len - n);
+					c->out_len -= n;
+				}
+			}
+		}
+
+		// Simulated time follows the wall clock, application loops run every millisecond
+		sim_run_until((int64_t)((seconds() - start) * speed * 1e6 / SIM_TICK_US * SIM_SUB));
+		for (i = 0; i < cfg.nodes; i++)
+			sim_poll(i);
+
+		if (quit && clients_seen)
+		{
+			for (i = 0; (i < MAX_CLIENTS) && (clients[i].fd < 0); i++);
+			if (i == MAX_CLIENTS)
+				break;
+		}
+	}
+
+	if (pty_link)
+		fprintf(stderr, "gwsim: adapter dropped %u bus frames\n", sim_call(0, "sim_adapter_dropped", 0, 0, 0));
+	fprintf(stderr, "gwsim: %.1f s, frames from clients %llu (rejected %llu), frames on the bus %llu, resets %u, bus busy %.1f%%\n",
+		sim_now() / (double)SIM_MS / 1000, (unsigned long long)frames_in, (unsigned long long)frames_rejected,
+		(unsigned long long)frames_out, sim_reset_count(), 100.0 * sim_busy_time() / (sim_now() ? sim_now() : 1));
+	sim_done();
+	if (pty_link)
+		unlink(pty_link);
+	else
+		close(listener);
+	return 0;
+}
@@ -0,0 +1,724 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+
+/*
+	clunet-sim: runs a group of virtual nodes exchanging random frames
+	and checks that every frame is delivered intact exactly once.
+*/
+
+#include "sim.h"
+#include "clunet.h"
+#include "clunet_bulk.h"
+#include "clunet_request.h"
+#include "clunet_capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+struct stats
+{
+	uint32_t sent;
+	uint32_t delivered;
+	uint32_t corrupted;
+	uint32_t losses;
+	uint32_t windows;
+	int verbose;
+	uint8_t (*node_stats)[CLUNET_STATS_SIZE];	// STATS_REPLY of every node
+	uint8_t* node_stats_valid;
+	/* Bulk transfers */
+	uint32_t bulk_sent, bulk_failed, bulk_received, bulk_errors;
+	uint64_t bulk_bytes;
+	int64_t bulk_last;
+	/* Requests */
+	uint32_t request_ok, request_timeouts, request_wrong;
+	/* Discovery: answers to node 0 by address */
+	uint8_t* discovered;
+	uint32_t discovery_answers;
+	int64_t discovery_last;
+	/* Send results of test frames (node library with CLUNET_SEND_COMPLETE) */
+	uint32_t send_results[4];
+	/* Streaming sniffer of node 0 */
+	struct sniffer* sniffer;
+};
+
+#define SNIFFER_MAX_FRAMES 65536
+
+/* Stream of the sniffer (clunet_capture.h) and its check against the bus */
+struct sniffer
+{
+	FILE* out;
+	double byte_time;		// UART byte (10 bits), sub-ticks
+	double credit;			// UART bytes due
+	int64_t last;
+	uint8_t batch[1024];
+	size_t batch_size;
+	uint8_t escape;
+	uint32_t bytes, batches, records, link_errors, bad_records;
+	uint32_t tick_ns;		// From the header batch
+	int64_t* starts;		// Start of every bus frame since the capture started
+	uint32_t frames;
+	uint32_t first_time;
+	int64_t max_error;		// Largest difference of record time from the engine, sub-ticks
+	int drift_ppm;
+};
+
+static uint32_t rng_state = 1;
+
+static uint32_t
+rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+/* Payload is derived from (src, sequence), so receiver can verify it */
+static uint8_t
+payload(uint8_t* data, uint8_t src, uint16_t seq, uint8_t size)
+{
+	uint8_t i;
+	uint32_t x = (src << 16) | seq | 0x80000000u;
+	for (i = 0; i < size; i++)
+	{
+		if (i < 2)
+			data[i] = (uint8_t)(seq >> (8 * i));
+		else
+		{
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			data[i] = (uint8_t)x;
+		}
+	}
+	return size;
+}
+
+static void
+received(void* ctx, int node, uint8_t src, uint8_t cmd, const uint8_t* data, uint8_t size)
+{
+	struct stats* st = ctx;
+	uint8_t expect[255];
+	if ((cmd == CLUNET_COMMAND_STATS_REPLY) && (size == CLUNET_STATS_SIZE) && st->node_stats)
+	{
+		const int from = sim_node_by_id(src);
+		if (from >= 0)
+		{
+			memcpy(st->node_stats[from], data, size);
+			st->node_stats_valid[from] = 1;
+		}
+		return;
+	}
+	if ((cmd == CLUNET_COMMAND_DISCOVERY_RESPONSE) && st->discovered && !node)
+	{
+		st->discovered[src]++;
+		st->discovery_answers++;
+		st->discovery_last = sim_now();
+		return;
+	}
+	if (cmd == SIM_BULK_SENT)
+	{
+		if (data[0] == CLUNET_BULK_OK)
+			st->bulk_sent++;
+		else
+		{
+			st->bulk_failed++;
+			printf("%12.1f us: node %d bulk transfer failed, result %u\n", sim_now() * SIM_TICK_US / SIM_SUB, src, data[0]);
+		}
+		return;
+	}
+	if (cmd == SIM_BULK_RECEIVED)
+	{
+		const uint32_t length = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+		const uint32_t errors = data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t)data[7] << 24);
+		st->bulk_received++;
+		st->bulk_bytes += length;
+		st->bulk_errors += errors;
+		st->bulk_last = sim_now();
+		if (st->verbose)
+			printf("%12.1f us: node %d <- %d bulk %u bytes, %u wrong\n", sim_now() * SIM_TICK_US / SIM_SUB, sim_node_id(node), src, length, errors);
+		return;
+	}
+	if (cmd == SIM_REQUEST_DONE)
+	{
+		if (data[0] == CLUNET_REQUEST_OK)
+			st->request_ok++;
+		else if (data[0] == CLUNET_REQUEST_TIMEOUT)
+			st->request_timeouts++;
+		else
+			st->request_wrong++;
+		if (st->verbose)
+			printf("%12.1f us: node %d request to %d, result %u\n", sim_now() * SIM_TICK_US / SIM_SUB, sim_node_id(node), src, data[0]);
+		return;
+	}
+	if (cmd == SIM_SEND_DONE)
+	{
+		if ((data[0] == 0x80) && (data[1] < 4))
+			st->send_results[data[1]]++;
+		return;
+	}
+	if (cmd != 0x80)
+		return;
+	const uint16_t seq = (size >= 2) ? (data[0] | (data[1] << 8)) : 0;
+	payload(expect, src, seq, size);
+	if ((size < 2) || memcmp(expect, data, size))
+		st->corrupted++;
+	else
+		st->delivered++;
+	if (st->verbose)
+		printf("%12.1f us: node %d <- %d seq %u size %u\n", sim_now() * SIM_TICK_US / SIM_SUB, sim_node_id(node), src, seq, size);
+}
+
+static void
+window(void* ctx, int64_t start, int64_t end, const uint8_t* drivers, int winner)
+{
+	struct stats* st = ctx;
+	int i;
+	(void)start;
+	(void)end;
+	st->windows++;
+	if (st->sniffer && (st->sniffer->frames < SNIFFER_MAX_FRAMES))
+		st->sniffer->starts[st->sniffer->frames++] = start;
+	for (i = 0; i < SIM_MAX_NODES; i++)
+		if (drivers[i] && (i != winner))
+			st->losses++;
+}
+
+static uint8_t
+crc8_update(uint8_t crc, uint8_t data)
+{
+	uint8_t i;
+	crc ^= data;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 1) ? ((crc >> 1) ^ 0x8C) : (crc >> 1);
+	return crc;
+}
+
+/* Record of the n-th frame: its start bit time is compared with the engine, relative to the first record */
+static void
+sniffer_record(struct sniffer* s, const uint8_t* r)
+{
+	const uint32_t time = r[0] | (r[1] << 8) | (r[2] << 16) | ((uint32_t)r[3] << 24);
+	const uint8_t* frame = r + CLUNET_CAPTURE_RECORD_HEADER;
+	const uint32_t n = s->records++;
+	uint8_t crc = 0;
+	int i;
+	for (i = 0; i < r[5]; i++)
+		crc = crc8_update(crc, frame[i]);
+	if (crc || (r[4] & (CLUNET_CAPTURE_CRC_ERROR | CLUNET_CAPTURE_LOST)) || (r[5] != frame[CLUNET_OFFSET_SIZE] + CLUNET_OFFSET_DATA + 1))
+		s->bad_records++;
+	if (!n)
+		s->first_time = time;
+	if (n < s->frames)
+	{
+		const int64_t expected = s->starts[n] - s->starts[0];
+		int64_t error = (int64_t)(uint32_t)(time - s->first_time) * SIM_SUB - expected;
+		if (error < 0)
+			error = -error;
+		if (error > s->max_error)
+			s->max_error = error;
+	}
+}
+
+static void
+sniffer_batch(struct sniffer* s)
+{
+	const uint8_t* b = s->batch;
+	const size_t size = s->batch_size;
+	size_t i, pos;
+	uint8_t crc = 0;
+	if (!size)
+		return;
+	s->batches++;
+	for (i = 0; i < size; i++)
+		crc = crc8_update(crc, b[i]);
+	if (crc || (size < 2))
+	{
+		s->link_errors++;
+		return;
+	}
+	if (b[0] == CLUNET_CAPTURE_BATCH_HEADER)
+	{
+		if ((size != CLUNET_CAPTURE_HEADER_SIZE + 2) || memcmp(b + 1, CLUNET_CAPTURE_MAGIC, 4))
+			s->link_errors++;
+		else
+			s->tick_ns = b[9] | (b[10] << 8) | (b[11] << 16) | ((uint32_t)b[12] << 24);
+		return;
+	}
+	for (pos = 1; pos + CLUNET_CAPTURE_RECORD_HEADER < size; pos += CLUNET_CAPTURE_RECORD_HEADER + b[pos + 5])
+	{
+		if (pos + CLUNET_CAPTURE_RECORD_HEADER + b[pos + 5] > size - 1)
+		{
+			s->link_errors++;
+			return;
+		}
+		sniffer_record(s, b + pos);
+	}
+}
+
+static void
+sniffer_input(struct sniffer* s, uint8_t byte)
+{
+	s->bytes++;
+	if (s->out)
+		fputc(byte, s->out);
+	if (byte == CLUNET_CAPTURE_SLIP_END)
+	{
+		sniffer_batch(s);
+		s->batch_size = s->escape = 0;
+		return;
+	}
+	if (byte == CLUNET_CAPTURE_SLIP_ESC)
+	{
+		s->escape = 1;
+		return;
+	}
+	if (s->escape)
+	{
+		s->escape = 0;
+		byte = (byte == CLUNET_CAPTURE_SLIP_ESC_END) ? CLUNET_CAPTURE_SLIP_END : CLUNET_CAPTURE_SLIP_ESC;
+	}
+	if (s->batch_size < sizeof(s->batch))
+		s->batch[s->batch_size++] = byte;
+}
+
+/* UART of node 0 sends as many bytes as the line rate allows since the last call */
+static void
+sniffer_drain(struct sniffer* s)
+{
+	s->credit += (sim_now() - s->last) / s->byte_time;
+	s->last = sim_now();
+	while (s->credit >= 1)
+	{
+		uint32_t byte = sim_call(0, "sim_capture_tx", 0, 0, 0);
+		if (byte > 0xFF)
+		{
+			// UART has sent everything: main loop of the sniffer may close the batch
+			sim_poll(0);
+			byte = sim_call(0, "sim_capture_tx", 0, 0, 0);
+			if (byte > 0xFF)
+			{
+				s->credit = 0;
+				break;
+			}
+		}
+		s->credit -= 1;
+		sniffer_input(s, byte);
+	}
+}
+
+/* Stream is complete and every frame on the bus is in it with the right time (drift of the sniffer clock allowed) */
+static int
+sniffer_report(struct sniffer* s)
+{
+	const uint32_t dropped = sim_call(0, "sim_capture_dropped", 0, 0, 0);
+	const int64_t span = s->frames ? s->starts[s->frames - 1] - s->starts[0] : 0;
+	const int64_t allowed = 2 * SIM_SUB + span * 2 * s->drift_ppm / 1000000;
+	printf("sniffer: %u frames on the bus, %u records in %u batches (%.1f per batch), %u stream bytes (%.1f per record), tick %u ns\n",
+		s->frames, s->records, s->batches, s->batches ? (double)s->records / s->batches : 0.0,
+		s->bytes, s->records ? (double)s->bytes / s->records : 0.0, s->tick_ns);
+	printf("sniffer: dropped %u, link errors %u, bad records %u, max time error %.2f ticks\n",
+		dropped, s->link_errors, s->bad_records, (double)s->max_error / SIM_SUB);
+	return (s->records != s->frames) || (s->frames >= SNIFFER_MAX_FRAMES) || dropped || s->link_errors || s->bad_records
+		|| !s->tick_ns || (s->max_error > allowed);
+}
+
+/* Poll statistics of every node by CLUNET_COMMAND_STATS from the node 0, as a gateway does, returns the number of nodes without a reply */
+static int
+poll_stats(struct stats* st, int nodes)
+{
+	static const char* names[] = { "sent", "received", "crc", "overflow", "lost fr", "lost fal", "lost flg", "waits" };
+	uint32_t total[8] = { 0 };
+	int i, k, missing = 0;
+
+	st->node_stats = calloc(nodes, CLUNET_STATS_SIZE);
+	st->node_stats_valid = calloc(nodes, 1);
+	for (i = 1; i < nodes; i++)
+	{
+		while (sim_ready_to_send(0))
+			sim_run_until(sim_now() + 64 * SIM_SUB);
+		sim_send(0, sim_node_id(i), CLUNET_PRIORITY_MESSAGE, CLUNET_COMMAND_STATS, 0, 0);
+	}
+	sim_run_until(sim_now() + 100000 * SIM_SUB);
+
+	printf("  node");
+	for (k = 0; k < 8; k++)
+		printf(" %9s", names[k]);
+	printf(" %9s\n", "retries");
+	for (i = 1; i < nodes; i++)
+	{
+		const uint8_t* d = st->node_stats[i];
+		printf("%6u", sim_node_id(i));
+		if (!st->node_stats_valid[i])
+		{
+			printf(" no reply\n");
+			missing++;
+			continue;
+		}
+		for (k = 0; k < 8; k++)
+		{
+			const uint16_t v = d[2 * k] | (d[2 * k + 1] << 8);
+			total[k] += v;
+			printf(" %9u", v);
+		}
+		printf(" %9u\n", d[16]);
+	}
+	printf(" total");
+	for (k = 0; k < 8; k++)
+		printf(" %9u", total[k]);
+	printf("\n");
+	free(st->node_stats);
+	free(st->node_stats_valid);
+	st->node_stats = 0;
+	return missing;
+}
+
+/* Every node sends a block to the next one at the same time, application loops run every millisecond */
+static int
+run_bulk(struct stats* st, const struct sim_config* cfg, uint32_t bytes, int poll)
+{
+	const int64_t ms = SIM_MS;
+	const int64_t start = sim_now();
+	int i;
+
+	for (i = 0; i < cfg->nodes; i++)
+		if (!sim_call(i, "sim_node_bulk_send", sim_node_id((i + 1) % cfg->nodes), bytes, CLUNET_PRIORITY_INFO))
+			st->bulk_failed++;
+	while ((st->bulk_sent + st->bulk_failed < (uint32_t)cfg->nodes) && (sim_now() - start < 600000 * ms))
+	{
+		sim_run_until(sim_now() + ms);
+		for (i = 0; i < cfg->nodes; i++)
+			sim_poll(i);
+	}
+	sim_run_until(sim_now() + 100 * ms);
+
+	const double seconds = (st->bulk_last - start) * SIM_TICK_US / SIM_SUB / 1e6;
+	printf("nodes %d, bulk %u bytes: sent %u, failed %u, received %u, wrong bytes %u\n",
+		cfg->nodes, bytes, st->bulk_sent, st->bulk_failed, st->bulk_received, st->bulk_errors);
+	printf("time %.3f s, goodput %.0f bytes/s, arbitration losses %u, bus busy %.1f%%\n",
+		seconds, seconds > 0 ? st->bulk_bytes / seconds : 0.0, st->losses, 100.0 * sim_busy_time() / (sim_now() - start));
+	const int missing = poll ? poll_stats(st, cfg->nodes) : 0;
+	sim_done();
+	return !missing && (st->bulk_sent == (uint32_t)cfg->nodes) && (st->bulk_received == (uint32_t)cfg->nodes) && !st->bulk_errors ? 0 : 1;
+}
+
+/* Node 0 pings every other node by requests, up to 'window' of them wait for responses at once, as a gateway polls.
+   Unchecked: node 0 fills its transmit queue with lower priority frames first, requests must not drop any of them */
+static int
+run_requests(struct stats* st, const struct sim_config* cfg, int rounds, int window, int unchecked)
+{
+	const int64_t ms = SIM_MS;
+	const uint32_t count = cfg->nodes - 1;
+	int64_t total = 0, longest = 0;
+	uint16_t seq = 0;
+	int round, i;
+
+	sim_call(0, "sim_node_requests_unchecked", unchecked, 0, 0);
+	for (round = 0; round < rounds; round++)
+	{
+		const int64_t start = sim_now();
+		const uint32_t done = st->request_ok + st->request_timeouts + st->request_wrong + count;
+		while (unchecked && !sim_ready_to_send(0))
+		{
+			uint8_t data[16];
+			const uint8_t size = payload(data, sim_node_id(0), seq, sizeof(data));
+			if (!sim_send(0, sim_node_id(1), CLUNET_PRIORITY_INFO, 0x80, data, size))
+				break;
+			seq++;
+			st->sent++;
+		}
+		sim_call(0, "sim_node_requests", sim_node_id(1), count, window);
+		while ((st->request_ok + st->request_timeouts + st->request_wrong < done) && (sim_now() - start < 60000 * ms))
+		{
+			sim_run_until(sim_now() + ms);
+			for (i = 0; i < cfg->nodes; i++)
+				sim_poll(i);
+		}
+		const int64_t elapsed = sim_now() - start;
+		total += elapsed;
+		if (elapsed > longest)
+			longest = elapsed;
+	}
+	// Lower priority frames wait behind the requests
+	const int64_t drain = sim_now() + 1000 * ms;
+	while ((st->delivered + st->corrupted < st->sent) && (sim_now() < drain))
+	{
+		sim_run_until(sim_now() + ms);
+		for (i = 0; i < cfg->nodes; i++)
+			sim_poll(i);
+	}
+
+	printf("nodes %d, requests %d x %u, window %d%s: ok %u, timeouts %u, wrong %u\n",
+		cfg->nodes, rounds, count, window, unchecked ? " back to back" : "", st->request_ok, st->request_timeouts, st->request_wrong);
+	if (unchecked)
+		printf("lower priority frames: sent %u, delivered %u, corrupted %u\n", st->sent, st->delivered, st->corrupted);
+	printf("round time %.1f ms average, %.1f ms max, arbitration losses %u\n",
+		rounds ? total / rounds / (double)ms : 0.0, longest / (double)ms, st->losses);
+	sim_done();
+	return (st->request_ok == (uint32_t)rounds * count) && (st->delivered == st->sent) && !st->corrupted ? 0 : 1;
+}
+
+/* Node 0 discovers the others by a broadcast DISCOVERY, then only the odd addresses by an incremental one */
+static int
+run_discovery(struct stats* st, const struct sim_config* cfg)
+{
+	const int64_t ms = SIM_MS;
+	uint8_t known[32];
+	int round, i, failed = 0;
+
+	// BOOT_COMPLETED broadcasts of all nodes are over
+	sim_run_until(sim_now() + cfg->nodes * 10 * ms);
+	st->discovered = calloc(256, 1);
+	for (round = 0; round < 2; round++)
+	{
+		uint8_t size = 0;
+		memset(known, 0, sizeof(known));
+		memset(st->discovered, 0, 256);
+		st->discovery_answers = 0;
+		// Incremental round: even addresses are already known
+		if (round)
+			for (i = 1; i < cfg->nodes; i++)
+				if (!(sim_node_id(i) & 1))
+				{
+					known[sim_node_id(i) >> 3] |= 1 << (sim_node_id(i) & 7);
+					size = (sim_node_id(i) >> 3) + 1;
+				}
+		const uint32_t losses = st->losses;
+		const int64_t start = sim_now();
+		sim_send(0, CLUNET_BROADCAST_ADDRESS, CLUNET_PRIORITY_MESSAGE, CLUNET_COMMAND_DISCOVERY, known, size);
+		sim_run_until(start + 5000 * ms);
+
+		uint32_t expected = 0, wrong = 0;
+		for (i = 1; i < cfg->nodes; i++)
+		{
+			const uint8_t id = sim_node_id(i);
+			const int answers = (round && !(id & 1)) ? 0 : 1;
+			expected += answers;
+			if (st->discovered[id] != answers)
+				wrong++;
+		}
+		printf("%s discovery: %u of %u nodes answered in %.1f ms, wrong %u, arbitration losses %u\n",
+			round ? "incremental" : "full", st->discovery_answers, expected,
+			(st->discovery_last - start) / (double)ms, wrong, st->losses - losses);
+		if (wrong || (st->discovery_answers != expected))
+			failed = 1;
+	}
+	free(st->discovered);
+	st->discovered = 0;
+	sim_done();
+	return failed;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: clunet-sim [options]\n"
+		"  -l FILE   node library (default ./clunet-node.so)\n"
+		"  -n N      number of nodes (default 8)\n"
+		"  -f N      frames sent by every node (default 20)\n"
+		"  -s N      maximum payload size (default 32)\n"
+		"  -T N      CLUNET_T the node library was built with (default 8)\n"
+		"  -L N      ISR latency, 1/%d tick (default 0)\n"
+		"  -C N      ISR cost, 1/%d tick (default 0)\n"
+		"  -d N      clock drift, +/- ppm (default 0)\n"
+		"  -r N      random seed (default 1)\n"
+		"  -b BYTES  bulk transfer instead of frames: every node sends BYTES to the next one\n"
+		"  -q N      requests instead of frames: node 0 pings every other node N times by clunet_request()\n"
+		"  -w N      outstanding requests of -q (default 64)\n"
+		"  -Q        requests of -q back to back, without checking clunet_ready_to_send()\n"
+		"  -D        discovery instead of frames: node 0 discovers the others, then only the odd addresses\n"
+		"  -S        poll statistics of every node (CLUNET_COMMAND_STATS) at the end\n"
+		"  -c FILE   node 0 is a sniffer (library with CLUNET_CAPTURE): its stream is written to FILE and checked against the bus\n"
+		"  -U BAUD   UART rate of the sniffer (default 500000)\n"
+		"  -v        print every delivered frame\n", SIM_SUB, SIM_SUB);
+}
+
+int
+main(int argc, char** argv)
+{
+	struct sim_config cfg = { "./clunet-node.so", 8, 1, 0, 0, 0, 8, 1 };
+	struct stats st;
+	struct sim_hooks hooks = { &st, received, 0, window };
+	int frames = 20, max_size = 32;
+	int opt, poll = 0, discovery = 0;
+	uint32_t bulk = 0;
+	int requests = 0, request_window = 64, request_unchecked = 0;
+	const char* capture = 0;
+	uint32_t baud = 500000;
+	struct sniffer sniffer;
+
+	memset(&st, 0, sizeof(st));
+	while ((opt = getopt(argc, argv, "l:n:f:s:T:L:C:d:r:b:q:w:c:U:QDSvh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'l': cfg.node_library = optarg; break;
+			case 'n': cfg.nodes = atoi(optarg); break;
+			case 'f': frames = atoi(optarg); break;
+			case 's': max_size = atoi(optarg); break;
+			case 'T': cfg.t = atoi(optarg); break;
+			case 'L': cfg.latency = atoi(optarg); break;
+			case 'C': cfg.cost = atoi(optarg); break;
+			case 'd': cfg.drift_ppm = atoi(optarg); break;
+			case 'r': cfg.seed = strtoul(optarg, 0, 0); break;
+			case 'b': bulk = strtoul(optarg, 0, 0); break;
+			case 'q': requests = atoi(optarg); break;
+			case 'w': request_window = atoi(optarg); break;
+			case 'Q': request_unchecked = 1; break;
+			case 'c': capture = optarg; break;
+			case 'U': baud = strtoul(optarg, 0, 0); break;
+			case 'D': discovery = 1; break;
+			case 'S': poll = 1; break;
+			case 'v': st.verbose = 1; break;
+			default: usage(); return 2;
+		}
+	}
+	if ((cfg.nodes < 2) || (max_size < 2) || (max_size > 250) || (capture && (bulk || requests || discovery || (cfg.nodes < 3) || !baud)))
+	{
+		usage();
+		return 2;
+	}
+	rng_state = cfg.seed ? cfg.seed : 1;
+
+	if (sim_init(&cfg, &hooks))
+		return 1;
+
+	int* left = calloc(cfg.nodes, sizeof(int));
+	uint16_t* seq = calloc(cfg.nodes, sizeof(uint16_t));
+	int i, busy;
+	for (i = 0; i < cfg.nodes; i++)
+		left[i] = frames;
+
+	// Let BOOT_COMPLETED broadcasts settle
+	sim_run_until(sim_now() + 2000 * SIM_SUB);
+
+	if (bulk)
+		return run_bulk(&st, &cfg, bulk, poll);
+	if (requests)
+		return run_requests(&st, &cfg, requests, request_window, request_unchecked);
+	if (discovery)
+		return run_discovery(&st, &cfg);
+
+	// Sniffer starts on a quiet bus, from now on every frame must be in its stream
+	memset(&sniffer, 0, sizeof(sniffer));
+	if (capture)
+	{
+		sniffer.out = fopen(capture, "wb");
+		if (!sniffer.out)
+		{
+			perror(capture);
+			return 1;
+		}
+		sniffer.starts = malloc(SNIFFER_MAX_FRAMES * sizeof(int64_t));
+		sniffer.byte_time = 10.0 * 1000000 / baud / SIM_TICK_US * SIM_SUB;
+		sniffer.drift_ppm = cfg.drift_ppm;
+		sniffer.last = sim_now();
+		st.sniffer = &sniffer;
+		sim_call(0, "sim_capture_start", 0, 0, 0);
+	}
+
+	// Every node sends its frames as soon as previous one left (application polls clunet_ready_to_send())
+	int64_t deadline = sim_now() + (int64_t)frames * cfg.nodes * (max_size + 8) * 20 * cfg.t * SIM_SUB;
+	do
+	{
+		busy = 0;
+		for (i = 0; i < cfg.nodes; i++)
+		{
+			if (!left[i])
+				continue;
+			busy = 1;
+			if (sim_ready_to_send(i))
+				continue;
+			uint8_t data[255];
+			int dst;
+			do
+				dst = rng() % cfg.nodes;
+			while (dst == i);
+			const uint8_t size = payload(data, sim_node_id(i), seq[i], 2 + rng() % (max_size - 1));
+			if (sim_send(i, sim_node_id(dst), 1 + rng() % 4, 0x80, data, size))
+			{
+				if (st.verbose)
+					printf("%12.1f us: node %d -> %d seq %u size %u\n", sim_now() * SIM_TICK_US / SIM_SUB, sim_node_id(i), sim_node_id(dst), seq[i], size);
+				seq[i]++;
+				left[i]--;
+				st.sent++;
+			}
+		}
+		sim_run_until(sim_now() + cfg.t * SIM_SUB);
+		if (capture)
+			sniffer_drain(&sniffer);
+	}
+	while (busy && (sim_now() < deadline));
+
+	// Drain
+	if (capture)
+	{
+		const int64_t end = sim_now() + 100000 * SIM_SUB;
+		while (sim_now() < end)
+		{
+			sim_run_until(sim_now() + 125 * SIM_SUB);
+			sniffer_drain(&sniffer);
+		}
+		// Ping after a long idle: sniffer time runs over many timer periods (32-bit extension)
+		sim_send(1, sim_node_id(2), CLUNET_PRIORITY_COMMAND, CLUNET_COMMAND_PING, (const uint8_t*)"idle", 4);
+		// Its records wait for the batch timeout
+		const int64_t ping_end = sim_now() + 20000 * SIM_SUB;
+		while (sim_now() < ping_end)
+		{
+			sim_run_until(sim_now() + 125 * SIM_SUB);
+			sniffer_drain(&sniffer);
+		}
+	}
+	else
+		sim_run_until(sim_now() + 100000 * SIM_SUB);
+	const int64_t elapsed = sim_now();
+	const int64_t busy_time = sim_busy_time();
+
+	printf("nodes %d, sent %u, delivered %u, corrupted %u, arbitration losses %u, windows %u\n",
+		cfg.nodes, st.sent, st.delivered, st.corrupted, st.losses, st.windows);
+	printf("isr calls %llu, resets %u, bus busy %.1f%%\n",
+		(unsigned long long)sim_isr_count(), sim_reset_count(), 100.0 * busy_time / elapsed);
+	const uint32_t results = st.send_results[0] + st.send_results[1] + st.send_results[2] + st.send_results[3];
+	if (results)
+		printf("send results: ok %u, aborted %u, gave up %u, dropped %u\n",
+			st.send_results[0], st.send_results[1], st.send_results[2], st.send_results[3]);
+	const int missing = poll ? poll_stats(&st, cfg.nodes) : 0;
+	int sniffer_failed = 0;
+	if (capture)
+	{
+		sniffer_failed = sniffer_report(&sniffer);
+		fclose(sniffer.out);
+		free(sniffer.starts);
+	}
+	sim_done();
+
+	free(left);
+	free(seq);
+	// Frames which were given up must be reported, every other one delivered
+	if (sniffer_failed || missing)
+		return 1;
+	if (results)
+		return (results == st.sent && st.delivered == st.send_results[0] && !st.corrupted && st.sent == (uint32_t)(frames * cfg.nodes)) ? 0 : 1;
+	return (st.delivered == st.sent && !st.corrupted && st.sent == (uint32_t)(frames * cfg.nodes)) ? 0 : 1;
+}
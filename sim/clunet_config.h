@@ -0,0 +1,112 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+
+/*
+	Configuration of the virtual nodes built by the simulator.
+	Device address is assigned by the simulator on node load.
+*/
+
+#ifndef __CLUNET_CONFIG_H__
+#define __CLUNET_CONFIG_H__
+
+extern unsigned char clunet_sim_device_id;
+
+/* Device address (0-254) */
+#define CLUNET_DEVICE_ID clunet_sim_device_id
+
+/* Device name */
+#define CLUNET_DEVICE_NAME "CLUNET sim node"
+
+/* Buffers sizes (memory usage) */
+#ifndef CLUNET_SEND_BUFFER_SIZE
+#define CLUNET_SEND_BUFFER_SIZE 128
+#endif
+#ifndef CLUNET_READ_BUFFER_SIZE
+#define CLUNET_READ_BUFFER_SIZE 128
+#endif
+#ifndef CLUNET_SEND_QUEUE_SIZE
+#define CLUNET_SEND_QUEUE_SIZE 4
+#endif
+
+/* Deferred receiving, required by clunet_bulk (CLUNET_SIM_DIRECT: frames are handled right in the external ISR) */
+#if !defined(CLUNET_READ_QUEUE_SIZE) && !defined(CLUNET_SIM_DIRECT)
+#define CLUNET_READ_QUEUE_SIZE 3
+#endif
+
+/* Outstanding requests of clunet_request, enough to poll every node at once */
+#define CLUNET_REQUEST_SLOTS 64
+
+/* Answers to a broadcast DISCOVERY are spread over 8 slots */
+#define CLUNET_DISCOVERY_SLOTS 8
+
+/* Command handlers table */
+#define CLUNET_HANDLERS 8
+
+/* Bus statistics counters */
+#define CLUNET_STATS
+
+/* Bus load estimate over 50 ms windows, timer ticks per millisecond of the virtual 8 MHz node */
+#define CLUNET_BUS_LOAD 50
+#define CLUNET_TICKS_PER_MS 125
+
+/* Receive filter */
+#define CLUNET_RECEIVE_FILTER
+
+/* Virtual pin, only port D is simulated */
+#define CLUNET_PORT D
+#define CLUNET_PIN 2
+
+/* T may be overridden from the simulator Makefile (T >= 8 && T <= 24) */
+#ifndef CLUNET_T
+#define CLUNET_T 8
+#endif
+
+/* Virtual 8-bit Timer/Counter */
+
+#define CLUNET_TIMER_INIT {}
+#define CLUNET_TIMER_PRESCALER 64
+#define CLUNET_TIMER_REG clunet_sim_timer()
+#define CLUNET_TIMER_REG_OCR (clunet_sim_io()->ocr)
+#define CLUNET_CLEAR_OCF { clunet_sim_io()->ocf = 0; }
+#define CLUNET_ENABLE_OCI { clunet_sim_io()->ocie = 1; }
+#define CLUNET_DISABLE_OCI { clunet_sim_io()->ocie = 0; }
+#define CLUNET_TIMER_OVERFLOW (clunet_sim_io()->tov)
+#define CLUNET_ENABLE_OVI { clunet_sim_io()->toie = 1; }
+
+/* Virtual external interrupt (any logical change) */
+#define CLUNET_INT_ENABLE { clunet_sim_io()->intf = 0; clunet_sim_io()->inte = 1; }
+#define CLUNET_INT_DISABLE { clunet_sim_io()->inte = 0; }
+#ifndef CLUNET_SIM_CAPTURE
+#define CLUNET_INT_INIT CLUNET_INT_ENABLE
+#else
+/* Virtual input capture unit instead (clunet-node-icp.so): edges are timestamped at the line change */
+#define CLUNET_INT_INIT { clunet_sim_io()->capture = 1; clunet_sim_io()->ices = CLUNET_READING ? 1 : 0; CLUNET_INT_ENABLE; }
+#define CLUNET_INT_CAPTURE_REG (clunet_sim_io()->icr)
+#define CLUNET_INT_CAPTURE_FRONT (clunet_sim_io()->ices)
+#define CLUNET_INT_CAPTURE_NEXT { clunet_sim_io()->ices ^= 1; clunet_sim_io()->intf = 0; }
+#endif
+
+/* Interrupt vectors (function names exported to the simulator) */
+#define CLUNET_TIMER_COMP_VECTOR clunet_sim_timer_comp_vect
+#define CLUNET_INT_VECTOR clunet_sim_int_vect
+#define CLUNET_TIMER_OVF_VECTOR clunet_sim_timer_ovf_vect
+
+#endif
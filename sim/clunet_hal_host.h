@@ -0,0 +1,91 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	Host port of the CLUNET hardware abstraction layer.
+	Every virtual node is a separate copy of clunet.c loaded by the simulator,
+	the "hardware" below always belongs to the node that is executing right now.
+*/
+
+#ifndef __CLUNET_HAL_HOST_H__
+#define __CLUNET_HAL_HOST_H__
+
+#include <stdint.h>
+
+/* Simulated MCU of the currently executing node */
+struct clunet_sim_io
+{
+	uint8_t ddr;	// Data direction of clunet port (pin is output - line pulled down)
+	uint8_t port;	// Output register of clunet port
+	uint8_t ocr;	// Output compare register
+	uint8_t ocie;	// Output compare interrupt enabled
+	uint8_t ocf;	// Output compare flag
+	uint8_t toie;	// Timer overflow interrupt enabled
+	uint8_t tov;	// Timer overflow flag
+	uint8_t inte;	// External interrupt enabled
+	uint8_t intf;	// External interrupt flag
+	uint8_t capture;	// External interrupt is input capture: only ices edge sets intf and latches icr
+	uint8_t ices;	// Input capture edge select (1 - rising edge, line released)
+	uint8_t icr;	// Input capture register (timer value of the edge)
+	uint8_t sreg_i;	// Global interrupt flag
+	uint8_t mcusr;	// Reset reason
+};
+
+/* Implemented by the simulator engine */
+struct clunet_sim_io* clunet_sim_io(void);
+uint8_t clunet_sim_timer(void);
+uint8_t clunet_sim_pin(void);
+void clunet_sim_reset(void);
+
+/* Non-volatile memory of the node (flash and EEPROM): erased (0xFF) at power-on, kept over watchdog resets */
+#define CLUNET_SIM_NVM_SIZE 0x10000
+uint8_t* clunet_sim_nvm(void);
+
+/* Interrupt service routines are plain functions looked up by the engine */
+#define ISR(vector) void vector(void)
+
+#define cli() { clunet_sim_io()->sreg_i = 0; }
+#define sei() { clunet_sim_io()->sreg_i = 1; }
+
+#define SREG (clunet_sim_io()->sreg_i)
+#define MCUSR (clunet_sim_io()->mcusr)
+
+/* Watchdog is used only for reboot: the engine reloads the node */
+#define WDTO_15MS 0
+#define wdt_enable(timeout) clunet_sim_reset()
+#define wdt_disable()
+
+/* Same as avr-libc <util/crc16.h> */
+static inline uint8_t
+_crc_ibutton_update(uint8_t crc, uint8_t data)
+{
+	uint8_t i;
+	crc ^= data;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 1) ? ((crc >> 1) ^ 0x8C) : (crc >> 1);
+	return crc;
+}
+
+/* Only the port used by clunet pin is simulated, other bits are don't care */
+#define DDRD (clunet_sim_io()->ddr)
+#define PORTD (clunet_sim_io()->port)
+#define PIND clunet_sim_pin()
+
+#endif
@@ -0,0 +1,15 @@
+# Traffic of profiles/saturation.profile with priority aging: low priorities get a bounded tail latency
+node_library = ./clunet-node-age.so
+nodes = 16
+priorities = 1:25,2:25,3:25,4:25
+size_min = 2
+size_max = 16
+load = 1.3
+duration_ms = 3000
+
+# Promoted frames stop at CLUNET_PRIORITY_MESSAGE, commands keep their latency.
+# Full queue refuses a frame of the same priority, so an accepted priority 2 frame waits instead of being replaced
+gate_min_fps = 100
+gate_max_p99_us.1 = 1500000
+gate_max_p99_us.2 = 2000000
+gate_max_p99_us.4 = 60000
@@ -0,0 +1,11 @@
+# Few nodes moving large blocks (firmware update like traffic)
+nodes = 4
+priorities = 1:5,2:90,4:5
+size_min = 24
+size_max = 40
+load = 0.7
+duration_ms = 4000
+
+gate_min_fps = 30
+gate_min_delivery = 0.95
+gate_max_p99_us.4 = 60000
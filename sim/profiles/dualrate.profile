@@ -0,0 +1,13 @@
+# Bulk traffic of profiles/bulk.profile with dual-rate frames (CLUNET_T_DATA = T / 2)
+node_library = ./clunet-node-dr.so
+t_data = 4
+nodes = 4
+priorities = 1:5,2:90,4:5
+size_min = 24
+size_max = 40
+load = 0.7
+duration_ms = 4000
+
+gate_min_fps = 50
+gate_min_delivery = 0.95
+gate_max_p99_us.4 = 40000
@@ -0,0 +1,14 @@
+# Equal priority senders above bus capacity with fair arbitration (without it the lowest source
+# address wins every tie: node_library=./clunet-node.so gives fairness 0.70 and 1.7 s stalls)
+node_library = ./clunet-node-fair.so
+nodes = 8
+priorities = 3:100
+size_min = 8
+size_max = 8
+load = 1.5
+duration_ms = 3000
+
+# Every node gets its turn once per fairness interval, the wait grows with the number of contenders
+gate_min_fps = 110
+gate_min_fairness = 0.95
+gate_max_p99_us.3 = 400000
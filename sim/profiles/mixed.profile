@@ -0,0 +1,14 @@
+# Typical home bus: every priority, small and medium payloads
+nodes = 16
+priorities = 1:25,2:35,3:30,4:10
+size_min = 2
+size_max = 32
+load = 0.6
+broadcast = 0.05
+duration_ms = 3000
+
+gate_min_fps = 40
+gate_min_delivery = 0.99
+gate_max_losses = 2
+gate_max_p99_us.1 = 250000
+gate_max_p99_us.4 = 60000
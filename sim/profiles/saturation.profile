@@ -0,0 +1,12 @@
+# Offered load above bus capacity: throughput ceiling and priority isolation
+nodes = 16
+priorities = 1:25,2:25,3:25,4:25
+size_min = 2
+size_max = 16
+load = 1.3
+duration_ms = 3000
+
+# Bus must stay busy and the highest priority must not starve
+gate_min_fps = 100
+gate_max_p99_us.3 = 250000
+gate_max_p99_us.4 = 60000
@@ -0,0 +1,15 @@
+# Traffic of profiles/saturation.profile, priority 1-2 frames of every node go through the shaper
+node_library = ./clunet-node-shp.so
+nodes = 16
+priorities = 1:25,2:25,3:25,4:25
+size_min = 2
+size_max = 16
+load = 1.3
+duration_ms = 3000
+
+# Sensors back off before the bus saturates: accepted frames are delivered, fewer losses, shorter message latency
+gate_min_fps = 100
+gate_min_delivery = 0.97
+gate_max_losses = 8
+gate_max_p99_us.3 = 90000
+gate_max_p99_us.4 = 60000
@@ -0,0 +1,13 @@
+# Many sensors sending small low priority reports, moderate load
+nodes = 32
+priorities = 1:60,2:30,3:8,4:2
+size_min = 2
+size_max = 8
+load = 0.4
+duration_ms = 3000
+
+gate_min_fps = 48
+gate_min_delivery = 0.99
+gate_max_losses = 2
+gate_max_p99_us.1 = 80000
+gate_max_p99_us.4 = 30000
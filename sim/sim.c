@@ -0,0 +1,682 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+#include "sim.h"
+#include "clunet_hal_host.h"
+
+#include <dlfcn.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NEVER INT64_MAX
+#define RESET_DELAY (100 * SIM_SUB) // Watchdog timeout and startup time (ticks)
+#define WDRF 0x08
+
+struct node
+{
+	struct clunet_sim_io io;
+	uint8_t id;
+	uint8_t driving;		// Line pulled by this node
+	uint8_t alive;			// Node code is loaded and initialized
+	char path[96];			// Private copy of node library
+	void* dl;
+	void (*init)(uint8_t id, uint8_t sniff);
+	void (*loop)(void);
+	uint8_t (*send)(uint8_t address, uint8_t prio, uint8_t command, const char* data, uint8_t size);
+	uint8_t (*ready_to_send)(void);
+	void (*timer_comp_vect)(void);
+	void (*int_vect)(void);
+	void (*timer_ovf_vect)(void);	// Optional (CLUNET_CAPTURE)
+	int64_t phase;			// Time of timer zero count
+	int64_t period;			// Timer tick duration
+	int64_t match_time;		// Time of next output compare match
+	uint8_t match_ocr;		// OCR value match_time was calculated for
+	int64_t overflow_time;		// Time of next timer wrap while overflow interrupt is enabled
+	int64_t ready_time;		// Time when interrupt became pending (-1: nothing pending)
+	int64_t busy_until;		// CPU is executing ISR until this time
+	int64_t reset_time;		// Time of restart after watchdog reset
+	uint8_t* nvm;			// Non-volatile memory (allocated on first use)
+};
+
+static struct sim_config cfg;
+static struct sim_hooks hooks;
+static struct node nodes[SIM_MAX_NODES];
+static struct node* current;
+static jmp_buf reset_jump;
+static char workdir[64];
+
+static int64_t now;
+static int drivers;
+static uint64_t isr_count;
+static uint32_t reset_count;
+
+/* Bus activity window tracking */
+static uint8_t window_active;
+static int64_t window_start, window_end, busy_time;
+static uint8_t window_drivers[SIM_MAX_NODES];
+static int window_winner;
+
+static uint32_t rng_state;
+
+static uint32_t
+rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+/* HAL hooks for the currently executing node */
+
+struct clunet_sim_io*
+clunet_sim_io(void)
+{
+	return &current->io;
+}
+
+static uint8_t
+node_timer(const struct node* n)
+{
+	return (uint8_t)((now - n->phase) / n->period);
+}
+
+uint8_t
+clunet_sim_timer(void)
+{
+	return node_timer(current);
+}
+
+uint8_t
+clunet_sim_pin(void)
+{
+	// Count our own not yet published driver change too
+	int low = drivers - current->driving + (current->io.ddr ? 1 : 0);
+	return low ? 0 : 0xFF;
+}
+
+uint8_t*
+clunet_sim_nvm(void)
+{
+	if (!current->nvm)
+	{
+		current->nvm = malloc(CLUNET_SIM_NVM_SIZE);
+		if (!current->nvm)
+			exit(1);
+		memset(current->nvm, 0xFF, CLUNET_SIM_NVM_SIZE);
+	}
+	return current->nvm;
+}
+
+void
+clunet_sim_reset(void)
+{
+	longjmp(reset_jump, 1);
+}
+
+/* Engine */
+
+static int
+pending(const struct node* n)
+{
+	return n->alive && n->io.sreg_i && ((n->io.intf && n->io.inte) || (n->io.ocf && n->io.ocie) || (n->io.tov && n->io.toie));
+}
+
+static void
+update_match(struct node* n)
+{
+	const int64_t count = (now - n->phase) / n->period;
+	uint32_t delta = (uint8_t)(n->io.ocr - (uint8_t)count);
+	if (!delta)
+		delta = 256;
+	n->match_time = n->phase + (count + delta) * n->period;
+	n->match_ocr = n->io.ocr;
+}
+
+/* Timer wraps are events only for nodes which enabled the overflow interrupt */
+static void
+update_overflow(struct node* n)
+{
+	if (!n->io.toie || !n->timer_ovf_vect)
+		n->overflow_time = NEVER;
+	else if (n->overflow_time == NEVER)
+		n->overflow_time = n->phase + (((now - n->phase) / n->period) / 256 + 1) * 256 * n->period;
+}
+
+static void
+update_pending(struct node* n)
+{
+	if (pending(n))
+	{
+		if (n->ready_time < 0)
+			n->ready_time = now;
+	}
+	else
+		n->ready_time = -1;
+}
+
+static void
+window_close(void)
+{
+	if (!window_active)
+		return;
+	window_active = 0;
+	busy_time += window_end - window_start;
+	if (hooks.window)
+		hooks.window(hooks.ctx, window_start, window_end, window_drivers, window_winner);
+}
+
+/* Publish line state of node after its code has been executed */
+static void
+update_line(struct node* n)
+{
+	const uint8_t driving = n->io.ddr ? 1 : 0;
+	if (driving == n->driving)
+		return;
+
+	const int was_low = drivers;
+	n->driving = driving;
+	drivers += driving ? 1 : -1;
+
+	// Frame starts after the interframe gap, its first driver belongs to the new window
+	if (driving && !was_low && (!window_active || (now - window_end >= 7 * cfg.t * SIM_SUB)))
+	{
+		window_close();
+		window_active = 1;
+		window_start = now;
+		memset(window_drivers, 0, sizeof(window_drivers));
+	}
+
+	// Losers release the line, so the last node which pulled it is the winner
+	if (driving)
+	{
+		window_drivers[n - nodes] = 1;
+		window_winner = n - nodes;
+	}
+
+	// Wired-AND: edge only when the first node pulls or the last node releases the line
+	if (!was_low == !drivers)
+		return;
+
+	if (!drivers)
+		window_end = now;
+
+	int i;
+	for (i = 0; i < cfg.nodes; i++)
+	{
+		struct node* m = &nodes[i];
+		// Input capture latches the timer at the edge, when the edge matches its edge select
+		if (m->io.capture)
+		{
+			if (m->io.ices != !drivers)
+				continue;
+			m->io.icr = node_timer(m);
+		}
+		m->io.intf = 1;
+		update_pending(m);
+	}
+}
+
+static void
+node_after_call(struct node* n)
+{
+	if (n->io.ocr != n->match_ocr)
+		update_match(n);
+	update_overflow(n);
+	update_line(n);
+	update_pending(n);
+}
+
+static void
+node_reset(struct node* n)
+{
+	n->alive = 0;
+	n->io.ddr = 0;
+	update_line(n);
+	n->io.ocie = n->io.inte = n->io.toie = n->io.sreg_i = 0;
+	n->overflow_time = NEVER;
+	n->ready_time = -1;
+	n->reset_time = now + RESET_DELAY;
+	reset_count++;
+}
+
+static int
+node_load(struct node* n)
+{
+	if (n->dl)
+		dlclose(n->dl);
+	n->dl = dlopen(n->path, RTLD_NOW | RTLD_LOCAL);
+	if (!n->dl)
+	{
+		fprintf(stderr, "sim: %s\n", dlerror());
+		return -1;
+	}
+	n->init = (void (*)(uint8_t, uint8_t))dlsym(n->dl, "sim_node_init");
+	n->loop = (void (*)(void))dlsym(n->dl, "sim_node_loop");
+	n->send = (uint8_t (*)(uint8_t, uint8_t, uint8_t, const char*, uint8_t))dlsym(n->dl, "sim_node_send");
+	n->ready_to_send = (uint8_t (*)(void))dlsym(n->dl, "sim_node_ready_to_send");
+	n->timer_comp_vect = (void (*)(void))dlsym(n->dl, "clunet_sim_timer_comp_vect");
+	n->int_vect = (void (*)(void))dlsym(n->dl, "clunet_sim_int_vect");
+	n->timer_ovf_vect = (void (*)(void))dlsym(n->dl, "clunet_sim_timer_ovf_vect");
+	if (!n->init || !n->loop || !n->send || !n->ready_to_send || !n->timer_comp_vect || !n->int_vect)
+	{
+		fprintf(stderr, "sim: %s: missing node entry points\n", n->path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Power-on or watchdog start of node */
+static void
+node_start(struct node* n)
+{
+	const uint8_t restart = n->reset_time != 0;
+	memset(&n->io, 0, sizeof(n->io));
+	n->io.mcusr = restart ? WDRF : 0;
+	n->driving = 0;
+	n->reset_time = NEVER;
+	n->busy_until = now;
+	n->alive = 1;
+	// Fresh copy of static data after watchdog reset
+	if (restart && node_load(n))
+		exit(1);
+	current = n;
+	if (!setjmp(reset_jump))
+		n->init(n->id, hooks.sniffed != 0);
+	else
+		node_reset(n);
+	current = 0;
+	node_after_call(n);
+}
+
+static void
+node_isr(struct node* n)
+{
+	current = n;
+	n->io.sreg_i = 0;
+	isr_count++;
+	if (!setjmp(reset_jump))
+	{
+		// External interrupt has higher priority (lower vector number)
+		if (n->io.intf && n->io.inte)
+		{
+			n->io.intf = 0;
+			n->int_vect();
+		}
+		else if (n->io.ocf && n->io.ocie)
+		{
+			n->io.ocf = 0;
+			n->timer_comp_vect();
+		}
+		else
+		{
+			n->io.tov = 0;
+			n->timer_ovf_vect();
+		}
+		n->io.sreg_i = 1;
+		n->busy_until = now + cfg.cost;
+		n->ready_time = -1;
+		node_after_call(n);
+		if (!pending(n))
+		{
+			n->loop();
+			node_after_call(n);
+		}
+	}
+	else
+		node_reset(n);
+	current = 0;
+}
+
+int
+sim_init(const struct sim_config* config, const struct sim_hooks* h)
+{
+	cfg = *config;
+	if (h)
+		hooks = *h;
+	if ((cfg.nodes < 1) || (cfg.nodes > SIM_MAX_NODES) || ((int)cfg.first_id + cfg.nodes > 255))
+	{
+		fprintf(stderr, "sim: invalid number of nodes\n");
+		return -1;
+	}
+
+	strcpy(workdir, "/tmp/clunet-sim-XXXXXX");
+	if (!mkdtemp(workdir))
+	{
+		perror("sim: mkdtemp");
+		return -1;
+	}
+
+	FILE* src = fopen(cfg.node_library, "rb");
+	if (!src)
+	{
+		perror(cfg.node_library);
+		return -1;
+	}
+	fseek(src, 0, SEEK_END);
+	const long size = ftell(src);
+	rewind(src);
+	char* image = malloc(size);
+	if (!image || (fread(image, 1, size, src) != (size_t)size))
+	{
+		fclose(src);
+		free(image);
+		return -1;
+	}
+	fclose(src);
+
+	rng_state = cfg.seed ? cfg.seed : 1;
+	now = 0;
+	drivers = 0;
+	isr_count = reset_count = 0;
+	busy_time = 0;
+	window_active = 0;
+
+	int i;
+	memset(nodes, 0, sizeof(nodes));
+	for (i = 0; i < cfg.nodes; i++)
+	{
+		struct node* n = &nodes[i];
+		// dlopen() loads a library only once, so every node gets its own copy
+		snprintf(n->path, sizeof(n->path), "%s/node%d.so", workdir, i);
+		FILE* dst = fopen(n->path, "wb");
+		if (!dst || (fwrite(image, 1, size, dst) != (size_t)size))
+		{
+			perror(n->path);
+			if (dst)
+				fclose(dst);
+			free(image);
+			return -1;
+		}
+		fclose(dst);
+		if (node_load(n))
+		{
+			free(image);
+			return -1;
+		}
+
+		n->id = cfg.first_id + i;
+		n->period = SIM_SUB;
+		if (cfg.drift_ppm)
+			n->period += (int64_t)SIM_SUB * ((int32_t)(rng() % (2 * cfg.drift_ppm + 1)) - cfg.drift_ppm) / 1000000;
+		n->phase = -(int64_t)(rng() % (256 * SIM_SUB));
+		n->ready_time = -1;
+		n->reset_time = 0;
+		n->match_ocr = 0;
+		n->match_time = NEVER;
+		n->overflow_time = NEVER;
+	}
+	free(image);
+
+	for (i = 0; i < cfg.nodes; i++)
+	{
+		nodes[i].match_ocr = ~nodes[i].io.ocr;
+		node_start(&nodes[i]);
+	}
+	return 0;
+}
+
+void
+sim_done(void)
+{
+	int i;
+	window_close();
+	for (i = 0; i < cfg.nodes; i++)
+	{
+		if (nodes[i].dl)
+			dlclose(nodes[i].dl);
+		nodes[i].dl = 0;
+		free(nodes[i].nvm);
+		nodes[i].nvm = 0;
+		unlink(nodes[i].path);
+	}
+	rmdir(workdir);
+}
+
+int64_t
+sim_now(void)
+{
+	return now;
+}
+
+void
+sim_run_until(int64_t until)
+{
+	while (1)
+	{
+		int64_t best = until;
+		struct node* next = 0;
+		int kind = 0;
+		int i;
+
+		// Ordered by time, then output compare matches, timer wraps, resets and interrupts, then node index
+		for (i = 0; i < cfg.nodes; i++)
+		{
+			struct node* n = &nodes[i];
+			if (n->match_time < best)
+			{
+				best = n->match_time;
+				next = n;
+				kind = 0;
+			}
+		}
+		for (i = 0; i < cfg.nodes; i++)
+		{
+			struct node* n = &nodes[i];
+			if (n->overflow_time < best)
+			{
+				best = n->overflow_time;
+				next = n;
+				kind = 3;
+			}
+		}
+		for (i = 0; i < cfg.nodes; i++)
+		{
+			struct node* n = &nodes[i];
+			if (n->reset_time < best)
+			{
+				best = n->reset_time;
+				next = n;
+				kind = 1;
+			}
+		}
+		for (i = 0; i < cfg.nodes; i++)
+		{
+			struct node* n = &nodes[i];
+			if (n->ready_time >= 0)
+			{
+				int64_t t = n->ready_time + cfg.latency;
+				if (t < n->busy_until)
+					t = n->busy_until;
+				if (t < best)
+				{
+					best = t;
+					next = n;
+					kind = 2;
+				}
+			}
+		}
+
+		if (!next)
+			break;
+
+		now = best;
+		switch (kind)
+		{
+			case 0:
+				next->io.ocf = 1;
+				update_match(next);
+				update_pending(next);
+				break;
+			case 1:
+				node_start(next);
+				break;
+			case 2:
+				node_isr(next);
+				break;
+			case 3:
+				next->io.tov = 1;
+				next->overflow_time += 256 * next->period;
+				update_pending(next);
+				break;
+		}
+	}
+	now = until;
+	// Bus is quiet: report the last window now, not on the next activity
+	if (window_active && !sim_bus_reading() && (now - window_end >= 7 * cfg.t * SIM_SUB))
+		window_close();
+}
+
+uint8_t
+sim_send(int node, uint8_t address, uint8_t prio, uint8_t command, const void* data, uint8_t size)
+{
+	struct node* n = &nodes[node];
+	volatile uint8_t result = 0;
+	if (!n->alive)
+		return 0;
+	current = n;
+	if (!setjmp(reset_jump))
+	{
+		result = n->send(address, prio, command, (const char*)data, size);
+		node_after_call(n);
+	}
+	else
+		node_reset(n);
+	current = 0;
+	return result;
+}
+
+uint8_t
+sim_ready_to_send(int node)
+{
+	struct node* n = &nodes[node];
+	uint8_t result;
+	if (!n->alive)
+		return 0;
+	current = n;
+	result = n->ready_to_send();
+	current = 0;
+	return result;
+}
+
+void
+sim_poll(int node)
+{
+	struct node* n = &nodes[node];
+	if (!n->alive)
+		return;
+	current = n;
+	if (!setjmp(reset_jump))
+	{
+		n->loop();
+		node_after_call(n);
+	}
+	else
+		node_reset(n);
+	current = 0;
+}
+
+uint32_t
+sim_call(int node, const char* symbol, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+{
+	struct node* n = &nodes[node];
+	volatile uint32_t result = 0;
+	uint32_t (*f)(uint32_t, uint32_t, uint32_t);
+	if (!n->alive)
+		return 0;
+	f = (uint32_t (*)(uint32_t, uint32_t, uint32_t))dlsym(n->dl, symbol);
+	if (!f)
+	{
+		fprintf(stderr, "sim: %s: missing node entry point %s\n", n->path, symbol);
+		exit(1);
+	}
+	current = n;
+	if (!setjmp(reset_jump))
+	{
+		result = f(arg0, arg1, arg2);
+		node_after_call(n);
+	}
+	else
+		node_reset(n);
+	current = 0;
+	return result;
+}
+
+void
+sim_reset(int node)
+{
+	if (nodes[node].alive)
+		node_reset(&nodes[node]);
+}
+
+int
+sim_node_by_id(uint8_t id)
+{
+	if ((id < cfg.first_id) || (id >= cfg.first_id + cfg.nodes))
+		return -1;
+	return id - cfg.first_id;
+}
+
+uint8_t
+sim_node_id(int node)
+{
+	return nodes[node].id;
+}
+
+uint64_t
+sim_isr_count(void)
+{
+	return isr_count;
+}
+
+uint32_t
+sim_reset_count(void)
+{
+	return reset_count;
+}
+
+uint8_t
+sim_bus_reading(void)
+{
+	return drivers != 0;
+}
+
+int64_t
+sim_busy_time(void)
+{
+	return busy_time;
+}
+
+void
+sim_node_received(uint8_t src, uint8_t cmd, const char* data, uint8_t size)
+{
+	if (hooks.received)
+		hooks.received(hooks.ctx, current - nodes, src, cmd, (const uint8_t*)data, size);
+}
+
+void
+sim_node_sniffed(uint8_t src, uint8_t dst, uint8_t cmd, const char* data, uint8_t size)
+{
+	if (hooks.sniffed)
+		hooks.sniffed(hooks.ctx, current - nodes, src, dst, cmd, (const uint8_t*)data, size);
+}
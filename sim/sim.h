@@ -0,0 +1,115 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	Deterministic discrete-time simulator of the CLUNET wired-AND bus.
+
+	Every node is an unchanged copy of clunet.c (plus sim_node.c glue) loaded from
+	a shared object, so all static state of the library is private to the node.
+	Each node has its own virtual 8-bit timer (with optional clock drift), output
+	compare unit, external interrupt and global interrupt flag. Interrupt service
+	routines are executed atomically, honouring the configured entry latency and
+	execution cost, in a strictly reproducible order.
+
+	Simulation time is measured in "sub-ticks": SIM_SUB sub-ticks are one nominal
+	timer tick (one CLUNET_TIMER_PRESCALER period of F_CPU).
+*/
+
+#ifndef __CLUNET_SIM_H__
+#define __CLUNET_SIM_H__
+
+#include <stdint.h>
+
+#define SIM_SUB 1024
+#define SIM_TICK_US 8.0 // Nominal tick of virtual nodes: 8 MHz, prescaler 64
+#define SIM_MAX_NODES 128
+#define SIM_MS ((int64_t)(1000 / SIM_TICK_US * SIM_SUB)) // Sub-ticks in one millisecond
+
+/* Simulator engine configuration */
+struct sim_config
+{
+	const char* node_library;	// Path to the node shared object
+	int nodes;			// Number of nodes (1..SIM_MAX_NODES)
+	uint8_t first_id;		// Address of the first node, others follow
+	int latency;			// ISR entry latency (sub-ticks)
+	int cost;			// ISR execution time (sub-ticks)
+	int drift_ppm;			// Maximum clock deviation of nodes (+/- ppm)
+	int t;				// CLUNET_T the nodes were built with (ticks)
+	uint32_t seed;			// Seed of clock phases and drifts
+};
+
+/* Observer callbacks (all optional) */
+struct sim_hooks
+{
+	void* ctx;
+	// Frame delivered to node by clunet_set_on_data_received()
+	void (*received)(void* ctx, int node, uint8_t src, uint8_t cmd, const uint8_t* data, uint8_t size);
+	// Frame seen by node sniffer
+	void (*sniffed)(void* ctx, int node, uint8_t src, uint8_t dst, uint8_t cmd, const uint8_t* data, uint8_t size);
+	// Bus activity window closed: [start, end) busy time, nodes which pulled line and the winner (the last one which pulled it)
+	void (*window)(void* ctx, int64_t start, int64_t end, const uint8_t* drivers, int winner);
+};
+
+int sim_init(const struct sim_config* config, const struct sim_hooks* hooks);
+void sim_done(void);
+
+// Current time (sub-ticks)
+int64_t sim_now(void);
+
+// Process all events strictly before time 'until' and advance clock to it
+void sim_run_until(int64_t until);
+
+// Main context calls on behalf of node application
+uint8_t sim_send(int node, uint8_t address, uint8_t prio, uint8_t command, const void* data, uint8_t size);
+uint8_t sim_ready_to_send(int node);
+
+// Main loop iteration of node (application timers), it also runs after every interrupt
+void sim_poll(int node);
+
+// Call node entry point "uint32_t symbol(uint32_t, uint32_t, uint32_t)" exported by the node library
+uint32_t sim_call(int node, const char* symbol, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+
+// Watchdog reset of node (it restarts after the reset delay, NVM is kept)
+void sim_reset(int node);
+
+// Node index by device address (-1 if absent)
+int sim_node_by_id(uint8_t id);
+uint8_t sim_node_id(int node);
+
+// Number of executed interrupts and node resets
+uint64_t sim_isr_count(void);
+uint32_t sim_reset_count(void);
+
+// Bus state
+uint8_t sim_bus_reading(void);
+int64_t sim_busy_time(void);
+
+/* Pseudo commands reported by sim_node.c through received hook (source is the reporting node for SENT) */
+#define SIM_BULK_SENT 0x81	// Data: result
+#define SIM_BULK_RECEIVED 0x82	// Data: length (4 bytes LE), number of wrong bytes (4 bytes LE)
+#define SIM_REQUEST_DONE 0x83	// Data: request result or SIM_REQUEST_WRONG (source is the requested node)
+#define SIM_REQUEST_WRONG 0xFF
+#define SIM_SEND_DONE 0x84	// Data: command, send result (source is the destination of the frame)
+
+/* Called by sim_node.c from inside a node */
+void sim_node_received(uint8_t src, uint8_t cmd, const char* data, uint8_t size);
+void sim_node_sniffed(uint8_t src, uint8_t dst, uint8_t cmd, const char* data, uint8_t size);
+
+#endif
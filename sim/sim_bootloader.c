@@ -0,0 +1,422 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	Bootloader stand-in for virtual nodes.
+
+	Answers the CLUNET_COMMAND_BOOT_CONTROL subcommands of demo_project/clunet_bootloader on top of
+	clunet.c, so host flashers can be tested end to end. Application flash and bootloader "fuses"
+	live in the node non-volatile memory and survive CLUNET_COMMAND_REBOOT.
+
+	Timing of the real bootloader is modelled where it shows on the bus: a stop-and-wait WRITE is
+	confirmed after erase and write time, and a multicast page keeps the bootloader deaf while
+	the page is being erased (it has no ACK to hide that time behind). Besides, a configured
+	percentage of pages is dropped as if the frame was corrupted.
+*/
+
+#include "clunet.h"
+#include "clunet_hal_host.h"
+#include "sim.h"
+#include "sim_bootloader.h"
+#include "clunet_bootloader.h"
+
+#include <string.h>
+
+#define BOOT_MAGIC 0xB007
+#define BOOT_ATTEMPTS 5		// START attempts before the application is started
+#define BOOT_TIMEOUT 1000	// Waiting for INIT after START (ms)
+#define BOOT_ERASE_TIME 4500	// Page erase (us)
+#define BOOT_BYTE_TIME 12	// Multicast page processing before the erase, per byte (us)
+#define BOOT_WRITE_TIME 9000	// Page erase and write (us)
+#define BOOT_MAX_PAGE 128
+
+/* Bootloader "fuses" at the end of non-volatile memory */
+struct boot_fuses
+{
+	uint16_t magic;
+	uint8_t page_size;
+	uint8_t loss;		// Percent of page frames dropped
+	uint8_t run_app;	// Start application on the next reset (jump to application)
+	uint32_t app_size;
+};
+
+#define FUSES ((struct boot_fuses*)(clunet_sim_nvm() + CLUNET_SIM_NVM_SIZE - sizeof(struct boot_fuses)))
+#define FLASH clunet_sim_nvm()
+
+enum { BOOT_NONE, BOOT_WAIT, BOOT_UPDATE };
+
+static uint8_t mode;
+static uint8_t forward_sniff;	// Engine observes sniffed frames
+static uint8_t attempts;
+static uint32_t deadline;
+static uint8_t flasher;
+static uint32_t expected;
+static uint32_t busy_until;	// us
+static uint8_t written_pending;
+static uint32_t rng_state;
+static uint8_t received_pages[CLUNET_SIM_NVM_SIZE / 32 / 8];
+
+static uint32_t
+now_ms(void)
+{
+	return (uint32_t)(sim_now() / SIM_MS);
+}
+
+static uint32_t
+now_us(void)
+{
+	return (uint32_t)(sim_now() * 1000 / SIM_MS);
+}
+
+static uint8_t
+lost(void)
+{
+	rng_state = rng_state * 1103515245 + 12345;
+	return ((rng_state >> 16) % 100) < FUSES->loss;
+}
+
+static uint16_t
+crc16_update(uint16_t crc, uint8_t data)
+{
+	uint8_t i;
+	crc ^= data;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 1) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+	return crc;
+}
+
+static uint16_t
+flash_crc(uint32_t address, uint32_t size)
+{
+	uint16_t crc = 0xFFFF;
+	while (size--)
+		crc = crc16_update(crc, FLASH[address++]);
+	return crc;
+}
+
+static void
+put32(uint8_t* p, uint32_t value)
+{
+	uint8_t i;
+	for (i = 0; i < 4; i++)
+		p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint32_t
+get32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void
+reply(const uint8_t* data, uint8_t size)
+{
+	clunet_send(flasher, BOOT_CONTROL_PRIORITY, CLUNET_COMMAND_BOOT_CONTROL, (const char*)data, size);
+}
+
+/* Same RLE as clunet_bootloader.c, returns 0 on success */
+static uint8_t
+rle_decode(const uint8_t* src, uint8_t size, uint8_t* page, uint8_t page_size)
+{
+	uint8_t out = 0;
+	while (size)
+	{
+		uint8_t n = *src++;
+		const uint8_t literal = (n < 128);
+		n = literal ? n + 1 : n - 126;
+		if (--size < (literal ? n : 1) || n > page_size - out)
+			return 1;
+		size -= literal ? n : 1;
+		do
+		{
+			page[out++] = *src;
+			src += literal;
+		}
+		while (--n);
+		src += !literal;
+	}
+	return out != page_size;
+}
+
+static void
+write_page(uint32_t address, const uint8_t* data)
+{
+	const uint8_t page_size = FUSES->page_size;
+	if (address + page_size <= FUSES->app_size)
+		memcpy(FLASH + address, data, page_size);
+}
+
+/* Restart into the application, as jump_to_app() after the reset would do */
+static void
+start_app(void)
+{
+	FUSES->run_app = 1;
+	clunet_sim_reset();
+}
+
+static void
+start_update(uint8_t address)
+{
+	const uint8_t ready[2] = { COMMAND_FIRMWARE_UPDATE_READY, FUSES->page_size };
+	flasher = address;
+	mode = BOOT_UPDATE;
+	expected = 0;
+	memset(received_pages, 0, sizeof(received_pages));
+	reply(ready, sizeof(ready));
+}
+
+static void
+page_crc(const uint8_t* data, uint8_t size)
+{
+	uint8_t answer[5 + 2 * CRC_QUERY_MAX];
+	uint32_t address;
+	uint8_t count, i;
+	if (size < 6)
+		return;
+	address = get32(data + 1);
+	count = (data[5] > CRC_QUERY_MAX) ? CRC_QUERY_MAX : data[5];
+	answer[0] = COMMAND_FIRMWARE_UPDATE_CRC_REPLY;
+	put32(answer + 1, address);
+	for (i = 0; i < count; i++, address += FUSES->page_size)
+	{
+		const uint16_t crc = (address + FUSES->page_size <= CLUNET_SIM_NVM_SIZE) ? flash_crc(address, FUSES->page_size) : 0;
+		answer[5 + 2 * i] = (uint8_t)crc;
+		answer[6 + 2 * i] = (uint8_t)(crc >> 8);
+	}
+	reply(answer, 5 + 2 * count);
+}
+
+static void
+missing_pages(const uint8_t* data, uint8_t size, uint8_t broadcast)
+{
+	uint8_t answer[3 + STATUS_QUERY_MAX / 8];
+	const uint32_t pages = FUSES->app_size / FUSES->page_size;
+	uint16_t index;
+	uint8_t count, i, missing = !broadcast;
+	if (size < 4)
+		return;
+	index = data[1] | (data[2] << 8);
+	count = (data[3] > STATUS_QUERY_MAX) ? STATUS_QUERY_MAX : data[3];
+	memset(answer, 0, sizeof(answer));
+	answer[0] = COMMAND_FIRMWARE_UPDATE_MISSING;
+	answer[1] = data[1];
+	answer[2] = data[2];
+	for (i = 0; i < count; i++, index++)
+	{
+		if ((index < pages) && !(received_pages[index >> 3] & (1 << (index & 7))))
+		{
+			answer[3 + (i >> 3)] |= 1 << (i & 7);
+			missing = 1;
+		}
+	}
+	if (missing)
+		reply(answer, 3 + (count + 7) / 8);
+}
+
+static void
+stream_page(uint8_t sub, const uint8_t* data, uint8_t size, uint8_t broadcast)
+{
+	const uint8_t page_size = FUSES->page_size;
+	const uint8_t data_size = size - 5;
+	uint8_t page[BOOT_MAX_PAGE];
+	const uint8_t* content = data + 5;
+	const uint32_t address = get32(data + 1);
+	uint8_t answer[5];
+
+	if (sub == COMMAND_FIRMWARE_UPDATE_STREAM_RLE)
+		content = rle_decode(data + 5, data_size, page, page_size) ? 0 : page;
+	else if (data_size && (data_size != page_size))
+		content = 0;
+
+	if (broadcast)
+	{
+		const uint32_t index = address / page_size;
+		uint8_t* const bits = received_pages + (index >> 3);
+		const uint8_t mask = 1 << (index & 7);
+		if (data_size && content && (address + page_size <= FUSES->app_size) && !(*bits & mask))
+		{
+			write_page(address, content);
+			// It listens again after the erase and 8 T of silence
+			busy_until = now_us() + page_size * BOOT_BYTE_TIME + BOOT_ERASE_TIME + (uint32_t)(8 * CLUNET_T * SIM_TICK_US);
+			*bits |= mask;
+		}
+		return;
+	}
+
+	if (!data_size)
+		expected = address;
+	else if ((address == expected) && content)
+	{
+		write_page(address, content);
+		expected += page_size;
+	}
+	answer[0] = ((address > expected) || ((address == expected) && data_size)) ? COMMAND_FIRMWARE_UPDATE_NAK : COMMAND_FIRMWARE_UPDATE_ACK;
+	put32(answer + 1, expected);
+	reply(answer, sizeof(answer));
+}
+
+static void
+boot_sniff(uint8_t src_address, uint8_t dst_address, uint8_t command, char* data_ptr, uint8_t size)
+{
+	const uint8_t* data = (const uint8_t*)data_ptr;
+	const uint8_t broadcast = (dst_address == CLUNET_BROADCAST_ADDRESS);
+	const uint32_t now = now_us();
+	uint32_t duration;
+
+	if (forward_sniff)
+		sim_node_sniffed(src_address, dst_address, command, data_ptr, size);
+
+	if ((src_address == CLUNET_DEVICE_ID) || ((dst_address != CLUNET_DEVICE_ID) && !broadcast)
+		|| (command != CLUNET_COMMAND_BOOT_CONTROL) || !size)
+		return;
+
+	// The real bootloader polls the line: a frame which started while it was busy is lost.
+	// Shortest duration of the frame (no stuffed bits): it is dropped only if it surely started that early.
+#ifdef CLUNET_T_DATA
+	// Priority and source address go with T, the rest with the data phase T
+	duration = (uint32_t)((2 * CLUNET_T + (CLUNET_OFFSET_DATA + size - 1) * CLUNET_T_DATA) * 8 * SIM_TICK_US);
+#else
+	duration = (uint32_t)((CLUNET_OFFSET_DATA + size + 1) * 8 * CLUNET_T * SIM_TICK_US);
+#endif
+	if ((int32_t)(now - duration - busy_until) < 0)
+		return;
+
+	if (mode == BOOT_WAIT)
+	{
+		if (data[0] == COMMAND_FIRMWARE_UPDATE_INIT)
+			start_update(src_address);
+		return;
+	}
+
+	if ((mode != BOOT_UPDATE) || (src_address != flasher))
+		return;
+
+	switch (data[0])
+	{
+		case COMMAND_FIRMWARE_UPDATE_INIT:
+			start_update(src_address);
+			break;
+
+		case COMMAND_FIRMWARE_UPDATE_WRITE:
+			if ((size < 5 + FUSES->page_size) || lost())
+				break;
+			write_page(get32(data + 1), data + 5);
+			busy_until = now + BOOT_WRITE_TIME;
+			written_pending = 1;
+			break;
+
+		case COMMAND_FIRMWARE_UPDATE_STREAM:
+		case COMMAND_FIRMWARE_UPDATE_STREAM_RLE:
+			if ((size < 5) || ((size > 5) && lost()))
+				break;
+			stream_page(data[0], data, size, broadcast);
+			break;
+
+		case COMMAND_FIRMWARE_UPDATE_CRC:
+			page_crc(data, size);
+			break;
+
+		case COMMAND_FIRMWARE_UPDATE_STATUS:
+			missing_pages(data, size, broadcast);
+			break;
+
+		case COMMAND_FIRMWARE_UPDATE_DONE:
+			start_app();
+			break;
+	}
+}
+
+uint8_t
+sim_bootloader_start(uint8_t sniff)
+{
+	struct boot_fuses* fuses = FUSES;
+	const uint8_t start[1] = { COMMAND_FIRMWARE_UPDATE_START };
+
+	mode = BOOT_NONE;
+	if (fuses->magic != BOOT_MAGIC)
+		return 0;
+	if (fuses->run_app)
+	{
+		fuses->run_app = 0;
+		return 0;
+	}
+
+	// clunet_init() has queued BOOT_COMPLETED, the bootloader does not send it
+	clunet_abort_send();
+	forward_sniff = sniff;
+	clunet_set_on_data_received_sniff(boot_sniff);
+	rng_state = CLUNET_DEVICE_ID;
+	mode = BOOT_WAIT;
+	attempts = BOOT_ATTEMPTS;
+	deadline = now_ms() + BOOT_TIMEOUT;
+	clunet_send(CLUNET_BROADCAST_ADDRESS, BOOT_CONTROL_PRIORITY, CLUNET_COMMAND_BOOT_CONTROL, (const char*)start, sizeof(start));
+	return 1;
+}
+
+void
+sim_bootloader_poll(void)
+{
+	const uint32_t now = now_ms();
+
+	if ((mode == BOOT_WAIT) && ((int32_t)(now - deadline) >= 0))
+	{
+		const uint8_t start[1] = { COMMAND_FIRMWARE_UPDATE_START };
+		if (!--attempts)
+			start_app();
+		deadline = now + BOOT_TIMEOUT;
+		clunet_send(CLUNET_BROADCAST_ADDRESS, BOOT_CONTROL_PRIORITY, CLUNET_COMMAND_BOOT_CONTROL, (const char*)start, sizeof(start));
+	}
+
+	if (written_pending && ((int32_t)(now_us() - busy_until) >= 0))
+	{
+		const uint8_t written[1] = { COMMAND_FIRMWARE_UPDATE_WRITTEN };
+		written_pending = 0;
+		reply(written, sizeof(written));
+	}
+}
+
+uint8_t
+sim_bootloader_active(void)
+{
+	return mode != BOOT_NONE;
+}
+
+uint32_t
+sim_bootloader_install(uint32_t page_size, uint32_t app_size, uint32_t loss)
+{
+	struct boot_fuses* fuses = FUSES;
+	if (!page_size || (page_size > BOOT_MAX_PAGE) || (page_size & 1) || (app_size % page_size)
+		|| (app_size > CLUNET_SIM_NVM_SIZE - BOOT_MAX_PAGE))
+		return 0;
+	fuses->magic = BOOT_MAGIC;
+	fuses->page_size = page_size;
+	fuses->app_size = app_size;
+	fuses->loss = loss;
+	fuses->run_app = 0;
+	return 1;
+}
+
+uint32_t
+sim_bootloader_image_crc(uint32_t length, uint32_t unused1, uint32_t unused2)
+{
+	(void)unused1;
+	(void)unused2;
+	return flash_crc(0, length);
+}
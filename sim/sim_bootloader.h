@@ -0,0 +1,45 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	Bootloader stand-in of virtual nodes (see sim_bootloader.c).
+*/
+
+#ifndef __SIM_BOOTLOADER_H__
+#define __SIM_BOOTLOADER_H__
+
+#include <stdint.h>
+
+// Called after clunet_init(): enters bootloader mode if one is installed, returns 1 in bootloader mode
+uint8_t sim_bootloader_start(uint8_t sniff);
+
+// Main loop iteration in bootloader mode (timeouts and delayed answers)
+void sim_bootloader_poll(void);
+
+// Node is in bootloader mode, application must not process frames
+uint8_t sim_bootloader_active(void);
+
+// Entry point for sim_call(): installs bootloader (page size, application section size, percent of lost pages), it starts after sim_reset()
+uint32_t sim_bootloader_install(uint32_t page_size, uint32_t app_size, uint32_t loss);
+
+// Entry point for sim_call(): CRC-16 of application section bytes [0, length)
+uint32_t sim_bootloader_image_crc(uint32_t length, uint32_t unused1, uint32_t unused2);
+
+#endif
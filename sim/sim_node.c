@@ -0,0 +1,329 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+
+/*
+	Virtual node firmware: application glue between clunet.c and the simulator engine.
+	Built together with clunet.c into a shared object which the engine loads once per node.
+*/
+
+#include "clunet.h"
+#ifdef CLUNET_READ_QUEUE_SIZE
+#include "clunet_bulk.h"
+#include "clunet_request.h"
+#endif
+#include "sim.h"
+#include "sim_bootloader.h"
+#ifdef CLUNET_CAPTURE
+#include "clunet_capture.h"
+#endif
+#ifdef CLUNET_SIM_ADAPTER
+#include "clunet_adapter.h"
+#endif
+
+unsigned char clunet_sim_device_id;
+
+static void
+data_received(uint8_t src_address, uint8_t command, char* data, uint8_t size)
+{
+	// Bootloader answers its frames from the sniffer callback, the application is not running
+	if (sim_bootloader_active())
+		return;
+#if defined(CLUNET_READ_QUEUE_SIZE) && !defined(CLUNET_HANDLERS)
+	if (clunet_bulk_received(src_address, command, data, size))
+		return;
+	if (clunet_request_received(src_address, command, data, size))
+		return;
+#endif
+	sim_node_received(src_address, command, data, size);
+}
+
+static void
+data_received_sniff(uint8_t src_address, uint8_t dst_address, uint8_t command, char* data, uint8_t size)
+{
+	sim_node_sniffed(src_address, dst_address, command, data, size);
+}
+
+#ifdef CLUNET_SEND_COMPLETE
+/* Results of queued frames go to the engine as if the node received them from the destination */
+static void
+send_complete(uint8_t dst_address, uint8_t command, uint8_t result)
+{
+	const char data[2] = { command, result };
+	sim_node_received(dst_address, SIM_SEND_DONE, data, sizeof(data));
+}
+#endif
+
+#ifdef CLUNET_READ_QUEUE_SIZE
+static void bulk_data(uint8_t src_address, uint8_t id, uint32_t offset, const char* data, uint8_t size);
+static void bulk_complete(uint8_t src_address, uint8_t id, uint32_t length);
+static void requests_issue(void);
+#endif
+
+/* Sniffer callback is set only if the engine observes sniffed frames, it turns off receive filter */
+void
+sim_node_init(uint8_t id, uint8_t sniff)
+{
+	clunet_sim_device_id = id;
+	clunet_set_on_data_received(data_received);
+	if (sniff)
+		clunet_set_on_data_received_sniff(data_received_sniff);
+#ifdef CLUNET_READ_QUEUE_SIZE
+	clunet_bulk_set_on_data(bulk_data);
+	clunet_bulk_set_on_complete(bulk_complete);
+#endif
+#ifdef CLUNET_SEND_COMPLETE
+	clunet_set_on_send_complete(send_complete);
+#endif
+	clunet_init();
+	if (!sim_bootloader_start(sniff))
+	{
+#if defined(CLUNET_READ_QUEUE_SIZE) && defined(CLUNET_HANDLERS)
+		// Transport modules take their commands through the handler table
+		clunet_bulk_register();
+		clunet_request_register();
+#endif
+	}
+}
+
+/* Main loop iteration, executed when no interrupt is pending */
+void
+sim_node_loop(void)
+{
+	clunet_poll();
+	clunet_bus_load_poll((uint16_t)(sim_now() / SIM_MS));
+	if (sim_bootloader_active())
+	{
+		sim_bootloader_poll();
+		return;
+	}
+#ifdef CLUNET_CAPTURE
+	clunet_capture_poll();
+#endif
+#ifdef CLUNET_SIM_ADAPTER
+	clunet_adapter_poll();
+#endif
+#ifdef CLUNET_READ_QUEUE_SIZE
+	clunet_bulk_poll((uint16_t)(sim_now() / SIM_MS));
+	clunet_request_poll((uint16_t)(sim_now() / SIM_MS));
+	requests_issue();
+#endif
+}
+
+uint8_t
+sim_node_send(uint8_t address, uint8_t prio, uint8_t command, const char* data, uint8_t size)
+{
+	return clunet_send(address, prio, command, data, size);
+}
+
+uint8_t
+sim_node_ready_to_send(void)
+{
+	return clunet_ready_to_send();
+}
+
+/* Entry point for sim_call(): bus load estimated by the node, 0-255 */
+uint32_t
+sim_node_bus_load(uint32_t unused0, uint32_t unused1, uint32_t unused2)
+{
+	(void)unused0;
+	(void)unused1;
+	(void)unused2;
+	return clunet_bus_load();
+}
+
+#ifdef CLUNET_CAPTURE
+/* Streaming sniffer: the engine drains the virtual UART by sim_capture_tx() at the line rate */
+uint32_t
+sim_capture_start(uint32_t unused0, uint32_t unused1, uint32_t unused2)
+{
+	(void)unused0;
+	(void)unused1;
+	(void)unused2;
+	clunet_capture_start(0);
+	return 0;
+}
+
+/* Entry point for sim_call(): next byte of the stream, 0x100 if the UART has nothing to send */
+uint32_t
+sim_capture_tx(uint32_t unused0, uint32_t unused1, uint32_t unused2)
+{
+	uint8_t byte;
+	(void)unused0;
+	(void)unused1;
+	(void)unused2;
+	return clunet_capture_tx(&byte) ? byte : 0x100;
+}
+
+uint32_t
+sim_capture_dropped(uint32_t unused0, uint32_t unused1, uint32_t unused2)
+{
+	(void)unused0;
+	(void)unused1;
+	(void)unused2;
+	return clunet_capture_dropped();
+}
+#endif
+
+#ifdef CLUNET_SIM_ADAPTER
+/* Serial adapter of the gateway: the engine feeds the virtual UART by sim_adapter_rx() and drains it by sim_adapter_tx() */
+uint32_t
+sim_adapter_start(uint32_t unused0, uint32_t unused1, uint32_t unused2)
+{
+	(void)unused0;
+	(void)unused1;
+	(void)unused2;
+	clunet_adapter_start(0);
+	return 0;
+}
+
+uint32_t
+sim_adapter_rx(uint32_t byte, uint32_t unused1, uint32_t unused2)
+{
+	(void)unused1;
+	(void)unused2;
+	clunet_adapter_rx((uint8_t)byte);
+	return 0;
+}
+
+/* Entry point for sim_call(): next byte for the host, 0x100 if the UART has nothing to send */
+uint32_t
+sim_adapter_tx(uint32_t unused0, uint32_t unused1, uint32_t unused2)
+{
+	uint8_t byte;
+	(void)unused0;
+	(void)unused1;
+	(void)unused2;
+	return clunet_adapter_tx(&byte) ? byte : 0x100;
+}
+
+uint32_t
+sim_adapter_dropped(uint32_t unused0, uint32_t unused1, uint32_t unused2)
+{
+	(void)unused0;
+	(void)unused1;
+	(void)unused2;
+	return clunet_adapter_dropped();
+}
+#endif
+
+#ifdef CLUNET_READ_QUEUE_SIZE
+/* Bulk transfer test: data is a function of sender address and offset, receiver counts wrong bytes */
+static uint32_t bulk_errors;
+
+static uint8_t
+bulk_pattern(uint8_t src_address, uint32_t offset)
+{
+	return (uint8_t)(offset ^ (offset >> 8) ^ (offset >> 16) ^ (src_address * 37));
+}
+
+static void
+bulk_read(uint32_t offset, char* buffer, uint8_t size)
+{
+	uint8_t i;
+	for (i = 0; i < size; i++)
+		buffer[i] = bulk_pattern(CLUNET_DEVICE_ID, offset + i);
+}
+
+static void
+bulk_done(uint8_t result)
+{
+	sim_node_received(CLUNET_DEVICE_ID, SIM_BULK_SENT, (const char*)&result, 1);
+}
+
+static void
+bulk_data(uint8_t src_address, uint8_t id, uint32_t offset, const char* data, uint8_t size)
+{
+	uint8_t i;
+	(void)id;
+	for (i = 0; i < size; i++)
+		if ((uint8_t)data[i] != bulk_pattern(src_address, offset + i))
+			bulk_errors++;
+}
+
+static void
+bulk_complete(uint8_t src_address, uint8_t id, uint32_t length)
+{
+	uint8_t report[8];
+	uint8_t i;
+	(void)id;
+	for (i = 0; i < 4; i++)
+	{
+		report[i] = (uint8_t)(length >> (8 * i));
+		report[4 + i] = (uint8_t)(bulk_errors >> (8 * i));
+	}
+	bulk_errors = 0;
+	sim_node_received(src_address, SIM_BULK_RECEIVED, (const char*)report, sizeof(report));
+}
+
+uint32_t
+sim_node_bulk_send(uint32_t address, uint32_t length, uint32_t prio)
+{
+	return clunet_bulk_send(address, prio, length, bulk_read, bulk_done);
+}
+
+/* Request test: pings a range of addresses by clunet_request(), up to 'window' requests wait for responses at once */
+#define SIM_REQUEST_TIMEOUT 200
+static uint8_t request_address, request_left, request_window, request_outstanding, request_unchecked;
+
+static void
+request_done(uint8_t id, uint8_t address, uint8_t result, uint8_t command, const char* data, uint8_t size)
+{
+	(void)id;
+	request_outstanding--;
+	// Response must echo the address of the responder and our own one
+	if ((result == CLUNET_REQUEST_OK) && ((command != CLUNET_COMMAND_PING_REPLY) || (size != 2)
+		|| ((uint8_t)data[0] != address) || ((uint8_t)data[1] != CLUNET_DEVICE_ID)))
+		result = SIM_REQUEST_WRONG;
+	sim_node_received(address, SIM_REQUEST_DONE, (const char*)&result, 1);
+}
+
+/* Requests are queued while the transmit queue has room, the rest wait for the next loop iteration.
+   Unchecked: back to back without clunet_ready_to_send(), clunet_request() must refuse them on a full queue itself */
+static void
+requests_issue(void)
+{
+	while (request_left && (request_outstanding < request_window) && (request_unchecked || !clunet_ready_to_send()))
+	{
+		const char data[2] = { request_address, CLUNET_DEVICE_ID };
+		if (!clunet_request(request_address, CLUNET_COMMAND_PING, data, sizeof(data), SIM_REQUEST_TIMEOUT, request_done))
+			break;
+		request_address++;
+		request_left--;
+		request_outstanding++;
+	}
+}
+
+uint32_t
+sim_node_requests(uint32_t first_address, uint32_t count, uint32_t window)
+{
+	request_address = first_address;
+	request_left = count;
+	request_window = window;
+	return 1;
+}
+
+uint32_t
+sim_node_requests_unchecked(uint32_t on)
+{
+	request_unchecked = on;
+	return 1;
+}
+#endif
@@ -0,0 +1,452 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	clunet-capture: reads the stream of a CLUNET sniffer (demo_project/clunet_sniffer, format in
+	clunet_capture.h) from its serial port or a file, writes a capture file and/or a pcap for
+	Wireshark, prints the frames.
+
+	pcap: nanosecond timestamps, link type 147 (USER0), packet is the record flags byte followed
+	by the frame as it was on the line (source, destination, command, size, data, CRC).
+	Record times are extended over the wraps of the 32-bit tick counter, so they never go back.
+	A serial capture is stamped with the wall clock of its first frame, a file starts at zero.
+*/
+
+#include "clunet.h"
+#include "clunet_capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PCAP_LINKTYPE_USER0 147
+#define MAX_BATCH 4096
+
+static int baud = 500000;
+static int verbose;
+static uint32_t tick_ns = 8000;		// Until the header says otherwise
+static uint8_t frame_t;			// CLUNET_T from the header
+static uint32_t max_frames;
+static volatile sig_atomic_t stop;
+
+static FILE* out;			// Capture file
+static FILE* pcap;
+static int header_written;
+
+/* Time extension */
+static int have_time;
+static uint32_t last_time;
+static uint64_t wraps;
+static uint64_t first_tick;
+static uint64_t base_ns;
+static int base_wall;			// Stamp with the wall clock (serial port)
+
+/* Statistics */
+static uint32_t frames, crc_errors, lost_marks, link_errors, batches;
+static uint64_t stream_bytes;
+
+/* SLIP decoder */
+static uint8_t batch[MAX_BATCH];
+static size_t batch_size;
+static int escape, overrun;
+
+static uint8_t
+crc8_update(uint8_t crc, uint8_t data)
+{
+	uint8_t i;
+	crc ^= data;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 1) ? ((crc >> 1) ^ 0x8C) : (crc >> 1);
+	return crc;
+}
+
+static void
+put_le32(uint8_t* p, uint32_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+static uint32_t
+get_le32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void
+on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static void
+write_header(void)
+{
+	uint8_t h[CLUNET_CAPTURE_HEADER_SIZE];
+	if (header_written || !out)
+		return;
+	memcpy(h, CLUNET_CAPTURE_MAGIC, 4);
+	h[4] = CLUNET_CAPTURE_VERSION;
+	h[5] = frame_t;
+	h[6] = h[7] = 0;
+	put_le32(h + 8, tick_ns);
+	fwrite(h, 1, sizeof(h), out);
+	header_written = 1;
+}
+
+/* Header of a stream or a capture file, 0 if it is not one */
+static int
+read_header(const uint8_t* h)
+{
+	if (memcmp(h, CLUNET_CAPTURE_MAGIC, 4) || (h[4] != CLUNET_CAPTURE_VERSION) || !get_le32(h + 8))
+		return 0;
+	frame_t = h[5];
+	tick_ns = get_le32(h + 8);
+	return 1;
+}
+
+static void
+print_record(double seconds, uint8_t flags, const uint8_t* frame, uint8_t size)
+{
+	int i;
+	printf("%14.6f prio %u %3u -> %3u cmd %3u size %3u%s%s",
+		seconds, (flags & CLUNET_CAPTURE_PRIORITY) + 1, frame[CLUNET_OFFSET_SRC_ADDRESS], frame[CLUNET_OFFSET_DST_ADDRESS],
+		frame[CLUNET_OFFSET_COMMAND], frame[CLUNET_OFFSET_SIZE],
+		(flags & CLUNET_CAPTURE_CRC_ERROR) ? " CRC" : "", (flags & CLUNET_CAPTURE_LOST) ? " LOST" : "");
+	for (i = CLUNET_OFFSET_DATA; i < size - 1; i++)
+		printf("%s%02x", (i == CLUNET_OFFSET_DATA) ? ": " : " ", frame[i]);
+	printf("\n");
+}
+
+static void
+record(const uint8_t* r)
+{
+	const uint32_t time = get_le32(r);
+	const uint8_t flags = r[4];
+	const uint8_t size = r[5];
+	const uint8_t* frame = r + CLUNET_CAPTURE_RECORD_HEADER;
+	uint64_t ticks, ns;
+
+	if ((size < CLUNET_OFFSET_DATA + 1) || (size != frame[CLUNET_OFFSET_SIZE] + CLUNET_OFFSET_DATA + 1))
+	{
+		link_errors++;
+		return;
+	}
+	if (have_time && (time < last_time))
+		wraps++;
+	last_time = time;
+	ticks = (wraps << 32) | time;
+	if (!have_time)
+	{
+		struct timespec ts;
+		have_time = 1;
+		first_tick = ticks;
+		if (base_wall && !clock_gettime(CLOCK_REALTIME, &ts))
+			base_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+	ns = base_ns + (ticks - first_tick) * tick_ns;
+
+	frames++;
+	if (flags & CLUNET_CAPTURE_CRC_ERROR)
+		crc_errors++;
+	if (flags & CLUNET_CAPTURE_LOST)
+		lost_marks++;
+	if (out)
+	{
+		write_header();
+		fwrite(r, 1, CLUNET_CAPTURE_RECORD_HEADER + size, out);
+	}
+	if (pcap)
+	{
+		uint8_t p[16];
+		put_le32(p, ns / 1000000000);
+		put_le32(p + 4, ns % 1000000000);
+		put_le32(p + 8, 1 + size);
+		put_le32(p + 12, 1 + size);
+		fwrite(p, 1, sizeof(p), pcap);
+		fputc(flags, pcap);
+		fwrite(frame, 1, size, pcap);
+	}
+	if (verbose)
+	{
+		print_record((double)(ns - base_ns) / 1e9, flags, frame, size);
+		if (base_wall)
+			fflush(stdout);
+	}
+	if (max_frames && (frames >= max_frames))
+		stop = 1;
+}
+
+static void
+stream_batch(void)
+{
+	size_t i, pos;
+	uint8_t crc = 0;
+	batches++;
+	for (i = 0; i < batch_size; i++)
+		crc = crc8_update(crc, batch[i]);
+	if (crc || (batch_size < 2))
+	{
+		link_errors++;
+		return;
+	}
+	if (batch[0] == CLUNET_CAPTURE_BATCH_HEADER)
+	{
+		if ((batch_size != CLUNET_CAPTURE_HEADER_SIZE + 2) || !read_header(batch + 1))
+			link_errors++;
+		return;
+	}
+	if (batch[0] != CLUNET_CAPTURE_BATCH_RECORDS)
+	{
+		link_errors++;
+		return;
+	}
+	for (pos = 1; pos + CLUNET_CAPTURE_RECORD_HEADER < batch_size; pos += CLUNET_CAPTURE_RECORD_HEADER + batch[pos + 5])
+	{
+		if (pos + CLUNET_CAPTURE_RECORD_HEADER + batch[pos + 5] > batch_size - 1)
+		{
+			link_errors++;
+			return;
+		}
+		record(batch + pos);
+	}
+}
+
+/* SLIP decoder of the stream: a batch ends with END, bytes before the first END are a partial batch */
+static void
+stream_input(const uint8_t* data, size_t length)
+{
+	static int synced;
+	size_t i;
+	stream_bytes += length;
+	for (i = 0; (i < length) && !stop; i++)
+	{
+		uint8_t byte = data[i];
+		if (byte == CLUNET_CAPTURE_SLIP_END)
+		{
+			if (overrun)
+				link_errors++;
+			else if (synced && batch_size)
+				stream_batch();
+			synced = 1;
+			batch_size = escape = overrun = 0;
+			continue;
+		}
+		if (byte == CLUNET_CAPTURE_SLIP_ESC)
+		{
+			escape = 1;
+			continue;
+		}
+		if (escape)
+		{
+			escape = 0;
+			byte = (byte == CLUNET_CAPTURE_SLIP_ESC_END) ? CLUNET_CAPTURE_SLIP_END : CLUNET_CAPTURE_SLIP_ESC;
+		}
+		if (batch_size < sizeof(batch))
+			batch[batch_size++] = byte;
+		else
+			overrun = 1;
+	}
+}
+
+/* Capture file written by -o */
+static int
+read_capture(FILE* f)
+{
+	uint8_t r[CLUNET_CAPTURE_RECORD_HEADER + 255];
+	if ((fread(r, 1, CLUNET_CAPTURE_HEADER_SIZE, f) != CLUNET_CAPTURE_HEADER_SIZE) || !read_header(r))
+		return -1;
+	while (!stop && (fread(r, 1, CLUNET_CAPTURE_RECORD_HEADER, f) == CLUNET_CAPTURE_RECORD_HEADER))
+	{
+		if (fread(r + CLUNET_CAPTURE_RECORD_HEADER, 1, r[5], f) != r[5])
+			return -1;
+		record(r);
+	}
+	return 0;
+}
+
+static speed_t
+baud_constant(int rate)
+{
+	switch (rate)
+	{
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+		case 460800: return B460800;
+		case 500000: return B500000;
+		case 921600: return B921600;
+		case 1000000: return B1000000;
+	}
+	return 0;
+}
+
+static int
+open_input(const char* path)
+{
+	struct termios tio;
+	const int fd = open(path, O_RDONLY | O_NOCTTY);
+	if ((fd < 0) || !isatty(fd))
+		return fd;
+	base_wall = 1;
+	if (!tcgetattr(fd, &tio))
+	{
+		cfmakeraw(&tio);
+		cfsetispeed(&tio, baud_constant(baud));
+		cfsetospeed(&tio, baud_constant(baud));
+		tio.c_cflag |= CLOCAL | CREAD;
+		tcsetattr(fd, TCSANOW, &tio);
+		tcflush(fd, TCIFLUSH);
+	}
+	return fd;
+}
+
+static FILE*
+open_pcap(const char* path)
+{
+	uint8_t h[24];
+	FILE* f = fopen(path, "wb");
+	if (!f)
+		return 0;
+	put_le32(h, 0xa1b23c4d);	// Nanosecond timestamps
+	h[4] = 2; h[5] = 0;		// Version 2.4
+	h[6] = 4; h[7] = 0;
+	put_le32(h + 8, 0);
+	put_le32(h + 12, 0);
+	put_le32(h + 16, 65535);
+	put_le32(h + 20, PCAP_LINKTYPE_USER0);
+	fwrite(h, 1, sizeof(h), f);
+	return f;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: clunet-capture [options] INPUT\n"
+		"  INPUT     sniffer serial port, or a file with its stream\n"
+		"  -b BAUD   serial speed (default 500000)\n"
+		"  -r        INPUT is a capture file written by -o\n"
+		"  -o FILE   write capture file\n"
+		"  -w FILE   write pcap (link type %d, USER0)\n"
+		"  -p        print every frame\n"
+		"  -t NS     timer tick until the stream header is seen (default 8000)\n"
+		"  -c N      stop after N frames\n"
+		"Serial capture stops on SIGINT.\n", PCAP_LINKTYPE_USER0);
+}
+
+int
+main(int argc, char** argv)
+{
+	const char* out_path = 0;
+	const char* pcap_path = 0;
+	int opt, capture_file = 0, failed = 0;
+	struct sigaction sa;
+
+	while ((opt = getopt(argc, argv, "b:ro:w:pt:c:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'b': baud = atoi(optarg); break;
+			case 'r': capture_file = 1; break;
+			case 'o': out_path = optarg; break;
+			case 'w': pcap_path = optarg; break;
+			case 'p': verbose = 1; break;
+			case 't': tick_ns = strtoul(optarg, 0, 0); break;
+			case 'c': max_frames = strtoul(optarg, 0, 0); break;
+			default: usage(); return 2;
+		}
+	}
+	if ((optind != argc - 1) || !baud_constant(baud) || !tick_ns)
+	{
+		usage();
+		return 2;
+	}
+	if ((out_path && !(out = fopen(out_path, "wb"))) || (pcap_path && !(pcap = open_pcap(pcap_path))))
+	{
+		perror(out_path && !out ? out_path : pcap_path);
+		return 1;
+	}
+
+	// Без SA_RESTART: read() из порта прерывается сигналом
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+
+	if (capture_file)
+	{
+		FILE* f = fopen(argv[optind], "rb");
+		if (!f || read_capture(f))
+		{
+			fprintf(stderr, "%s: %s\n", argv[optind], f ? "not a capture file" : strerror(errno));
+			failed = 1;
+		}
+		if (f)
+			fclose(f);
+	}
+	else
+	{
+		uint8_t buffer[4096];
+		ssize_t length;
+		const int fd = open_input(argv[optind]);
+		if (fd < 0)
+		{
+			perror(argv[optind]);
+			return 1;
+		}
+		while (!stop)
+		{
+			length = read(fd, buffer, sizeof(buffer));
+			if (length > 0)
+				stream_input(buffer, length);
+			else if (!length || (errno != EINTR))
+				break;
+		}
+		close(fd);
+	}
+	// Пустой захват - всё равно корректный файл
+	write_header();
+	if (out)
+		fclose(out);
+	if (pcap)
+		fclose(pcap);
+
+	fprintf(stderr, "frames %u, crc errors %u, lost marks %u", frames, crc_errors, lost_marks);
+	if (!capture_file)
+		fprintf(stderr, ", stream %llu bytes in %u batches, link errors %u", (unsigned long long)stream_bytes, batches, link_errors);
+	if (have_time)
+		fprintf(stderr, ", %.3f s", (double)((((wraps << 32) | last_time) - first_tick) * tick_ns) / 1e9);
+	fprintf(stderr, "\n");
+	return (failed || link_errors || lost_marks) ? 1 : 0;
+}
@@ -0,0 +1,1150 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	clunet-flasher: firmware update of CLUNET devices over a network gateway.
+
+	Reads an Intel HEX image and talks to clunet_bootloader through the gateway TCP protocol
+	(tools/gateway/clunet_gateway.h). Devices are updated in parallel over one connection:
+	every device has its own state machine and all frames go out in batched writes.
+
+	Per device: REBOOT, START -> INIT -> READY, CRC queries of the image pages (unchanged pages are
+	skipped), pipelined STREAM pages (RLE compressed when shorter), CRC verification and DONE
+	with image length and CRC. With -m pages are multicast once to all devices, then missing pages
+	are collected with STATUS (only devices with gaps answer) and multicast again.
+*/
+
+#include "clunet.h"
+#include "clunet_gateway.h"
+#include "clunet_bootloader.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DEVICES 64
+#define MAX_IMAGE 0x40000
+#define MAX_PAGE 128
+#define PAGE_ERASE_TIME 0.0045	// Multicast page: bootloader erases it without answering, ATmega8 maximum (s)
+#define PAGE_BYTE_TIME 16e-6	// Bootloader work per page byte before the erase: frame CRC, RLE, SPM buffer (s)
+#define BUS_T 64e-6		// CLUNET bit time (s), a receiver waits 8 T of silence before the next frame
+#define REBOOT_TIMEOUT 3.0	// From REBOOT to START (s)
+#define DONE_TIMEOUT 2.0	// From DONE to BOOT_COMPLETED of the application (s)
+#define MAX_RETRIES 10
+#define MAX_ROUNDS 10		// Multicast repair rounds and verification rounds
+
+enum
+{
+	DEV_REBOOT,	// Waiting for START
+	DEV_INIT,	// Waiting for READY
+	DEV_CRC,	// Comparing page CRCs with the image
+	DEV_WRITE,	// Streaming changed pages
+	DEV_MULTICAST,	// Waiting for multicast pass
+	DEV_VERIFY,	// Comparing page CRCs after writing
+	DEV_DONE,	// Waiting for BOOT_COMPLETED
+	DEV_FINISHED,
+	DEV_FAILED
+};
+
+struct device
+{
+	uint8_t id;
+	int state;
+	double deadline;
+	int retries;
+	int rounds;
+	int page_size;
+	int pages;
+	uint8_t dirty[MAX_IMAGE / 32];	// Page differs from image
+	uint8_t done[MAX_IMAGE / 32];	// Page written and acknowledged
+	uint8_t raw[MAX_IMAGE / 32];	// Bootloader rejected RLE of the page
+	uint32_t expected;		// Next page address expected by bootloader
+	int crc_next;			// First page of the next CRC query
+	int crc_mismatch;		// Pages which differ after the last CRC pass
+	int inflight;			// Page in flight (-1: none or seek)
+	uint32_t written, skipped;
+	uint64_t bus_bytes;		// Payload sent to this device
+	double started, finished;
+	const char* error;
+};
+
+/* Options */
+static int multicast, full, no_crc, no_rle, stop_and_wait, no_reboot, verbose;
+static double timeout = 0.5;
+
+/* Image */
+static uint8_t image[MAX_IMAGE];
+static uint32_t image_length;
+static uint16_t image_crc;
+
+/* Gateway connection */
+static int sock = -1;
+static int gateway = -1;	// Bus address of the gateway (from HELLO)
+static uint8_t in_buf[65536];
+static size_t in_len;
+static uint8_t out_buf[65536];
+static size_t out_len;
+static uint64_t records_out, writes_out;
+
+static struct device devices[MAX_DEVICES];
+static int device_count;
+
+/* Multicast pass */
+static struct
+{
+	int active;
+	int page_size;
+	int pages;
+	uint8_t pending[MAX_IMAGE / 32];	// Pages to multicast in this round
+	uint8_t dirty[MAX_IMAGE / 32];		// Union of changed pages of all devices
+	int next;				// Next page to send
+	int echo_page;				// Page whose echo we wait for (-1: none)
+	double next_time;			// Do not send before
+	int status_next;			// Next page of STATUS queries (-1: sending pages)
+	int rounds;
+	int missing;				// Missing pages reported in this round
+	uint64_t bus_bytes;
+} mc;
+
+static double
+seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+say(const struct device* d, const char* format, ...)
+{
+	va_list args;
+	if (!verbose)
+		return;
+	va_start(args, format);
+	if (d)
+		fprintf(stderr, "%8.3f device %u: ", seconds(), d->id);
+	else
+		fprintf(stderr, "%8.3f multicast: ", seconds());
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+	va_end(args);
+}
+
+#define BIT(map, i) ((map)[(i) >> 3] & (1 << ((i) & 7)))
+#define SET_BIT(map, i) ((map)[(i) >> 3] |= (1 << ((i) & 7)))
+#define CLEAR_BIT(map, i) ((map)[(i) >> 3] &= ~(1 << ((i) & 7)))
+
+static uint16_t
+crc16_update(uint16_t crc, uint8_t data)
+{
+	int i;
+	crc ^= data;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 1) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+	return crc;
+}
+
+static uint16_t
+crc16(const uint8_t* data, uint32_t size)
+{
+	uint16_t crc = 0xFFFF;
+	while (size--)
+		crc = crc16_update(crc, *data++);
+	return crc;
+}
+
+static void
+put32(uint8_t* p, uint32_t value)
+{
+	int i;
+	for (i = 0; i < 4; i++)
+		p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint32_t
+get32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Intel HEX */
+
+static int
+hex_byte(const char* s)
+{
+	int value = 0, i;
+	for (i = 0; i < 2; i++)
+	{
+		const char c = s[i];
+		value <<= 4;
+		if ((c >= '0') && (c <= '9'))
+			value |= c - '0';
+		else if ((c >= 'A') && (c <= 'F'))
+			value |= c - 'A' + 10;
+		else if ((c >= 'a') && (c <= 'f'))
+			value |= c - 'a' + 10;
+		else
+			return -1;
+	}
+	return value;
+}
+
+static int
+load_hex(const char* path)
+{
+	char line[600];
+	uint32_t base = 0;
+	int line_no = 0;
+	FILE* f = fopen(path, "r");
+	if (!f)
+	{
+		perror(path);
+		return -1;
+	}
+	memset(image, 0xFF, sizeof(image));
+	image_length = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		uint8_t record[300];
+		size_t length = strcspn(line, "\r\n");
+		int i, count;
+		uint8_t sum = 0;
+		line_no++;
+		if (!length)
+			continue;
+		if ((line[0] != ':') || (length < 11) || !(length & 1) || (length > 1 + 2 * sizeof(record)))
+			goto _bad;
+		count = (length - 1) / 2;
+		for (i = 0; i < count; i++)
+		{
+			const int value = hex_byte(line + 1 + 2 * i);
+			if (value < 0)
+				goto _bad;
+			record[i] = value;
+			sum += value;
+		}
+		if (sum || (record[0] + 5 != count))
+			goto _bad;
+		const uint32_t address = base + ((record[1] << 8) | record[2]);
+		switch (record[3])
+		{
+			case 0x00:
+				if (address + record[0] > MAX_IMAGE)
+				{
+					fprintf(stderr, "%s:%d: address 0x%X is out of supported range\n", path, line_no, address);
+					fclose(f);
+					return -1;
+				}
+				memcpy(image + address, record + 4, record[0]);
+				if (address + record[0] > image_length)
+					image_length = address + record[0];
+				break;
+			case 0x01:
+				fclose(f);
+				return image_length ? 0 : -1;
+			case 0x02:
+				base = ((record[4] << 8) | record[5]) << 4;
+				break;
+			case 0x04:
+				base = ((record[4] << 8) | record[5]) << 16;
+				break;
+		}
+	}
+	fclose(f);
+	fprintf(stderr, "%s: no end of file record\n", path);
+	return -1;
+_bad:
+	fprintf(stderr, "%s:%d: bad record\n", path, line_no);
+	fclose(f);
+	return -1;
+}
+
+/*	RLE of clunet_bootloader: control byte n < 128 - n + 1 literal bytes follow,
+	n >= 128 - the next byte is repeated n - 126 times. Returns encoded size.
+*/
+static int
+rle_encode(const uint8_t* src, int size, uint8_t* dst)
+{
+	int in = 0, out = 0, literal = -1;
+	while (in < size)
+	{
+		int run = 1;
+		while ((in + run < size) && (run < 129) && (src[in + run] == src[in]))
+			run++;
+		if (run >= 3)
+		{
+			dst[out++] = run + 126;
+			dst[out++] = src[in];
+			in += run;
+			literal = -1;
+			continue;
+		}
+		if ((literal < 0) || (dst[literal] == 127))
+		{
+			literal = out;
+			dst[out++] = 0xFF;	// Incremented to 0 by the first byte
+		}
+		dst[literal]++;
+		dst[out++] = src[in++];
+	}
+	return out;
+}
+
+/* Gateway */
+
+static int
+gateway_connect(const char* host, const char* port)
+{
+	struct addrinfo hints, *list, *ai;
+	int fd = -1;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &list))
+	{
+		fprintf(stderr, "%s: unknown host\n", host);
+		return -1;
+	}
+	for (ai = list; ai; ai = ai->ai_next)
+	{
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(list);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s:%s: %s\n", host, port, strerror(errno));
+		return -1;
+	}
+	const int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+/* Frames are collected and written to the gateway once per loop iteration */
+static void
+queue_frame(uint8_t dst, uint8_t prio, uint8_t command, const uint8_t* data, uint8_t size)
+{
+	if (out_len + CLUNET_GW_HEADER_SIZE + size > sizeof(out_buf))
+		return;
+	out_buf[out_len++] = prio;
+	out_buf[out_len++] = dst;
+	out_buf[out_len++] = command;
+	out_buf[out_len++] = size;
+	memcpy(out_buf + out_len, data, size);
+	out_len += size;
+	records_out++;
+}
+
+static int
+flush_frames(void)
+{
+	size_t pos = 0;
+	while (pos < out_len)
+	{
+		const ssize_t n = write(sock, out_buf + pos, out_len - pos);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("gateway");
+			return -1;
+		}
+		pos += n;
+	}
+	if (out_len)
+		writes_out++;
+	out_len = 0;
+	return 0;
+}
+
+static void
+boot_command(struct device* d, const uint8_t* data, uint8_t size)
+{
+	queue_frame(d ? d->id : CLUNET_BROADCAST_ADDRESS, BOOT_CONTROL_PRIORITY, CLUNET_COMMAND_BOOT_CONTROL, data, size);
+	if (d)
+		d->bus_bytes += size;
+	else
+		mc.bus_bytes += size;
+}
+
+/* Device state machine */
+
+static void
+fail(struct device* d, const char* error)
+{
+	d->state = DEV_FAILED;
+	d->error = error;
+	d->finished = seconds();
+	say(d, "failed: %s", error);
+}
+
+static void
+set_state(struct device* d, int state, double wait)
+{
+	d->state = state;
+	d->retries = 0;
+	d->deadline = seconds() + wait;
+}
+
+static void
+send_reboot(struct device* d)
+{
+	// Same priority as the page stream: a retry left behind it would reset the device after writing
+	if (!no_reboot)
+		queue_frame(d->id, BOOT_CONTROL_PRIORITY, CLUNET_COMMAND_REBOOT, 0, 0);
+}
+
+static void
+send_init(struct device* d)
+{
+	const uint8_t data[1] = { COMMAND_FIRMWARE_UPDATE_INIT };
+	boot_command(d, data, sizeof(data));
+}
+
+static void
+send_crc_query(struct device* d)
+{
+	uint8_t data[6];
+	const int count = (d->pages - d->crc_next > CRC_QUERY_MAX) ? CRC_QUERY_MAX : d->pages - d->crc_next;
+	data[0] = COMMAND_FIRMWARE_UPDATE_CRC;
+	put32(data + 1, d->crc_next * d->page_size);
+	data[5] = count;
+	boot_command(d, data, sizeof(data));
+}
+
+/* Page data: plain or RLE when shorter (sub command is returned) */
+static uint8_t
+page_frame(int page_size, int page, int allow_rle, uint8_t sub, uint8_t* data, uint8_t* size)
+{
+	uint8_t packed[2 * MAX_PAGE];
+	const uint8_t* content = image + page * page_size;
+	int length = allow_rle && !no_rle ? rle_encode(content, page_size, packed) : page_size;
+	data[0] = sub;
+	put32(data + 1, page * page_size);
+	if (length < page_size)
+	{
+		data[0] = COMMAND_FIRMWARE_UPDATE_STREAM_RLE;
+		memcpy(data + 5, packed, length);
+	}
+	else
+	{
+		length = page_size;
+		memcpy(data + 5, content, page_size);
+	}
+	*size = 5 + length;
+	return data[0];
+}
+
+static int
+next_dirty(const struct device* d)
+{
+	int i;
+	for (i = 0; i < d->pages; i++)
+		if (BIT(d->dirty, i) && !BIT(d->done, i))
+			return i;
+	return -1;
+}
+
+static void start_verify(struct device* d);
+
+static void
+send_next(struct device* d)
+{
+	uint8_t data[5 + MAX_PAGE];
+	uint8_t size;
+	const int page = next_dirty(d);
+
+	if (page < 0)
+	{
+		start_verify(d);
+		return;
+	}
+	if (stop_and_wait)
+	{
+		d->inflight = page;
+		page_frame(d->page_size, page, 0, COMMAND_FIRMWARE_UPDATE_WRITE, data, &size);
+		boot_command(d, data, size);
+		return;
+	}
+	if (d->expected != (uint32_t)(page * d->page_size))
+	{
+		// Bootloader expects another page: move it over unchanged pages with an empty frame
+		d->inflight = -1;
+		data[0] = COMMAND_FIRMWARE_UPDATE_STREAM;
+		put32(data + 1, page * d->page_size);
+		boot_command(d, data, 5);
+		return;
+	}
+	d->inflight = page;
+	page_frame(d->page_size, page, !BIT(d->raw, page), COMMAND_FIRMWARE_UPDATE_STREAM, data, &size);
+	boot_command(d, data, size);
+}
+
+static void
+start_write(struct device* d)
+{
+	set_state(d, DEV_WRITE, timeout);
+	memset(d->done, 0, sizeof(d->done));
+	d->expected = 0;
+	send_next(d);
+}
+
+static void
+send_done(struct device* d)
+{
+	uint8_t data[7];
+	data[0] = COMMAND_FIRMWARE_UPDATE_DONE;
+	put32(data + 1, image_length);
+	data[5] = (uint8_t)image_crc;
+	data[6] = (uint8_t)(image_crc >> 8);
+	boot_command(d, data, sizeof(data));
+}
+
+static void
+start_verify(struct device* d)
+{
+	if (no_crc)
+	{
+		// Bootloader without CRC query: the image can not be verified
+		say(d, "written, starting application");
+		set_state(d, DEV_DONE, DONE_TIMEOUT);
+		send_done(d);
+		return;
+	}
+	set_state(d, DEV_VERIFY, timeout);
+	d->crc_next = 0;
+	d->crc_mismatch = 0;
+	send_crc_query(d);
+}
+
+/* CRC_REPLY: marks changed pages, moves to the next stage after the last query */
+static void
+crc_reply(struct device* d, const uint8_t* data, uint8_t size)
+{
+	int i, count;
+	if ((size < 5) || (get32(data + 1) != (uint32_t)(d->crc_next * d->page_size)))
+		return;
+	count = (size - 5) / 2;
+	if (count > d->pages - d->crc_next)
+		count = d->pages - d->crc_next;
+	for (i = 0; i < count; i++)
+	{
+		const int page = d->crc_next + i;
+		const uint16_t crc = data[5 + 2 * i] | (data[6 + 2 * i] << 8);
+		if (crc != crc16(image + page * d->page_size, d->page_size))
+		{
+			SET_BIT(d->dirty, page);
+			d->crc_mismatch++;
+		}
+		else if (d->state == DEV_CRC)
+			d->skipped++;
+	}
+	d->crc_next += count;
+	d->deadline = seconds() + timeout;
+	d->retries = 0;
+	if (d->crc_next < d->pages)
+	{
+		send_crc_query(d);
+		return;
+	}
+
+	if (d->state == DEV_CRC)
+	{
+		say(d, "%d of %d pages differ", d->crc_mismatch, d->pages);
+		if (multicast)
+			set_state(d, DEV_MULTICAST, 0);
+		else
+			start_write(d);
+		return;
+	}
+
+	// Verification
+	if (!d->crc_mismatch)
+	{
+		say(d, "verified, starting application");
+		set_state(d, DEV_DONE, DONE_TIMEOUT);
+		send_done(d);
+	}
+	else if (++d->rounds > MAX_ROUNDS)
+		fail(d, "verification failed");
+	else
+	{
+		say(d, "%d pages differ after writing, writing them again", d->crc_mismatch);
+		start_write(d);
+	}
+}
+
+static void
+device_frame(struct device* d, const uint8_t* data, uint8_t size)
+{
+	const uint8_t sub = data[0];
+
+	if (sub == COMMAND_FIRMWARE_UPDATE_START)
+	{
+		// Bootloader has started, it waits for INIT for a second
+		if ((d->state == DEV_REBOOT) || (d->state == DEV_INIT))
+		{
+			say(d, "bootloader started");
+			set_state(d, DEV_INIT, timeout);
+			send_init(d);
+		}
+		return;
+	}
+
+	switch (d->state)
+	{
+		case DEV_INIT:
+			if ((sub != COMMAND_FIRMWARE_UPDATE_READY) || (size < 2))
+				return;
+			d->page_size = data[1];
+			if (!d->page_size || (d->page_size > MAX_PAGE) || (d->page_size & 1))
+			{
+				fail(d, "unsupported page size");
+				return;
+			}
+			d->pages = (image_length + d->page_size - 1) / d->page_size;
+			memset(d->dirty, 0, sizeof(d->dirty));
+			memset(d->raw, 0, sizeof(d->raw));
+			say(d, "update mode, page %d bytes, %d pages", d->page_size, d->pages);
+			if (full)
+			{
+				int i;
+				for (i = 0; i < d->pages; i++)
+					SET_BIT(d->dirty, i);
+				set_state(d, multicast ? DEV_MULTICAST : DEV_WRITE, timeout);
+				if (!multicast)
+					start_write(d);
+				return;
+			}
+			set_state(d, DEV_CRC, timeout);
+			d->crc_next = 0;
+			d->crc_mismatch = 0;
+			send_crc_query(d);
+			return;
+
+		case DEV_CRC:
+		case DEV_VERIFY:
+			if (sub == COMMAND_FIRMWARE_UPDATE_CRC_REPLY)
+				crc_reply(d, data, size);
+			return;
+
+		case DEV_WRITE:
+			if (stop_and_wait)
+			{
+				if ((sub != COMMAND_FIRMWARE_UPDATE_WRITTEN) || (d->inflight < 0))
+					return;
+				SET_BIT(d->done, d->inflight);
+				d->written++;
+			}
+			else
+			{
+				uint32_t address;
+				if (((sub != COMMAND_FIRMWARE_UPDATE_ACK) && (sub != COMMAND_FIRMWARE_UPDATE_NAK)) || (size < 5))
+					return;
+				address = get32(data + 1);
+				if (d->inflight >= 0)
+				{
+					const uint32_t page_address = d->inflight * d->page_size;
+					if (address == page_address + d->page_size)
+					{
+						if (!BIT(d->done, d->inflight))
+							d->written++;
+						SET_BIT(d->done, d->inflight);
+					}
+					else if ((sub == COMMAND_FIRMWARE_UPDATE_NAK) && (address == page_address))
+						SET_BIT(d->raw, d->inflight);	// RLE was not accepted
+				}
+				d->expected = address;
+			}
+			d->deadline = seconds() + timeout;
+			d->retries = 0;
+			send_next(d);
+			return;
+	}
+}
+
+static void
+device_timeout(struct device* d)
+{
+	if (++d->retries > MAX_RETRIES)
+	{
+		fail(d, "no answer");
+		return;
+	}
+	switch (d->state)
+	{
+		case DEV_REBOOT:
+			say(d, "rebooting");
+			send_reboot(d);
+			d->deadline = seconds() + REBOOT_TIMEOUT;
+			return;
+		case DEV_INIT:
+			send_init(d);
+			break;
+		case DEV_CRC:
+		case DEV_VERIFY:
+			send_crc_query(d);
+			break;
+		case DEV_WRITE:
+			send_next(d);
+			break;
+		case DEV_DONE:
+			if (d->retries > 3)
+			{
+				// Application does not report BOOT_COMPLETED, the image is verified anyway
+				d->state = DEV_FINISHED;
+				d->finished = seconds();
+				return;
+			}
+			send_done(d);
+			d->deadline = seconds() + DONE_TIMEOUT;
+			return;
+	}
+	d->deadline = seconds() + timeout;
+}
+
+/* Multicast pass */
+
+static void
+multicast_status(void)
+{
+	uint8_t data[4];
+	int count = 0;
+	// One query covers a run of sent pages, so devices do not report pages nobody sent
+	while ((mc.status_next < mc.pages) && !BIT(mc.dirty, mc.status_next))
+		mc.status_next++;
+	if (mc.status_next >= mc.pages)
+		return;
+	while ((mc.status_next + count < mc.pages) && (count < STATUS_QUERY_MAX) && BIT(mc.dirty, mc.status_next + count))
+		count++;
+	data[0] = COMMAND_FIRMWARE_UPDATE_STATUS;
+	data[1] = (uint8_t)mc.status_next;
+	data[2] = (uint8_t)(mc.status_next >> 8);
+	data[3] = count;
+	boot_command(0, data, sizeof(data));
+	mc.echo_page = -2;	// Echo of STATUS, then answers
+	mc.next_time = seconds() + 2.0;
+	say(0, "status of pages %d..%d", mc.status_next, mc.status_next + count - 1);
+	mc.status_next += count;
+}
+
+static void
+multicast_start(void)
+{
+	int i, j;
+	mc.active = 1;
+	mc.page_size = 0;
+	memset(mc.dirty, 0, sizeof(mc.dirty));
+	for (i = 0; i < device_count; i++)
+	{
+		struct device* d = &devices[i];
+		if (d->state != DEV_MULTICAST)
+			continue;
+		if (!mc.page_size)
+		{
+			mc.page_size = d->page_size;
+			mc.pages = d->pages;
+		}
+		if (d->page_size != mc.page_size)
+		{
+			fail(d, "page size differs from other devices");
+			continue;
+		}
+		for (j = 0; j < (int)sizeof(mc.dirty); j++)
+			mc.dirty[j] |= d->dirty[j];
+	}
+	memcpy(mc.pending, mc.dirty, sizeof(mc.pending));
+	mc.next = 0;
+	mc.echo_page = -1;
+	mc.status_next = -1;
+	mc.next_time = 0;
+	say(0, "sending pages");
+}
+
+static void
+multicast_finish(void)
+{
+	int i, j;
+	mc.active = 0;
+	for (i = 0; i < device_count; i++)
+	{
+		struct device* d = &devices[i];
+		if (d->state != DEV_MULTICAST)
+			continue;
+		for (j = 0; j < d->pages; j++)
+			if (BIT(d->dirty, j))
+				d->written++;
+		start_verify(d);
+	}
+}
+
+static void
+multicast_step(void)
+{
+	const double now = seconds();
+	uint8_t data[5 + MAX_PAGE];
+	uint8_t size;
+
+	if (mc.echo_page != -1)
+	{
+		if (now < mc.next_time)
+			return;
+		// Waited for echo or for answers to STATUS long enough
+		mc.echo_page = -1;
+	}
+	if (now < mc.next_time)
+		return;
+
+	if (mc.status_next < 0)
+	{
+		while ((mc.next < mc.pages) && !BIT(mc.pending, mc.next))
+			mc.next++;
+		if (mc.next < mc.pages)
+		{
+			// Repairs are sent uncompressed: a bootloader could reject RLE
+			page_frame(mc.page_size, mc.next, !mc.rounds, COMMAND_FIRMWARE_UPDATE_STREAM, data, &size);
+			boot_command(0, data, size);
+			mc.echo_page = mc.next++;
+			mc.next_time = now + 2.0;
+			return;
+		}
+		// Pass is over: collect missing pages
+		memset(mc.pending, 0, sizeof(mc.pending));
+		mc.missing = 0;
+		mc.status_next = 0;
+	}
+
+	if (mc.status_next < mc.pages)
+	{
+		multicast_status();
+		if (mc.echo_page == -2)
+			return;
+	}
+
+	// All STATUS queries answered: repeat missing pages or finish
+	if (mc.missing && (++mc.rounds <= MAX_ROUNDS))
+	{
+		say(0, "round %d: %d missing pages", mc.rounds, mc.missing);
+		mc.next = 0;
+		mc.status_next = -1;
+		return;
+	}
+	multicast_finish();
+}
+
+/* Pause after a multicast page: the bootloader does not listen until the page is erased */
+static double
+multicast_gap(int page_size)
+{
+	return PAGE_ERASE_TIME + page_size * PAGE_BYTE_TIME + 8 * BUS_T;
+}
+
+static void
+multicast_echo(const uint8_t* data, uint8_t size)
+{
+	const double now = seconds();
+	if ((mc.echo_page >= 0) && ((data[0] == COMMAND_FIRMWARE_UPDATE_STREAM) || (data[0] == COMMAND_FIRMWARE_UPDATE_STREAM_RLE))
+		&& (size >= 5) && (get32(data + 1) == (uint32_t)(mc.echo_page * mc.page_size)))
+	{
+		mc.next_time = now + multicast_gap(mc.page_size);
+		mc.echo_page = -3;	// Nothing more to wait for except the gap
+	}
+	else if ((mc.echo_page == -2) && (data[0] == COMMAND_FIRMWARE_UPDATE_STATUS))
+	{
+		// Every device with gaps answers once, answers are serialized by arbitration
+		mc.next_time = now + 0.2 + 0.03 * device_count;
+		mc.echo_page = -3;
+	}
+}
+
+static void
+multicast_missing(const uint8_t* data, uint8_t size)
+{
+	const int first = data[1] | (data[2] << 8);
+	int i;
+	if (size < 3)
+		return;
+	for (i = 0; i < (size - 3) * 8; i++)
+	{
+		const int page = first + i;
+		if ((data[3 + (i >> 3)] & (1 << (i & 7))) && (page < mc.pages) && BIT(mc.dirty, page) && !BIT(mc.pending, page))
+		{
+			SET_BIT(mc.pending, page);
+			mc.missing++;
+		}
+	}
+}
+
+/* Gateway input */
+
+static struct device*
+device_by_id(uint8_t id)
+{
+	int i;
+	for (i = 0; i < device_count; i++)
+		if (devices[i].id == id)
+			return &devices[i];
+	return 0;
+}
+
+static void
+record(const uint8_t* r)
+{
+	const uint8_t src = r[0], dst = r[1], command = r[2], size = r[3];
+	const uint8_t* data = r + CLUNET_GW_HEADER_SIZE;
+	struct device* d;
+
+	if (src == CLUNET_GW_CONTROL)
+	{
+		if (dst == CLUNET_GW_HELLO)
+			gateway = command;
+		return;
+	}
+	if ((src == gateway) && (dst == CLUNET_BROADCAST_ADDRESS) && (command == CLUNET_COMMAND_BOOT_CONTROL) && size && mc.active)
+	{
+		multicast_echo(data, size);
+		return;
+	}
+	d = device_by_id(src);
+	if (!d)
+		return;
+	if ((command == CLUNET_COMMAND_BOOT_COMPLETED) && (d->state == DEV_DONE))
+	{
+		say(d, "application started");
+		d->state = DEV_FINISHED;
+		d->finished = seconds();
+		return;
+	}
+	if ((command != CLUNET_COMMAND_BOOT_CONTROL) || !size || ((dst != gateway) && (dst != CLUNET_BROADCAST_ADDRESS)))
+		return;
+	if (mc.active && (data[0] == COMMAND_FIRMWARE_UPDATE_MISSING))
+		multicast_missing(data, size);
+	else
+		device_frame(d, data, size);
+}
+
+static int
+receive(double wait)
+{
+	struct pollfd pfd = { sock, POLLIN, 0 };
+	size_t pos = 0;
+	ssize_t n;
+	const int ms = (int)(wait * 1000) + 1;
+
+	if (poll(&pfd, 1, ms) <= 0)
+		return 0;
+	n = read(sock, in_buf + in_len, sizeof(in_buf) - in_len);
+	if (n <= 0)
+	{
+		fprintf(stderr, "gateway: connection closed\n");
+		return -1;
+	}
+	in_len += n;
+	while (in_len - pos >= CLUNET_GW_HEADER_SIZE)
+	{
+		const size_t length = CLUNET_GW_HEADER_SIZE + in_buf[pos + 3];
+		if (in_len - pos < length)
+			break;
+		record(in_buf + pos);
+		pos += length;
+	}
+	memmove(in_buf, in_buf + pos, in_len - pos);
+	in_len -= pos;
+	return 0;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: clunet-flasher [options] HOST [PORT] ID[,ID...] FILE.hex\n"
+		"  -m      multicast: send every page once to all devices, then repair gaps\n"
+		"  -f      write every page (do not compare page CRCs)\n"
+		"  -c      bootloader without CRC query: write every page, do not verify\n"
+		"  -z      do not compress pages\n"
+		"  -w      stop-and-wait WRITE instead of pipelined STREAM (old bootloaders)\n"
+		"  -R      do not send REBOOT, devices start the bootloader themselves\n"
+		"  -t MS   answer timeout (default 500)\n"
+		"  -v      print progress\n"
+		"PORT defaults to %d.\n", CLUNET_GW_PORT);
+}
+
+int
+main(int argc, char** argv)
+{
+	const char *host, *port = "10009", *ids, *file;
+	char port_default[8];
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "mfczwRt:vh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'm': multicast = 1; break;
+			case 'f': full = 1; break;
+			case 'c': full = no_crc = 1; break;
+			case 'z': no_rle = 1; break;
+			case 'w': stop_and_wait = 1; break;
+			case 'R': no_reboot = 1; break;
+			case 't': timeout = atoi(optarg) / 1000.0; break;
+			case 'v': verbose = 1; break;
+			default: usage(); return 2;
+		}
+	}
+	snprintf(port_default, sizeof(port_default), "%d", CLUNET_GW_PORT);
+	port = port_default;
+	if (argc - optind == 4)
+	{
+		host = argv[optind];
+		port = argv[optind + 1];
+		ids = argv[optind + 2];
+		file = argv[optind + 3];
+	}
+	else if (argc - optind == 3)
+	{
+		host = argv[optind];
+		ids = argv[optind + 1];
+		file = argv[optind + 2];
+	}
+	else
+	{
+		usage();
+		return 2;
+	}
+	if (multicast && stop_and_wait)
+	{
+		fprintf(stderr, "multicast needs a streaming bootloader, -m and -w can not be used together\n");
+		return 2;
+	}
+
+	while (*ids && (device_count < MAX_DEVICES))
+	{
+		char* end;
+		const long id = strtol(ids, &end, 0);
+		if ((end == ids) || (id < 0) || (id >= CLUNET_BROADCAST_ADDRESS) || device_by_id(id))
+		{
+			usage();
+			return 2;
+		}
+		memset(&devices[device_count], 0, sizeof(devices[0]));
+		devices[device_count++].id = id;
+		ids = (*end == ',') ? end + 1 : end;
+	}
+	if (!device_count)
+	{
+		usage();
+		return 2;
+	}
+
+	if (load_hex(file))
+		return 1;
+	image_crc = crc16(image, image_length);
+
+	sock = gateway_connect(host, port);
+	if (sock < 0)
+		return 1;
+
+	// Gateway tells its bus address, the bootloaders answer to it
+	const double hello_deadline = seconds() + 2.0;
+	while ((gateway < 0) && (seconds() < hello_deadline))
+		if (receive(hello_deadline - seconds()))
+			return 1;
+	if (gateway < 0)
+	{
+		fprintf(stderr, "gateway: no HELLO\n");
+		return 1;
+	}
+
+	const double start = seconds();
+	for (i = 0; i < device_count; i++)
+	{
+		struct device* d = &devices[i];
+		d->started = start;
+		d->inflight = -1;
+		set_state(d, DEV_REBOOT, no_reboot ? 10 * REBOOT_TIMEOUT : REBOOT_TIMEOUT);
+		send_reboot(d);
+	}
+
+	while (1)
+	{
+		int active = 0, waiting = 0;
+		if (flush_frames() || receive(0.002))
+			return 1;
+		const double now = seconds();
+		for (i = 0; i < device_count; i++)
+		{
+			struct device* d = &devices[i];
+			if ((d->state == DEV_FINISHED) || (d->state == DEV_FAILED))
+				continue;
+			active++;
+			if (d->state == DEV_MULTICAST)
+				waiting++;
+			else if (now >= d->deadline)
+				device_timeout(d);
+		}
+		if (!active)
+			break;
+		// Multicast pass starts when every device has compared its pages
+		if (multicast && !mc.active && waiting && (waiting == active))
+			multicast_start();
+		if (mc.active)
+			multicast_step();
+	}
+	flush_frames();
+
+	const double elapsed = seconds() - start;
+	int ok = 0;
+	uint64_t bus_bytes = mc.bus_bytes;
+	for (i = 0; i < device_count; i++)
+	{
+		const struct device* d = &devices[i];
+		bus_bytes += d->bus_bytes;
+		if (d->state == DEV_FINISHED)
+		{
+			ok++;
+			printf("device %u: ok, %u pages written, %u unchanged, %.2f s\n", d->id, d->written, d->skipped, d->finished - d->started);
+		}
+		else
+			printf("device %u: FAILED (%s)\n", d->id, d->error);
+	}
+	printf("%d of %d devices updated, image %u bytes, %.2f s, %.0f bytes/s (image bytes of all devices per second)\n",
+		ok, device_count, image_length, elapsed, (double)image_length * ok / elapsed);
+	printf("bus payload %llu bytes, %llu frames in %llu gateway writes\n",
+		(unsigned long long)bus_bytes, (unsigned long long)records_out, (unsigned long long)writes_out);
+	close(sock);
+	return (ok == device_count) ? 0 : 1;
+}
@@ -0,0 +1,979 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	clunet-gatewayd: TCP gateway to a CLUNET serial adapter (protocol in clunet_gateway.h).
+
+	Single-threaded epoll loop. Frames from the bus are appended to the output buffers of all
+	subscribed clients and written once per flush interval, so a client gets many frames per
+	write() however many frames the bus carries. Frames of clients go to the adapter in a
+	round-robin order, never more than the adapter has announced it can buffer. While the bus
+	is saturated the input of clients is not read, and TCP flow control slows them down.
+
+	Names of the devices are cached from DISCOVERY_RESPONSE frames. A broadcast DISCOVERY of a
+	client is answered from the cache; the bus is swept again (incrementally, only for devices
+	not known) once per cache lifetime. A device which sends BOOT_COMPLETED is asked for its
+	name by the daemon itself.
+*/
+
+#define _GNU_SOURCE	// accept4()
+
+#include "clunet.h"
+#include "clunet_gateway.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CLIENT_IN_SIZE 4096		// Client input: pending frames stay here until the adapter takes them
+#define MAX_FILTERS 32
+#define MAX_CREDITS 64			// Frames in flight to the adapter
+#define ADAPTER_OUT_SIZE (MAX_CREDITS * CLUNET_GW_MAX_LINK)
+#define CREDIT_TIMEOUT 2.0		// Adapter lost frames in flight (s)
+#define REOPEN_INTERVAL 1.0		// Adapter reopen and HELLO query interval (s)
+#define MAX_EVENTS 256
+
+struct client
+{
+	int fd;				// -1: free slot
+	uint32_t serial;		// Connection number, credits of closed clients are ignored
+	uint8_t in[CLIENT_IN_SIZE];
+	size_t in_len;
+	uint8_t* out;
+	size_t out_len;
+	uint8_t reading;		// EPOLLIN enabled
+	uint8_t writing;		// EPOLLOUT enabled (socket buffer is full)
+	uint8_t dirty;			// In flush list
+	uint8_t closing;
+	struct clunet_gw_filter filters[MAX_FILTERS];
+	int filter_count;
+	uint64_t frames_in, records_out, dropped;
+};
+
+/* Frame in flight to the adapter: the client which sent it gets REJECTED if it was refused */
+struct inflight
+{
+	int client;			// -1: frame of the daemon (node cache)
+	uint32_t serial;
+	uint8_t dst;
+	uint8_t command;
+};
+
+/* Options */
+static const char* device;
+static int baud = 115200;
+static int port = CLUNET_GW_PORT;
+static const char* listen_address = "0.0.0.0";
+static int max_clients = 1024;
+static double flush_delay = 0.005;
+static size_t out_size = 65536;
+static double cache_lifetime = 60;
+static int verbose;
+
+static int epfd;
+static int listener = -1;
+static struct client* clients;
+static int client_count;
+static uint32_t next_serial;
+static int* dirty_list;
+static int dirty_count;
+static double dirty_since;
+static int rr_next;			// Round-robin position of the next client to send
+static int pending_clients;		// Clients whose input was not fully consumed
+
+/* Adapter */
+static struct
+{
+	int fd;
+	int address;			// Bus address of the adapter (-1 until HELLO)
+	struct clunet_gw_link link;
+	uint8_t out[ADAPTER_OUT_SIZE];
+	size_t out_len;
+	uint8_t writing;
+	int window;			// Frames the adapter can buffer
+	int credits;
+	struct inflight inflight[MAX_CREDITS];
+	int inflight_head;
+	double last_credit;
+	double last_attempt;		// Last open attempt or HELLO query
+} adapter = { .fd = -1, .address = -1 };
+
+/* Statistics */
+static struct
+{
+	uint64_t bus_frames;		// Frames received from the adapter
+	uint64_t sent_frames;		// Client frames accepted by the adapter
+	uint64_t rejected;		// Refused by clunet_send() or malformed
+	uint64_t link_errors;		// Damaged serial records
+	uint64_t records_out;		// Records queued to clients
+	uint64_t client_writes;		// write() calls to clients
+	uint64_t dropped;		// Records dropped because a client does not read
+	uint64_t accepted;		// Connections
+	uint64_t discovery_cached;	// DISCOVERY of clients answered from the node cache only
+	uint64_t discovery_swept;	// DISCOVERY of clients which went to the bus
+	uint64_t names_asked;		// DISCOVERY of the daemon to rebooted devices
+} stats;
+
+/* Node cache */
+struct node
+{
+	double seen;			// Last frame from the device, 0: never
+	uint8_t named;			// Name is known since the last boot of the device
+	uint8_t name_len;
+	uint8_t name[CLUNET_GW_MAX_DATA];
+};
+
+static struct node nodes[CLUNET_BROADCAST_ADDRESS];
+static double last_sweep = -1e9;	// Last DISCOVERY which went to the bus
+static uint8_t unnamed[(CLUNET_BROADCAST_ADDRESS + 7) / 8];	// Rebooted devices to be asked for the name
+static int unnamed_count;
+
+static volatile sig_atomic_t stop, dump;
+
+static double
+seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+say(const char* format, ...)
+{
+	va_list args;
+	if (!verbose)
+		return;
+	va_start(args, format);
+	fprintf(stderr, "gatewayd: ");
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+	va_end(args);
+}
+
+static void
+watch(int fd, uint32_t events, uint64_t tag, int op)
+{
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.u64 = tag;
+	if (epoll_ctl(epfd, op, fd, &ev) && (op != EPOLL_CTL_DEL))
+		perror("gatewayd: epoll_ctl");
+}
+
+/* Epoll tags: clients are 0..max_clients-1 */
+#define TAG_LISTENER ((uint64_t)-1)
+#define TAG_ADAPTER ((uint64_t)-2)
+
+/* Adapter */
+
+static void
+adapter_put(const uint8_t* record)
+{
+	if (adapter.fd < 0)
+		return;
+	if (adapter.out_len + CLUNET_GW_MAX_LINK > sizeof(adapter.out))
+		return;	// Unreachable while credits are respected
+	adapter.out_len += clunet_gw_link_encode(record, adapter.out + adapter.out_len);
+}
+
+/* Queues a frame to the adapter, one credit must be available */
+static void
+adapter_send(const uint8_t* record, int client, uint32_t serial)
+{
+	struct inflight* f = &adapter.inflight[(adapter.inflight_head + adapter.window - adapter.credits) % MAX_CREDITS];
+	f->client = client;
+	f->serial = serial;
+	f->dst = record[1];
+	f->command = record[2];
+	if (adapter.credits == adapter.window)
+		adapter.last_credit = seconds();
+	adapter.credits--;
+	adapter_put(record);
+}
+
+static void
+adapter_query(void)
+{
+	const uint8_t hello[CLUNET_GW_HEADER_SIZE] = { CLUNET_GW_CONTROL, CLUNET_GW_HELLO, 0, 0 };
+	adapter_put(hello);
+	adapter.last_attempt = seconds();
+}
+
+static speed_t
+baud_constant(int rate)
+{
+	switch (rate)
+	{
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+		case 460800: return B460800;
+		case 500000: return B500000;
+		case 921600: return B921600;
+		case 1000000: return B1000000;
+	}
+	return 0;
+}
+
+static void
+adapter_open(void)
+{
+	struct termios tio;
+	adapter.last_attempt = seconds();
+	adapter.fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (adapter.fd < 0)
+	{
+		say("%s: %s", device, strerror(errno));
+		return;
+	}
+	if (!tcgetattr(adapter.fd, &tio))
+	{
+		cfmakeraw(&tio);
+		cfsetispeed(&tio, baud_constant(baud));
+		cfsetospeed(&tio, baud_constant(baud));
+		tio.c_cflag |= CLOCAL | CREAD;
+		tcsetattr(adapter.fd, TCSANOW, &tio);
+		tcflush(adapter.fd, TCIOFLUSH);
+	}
+	memset(&adapter.link, 0, sizeof(adapter.link));
+	adapter.out_len = 0;
+	adapter.writing = 0;
+	adapter.address = -1;
+	adapter.window = adapter.credits = 0;
+	watch(adapter.fd, EPOLLIN, TAG_ADAPTER, EPOLL_CTL_ADD);
+	say("%s: opened", device);
+	adapter_query();
+}
+
+static void
+adapter_close(const char* reason)
+{
+	fprintf(stderr, "gatewayd: %s: %s\n", device, reason);
+	watch(adapter.fd, 0, TAG_ADAPTER, EPOLL_CTL_DEL);
+	close(adapter.fd);
+	adapter.fd = -1;
+	adapter.address = -1;
+	adapter.window = adapter.credits = 0;
+}
+
+static void
+adapter_flush(void)
+{
+	size_t pos = 0;
+	while (pos < adapter.out_len)
+	{
+		const ssize_t n = write(adapter.fd, adapter.out + pos, adapter.out_len - pos);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+			{
+				adapter_close(strerror(errno));
+				return;
+			}
+			break;
+		}
+		pos += n;
+	}
+	memmove(adapter.out, adapter.out + pos, adapter.out_len - pos);
+	adapter.out_len -= pos;
+	if (!adapter.writing != !adapter.out_len)
+	{
+		adapter.writing = adapter.out_len != 0;
+		watch(adapter.fd, EPOLLIN | (adapter.writing ? EPOLLOUT : 0), TAG_ADAPTER, EPOLL_CTL_MOD);
+	}
+}
+
+/* Clients */
+
+static void client_put(struct client* c, const uint8_t* record);
+
+static void
+client_close(struct client* c)
+{
+	watch(c->fd, 0, c - clients, EPOLL_CTL_DEL);
+	close(c->fd);
+	say("client %d: closed", (int)(c - clients));
+	c->fd = -1;
+	if (c->in_len)
+		pending_clients--;
+	c->in_len = c->out_len = 0;
+	client_count--;
+}
+
+static void
+client_events(struct client* c)
+{
+	const uint32_t events = (c->reading ? EPOLLIN : 0) | (c->writing ? EPOLLOUT : 0);
+	watch(c->fd, events, c - clients, EPOLL_CTL_MOD);
+}
+
+static void
+mark_dirty(struct client* c)
+{
+	if (c->dirty)
+		return;
+	if (!dirty_count)
+		dirty_since = seconds();
+	c->dirty = 1;
+	dirty_list[dirty_count++] = c - clients;
+}
+
+static void
+client_put(struct client* c, const uint8_t* record)
+{
+	const size_t size = CLUNET_GW_HEADER_SIZE + record[3];
+	if (c->out_len + size > out_size)
+	{
+		// Client does not read: frames are dropped instead of stalling the gateway
+		c->dropped++;
+		stats.dropped++;
+		return;
+	}
+	memcpy(c->out + c->out_len, record, size);
+	c->out_len += size;
+	c->records_out++;
+	stats.records_out++;
+	if (!c->writing)
+		mark_dirty(c);
+}
+
+static void
+client_hello(struct client* c)
+{
+	const uint8_t hello[CLUNET_GW_HEADER_SIZE] = { CLUNET_GW_CONTROL, CLUNET_GW_HELLO, (uint8_t)adapter.address, 0 };
+	client_put(c, hello);
+}
+
+static void
+client_flush(struct client* c)
+{
+	size_t pos = 0;
+	while (pos < c->out_len)
+	{
+		const ssize_t n = write(c->fd, c->out + pos, c->out_len - pos);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				c->closing = 1;
+			break;
+		}
+		stats.client_writes++;
+		pos += n;
+	}
+	memmove(c->out, c->out + pos, c->out_len - pos);
+	c->out_len -= pos;
+	if (!c->writing != !c->out_len)
+	{
+		c->writing = c->out_len != 0;
+		client_events(c);
+	}
+}
+
+static int
+filter_match(const struct clunet_gw_filter* f, const uint8_t* record)
+{
+	const uint8_t src = record[0], dst = record[1], command = record[2];
+	if (!(f->flags & CLUNET_GW_ANY_COMMAND) && (f->command != command))
+		return 0;
+	if (f->flags & CLUNET_GW_ADDRESS)
+		return (f->src == src) || (f->src == dst);
+	if (!(f->flags & CLUNET_GW_ANY_SRC) && (f->src != src))
+		return 0;
+	return (f->flags & CLUNET_GW_ANY_DST) || (f->dst == dst);
+}
+
+static int
+client_wants(const struct client* c, const uint8_t* record)
+{
+	int i;
+	if (!c->filter_count)
+		return 1;
+	for (i = 0; i < c->filter_count; i++)
+		if (filter_match(&c->filters[i], record))
+			return 1;
+	return 0;
+}
+
+static void
+client_reject(struct client* c, uint8_t dst, uint8_t command)
+{
+	const uint8_t rejected[CLUNET_GW_HEADER_SIZE + 1] = { CLUNET_GW_CONTROL, CLUNET_GW_REJECTED, command, 1, dst };
+	stats.rejected++;
+	client_put(c, rejected);
+}
+
+static void
+client_control(struct client* c, const uint8_t* r)
+{
+	const struct clunet_gw_filter* f = (const struct clunet_gw_filter*)(r + CLUNET_GW_HEADER_SIZE);
+	int i;
+	switch (r[1])
+	{
+		case CLUNET_GW_SUBSCRIBE:
+			for (i = 0; (i < r[3] / (int)sizeof(*f)) && (c->filter_count < MAX_FILTERS); i++)
+				c->filters[c->filter_count++] = f[i];
+			break;
+		case CLUNET_GW_UNSUBSCRIBE:
+			c->filter_count = 0;
+			break;
+	}
+}
+
+/* Node cache */
+
+static int
+node_fresh(const struct node* n)
+{
+	return n->named && (seconds() - n->seen < cache_lifetime);
+}
+
+static void
+cache_frame(const uint8_t* r)
+{
+	struct node* n;
+	if ((r[0] >= CLUNET_BROADCAST_ADDRESS) || (r[0] == adapter.address))
+		return;
+	n = &nodes[r[0]];
+	n->seen = seconds();
+	if (r[2] == CLUNET_COMMAND_DISCOVERY_RESPONSE)
+	{
+		n->named = 1;
+		n->name_len = r[3];
+		memcpy(n->name, r + CLUNET_GW_HEADER_SIZE, r[3]);
+		if (unnamed[r[0] >> 3] & (1 << (r[0] & 7)))
+		{
+			unnamed[r[0] >> 3] &= ~(1 << (r[0] & 7));
+			unnamed_count--;
+		}
+	}
+	else if ((r[2] == CLUNET_COMMAND_BOOT_COMPLETED) && !(unnamed[r[0] >> 3] & (1 << (r[0] & 7))))
+	{
+		// Firmware may have changed: the name is asked again
+		n->named = 0;
+		unnamed[r[0] >> 3] |= 1 << (r[0] & 7);
+		unnamed_count++;
+	}
+}
+
+/* DISCOVERY_RESPONSE records of the known devices, as if they have answered the adapter */
+static void
+cache_answer(struct client* c)
+{
+	uint8_t record[CLUNET_GW_MAX_RECORD];
+	int i;
+	for (i = 0; i < CLUNET_BROADCAST_ADDRESS; i++)
+	{
+		const struct node* n = &nodes[i];
+		if (!node_fresh(n))
+			continue;
+		record[0] = i;
+		record[1] = adapter.address;
+		record[2] = CLUNET_COMMAND_DISCOVERY_RESPONSE;
+		record[3] = n->name_len;
+		memcpy(record + CLUNET_GW_HEADER_SIZE, n->name, n->name_len);
+		client_put(c, record);
+	}
+}
+
+/* Incremental DISCOVERY: devices set in the bitmap of known addresses stay silent */
+static void
+cache_sweep(struct client* c)
+{
+	uint8_t record[CLUNET_GW_HEADER_SIZE + (CLUNET_BROADCAST_ADDRESS + 7) / 8] =
+		{ CLUNET_PRIORITY_MESSAGE, CLUNET_BROADCAST_ADDRESS, CLUNET_COMMAND_DISCOVERY, 0 };
+	int i;
+	for (i = 0; i < CLUNET_BROADCAST_ADDRESS; i++)
+	{
+		if (node_fresh(&nodes[i]))
+		{
+			record[CLUNET_GW_HEADER_SIZE + (i >> 3)] |= 1 << (i & 7);
+			record[3] = (i >> 3) + 1;
+		}
+	}
+	adapter_send(record, c - clients, c->serial);
+	last_sweep = seconds();
+	stats.discovery_swept++;
+}
+
+/* Rebooted devices are asked for the name, one frame per free credit */
+static void
+cache_ask(void)
+{
+	int i;
+	for (i = 0; (i < CLUNET_BROADCAST_ADDRESS) && unnamed_count && (adapter.credits > 0); i++)
+	{
+		if (unnamed[i >> 3] & (1 << (i & 7)))
+		{
+			const uint8_t discovery[CLUNET_GW_HEADER_SIZE] = { CLUNET_PRIORITY_MESSAGE, (uint8_t)i, CLUNET_COMMAND_DISCOVERY, 0 };
+			unnamed[i >> 3] &= ~(1 << (i & 7));
+			unnamed_count--;
+			adapter_send(discovery, -1, 0);
+			stats.names_asked++;
+		}
+	}
+}
+
+/*	Consumes the records at the head of client input: control records are handled at once,
+	the next frame is taken only if 'send' is set and the adapter has a free slot.
+	Returns 1 if a frame has been sent.
+*/
+static int
+client_consume(struct client* c, int send)
+{
+	size_t pos = 0;
+	int sent = 0;
+	const size_t before = c->in_len;
+	while (c->in_len - pos >= CLUNET_GW_HEADER_SIZE)
+	{
+		const uint8_t* r = c->in + pos;
+		const size_t length = CLUNET_GW_HEADER_SIZE + r[3];
+		if (c->in_len - pos < length)
+			break;
+		if (r[0] == CLUNET_GW_CONTROL)
+			client_control(c, r);
+		else if (!r[0] || (r[0] > 8) || (r[3] > CLUNET_GW_MAX_DATA))
+			client_reject(c, r[1], r[2]);
+		else if (cache_lifetime && (r[1] == CLUNET_BROADCAST_ADDRESS) && (r[2] == CLUNET_COMMAND_DISCOVERY) && !r[3]
+			&& (seconds() - last_sweep < cache_lifetime))
+		{
+			cache_answer(c);
+			stats.discovery_cached++;
+		}
+		else
+		{
+			if (!send || sent || (adapter.credits <= 0))
+				break;
+			if (cache_lifetime && (r[1] == CLUNET_BROADCAST_ADDRESS) && (r[2] == CLUNET_COMMAND_DISCOVERY) && !r[3])
+			{
+				cache_answer(c);
+				cache_sweep(c);
+			}
+			else
+				adapter_send(r, c - clients, c->serial);
+			c->frames_in++;
+			sent = 1;
+		}
+		pos += length;
+	}
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+	if (!before != !c->in_len)
+		pending_clients += c->in_len ? 1 : -1;
+	// Input had no room for the next record, it is read again when the frames are sent
+	if (!c->reading && (c->in_len < sizeof(c->in) / 2))
+	{
+		c->reading = 1;
+		client_events(c);
+	}
+	return sent;
+}
+
+/* Frames of clients to the adapter, one frame per client in turn */
+static void
+pump(void)
+{
+	int idle = 0;
+	if (adapter.address < 0)
+		return;
+	if (cache_lifetime && unnamed_count)
+		cache_ask();
+	while ((adapter.credits > 0) && pending_clients && (idle < max_clients))
+	{
+		struct client* c = &clients[rr_next];
+		rr_next = (rr_next + 1) % max_clients;
+		if ((c->fd >= 0) && c->in_len && client_consume(c, 1))
+			idle = 0;
+		else
+			idle++;
+	}
+}
+
+static void
+client_read(struct client* c)
+{
+	while (c->in_len < sizeof(c->in))
+	{
+		const ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				c->closing = 1;
+			break;
+		}
+		if (!n)
+		{
+			c->closing = 1;
+			break;
+		}
+		if (!c->in_len)
+			pending_clients++;
+		c->in_len += n;
+	}
+	client_consume(c, 0);
+	if (c->in_len == sizeof(c->in))
+	{
+		// Backpressure: frames wait for the bus, stop reading the socket
+		c->reading = 0;
+		client_events(c);
+	}
+}
+
+static void
+accept_clients(void)
+{
+	while (1)
+	{
+		const int fd = accept4(listener, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		const int one = 1;
+		int i;
+		if (fd < 0)
+			return;
+		for (i = 0; (i < max_clients) && (clients[i].fd >= 0); i++);
+		if (i == max_clients)
+		{
+			close(fd);
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		struct client* c = &clients[i];
+		c->fd = fd;
+		c->serial = ++next_serial;
+		c->in_len = c->out_len = 0;
+		c->reading = 1;
+		c->writing = c->dirty = c->closing = 0;
+		c->filter_count = 0;
+		c->frames_in = c->records_out = c->dropped = 0;
+		client_count++;
+		stats.accepted++;
+		watch(fd, EPOLLIN, i, EPOLL_CTL_ADD);
+		say("client %d: connected", i);
+		if (adapter.address >= 0)
+			client_hello(c);
+	}
+}
+
+/* Adapter input */
+
+static void
+adapter_record(const uint8_t* r)
+{
+	int i;
+	if (r[0] == CLUNET_GW_CONTROL)
+	{
+		switch (r[1])
+		{
+			case CLUNET_GW_HELLO:
+				// Adapter (re)started: frames in flight are lost
+				adapter.address = r[2];
+				adapter.window = (r[3] && r[4]) ? r[4] : 1;
+				if (adapter.window > MAX_CREDITS)
+					adapter.window = MAX_CREDITS;
+				adapter.credits = adapter.window;
+				adapter.inflight_head = 0;
+				say("adapter %d, %d frames window", adapter.address, adapter.window);
+				for (i = 0; i < max_clients; i++)
+					if (clients[i].fd >= 0)
+						client_hello(&clients[i]);
+				break;
+			case CLUNET_GW_CREDIT:
+				if (adapter.credits < adapter.window)
+				{
+					const struct inflight* f = &adapter.inflight[adapter.inflight_head];
+					adapter.inflight_head = (adapter.inflight_head + 1) % MAX_CREDITS;
+					adapter.credits++;
+					adapter.last_credit = seconds();
+					if (r[2])
+						stats.sent_frames++;
+					else if ((f->client >= 0) && (clients[f->client].fd >= 0) && (clients[f->client].serial == f->serial))
+						client_reject(&clients[f->client], f->dst, f->command);
+				}
+				break;
+		}
+		return;
+	}
+	stats.bus_frames++;
+	if (cache_lifetime)
+		cache_frame(r);
+	for (i = 0; i < max_clients; i++)
+	{
+		struct client* c = &clients[i];
+		if ((c->fd >= 0) && client_wants(c, r))
+			client_put(c, r);
+	}
+}
+
+static void
+adapter_read(void)
+{
+	uint8_t buf[4096];
+	while (adapter.fd >= 0)
+	{
+		const ssize_t n = read(adapter.fd, buf, sizeof(buf));
+		ssize_t i;
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				adapter_close(strerror(errno));
+			return;
+		}
+		if (!n)
+		{
+			adapter_close("closed");
+			return;
+		}
+		for (i = 0; i < n; i++)
+		{
+			const int size = clunet_gw_link_input(&adapter.link, buf[i]);
+			if (size > 0)
+				adapter_record(adapter.link.record);
+			else if (size < 0)
+				stats.link_errors++;
+		}
+	}
+}
+
+/* Main loop */
+
+static void
+flush_clients(void)
+{
+	int i;
+	for (i = 0; i < dirty_count; i++)
+	{
+		struct client* c = &clients[dirty_list[i]];
+		c->dirty = 0;
+		if ((c->fd >= 0) && !c->writing)
+		{
+			client_flush(c);
+			if (c->closing)
+				client_close(c);
+		}
+	}
+	dirty_count = 0;
+}
+
+static void
+print_stats(void)
+{
+	fprintf(stderr, "gatewayd: clients %d (accepted %llu), bus frames %llu, sent %llu, rejected %llu, link errors %llu\n",
+		client_count, (unsigned long long)stats.accepted, (unsigned long long)stats.bus_frames,
+		(unsigned long long)stats.sent_frames, (unsigned long long)stats.rejected, (unsigned long long)stats.link_errors);
+	fprintf(stderr, "gatewayd: records to clients %llu in %llu writes (%.1f per write), dropped %llu\n",
+		(unsigned long long)stats.records_out, (unsigned long long)stats.client_writes,
+		stats.client_writes ? (double)stats.records_out / stats.client_writes : 0.0, (unsigned long long)stats.dropped);
+	fprintf(stderr, "gatewayd: discovery from cache %llu, from bus %llu, names asked %llu\n",
+		(unsigned long long)stats.discovery_cached, (unsigned long long)stats.discovery_swept, (unsigned long long)stats.names_asked);
+}
+
+static void
+on_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		dump = 1;
+	else
+		stop = 1;
+}
+
+static int
+listen_on(void)
+{
+	struct sockaddr_in addr;
+	const int one = 1;
+	const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (!inet_aton(listen_address, &addr.sin_addr) || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 1024))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: clunet-gatewayd [options] -d DEVICE\n"
+		"  -d DEVICE  serial adapter (tty or pty)\n"
+		"  -b BAUD    serial speed (default 115200)\n"
+		"  -p PORT    TCP port (default %d)\n"
+		"  -a ADDR    listen address (default 0.0.0.0)\n"
+		"  -c N       maximum clients (default 1024)\n"
+		"  -F MS      output batching interval, 0 writes at once (default 5)\n"
+		"  -o KB      output buffer of a client, frames are dropped when it is full (default 64)\n"
+		"  -D S       node cache lifetime: DISCOVERY is answered from the cache, 0 passes it to the bus (default 60)\n"
+		"  -v         log connections\n"
+		"SIGUSR1 prints statistics.\n", CLUNET_GW_PORT);
+}
+
+int
+main(int argc, char** argv)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "d:b:p:a:c:F:o:D:vh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd': device = optarg; break;
+			case 'b': baud = atoi(optarg); break;
+			case 'p': port = atoi(optarg); break;
+			case 'a': listen_address = optarg; break;
+			case 'c': max_clients = atoi(optarg); break;
+			case 'F': flush_delay = atof(optarg) / 1000; break;
+			case 'o': out_size = atoi(optarg) * 1024; break;
+			case 'D': cache_lifetime = atof(optarg); break;
+			case 'v': verbose = 1; break;
+			default: usage(); return 2;
+		}
+	}
+	if (!device || (max_clients < 1) || (out_size < CLUNET_GW_MAX_RECORD) || !baud_constant(baud) || (cache_lifetime < 0))
+	{
+		usage();
+		return 2;
+	}
+
+	clients = calloc(max_clients, sizeof(*clients));
+	dirty_list = calloc(max_clients, sizeof(*dirty_list));
+	if (!clients || !dirty_list)
+		return 1;
+	for (i = 0; i < max_clients; i++)
+	{
+		clients[i].fd = -1;
+		clients[i].out = malloc(out_size);
+		if (!clients[i].out)
+			return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGUSR1, on_signal);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	listener = listen_on();
+	if ((epfd < 0) || (listener < 0))
+	{
+		fprintf(stderr, "gatewayd: port %d: %s\n", port, strerror(errno));
+		return 1;
+	}
+	watch(listener, EPOLLIN, TAG_LISTENER, EPOLL_CTL_ADD);
+	adapter_open();
+
+	while (!stop)
+	{
+		double now = seconds();
+		double wake = now + REOPEN_INTERVAL;
+		int count, timeout_ms;
+
+		if (dirty_count && (dirty_since + flush_delay < wake))
+			wake = dirty_since + flush_delay;
+		if ((adapter.fd >= 0) && (adapter.credits < adapter.window) && (adapter.last_credit + CREDIT_TIMEOUT < wake))
+			wake = adapter.last_credit + CREDIT_TIMEOUT;
+		timeout_ms = (wake > now) ? (int)((wake - now) * 1000) + 1 : 0;
+		count = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+		if (dump)
+		{
+			dump = 0;
+			print_stats();
+		}
+		for (i = 0; i < count; i++)
+		{
+			const uint64_t tag = events[i].data.u64;
+			if (tag == TAG_LISTENER)
+				accept_clients();
+			else if (tag == TAG_ADAPTER)
+			{
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					adapter_read();
+				if ((adapter.fd >= 0) && (events[i].events & EPOLLOUT))
+					adapter_flush();
+			}
+			else
+			{
+				struct client* c = &clients[tag];
+				if (c->fd < 0)
+					continue;
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					client_read(c);
+				if (events[i].events & EPOLLOUT)
+					client_flush(c);
+				if (c->closing)
+					client_close(c);
+			}
+		}
+
+		now = seconds();
+		if (adapter.fd < 0)
+		{
+			if (now - adapter.last_attempt >= REOPEN_INTERVAL)
+				adapter_open();
+		}
+		else if ((adapter.address < 0) && (now - adapter.last_attempt >= REOPEN_INTERVAL))
+			adapter_query();
+		else if ((adapter.credits < adapter.window) && (now - adapter.last_credit >= CREDIT_TIMEOUT))
+		{
+			// Adapter does not return credits: ask it to start over
+			say("adapter does not answer, resynchronizing");
+			adapter.address = -1;
+			adapter_query();
+		}
+
+		pump();
+		if (adapter.fd >= 0)
+			adapter_flush();
+		if (dirty_count && (now - dirty_since >= flush_delay))
+			flush_clients();
+	}
+
+	print_stats();
+	return 0;
+}
@@ -0,0 +1,321 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	clunet-gwload: many-client load of a CLUNET gateway.
+
+	One connection pings devices as fast as the gateway takes frames, the others only listen.
+	Half of the listeners subscribe to the traffic of one device, the rest get everything.
+	Reports replies per second and records per read() of the listeners (batching of the gateway),
+	and fails if a subscribed client gets a frame outside its filter.
+	Before the load the sender discovers the devices twice: the second answer comes from the
+	node cache of the gateway.
+*/
+
+#include "clunet.h"
+#include "clunet_gateway.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DEVICES 64
+#define PING_WINDOW 8		// Pings in flight
+
+struct connection
+{
+	int fd;
+	int address;		// Subscribed device (-1: all frames)
+	uint8_t in[8192];
+	size_t in_len;
+	uint64_t records, reads, violations;
+};
+
+static struct connection* connections;
+static int connection_count = 200;
+static int devices[MAX_DEVICES];
+static int device_count;
+static int gateway = -1;
+static uint64_t replies;
+static uint8_t discovered[256];
+
+static double
+seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+connect_to(const char* host, const char* port)
+{
+	struct addrinfo hints, *ai;
+	int fd;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &ai))
+		return -1;
+	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if ((fd >= 0) && connect(fd, ai->ai_addr, ai->ai_addrlen))
+	{
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+static int
+send_all(int fd, const uint8_t* data, size_t size)
+{
+	while (size)
+	{
+		const ssize_t n = write(fd, data, size);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static void
+record(struct connection* c, const uint8_t* r, int sender)
+{
+	if (r[0] == CLUNET_GW_CONTROL)
+	{
+		if (r[1] == CLUNET_GW_HELLO)
+			gateway = r[2];
+		return;
+	}
+	c->records++;
+	if ((c->address >= 0) && (r[0] != c->address) && (r[1] != c->address))
+		c->violations++;
+	if (sender && (r[2] == CLUNET_COMMAND_PING_REPLY) && (r[1] == gateway))
+		replies++;
+	if (sender && (r[2] == CLUNET_COMMAND_DISCOVERY_RESPONSE) && (r[1] == gateway))
+		discovered[r[0]] = 1;
+}
+
+/* Returns -1 when the connection is closed */
+static int
+receive(struct connection* c, int sender)
+{
+	size_t pos = 0;
+	const ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+	if (n <= 0)
+		return ((n < 0) && (errno == EINTR)) ? 0 : -1;
+	c->reads++;
+	c->in_len += n;
+	while (c->in_len - pos >= CLUNET_GW_HEADER_SIZE)
+	{
+		const size_t length = CLUNET_GW_HEADER_SIZE + c->in[pos + 3];
+		if (c->in_len - pos < length)
+			break;
+		record(c, c->in + pos, sender);
+		pos += length;
+	}
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+	return 0;
+}
+
+/* Broadcast DISCOVERY from the sender, returns the time until all devices have answered or -1 */
+static double
+discover(struct pollfd* fds)
+{
+	const uint8_t discovery[CLUNET_GW_HEADER_SIZE] = { CLUNET_PRIORITY_MESSAGE, CLUNET_BROADCAST_ADDRESS, CLUNET_COMMAND_DISCOVERY, 0 };
+	const double start = seconds();
+	int i, missing = device_count;
+	memset(discovered, 0, sizeof(discovered));
+	if (send_all(connections[0].fd, discovery, sizeof(discovery)))
+		return -1;
+	while (missing && (seconds() - start < 2))
+	{
+		if (poll(fds, connection_count + 1, 10) < 0)
+			return -1;
+		for (i = 0; i <= connection_count; i++)
+			if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && receive(&connections[i], !i))
+				return -1;
+		for (i = missing = 0; i < device_count; i++)
+			missing += !discovered[devices[i]];
+	}
+	return missing ? -1 : seconds() - start;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: clunet-gwload [options] HOST [PORT] ID[,ID...]\n"
+		"  -c N    listening connections (default 200)\n"
+		"  -t S    duration (default 5)\n"
+		"PORT defaults to %d.\n", CLUNET_GW_PORT);
+}
+
+int
+main(int argc, char** argv)
+{
+	const char *host, *ids;
+	char port[8];
+	double duration = 5;
+	struct pollfd* fds;
+	uint64_t sent = 0, records = 0, reads = 0, violations = 0;
+	int opt, i, next_device = 0;
+
+	snprintf(port, sizeof(port), "%d", CLUNET_GW_PORT);
+	while ((opt = getopt(argc, argv, "c:t:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'c': connection_count = atoi(optarg); break;
+			case 't': duration = atof(optarg); break;
+			default: usage(); return 2;
+		}
+	}
+	if (argc - optind == 3)
+	{
+		host = argv[optind];
+		snprintf(port, sizeof(port), "%s", argv[optind + 1]);
+		ids = argv[optind + 2];
+	}
+	else if (argc - optind == 2)
+	{
+		host = argv[optind];
+		ids = argv[optind + 1];
+	}
+	else
+	{
+		usage();
+		return 2;
+	}
+	while (*ids && (device_count < MAX_DEVICES))
+	{
+		char* end;
+		devices[device_count++] = strtol(ids, &end, 0);
+		if (end == ids)
+		{
+			usage();
+			return 2;
+		}
+		ids = (*end == ',') ? end + 1 : end;
+	}
+	if (!device_count || (connection_count < 1))
+	{
+		usage();
+		return 2;
+	}
+
+	// Connection 0 sends pings, the others listen
+	connections = calloc(connection_count + 1, sizeof(*connections));
+	fds = calloc(connection_count + 1, sizeof(*fds));
+	if (!connections || !fds)
+		return 1;
+	for (i = 0; i <= connection_count; i++)
+	{
+		struct connection* c = &connections[i];
+		c->fd = connect_to(host, port);
+		if (c->fd < 0)
+		{
+			fprintf(stderr, "gwload: %s:%s: connection %d failed\n", host, port, i);
+			return 1;
+		}
+		c->address = ((i > 0) && (i & 1)) ? devices[(i / 2) % device_count] : -1;
+		if (c->address >= 0)
+		{
+			const uint8_t subscribe[CLUNET_GW_HEADER_SIZE + sizeof(struct clunet_gw_filter)] =
+				{ CLUNET_GW_CONTROL, CLUNET_GW_SUBSCRIBE, 0, sizeof(struct clunet_gw_filter),
+				  (uint8_t)c->address, 0, 0, CLUNET_GW_ADDRESS | CLUNET_GW_ANY_COMMAND };
+			send_all(c->fd, subscribe, sizeof(subscribe));
+		}
+		fds[i].fd = c->fd;
+		fds[i].events = POLLIN;
+	}
+
+	// Frames which came before the gateway read SUBSCRIBE are not counted
+	const double settle = seconds() + 0.5;
+	while (seconds() < settle)
+	{
+		if (poll(fds, connection_count + 1, 100) < 0)
+			break;
+		for (i = 0; i <= connection_count; i++)
+			if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && receive(&connections[i], 0))
+				return 1;
+	}
+	const double bus = discover(fds), cached = discover(fds);
+	if ((bus < 0) || (cached < 0))
+	{
+		fprintf(stderr, "gwload: devices do not answer DISCOVERY\n");
+		return 1;
+	}
+	printf("discovery of %d devices: %.1f ms, again %.1f ms\n", device_count, bus * 1000, cached * 1000);
+	for (i = 0; i <= connection_count; i++)
+		connections[i].records = connections[i].reads = connections[i].violations = 0;
+
+	const double start = seconds();
+	double now = start;
+	while (now - start < duration)
+	{
+		// Keep the window of pings full
+		while ((gateway >= 0) && (sent - replies < PING_WINDOW))
+		{
+			const uint8_t ping[CLUNET_GW_HEADER_SIZE] = { CLUNET_PRIORITY_MESSAGE, (uint8_t)devices[next_device], CLUNET_COMMAND_PING, 0 };
+			next_device = (next_device + 1) % device_count;
+			if (send_all(connections[0].fd, ping, sizeof(ping)))
+				return 1;
+			sent++;
+		}
+		if (poll(fds, connection_count + 1, 100) < 0)
+			break;
+		for (i = 0; i <= connection_count; i++)
+		{
+			if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && receive(&connections[i], !i))
+			{
+				fprintf(stderr, "gwload: connection %d closed by the gateway\n", i);
+				return 1;
+			}
+		}
+		now = seconds();
+	}
+
+	for (i = 1; i <= connection_count; i++)
+	{
+		records += connections[i].records;
+		reads += connections[i].reads;
+		violations += connections[i].violations;
+	}
+	printf("%d listeners, %.1f s: %llu pings, %.0f replies/s, %llu records to listeners in %llu reads (%.1f per read), %llu filter violations\n",
+		connection_count, now - start, (unsigned long long)sent, replies / (now - start), (unsigned long long)records,
+		(unsigned long long)reads, reads ? (double)records / reads : 0.0, (unsigned long long)violations);
+	return (!replies || violations) ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	TCP protocol of the CLUNET network gateway (default port 10009).
+
+	Both directions carry a stream of records: a 4-byte header and up to 250 bytes of data,
+	several records may share one TCP segment.
+
+	Client -> gateway:
+		[prio 1..8] [dst] [command] [size] [data...]	send a frame to the bus
+	Gateway -> client:
+		[src] [dst] [command] [size] [data...]		frame seen on the bus, frames sent by the gateway
+								itself come back too (src is the gateway address),
+								when they have been transmitted
+	Both directions:
+		[CLUNET_GW_CONTROL] [op] [arg] [size] [data...]	gateway control record (0xFF is neither
+								a valid priority nor a valid source address)
+
+	A client without subscriptions receives every frame. After SUBSCRIBE it receives only the frames
+	matching any of its filters.
+
+	Serial adapter link (clunet-gatewayd <-> adapter on the bus): the same records, every record
+	is followed by CRC-8 (Dallas/Maxim, as on the bus) and SLIP framed (RFC 1055). The adapter
+	announces itself with HELLO carrying the number of host frames it can buffer. Every frame of
+	the host is answered with CREDIT once the adapter has passed it to clunet_send(), so the
+	host never has more frames in flight than the adapter can buffer.
+*/
+
+#ifndef __CLUNET_GATEWAY_H__
+#define __CLUNET_GATEWAY_H__
+
+#include <stdint.h>
+
+#define CLUNET_GW_PORT 10009
+
+#define CLUNET_GW_HEADER_SIZE 4
+#define CLUNET_GW_MAX_DATA 250
+#define CLUNET_GW_MAX_RECORD (CLUNET_GW_HEADER_SIZE + CLUNET_GW_MAX_DATA)
+
+#define CLUNET_GW_CONTROL 0xFF
+
+/* Control operations */
+#define CLUNET_GW_HELLO 0x01		// gateway -> client on connect, arg: bus address of the gateway
+					// adapter -> host, arg: bus address, data[0]: host frames it can buffer
+#define CLUNET_GW_SUBSCRIBE 0x02	// client -> gateway, data: filters (struct clunet_gw_filter)
+#define CLUNET_GW_UNSUBSCRIBE 0x03	// client -> gateway, removes all filters
+#define CLUNET_GW_CREDIT 0x04		// adapter -> host, arg: 1 frame queued, 0 frame refused by clunet_send()
+#define CLUNET_GW_REJECTED 0x05		// gateway -> client, arg: command, data[0]: destination of a refused frame
+
+/* Subscription filter, a frame matches when all fields not covered by flags are equal */
+struct clunet_gw_filter
+{
+	uint8_t src;
+	uint8_t dst;
+	uint8_t command;
+	uint8_t flags;
+};
+
+#define CLUNET_GW_ANY_SRC 0x01
+#define CLUNET_GW_ANY_DST 0x02
+#define CLUNET_GW_ANY_COMMAND 0x04
+#define CLUNET_GW_ADDRESS 0x08		// src field matches source or destination (any traffic of a device)
+
+/* SLIP framing of the serial link */
+#define CLUNET_GW_SLIP_END 0xC0
+#define CLUNET_GW_SLIP_ESC 0xDB
+#define CLUNET_GW_SLIP_ESC_END 0xDC
+#define CLUNET_GW_SLIP_ESC_ESC 0xDD
+#define CLUNET_GW_MAX_LINK (2 * (CLUNET_GW_MAX_RECORD + 1) + 1)
+
+/* Serial link receiver */
+struct clunet_gw_link
+{
+	uint8_t record[CLUNET_GW_MAX_RECORD + 1];
+	uint16_t size;
+	uint8_t escape;
+	uint8_t overflow;
+};
+
+/* Record header */
+struct clunet_gw_header
+{
+	uint8_t prio_src;	// Priority (to gateway), source address (from gateway) or CLUNET_GW_CONTROL
+	uint8_t dst_op;		// Destination address or control operation
+	uint8_t command_arg;	// Command or control argument
+	uint8_t size;		// Size of data
+};
+
+// Encodes record (header and data) for the serial link, returns the encoded size (up to CLUNET_GW_MAX_LINK)
+uint16_t clunet_gw_link_encode(const uint8_t* record, uint8_t* out);
+
+// Feeds a received byte, returns the record size when a complete valid record is in link->record,
+// 0 while receiving, -1 for a damaged record
+int clunet_gw_link_input(struct clunet_gw_link* link, uint8_t byte);
+
+#endif
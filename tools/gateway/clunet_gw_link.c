@@ -0,0 +1,108 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/* Serial link framing of the gateway records (see clunet_gateway.h) */
+
+#include "clunet_gateway.h"
+
+static uint8_t
+crc8_update(uint8_t crc, uint8_t data)
+{
+	uint8_t i;
+	crc ^= data;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 1) ? ((crc >> 1) ^ 0x8C) : (crc >> 1);
+	return crc;
+}
+
+static uint8_t*
+slip_put(uint8_t* out, uint8_t byte)
+{
+	if (byte == CLUNET_GW_SLIP_END)
+	{
+		*out++ = CLUNET_GW_SLIP_ESC;
+		*out++ = CLUNET_GW_SLIP_ESC_END;
+	}
+	else if (byte == CLUNET_GW_SLIP_ESC)
+	{
+		*out++ = CLUNET_GW_SLIP_ESC;
+		*out++ = CLUNET_GW_SLIP_ESC_ESC;
+	}
+	else
+		*out++ = byte;
+	return out;
+}
+
+uint16_t
+clunet_gw_link_encode(const uint8_t* record, uint8_t* out)
+{
+	const uint16_t size = CLUNET_GW_HEADER_SIZE + record[3];
+	uint8_t* const start = out;
+	uint8_t crc = 0;
+	uint16_t i;
+	// Leading END flushes line noise collected by the receiver
+	*out++ = CLUNET_GW_SLIP_END;
+	for (i = 0; i < size; i++)
+	{
+		crc = crc8_update(crc, record[i]);
+		out = slip_put(out, record[i]);
+	}
+	out = slip_put(out, crc);
+	*out++ = CLUNET_GW_SLIP_END;
+	return out - start;
+}
+
+int
+clunet_gw_link_input(struct clunet_gw_link* link, uint8_t byte)
+{
+	if (byte == CLUNET_GW_SLIP_END)
+	{
+		const uint16_t size = link->size;
+		const uint8_t overflow = link->overflow;
+		uint8_t crc = 0;
+		uint16_t i;
+		link->size = link->escape = link->overflow = 0;
+		if (!size)
+			return 0;
+		for (i = 0; i < size; i++)
+			crc = crc8_update(crc, link->record[i]);
+		if (overflow || (size < CLUNET_GW_HEADER_SIZE + 1) || crc || (size != CLUNET_GW_HEADER_SIZE + link->record[3] + 1))
+			return -1;
+		return size - 1;
+	}
+	if (byte == CLUNET_GW_SLIP_ESC)
+	{
+		link->escape = 1;
+		return 0;
+	}
+	if (link->escape)
+	{
+		link->escape = 0;
+		if (byte == CLUNET_GW_SLIP_ESC_END)
+			byte = CLUNET_GW_SLIP_END;
+		else if (byte == CLUNET_GW_SLIP_ESC_ESC)
+			byte = CLUNET_GW_SLIP_ESC;
+	}
+	if (link->size < sizeof(link->record))
+		link->record[link->size++] = byte;
+	else
+		link->overflow = 1;
+	return 0;
+}
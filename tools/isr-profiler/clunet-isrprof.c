@@ -0,0 +1,465 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	clunet-isrprof: cycle-accurate cost of the CLUNET interrupt handlers.
+
+	Runs the AVR firmware (isrprof-firmware.elf) under simavr, plays edge scenarios on the
+	bus pin as a remote node (wired-AND with the firmware own output) and measures every
+	invocation of the timer compare and external interrupt handlers in CPU cycles:
+	from the vector dispatch up to RETI, plus the hardware interrupt response time.
+
+	The budget of the handlers is one bit: CLUNET_T * prescaler cycles. The timer handler
+	and the external handler of its own edge run back to back, so the worst pair
+	(max TIMER_COMP + max INT) must fit the budget with the required headroom,
+	otherwise the exit code is 1 and the build fails.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_irq.h"
+#include "sim_interrupts.h"
+#include "avr_ioport.h"
+
+#define ISR_RESPONSE 4		// Cycles from interrupt request to the vector (pushing PC)
+#define SYNC_TIMEOUT 1000	// Maximum wait for the firmware transmission (T)
+
+enum { ISR_COMP, ISR_INT, ISR_COUNT };
+static const char* isr_name[ISR_COUNT] = { "TIMER_COMP", "INT" };
+
+struct isr_stats
+{
+	uint64_t calls;
+	uint64_t total;
+	uint32_t min, max;
+	avr_cycle_count_t entered;
+};
+
+/* Profiler options */
+static const char* mcu_name = "atmega8";
+static uint32_t frequency = 8000000;
+static int prescaler = 64;
+static int clunet_t = 8;
+static char port_name = 'D';
+static int pin = 2;
+static int vector[ISR_COUNT] = { 3, 1 };	// ATmega8: TIMER2_COMP_vect, INT0_vect
+static double min_headroom = 0;			// Percent of the bit budget
+static int verbose;
+
+/* Simulation */
+static avr_t* avr;
+static avr_irq_t* pin_irq;
+static uint8_t firmware_pull;		// Firmware pulls the line (DDR bit is set)
+static uint8_t remote_pull;		// Scenario pulls the line
+static double skew = 1.0;		// Remote clock: duration multiplier
+static struct isr_stats stats[ISR_COUNT];
+static struct isr_stats total_stats[ISR_COUNT];
+
+static void
+update_line(void)
+{
+	avr_raise_irq(pin_irq, (firmware_pull || remote_pull) ? 0 : 1);
+}
+
+static void
+ddr_changed(struct avr_irq_t* irq, uint32_t value, void* param)
+{
+	(void)irq;
+	(void)param;
+	const uint8_t pull = (value >> pin) & 1;
+	if (pull != firmware_pull)
+	{
+		firmware_pull = pull;
+		update_line();
+	}
+}
+
+static void
+isr_running(struct avr_irq_t* irq, uint32_t value, void* param)
+{
+	struct isr_stats* s = param;
+	(void)irq;
+	if (value)
+	{
+		s->entered = avr->cycle;
+		return;
+	}
+	const uint32_t cycles = (uint32_t)(avr->cycle - s->entered) + ISR_RESPONSE;
+	if (!s->calls || (cycles < s->min))
+		s->min = cycles;
+	if (cycles > s->max)
+		s->max = cycles;
+	s->calls++;
+	s->total += cycles;
+}
+
+static int
+run_until(avr_cycle_count_t until)
+{
+	while (avr->cycle < until)
+	{
+		const int state = avr_run(avr);
+		if ((state == cpu_Done) || (state == cpu_Crashed))
+		{
+			fprintf(stderr, "firmware stopped at cycle %llu\n", (unsigned long long)avr->cycle);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Drive the line for 'ticks' timer ticks of the remote clock */
+static int
+drive(uint8_t pull, double ticks)
+{
+	remote_pull = pull;
+	update_line();
+	return run_until(avr->cycle + (avr_cycle_count_t)(ticks * prescaler * skew + 0.5));
+}
+
+static uint8_t
+crc_ibutton_update(uint8_t crc, uint8_t data)
+{
+	uint8_t i;
+	crc ^= data;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 1) ? ((crc >> 1) ^ 0x8C) : (crc >> 1);
+	return crc;
+}
+
+/* Send frame as a remote node: same bit order and stuffing as clunet_send() */
+static int
+send_frame(uint8_t prio, const uint8_t* frame, int length, int corrupt_crc)
+{
+	uint8_t bits[8 * 260 + 4];
+	int count = 0, i, j;
+	uint8_t crc = 0;
+
+	bits[count++] = 1; // Start bit
+	for (i = 2; i >= 0; i--)
+		bits[count++] = ((prio - 1) >> i) & 1;
+	for (i = 0; i <= length; i++)
+	{
+		uint8_t byte;
+		if (i < length)
+		{
+			byte = frame[i];
+			crc = crc_ibutton_update(crc, byte);
+		}
+		else
+			byte = corrupt_crc ? crc ^ 1 : crc;
+		for (j = 7; j >= 0; j--)
+			bits[count++] = (byte >> j) & 1;
+	}
+
+	uint8_t level = 1;
+	int run = 1; // Start bit
+	i = 1;
+	while (1)
+	{
+		// Collect bits of the current level
+		do
+		{
+			if (bits[i] != level)
+				break;
+			run++;
+			if (++i == count)
+				goto _complete;
+		}
+		while (run < 5);
+
+		if (drive(level, run * clunet_t))
+			return -1;
+		// Bit stuffing: stuffed bit begins the next run
+		run = (run == 5);
+		level ^= 1;
+	}
+
+_complete:
+	if (drive(level, run * clunet_t))
+		return -1;
+	// Stop bit after recessive last run
+	if (!level && drive(1, clunet_t))
+		return -1;
+	return drive(0, 0);
+}
+
+static int
+sync_firmware(void)
+{
+	const avr_cycle_count_t timeout = avr->cycle + (avr_cycle_count_t)SYNC_TIMEOUT * clunet_t * prescaler;
+	remote_pull = 0;
+	update_line();
+	while (!firmware_pull)
+	{
+		if (avr->cycle >= timeout)
+		{
+			fprintf(stderr, "sync: firmware does not transmit\n");
+			return -1;
+		}
+		if (run_until(avr->cycle + 1))
+			return -1;
+	}
+	return 0;
+}
+
+/* One scenario line, see scenarios/ */
+static int
+scenario_line(char* line, const char* where)
+{
+	char* argv[270];
+	int argc = 0;
+	char* hash = strchr(line, '#');
+	if (hash)
+		*hash = 0;
+	for (char* tok = strtok(line, " \t\r\n"); tok && (argc < 270); tok = strtok(0, " \t\r\n"))
+		argv[argc++] = tok;
+	if (!argc)
+		return 0;
+
+	if (!strcmp(argv[0], "idle") && (argc == 2))
+		return drive(0, atof(argv[1]) * clunet_t);
+
+	if (!strcmp(argv[0], "skew") && (argc == 2))
+	{
+		skew = 1 + atof(argv[1]) / 100;
+		return 0;
+	}
+
+	if (!strcmp(argv[0], "sync") && (argc == 1))
+		return sync_firmware();
+
+	// frame PRIO SRC DST CMD [DATA...], badcrc PRIO SRC DST CMD [DATA...]
+	if ((!strcmp(argv[0], "frame") || !strcmp(argv[0], "badcrc")) && (argc >= 5) && (argc <= 5 + 250))
+	{
+		uint8_t frame[4 + 250];
+		int i;
+		const int prio = strtol(argv[1], 0, 0);
+		if ((prio < 1) || (prio > 8))
+			goto _error;
+		for (i = 0; i < 3; i++)
+			frame[i] = strtol(argv[2 + i], 0, 0);
+		frame[3] = argc - 5;
+		for (i = 5; i < argc; i++)
+			frame[4 + i - 5] = strtol(argv[i], 0, 16);
+		return send_frame(prio, frame, argc - 1, argv[0][0] == 'b');
+	}
+
+	// fill PRIO SRC DST CMD SIZE BYTE: payload of repeated byte (long stuffed runs)
+	if (!strcmp(argv[0], "fill") && (argc == 7))
+	{
+		uint8_t frame[4 + 250];
+		const int prio = strtol(argv[1], 0, 0);
+		const int size = strtol(argv[5], 0, 0);
+		if ((prio < 1) || (prio > 8) || (size < 0) || (size > 250))
+			goto _error;
+		frame[0] = strtol(argv[2], 0, 0);
+		frame[1] = strtol(argv[3], 0, 0);
+		frame[2] = strtol(argv[4], 0, 0);
+		frame[3] = size;
+		memset(frame + 4, strtol(argv[6], 0, 16), size);
+		return send_frame(prio, frame, 4 + size, 0);
+	}
+
+	// raw LEVEL:TICKS ... - recorded line (1 - pulled), durations in timer ticks
+	if (!strcmp(argv[0], "raw") && (argc >= 2))
+	{
+		int i;
+		for (i = 1; i < argc; i++)
+		{
+			int level;
+			double ticks;
+			if ((sscanf(argv[i], "%d:%lf", &level, &ticks) != 2) || (level & ~1))
+				goto _error;
+			if (drive(level, ticks))
+				return -1;
+		}
+		return drive(0, 0);
+	}
+
+_error:
+	fprintf(stderr, "%s: invalid command '%s'\n", where, argv[0]);
+	return -1;
+}
+
+static int
+run_scenario(const char* path)
+{
+	char line[2048], where[300];
+	int n = 0;
+	FILE* f = fopen(path, "r");
+	if (!f)
+	{
+		perror(path);
+		return -1;
+	}
+	skew = 1.0;
+	memset(stats, 0, sizeof(stats));
+	while (fgets(line, sizeof(line), f))
+	{
+		snprintf(where, sizeof(where), "%s:%d", path, ++n);
+		if (verbose)
+			fprintf(stderr, "%10llu %s", (unsigned long long)avr->cycle, line);
+		if (scenario_line(line, where))
+		{
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+static void
+report(const char* title, const struct isr_stats* s)
+{
+	const uint32_t budget = clunet_t * prescaler;
+	int i;
+	printf("%s\n", title);
+	printf("  handler        calls      min      avg      max   budget  headroom\n");
+	for (i = 0; i < ISR_COUNT; i++)
+		printf("  %-10s %9llu %8u %8.1f %8u %8u %8.1f%%\n", isr_name[i], (unsigned long long)s[i].calls,
+			s[i].min, s[i].calls ? (double)s[i].total / s[i].calls : 0.0, s[i].max,
+			budget, 100.0 * ((double)budget - s[i].max) / budget);
+	const uint32_t pair = s[ISR_COMP].max + s[ISR_INT].max;
+	printf("  %-10s %9s %8s %8s %8u %8u %8.1f%%\n", "worst pair", "", "", "", pair,
+		budget, 100.0 * ((double)budget - pair) / budget);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: clunet-isrprof [options] FIRMWARE.elf SCENARIO...\n"
+		"  -m MCU         MCU name (%s)\n"
+		"  -f HZ          CPU frequency (%u)\n"
+		"  -p PRESCALER   timer prescaler (%d)\n"
+		"  -T TICKS       CLUNET_T the firmware is built with (%d)\n"
+		"  -P PORT:PIN    bus pin (%c:%d)\n"
+		"  -c VECTOR      timer compare vector number (%d)\n"
+		"  -i VECTOR      external interrupt vector number (%d)\n"
+		"  -H PERCENT     minimal headroom of the worst pair, fail below it (off)\n"
+		"  -v             trace scenario commands\n",
+		mcu_name, frequency, prescaler, clunet_t, port_name, pin, vector[ISR_COMP], vector[ISR_INT]);
+}
+
+int
+main(int argc, char** argv)
+{
+	elf_firmware_t firmware;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "m:f:p:T:P:c:i:H:v")) != -1)
+	{
+		switch (opt)
+		{
+			case 'm': mcu_name = optarg; break;
+			case 'f': frequency = strtoul(optarg, 0, 0); break;
+			case 'p': prescaler = atoi(optarg); break;
+			case 'T': clunet_t = atoi(optarg); break;
+			case 'P':
+				if (sscanf(optarg, "%c:%d", &port_name, &pin) != 2)
+				{
+					usage();
+					return 2;
+				}
+				port_name = toupper((unsigned char)port_name);
+				break;
+			case 'c': vector[ISR_COMP] = atoi(optarg); break;
+			case 'i': vector[ISR_INT] = atoi(optarg); break;
+			case 'H': min_headroom = atof(optarg); break;
+			case 'v': verbose = 1; break;
+			default:
+				usage();
+				return 2;
+		}
+	}
+	if (argc - optind < 2)
+	{
+		usage();
+		return 2;
+	}
+
+	memset(&firmware, 0, sizeof(firmware));
+	if (elf_read_firmware(argv[optind], &firmware))
+	{
+		fprintf(stderr, "%s: can't load firmware\n", argv[optind]);
+		return 2;
+	}
+	avr = avr_make_mcu_by_name(mcu_name);
+	if (!avr)
+	{
+		fprintf(stderr, "%s: unknown MCU\n", mcu_name);
+		return 2;
+	}
+	avr_init(avr);
+	avr->frequency = frequency;
+	avr_load_firmware(avr, &firmware);
+
+	// Wired-AND bus: firmware output (DDR bit) and the scenario
+	pin_irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(port_name), pin);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(port_name), IOPORT_IRQ_DIRECTION_ALL), ddr_changed, 0);
+	for (i = 0; i < ISR_COUNT; i++)
+		avr_irq_register_notify(avr_get_interrupt_irq(avr, vector[i]) + AVR_INT_IRQ_RUNNING, isr_running, &stats[i]);
+	update_line();
+
+	int failed = 0;
+	for (i = optind + 1; i < argc; i++)
+	{
+		if (run_scenario(argv[i]))
+			return 2;
+		report(argv[i], stats);
+		for (int k = 0; k < ISR_COUNT; k++)
+		{
+			if (!stats[k].calls)
+				continue;
+			if (!total_stats[k].calls || (stats[k].min < total_stats[k].min))
+				total_stats[k].min = stats[k].min;
+			if (stats[k].max > total_stats[k].max)
+				total_stats[k].max = stats[k].max;
+			total_stats[k].calls += stats[k].calls;
+			total_stats[k].total += stats[k].total;
+		}
+	}
+	if (argc - optind > 2)
+		report("all scenarios", total_stats);
+
+	const uint32_t budget = clunet_t * prescaler;
+	const uint32_t pair = total_stats[ISR_COMP].max + total_stats[ISR_INT].max;
+	const double headroom = 100.0 * ((double)budget - pair) / budget;
+	if (!total_stats[ISR_COMP].calls || !total_stats[ISR_INT].calls)
+	{
+		printf("FAILED: scenarios did not invoke both handlers\n");
+		failed = 1;
+	}
+	else if (min_headroom && (headroom < min_headroom))
+	{
+		printf("FAILED: worst pair headroom %.1f%% is below %.1f%%\n", headroom, min_headroom);
+		failed = 1;
+	}
+	return failed;
+}
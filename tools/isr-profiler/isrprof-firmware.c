@@ -0,0 +1,46 @@
+/**************************************************************************************
+The MIT License (MIT)
+Copyright (c) 2016 Sergey V. DUDANOV
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************************/
+
+/*
+	Firmware image for the ISR profiler: the protocol core with the demo project configuration
+	and an empty application. Device only answers PING and DISCOVERY, so both receiving
+	and transmitting paths of the interrupts are exercised by the edge scenarios.
+*/
+
+#include "clunet.h"
+
+static void
+data_received(uint8_t src_address, uint8_t command, char* data, uint8_t size)
+{
+	(void)src_address;
+	(void)command;
+	(void)data;
+	(void)size;
+}
+
+int
+main(void)
+{
+	clunet_init();
+	clunet_set_on_data_received(data_received);
+	while (1)
+		clunet_poll();
+	return 0;
+}